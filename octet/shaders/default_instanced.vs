@@ -0,0 +1,35 @@
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// Instanced vertex shader for materials. Same as default.vs, but the model matrix
+// comes from a per-instance attribute so that many copies of a mesh draw in one call.
+//
+
+// matrices
+uniform mat4 cameraToProjection;
+
+// attributes from vertex buffer
+attribute vec4 pos;
+attribute vec2 uv;
+attribute vec3 normal;
+attribute vec4 color;
+
+// attributes from the instance buffer
+attribute mat4 instance_modelToCamera;
+
+// outputs
+varying vec3 normal_;
+varying vec2 uv_;
+varying vec4 color_;
+varying vec3 model_pos_;
+varying vec3 camera_pos_;
+
+void main() {
+  vec4 tpos = instance_modelToCamera * pos;
+  gl_Position = cameraToProjection * tpos;
+  vec3 tnormal = (instance_modelToCamera * vec4(normal, 0.0)).xyz;
+  normal_ = tnormal;
+  uv_ = uv;
+  color_ = color;
+  camera_pos_ = tpos.xyz;
+  model_pos_ = pos.xyz;
+}
@@ -4,9 +4,9 @@
 //
 // Modular Framework for OpenGLES2 rendering on multiple platforms.
 //
-// game-style memory allocator
+// game-style memory allocators
 //
-// this is a placeholder for a game-style memory allocator
+// "allocator" is the default and forwards to malloc and free.
 // using malloc and free is frowned upon in grown-up circles.
 //
 // these functions are poor for the following reasons:
@@ -14,6 +14,17 @@
 // 1) free() has to compute the size of the block to free
 // 2) these functions use heavy weight locks to guard the heap.
 // 3) implementations are quite variable
+//
+// so there are also:
+//
+// linear_arena     bump allocation from large blocks, everything is freed at once.
+// frame_allocator  a shared linear_arena for data that lasts one frame.
+// pool_allocator   free lists of fixed sized blocks for small allocations.
+// type_pool<T>     a pool for one class, used by RESOURCE_POOL.
+//
+// Any class with static malloc, free and realloc functions can be used as the
+// allocator_t of a container, eg. dynarray<int, pool_allocator>.
+// Each allocator keeps its own statistics.
 
 // this is a dummy class used to customise the placement new and delete
 struct dynarray_dummy_t {};
@@ -49,10 +60,52 @@ void operator delete(void *ptr, void *place, dynarray_dummy_t x) {}
 
 
 namespace octet { namespace containers {
+  /// Statistics kept by each allocator.
+  /// Allocations happen on worker threads too, so these are atomic.
+  struct allocator_stats {
+    /// bytes allocated and not freed
+    std::atomic<size_t> num_bytes;
+
+    /// most bytes allocated at once
+    std::atomic<size_t> peak_bytes;
+
+    /// bytes taken from the system by pools and arenas
+    std::atomic<size_t> reserved_bytes;
+
+    /// number of calls to malloc and free
+    std::atomic<size_t> num_allocs;
+    std::atomic<size_t> num_frees;
+
+    allocator_stats() : num_bytes(0), peak_bytes(0), reserved_bytes(0), num_allocs(0), num_frees(0) {
+    }
+
+    void on_alloc(size_t size) {
+      num_allocs.fetch_add(1, std::memory_order_relaxed);
+      size_t now = num_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+      size_t peak = peak_bytes.load(std::memory_order_relaxed);
+      while (now > peak && !peak_bytes.compare_exchange_weak(peak, now, std::memory_order_relaxed)) {
+      }
+    }
+
+    void on_free(size_t size) {
+      num_frees.fetch_add(1, std::memory_order_relaxed);
+      num_bytes.fetch_sub(size, std::memory_order_relaxed);
+    }
+
+    /// write the statistics to a file
+    void dump(FILE *file, const char *name) const {
+      fprintf(
+        file, "%s: %llu bytes (peak %llu, reserved %llu) %llu allocs %llu frees\n", name,
+        (unsigned long long)num_bytes, (unsigned long long)peak_bytes, (unsigned long long)reserved_bytes,
+        (unsigned long long)num_allocs, (unsigned long long)num_frees
+      );
+    }
+  };
+
   class allocator {
     // singleton state, a bit like an old-world global variable
     struct state_t {
-      size_t num_bytes;
+      allocator_stats stats;
     };
 
     static state_t &state() {
@@ -61,9 +114,8 @@ namespace octet { namespace containers {
     }
 
   public:
-    // todo: implement this from scratch using a pool allocator
     static void *malloc(size_t size) {
-      state().num_bytes += size;
+      state().stats.on_alloc(size);
       #if OCTET_MAC
         void *res = 0;
         posix_memalign(&res, 16, size);
@@ -79,7 +131,7 @@ namespace octet { namespace containers {
     }
 
     static void free(void *ptr, size_t size) {
-      state().num_bytes -= size;
+      state().stats.on_free(size);
       //printf("free %p[%d] -> %d\n", ptr, size, state().num_bytes);
       #if OCTET_MAC
         return ::free(ptr);
@@ -91,7 +143,8 @@ namespace octet { namespace containers {
     }
 
     static void *realloc(void *ptr, size_t old_size, size_t size) {
-      state().num_bytes += size - old_size;
+      state().stats.on_free(old_size);
+      state().stats.on_alloc(size);
       #if OCTET_MAC
         void *res = ::realloc(ptr, size);
       #elif OCTET_SSE
@@ -109,6 +162,588 @@ namespace octet { namespace containers {
       ::free(::malloc(8192));
       ::free(::malloc(32));
     }
+
+    /// statistics for the system heap
+    static const allocator_stats &get_stats() {
+      return state().stats;
+    }
+  };
+
+  /// Linear allocator: allocations are a pointer increment and are all freed by reset().
+  ///
+  /// Memory comes from the system in large blocks. Freeing or growing the most recent
+  /// allocation is done in place, so a dynarray growing at the end of an arena does not waste space.
+  /// An arena is used by one thread at a time; see frame_allocator for a shared one.
+  class linear_arena {
+    struct block {
+      block *next;
+      size_t size;
+    };
+
+    enum { alignment = 16, header_size = (sizeof(block) + alignment - 1) & ~(alignment - 1) };
+
+    block *blocks;
+    uint8_t *ptr;
+    uint8_t *end;
+    uint8_t *last;
+    size_t block_size;
+    allocator_stats stats;
+
+    // start a new block big enough for size bytes.
+    void new_block(size_t size) {
+      size_t bytes = size + header_size > block_size ? size + header_size : block_size;
+      block *b = (block*)allocator::malloc(bytes);
+      b->next = blocks;
+      b->size = bytes;
+      blocks = b;
+      ptr = (uint8_t*)b + header_size;
+      end = (uint8_t*)b + bytes;
+      stats.reserved_bytes += bytes;
+    }
+
+    linear_arena(const linear_arena &rhs);
+    void operator=(const linear_arena &rhs);
+  public:
+    /// Make an arena which takes memory from the system in blocks of block_size bytes.
+    linear_arena(size_t block_size = 0x10000) {
+      blocks = NULL;
+      ptr = end = last = NULL;
+      this->block_size = block_size;
+    }
+
+    ~linear_arena() {
+      release();
+    }
+
+    /// Allocate size bytes, aligned to 16 bytes.
+    void *allocate(size_t size) {
+      size = (size + alignment - 1) & ~(size_t)(alignment - 1);
+      if (size > (size_t)(end - ptr)) {
+        new_block(size);
+      }
+      last = ptr;
+      ptr += size;
+      stats.on_alloc(size);
+      return last;
+    }
+
+    /// Free an allocation. Only the most recent allocation actually gives memory back.
+    void deallocate(void *p, size_t size) {
+      size = (size + alignment - 1) & ~(size_t)(alignment - 1);
+      if (p && p == last) {
+        ptr = last;
+        last = NULL;
+      }
+      stats.on_free(size);
+    }
+
+    /// Change the size of an allocation, in place if it is the most recent.
+    void *reallocate(void *p, size_t old_size, size_t size) {
+      size_t old_aligned = (old_size + alignment - 1) & ~(size_t)(alignment - 1);
+      size_t new_aligned = (size + alignment - 1) & ~(size_t)(alignment - 1);
+      if (p && p == last && new_aligned <= (size_t)(end - last)) {
+        ptr = last + new_aligned;
+        stats.on_free(old_aligned);
+        stats.on_alloc(new_aligned);
+        return p;
+      }
+      void *result = allocate(size);
+      if (p) {
+        memcpy(result, p, old_size < size ? old_size : size);
+        stats.on_free(old_aligned);
+      }
+      return result;
+    }
+
+    /// Free all the allocations, keeping the most recent block for next time.
+    void reset() {
+      if (!blocks) return;
+      block *keep = blocks;
+      for (block *b = keep->next; b; ) {
+        block *next = b->next;
+        stats.reserved_bytes -= b->size;
+        allocator::free(b, b->size);
+        b = next;
+      }
+      keep->next = NULL;
+      ptr = (uint8_t*)keep + header_size;
+      end = (uint8_t*)keep + keep->size;
+      last = NULL;
+      stats.num_bytes = 0;
+    }
+
+    /// Give all the memory back to the system.
+    void release() {
+      for (block *b = blocks; b; ) {
+        block *next = b->next;
+        allocator::free(b, b->size);
+        b = next;
+      }
+      blocks = NULL;
+      ptr = end = last = NULL;
+      stats.num_bytes = 0;
+      stats.reserved_bytes = 0;
+    }
+
+    /// statistics for this arena
+    const allocator_stats &get_stats() const {
+      return stats;
+    }
+  };
+
+  /// Allocator for temporary data that lasts for one frame, eg. dynarray<vec4, frame_allocator>.
+  /// Call frame_allocator::reset() at the end of each frame, when none of it is in use.
+  class frame_allocator {
+    struct state_t {
+      std::mutex lock;
+      linear_arena arena;
+
+      state_t() : arena(0x100000) {
+      }
+    };
+
+    static state_t &state() {
+      static state_t instance;
+      return instance;
+    }
+
+  public:
+    static void *malloc(size_t size) {
+      state_t &s = state();
+      std::lock_guard<std::mutex> guard(s.lock);
+      return s.arena.allocate(size);
+    }
+
+    static void free(void *ptr, size_t size) {
+      state_t &s = state();
+      std::lock_guard<std::mutex> guard(s.lock);
+      s.arena.deallocate(ptr, size);
+    }
+
+    static void *realloc(void *ptr, size_t old_size, size_t size) {
+      state_t &s = state();
+      std::lock_guard<std::mutex> guard(s.lock);
+      return s.arena.reallocate(ptr, old_size, size);
+    }
+
+    /// free everything allocated this frame.
+    static void reset() {
+      state_t &s = state();
+      std::lock_guard<std::mutex> guard(s.lock);
+      s.arena.reset();
+    }
+
+    /// statistics for the frame arena
+    static const allocator_stats &get_stats() {
+      return state().arena.get_stats();
+    }
+  };
+
+  /// A free list of blocks of one size.
+  ///
+  /// Each thread keeps a few free blocks in a cache so that most allocations and frees
+  /// do not take the lock. Caches are plain structs so that they can be OCTET_THREAD_LOCAL.
+  /// Memory is kept by the pool for reuse and not given back to the system.
+  /// The statistics are counted in the caches and added to the pool's a batch at a time.
+  class fixed_pool {
+  public:
+    /// a thread's free blocks
+    struct cache {
+      void *head;
+      unsigned count;
+      size_t num_allocs;
+      size_t num_frees;
+    };
+
+  private:
+    struct free_block {
+      free_block *next;
+    };
+
+    enum {
+      // blocks moved between a thread's cache and the pool at a time
+      batch_size = 32,
+      page_size = 0x10000,
+    };
+
+    std::mutex lock;
+    free_block *free_list;
+    size_t elem_size;
+    allocator_stats stats;
+
+    // an allocator made of several pools
+    allocator_stats *owner;
+
+    fixed_pool(const fixed_pool &rhs);
+    void operator=(const fixed_pool &rhs);
+
+    void merge_counts(cache &c) {
+      if (c.num_allocs == 0 && c.num_frees == 0) return;
+      allocator_stats *all[] = { &stats, owner };
+      for (unsigned i = 0; i != 2 && all[i]; ++i) {
+        allocator_stats &s = *all[i];
+        s.num_allocs.fetch_add(c.num_allocs, std::memory_order_relaxed);
+        s.num_frees.fetch_add(c.num_frees, std::memory_order_relaxed);
+        size_t now = s.num_bytes.fetch_add((c.num_allocs - c.num_frees) * elem_size, std::memory_order_relaxed) + (c.num_allocs - c.num_frees) * elem_size;
+        size_t peak = s.peak_bytes.load(std::memory_order_relaxed);
+        while ((ptrdiff_t)now > (ptrdiff_t)peak && !s.peak_bytes.compare_exchange_weak(peak, now, std::memory_order_relaxed)) {
+        }
+      }
+      c.num_allocs = c.num_frees = 0;
+    }
+
+    // move a batch of blocks from the pool to the cache, making more if necessary.
+    void refill(cache &c) {
+      std::lock_guard<std::mutex> guard(lock);
+      merge_counts(c);
+      if (!free_list) {
+        size_t num_elems = page_size / elem_size > batch_size ? page_size / elem_size : (size_t)batch_size;
+        uint8_t *page = (uint8_t*)allocator::malloc(num_elems * elem_size);
+        stats.reserved_bytes += num_elems * elem_size;
+        if (owner) owner->reserved_bytes += num_elems * elem_size;
+        for (size_t i = num_elems; i-- != 0; ) {
+          free_block *b = (free_block*)(page + i * elem_size);
+          b->next = free_list;
+          free_list = b;
+        }
+      }
+      for (unsigned i = 0; i != batch_size && free_list; ++i) {
+        free_block *b = free_list;
+        free_list = b->next;
+        b->next = (free_block*)c.head;
+        c.head = b;
+        c.count++;
+      }
+    }
+
+    // move a batch of blocks from the cache back to the pool.
+    void flush(cache &c) {
+      free_block *first = (free_block*)c.head;
+      free_block *last = first;
+      unsigned n = 1;
+      while (n != batch_size && last->next) {
+        last = last->next;
+        n++;
+      }
+      c.head = last->next;
+      c.count -= n;
+
+      std::lock_guard<std::mutex> guard(lock);
+      merge_counts(c);
+      last->next = free_list;
+      free_list = first;
+    }
+
+  public:
+    /// make a pool for blocks of elem_size bytes, rounded up to a multiple of a pointer.
+    /// memory taken from the system is also counted in the owner's statistics.
+    fixed_pool(size_t elem_size, allocator_stats *owner = NULL) {
+      free_list = NULL;
+      this->owner = owner;
+      this->elem_size = (elem_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+      if (this->elem_size == 0) this->elem_size = sizeof(void*);
+    }
+
+    /// allocate a block, using the thread's cache
+    void *allocate(cache &c) {
+      if (!c.head) refill(c);
+      free_block *b = (free_block*)c.head;
+      c.head = b->next;
+      c.count--;
+      c.num_allocs++;
+      return b;
+    }
+
+    /// free a block, using the thread's cache
+    void deallocate(cache &c, void *ptr) {
+      free_block *b = (free_block*)ptr;
+      b->next = (free_block*)c.head;
+      c.head = b;
+      c.num_frees++;
+      if (++c.count >= batch_size * 2) flush(c);
+    }
+
+    /// size of the blocks
+    size_t get_elem_size() const {
+      return elem_size;
+    }
+
+    /// statistics for this pool
+    const allocator_stats &get_stats() const {
+      return stats;
+    }
+  };
+
+  /// Allocator for small objects with pools of blocks in sizes from 16 to 512 bytes.
+  /// Larger allocations go to the system heap. Use as the allocator_t of a container,
+  /// eg. dictionary<int, pool_allocator>.
+  class pool_allocator {
+    enum { num_classes = 16, max_size = 512 };
+
+    // 16 byte steps to 128, 32 byte steps to 256 and 64 byte steps to 512.
+    static unsigned get_class(size_t size) {
+      if (size <= 128) return size ? (unsigned)((size - 1) >> 4) : 0;
+      if (size <= 256) return 8 + (unsigned)((size - 129) >> 5);
+      return 12 + (unsigned)((size - 257) >> 6);
+    }
+
+    static size_t get_class_size(unsigned i) {
+      return i < 8 ? (i + 1) * 16 : i < 12 ? 128 + (i - 7) * 32 : 256 + (i - 11) * 64;
+    }
+
+    struct state_t {
+      fixed_pool *pools[num_classes];
+      allocator_stats stats;
+
+      state_t() {
+        for (unsigned i = 0; i != num_classes; ++i) {
+          pools[i] = new fixed_pool(get_class_size(i), &stats);
+        }
+      }
+    };
+
+    static state_t &state() {
+      static state_t instance;
+      return instance;
+    }
+
+    static fixed_pool::cache *get_caches() {
+      static OCTET_THREAD_LOCAL fixed_pool::cache caches[num_classes];
+      return caches;
+    }
+
+  public:
+    static void *malloc(size_t size) {
+      if (size > max_size) return allocator::malloc(size);
+      unsigned i = get_class(size);
+      return state().pools[i]->allocate(get_caches()[i]);
+    }
+
+    static void free(void *ptr, size_t size) {
+      if (!ptr) return;
+      if (size > max_size) return allocator::free(ptr, size);
+      unsigned i = get_class(size);
+      state().pools[i]->deallocate(get_caches()[i], ptr);
+    }
+
+    static void *realloc(void *ptr, size_t old_size, size_t size) {
+      if (old_size > max_size && size > max_size) return allocator::realloc(ptr, old_size, size);
+      if (ptr && old_size <= max_size && size <= max_size && get_class(old_size) == get_class(size)) {
+        return ptr;
+      }
+      void *result = malloc(size);
+      if (ptr) {
+        memcpy(result, ptr, old_size < size ? old_size : size);
+        free(ptr, old_size);
+      }
+      return result;
+    }
+
+    /// statistics for all the size classes (blocks from 16 to 512 bytes)
+    static const allocator_stats &get_stats() {
+      return state().stats;
+    }
+
+    /// statistics for the pool that holds allocations of a size
+    static const allocator_stats &get_stats(size_t size) {
+      return state().pools[get_class(size < max_size ? size : (size_t)max_size)]->get_stats();
+    }
+  };
+
+  /// A pool for one class, so that objects which are made and destroyed often are close together
+  /// and do not fragment the heap. Derived classes of a different size use pool_allocator.
+  template <class type> class type_pool {
+    static fixed_pool &pool() {
+      static fixed_pool instance(sizeof(type));
+      return instance;
+    }
+
+    static fixed_pool::cache &get_cache() {
+      static OCTET_THREAD_LOCAL fixed_pool::cache cache;
+      return cache;
+    }
+
+  public:
+    static void *malloc(size_t size) {
+      if (size != sizeof(type)) return pool_allocator::malloc(size);
+      return pool().allocate(get_cache());
+    }
+
+    static void free(void *ptr, size_t size) {
+      if (!ptr) return;
+      if (size != sizeof(type)) return pool_allocator::free(ptr, size);
+      pool().deallocate(get_cache(), ptr);
+    }
+
+    static void *realloc(void *ptr, size_t old_size, size_t size) {
+      if (old_size == size) return ptr;
+      void *result = malloc(size);
+      if (ptr) {
+        memcpy(result, ptr, old_size < size ? old_size : size);
+        free(ptr, old_size);
+      }
+      return result;
+    }
+
+    /// statistics for this class
+    static const allocator_stats &get_stats() {
+      return pool().get_stats();
+    }
   };
+
+  #if OCTET_UNIT_TEST
+    class allocator_unit_test {
+      // fill a block with a pattern that depends on a seed.
+      static void fill(void *ptr, size_t size, unsigned seed) {
+        for (size_t i = 0; i != size; ++i) ((uint8_t*)ptr)[i] = (uint8_t)(seed * 7 + i);
+      }
+
+      static bool check(const void *ptr, size_t size, unsigned seed) {
+        for (size_t i = 0; i != size; ++i) {
+          if (((const uint8_t*)ptr)[i] != (uint8_t)(seed * 7 + i)) return false;
+        }
+        return true;
+      }
+
+      static void test_arena() {
+        linear_arena arena(0x1000);
+        // the most recent allocation is freed and grown in place.
+        void *p = arena.allocate(40);
+        arena.deallocate(p, 40);
+        void *again = arena.allocate(40);
+        assert(again == p);
+        fill(again, 40, 1);
+        void *grown = arena.reallocate(again, 40, 200);
+        assert(grown == p && check(p, 40, 1));
+        (void)grown;
+
+        // an older one is copied.
+        void *q = arena.allocate(16);
+        void *r = arena.reallocate(p, 200, 300);
+        assert(r != p && r != q && check(r, 40, 1));
+
+        void *ptrs[100];
+        for (unsigned i = 0; i != 100; ++i) {
+          ptrs[i] = arena.allocate(i * 3 + 1);
+          assert(((uintptr_t)ptrs[i] & 15) == 0);
+          fill(ptrs[i], i * 3 + 1, i);
+        }
+        for (unsigned i = 0; i != 100; ++i) {
+          assert(check(ptrs[i], i * 3 + 1, i));
+        }
+
+        // bigger than a block.
+        void *big = arena.allocate(0x3000);
+        fill(big, 0x3000, 2);
+        assert(check(big, 0x3000, 2) && check(r, 40, 1) && check(ptrs[99], 298, 99));
+
+        // reset keeps one block, release gives it back.
+        assert(arena.get_stats().reserved_bytes > 0x3000);
+        arena.reset();
+        assert(arena.get_stats().num_bytes == 0);
+        size_t reserved = arena.get_stats().reserved_bytes;
+        arena.allocate(16);
+        assert(arena.get_stats().reserved_bytes == reserved);
+        arena.release();
+        assert(arena.get_stats().num_bytes == 0 && arena.get_stats().reserved_bytes == 0);
+
+        void *f = frame_allocator::malloc(100);
+        fill(f, 100, 3);
+        f = frame_allocator::realloc(f, 100, 1000);
+        assert(check(f, 100, 3));
+        frame_allocator::free(f, 1000);
+        frame_allocator::reset();
+        assert(frame_allocator::get_stats().num_bytes == 0);
+      }
+
+      static void test_pools() {
+        // every size up to twice the largest class, all live at once.
+        enum { num_sizes = 1024 };
+        void *ptrs[num_sizes];
+        for (unsigned i = 0; i != num_sizes; ++i) {
+          ptrs[i] = pool_allocator::malloc(i + 1);
+          assert(ptrs[i] && ((uintptr_t)ptrs[i] & (sizeof(void*) - 1)) == 0);
+          fill(ptrs[i], i + 1, i);
+        }
+        for (unsigned i = 0; i != num_sizes; ++i) {
+          assert(check(ptrs[i], i + 1, i));
+        }
+
+        // within a class, realloc does not move; between classes it copies.
+        void *same = pool_allocator::realloc(ptrs[16], 17, 32);
+        assert(same == ptrs[16]);
+        void *moved = pool_allocator::realloc(same, 32, 100);
+        assert(check(moved, 17, 16));
+        ptrs[16] = pool_allocator::realloc(moved, 100, 17);
+        assert(check(ptrs[16], 17, 16));
+        ptrs[600] = pool_allocator::realloc(ptrs[600], 601, 2000);
+        assert(check(ptrs[600], 601, 600));
+        ptrs[600] = pool_allocator::realloc(ptrs[600], 2000, 601);
+        assert(check(ptrs[600], 601, 600));
+
+        for (unsigned i = 0; i != num_sizes; ++i) {
+          pool_allocator::free(ptrs[i], i + 1);
+        }
+
+        // freed blocks are reused: a second round does not take more memory from the system.
+        enum { num_blocks = 4000 };
+        void **blocks = (void**)allocator::malloc(num_blocks * sizeof(void*));
+        size_t reserved = 0;
+        for (unsigned round = 0; round != 2; ++round) {
+          for (unsigned i = 0; i != num_blocks; ++i) {
+            blocks[i] = pool_allocator::malloc(40);
+            fill(blocks[i], 40, i);
+          }
+          for (unsigned i = 0; i != num_blocks; ++i) {
+            assert(check(blocks[i], 40, i));
+            pool_allocator::free(blocks[i], 40);
+          }
+          if (round == 0) {
+            reserved = pool_allocator::get_stats(40).reserved_bytes;
+            assert(reserved >= num_blocks * 40);
+          }
+        }
+        assert(pool_allocator::get_stats(40).reserved_bytes == reserved);
+
+        // blocks made on one thread are freed on others.
+        for (unsigned i = 0; i != num_blocks; ++i) {
+          blocks[i] = type_pool<allocator_stats>::malloc(sizeof(allocator_stats));
+          fill(blocks[i], sizeof(allocator_stats), i);
+        }
+        std::thread threads[4];
+        for (unsigned t = 0; t != 4; ++t) {
+          threads[t] = std::thread([blocks, t]() {
+            for (unsigned i = t; i < num_blocks; i += 4) {
+              assert(check(blocks[i], sizeof(allocator_stats), i));
+              type_pool<allocator_stats>::free(blocks[i], sizeof(allocator_stats));
+              size_t size = i % 600 + 1;
+              void *tmp = pool_allocator::malloc(size);
+              fill(tmp, size, i);
+              assert(check(tmp, size, i));
+              pool_allocator::free(tmp, size);
+            }
+          });
+        }
+        for (unsigned t = 0; t != 4; ++t) {
+          threads[t].join();
+        }
+        allocator::free(blocks, num_blocks * sizeof(void*));
+
+        // other sizes go to pool_allocator.
+        void *odd = type_pool<allocator_stats>::malloc(3);
+        fill(odd, 3, 4);
+        odd = type_pool<allocator_stats>::realloc(odd, 3, sizeof(allocator_stats));
+        assert(check(odd, 3, 4));
+        type_pool<allocator_stats>::free(odd, sizeof(allocator_stats));
+      }
+
+    public:
+      allocator_unit_test() {
+        test_arena();
+        test_pools();
+      }
+    };
+    static allocator_unit_test allocator_unit_test;
+  #endif
 } }
 
@@ -7,6 +7,15 @@
 
 
 namespace octet { namespace containers {
+  /// Can items of this type be moved to a new address with memcpy?
+  ///
+  /// This is true of plain data. Classes that hold pointers to other memory but never
+  /// to themselves, like string and ref<>, say so with a specialization, so that arrays
+  /// of them grow with realloc instead of moving every element.
+  template <class item_t> struct is_relocatable {
+    enum { value = std::is_trivially_copyable<item_t>::value };
+  };
+
   /// Dynamic array class similar to std::vector.
   ///
   /// Example
@@ -24,16 +33,70 @@ namespace octet { namespace containers {
   ///     dynarray<int> ints;          // ok. int is well-behaved.
   ///     dynarray<mesh> meshes;       // bad! mesh contains other arrays.
   ///     dynarray<ref<mesh> > meshes; // ok. managed pointers to meshes.
-  template <class item_t, class allocator_t=allocator, bool use_new_delete=true> class dynarray {
+  ///
+  /// Sizes are 32 bit unless you ask for more:
+  ///
+  ///     dynarray<uint8_t, allocator, true, uint64_t> huge_buffer;
+  template <class item_t, class allocator_t=allocator, bool use_new_delete=true, class int_size_t=unsigned> class dynarray {
     item_t *data_;
-    typedef unsigned int_size_t;
 
-    // note we don't use size_t for these as we don't expect to use arrays > 4G and we care about performance!
+    // note we don't use size_t for these by default as we don't expect to use arrays > 4G and we care about performance!
     int_size_t size_;
     int_size_t capacity_;
-    enum { min_capacity = 8 };
+    enum {
+      min_capacity = 8,
+
+      // items can be moved with memmove and realloc.
+      relocatable = !use_new_delete || is_relocatable<item_t>::value,
+    };
+
+    // capacity to grow to for at least min_size items: double the capacity so that push_back
+    // and resize in a loop take constant time per item.
+    int_size_t grow_capacity(int_size_t min_size) const {
+      int_size_t new_capacity = capacity_ == 0 ? (int_size_t)min_capacity : capacity_ * 2;
+      return new_capacity < min_size ? min_size : new_capacity;
+    }
+
+    // move the items to a block of new_capacity items.
+    void reallocate(int_size_t new_capacity) {
+      if (relocatable) {
+        if (data_) {
+          data_ = (item_t*)allocator_t::realloc(data_, capacity_ * sizeof(item_t), new_capacity * sizeof(item_t));
+        } else {
+          data_ = (item_t*)allocator_t::malloc(new_capacity * sizeof(item_t));
+        }
+      } else {
+        item_t *new_data = (item_t*)allocator_t::malloc(new_capacity * sizeof(item_t));
+        relocate(new_data, data_, size_);
+        if (data_) {
+          allocator_t::free(data_, capacity_ * sizeof(item_t));
+        }
+        data_ = new_data;
+      }
+      capacity_ = new_capacity;
+    }
+
+    // move num items from src to dest, which may overlap, leaving src uninitialized.
+    static void relocate(item_t *dest, item_t *src, int_size_t num) {
+      dynarray_dummy_t x;
+      if (relocatable) {
+        if (num) memmove((void*)dest, (void*)src, num * sizeof(item_t));
+      } else if (dest < src) {
+        for (int_size_t i = 0; i != num; ++i) {
+          new (dest + i, x) item_t(std::move(src[i]));
+          src[i].~item_t();
+        }
+      } else {
+        for (int_size_t i = num; i != 0; --i) {
+          new (dest + i - 1, x) item_t(std::move(src[i - 1]));
+          src[i - 1].~item_t();
+        }
+      }
+    }
 
   public:
+    typedef int_size_t size_type;
+
     /// Create a new, empty, dynamic array
     dynarray() {
       data_ = 0;
@@ -43,7 +106,7 @@ namespace octet { namespace containers {
 
     /// Create a new dynamic array of a certain size.
     dynarray(int_size_t size) {
-      data_ = (item_t*)allocator::malloc(size * sizeof(item_t));
+      data_ = (item_t*)allocator_t::malloc(size * sizeof(item_t));
       size_ = capacity_ = size;
       if (use_new_delete) {
         dynarray_dummy_t x;
@@ -57,16 +120,44 @@ namespace octet { namespace containers {
     ///
     /// Note: this is very slow and will happen frequently in naive code.
     dynarray(const dynarray &rhs) {
-      data_ = (item_t*)allocator::malloc(rhs.size_ * sizeof(item_t));
+      data_ = (item_t*)allocator_t::malloc(rhs.size_ * sizeof(item_t));
       size_ = capacity_ = rhs.size_;
-      if (use_new_delete) {
+      if (use_new_delete && !std::is_trivially_copyable<item_t>::value) {
         dynarray_dummy_t x;
         for (int_size_t i = 0; i != size_; ++i) {
           new (data_ + i, x)item_t(rhs.data_[i]);
         }
-      } else {
-        memcpy(data_, rhs.data_, rhs.size_ * sizeof(item_t));
+      } else if (size_) {
+        memcpy((void*)data_, (void*)rhs.data_, rhs.size_ * sizeof(item_t));
+      }
+    }
+
+    /// Take the contents of another array, leaving it empty. This is fast.
+    dynarray(dynarray &&rhs) {
+      data_ = rhs.data_;
+      size_ = rhs.size_;
+      capacity_ = rhs.capacity_;
+      rhs.data_ = 0;
+      rhs.size_ = 0;
+      rhs.capacity_ = 0;
+    }
+
+    /// Replace the contents with a copy of another array.
+    dynarray &operator=(const dynarray &rhs) {
+      if (this != &rhs) {
+        dynarray tmp(rhs);
+        swap(tmp);
+      }
+      return *this;
+    }
+
+    /// Replace the contents with those of another array, leaving it empty.
+    dynarray &operator=(dynarray &&rhs) {
+      if (this != &rhs) {
+        reset();
+        swap(rhs);
       }
+      return *this;
     }
 
     /// Destroy the array and its contents.
@@ -108,37 +199,80 @@ namespace octet { namespace containers {
   
     /// iterator insert for STL compatibility
     iterator insert(iterator it, const item_t &new_item) {
-      int_size_t old_length = size_;
-      resize(size_+1);
-      for (int_size_t i = old_length; i != it.elem; --i) {
-        data_[i] = data_[i-1];
+      return insert(it, &new_item, &new_item + 1);
+    }
+
+    /// Insert copies of the items from first to last before it.
+    /// Later items are moved up with memmove if they are relocatable.
+    iterator insert(iterator it, const item_t *first, const item_t *last) {
+      int_size_t num = (int_size_t)(last - first);
+      if (num == 0) return it;
+
+      if (first < data_ + size_ && last > data_) {
+        // inserting part of this array: copy it first as we may move it.
+        dynarray tmp;
+        tmp.insert(tmp.end(), first, last);
+        return insert(it, tmp.data(), tmp.data() + num);
+      }
+
+      if (size_ + num > capacity_) {
+        reallocate(grow_capacity(size_ + num));
       }
-      data_[it.elem] = new_item;
+
+      relocate(data_ + it.elem + num, data_ + it.elem, size_ - it.elem);
+      dynarray_dummy_t x;
+      for (int_size_t i = 0; i != num; ++i) {
+        new (data_ + it.elem + i, x) item_t(first[i]);
+      }
+      size_ += num;
       return it;
     }
 
     /// iterator erase for STL compatibility
     iterator erase(iterator it) {
-      for (int_size_t i = it.elem; i < size_-1; ++i) {
-        data_[i] = data_[i+1];
+      return erase(it, iterator(this, it.elem + 1));
+    }
+
+    /// Erase the items from first up to last, moving later items down to fill the gap.
+    iterator erase(iterator first, iterator last) {
+      int_size_t num = last.elem - first.elem;
+      if (use_new_delete) {
+        for (int_size_t i = first.elem; i != last.elem; ++i) {
+          data_[i].~item_t();
+        }
       }
-      resize(size_-1);
-      return it;
+      relocate(data_ + first.elem, data_ + last.elem, size_ - last.elem);
+      size_ -= num;
+      return first;
     }
   
     /// Erase an item; move subsequent items down to fill the gap.
-    void erase(unsigned elem) {
-      for (int_size_t i = elem; i < size_-1; ++i) {
-        data_[i] = data_[i+1];
+    void erase(int_size_t elem) {
+      erase(iterator(this, elem), iterator(this, elem + 1));
+    }
+
+    /// Construct an item at the back of the array from the arguments of one of its constructors.
+    template <class... args_t> item_t &emplace_back(args_t&&... args) {
+      dynarray_dummy_t x;
+      if (size_ == capacity_) {
+        // the arguments may be items of this array, so make the new item before growing.
+        item_t tmp(std::forward<args_t>(args)...);
+        reallocate(grow_capacity(size_ + 1));
+        new (data_ + size_, x) item_t(std::move(tmp));
+      } else {
+        new (data_ + size_, x) item_t(std::forward<args_t>(args)...);
       }
-      resize(size_-1);
+      return data_[size_++];
     }
 
     /// Add an item at the back of the array.
     void push_back(const item_t &new_item) {
-      int_size_t old_length = size_;
-      resize(size_+1);
-      data_[old_length] = new_item;
+      emplace_back(new_item);
+    }
+
+    /// Move an item to the back of the array.
+    void push_back(item_t &&new_item) {
+      emplace_back(std::move(new_item));
     }
 
     /// Get the last element in the array.
@@ -171,76 +305,41 @@ namespace octet { namespace containers {
     item_t *data() { return data_; }
   
     /// Resize the array to make it bigger or smaller.
+    /// Growing beyond the capacity at least doubles it, so resizing in a loop is fast.
     void resize(size_t new_length) {
-      bool trace = false; // hack this for detailed traces
       dynarray_dummy_t x;
-      if (new_length >= size_ && new_length <= capacity_) {
-        if (trace) printf("case 1: growing dynarray up to capacity_\n");
-        if (use_new_delete) {
-          int_size_t len = size_; // avoid aliases
-          while (len < new_length) {
-            new (data_ + len, x)item_t;
-            ++len;
-          }
-        }
-        size_ = (int_size_t)new_length;
-      } else if (new_length > capacity_) {
-        if (trace) printf("case 2: growing dynarray beyond capacity_\n");
-        int_size_t new_capacity = ((int_size_t)new_length < size_ ? size_ : (int_size_t)new_length);
-
-        if (new_length == size_ + 1) {
-          // growing array by 1: round up to power of two.
-          new_capacity = capacity_ == 0 ? min_capacity : capacity_ * 2;
-          while (new_capacity < new_length) new_capacity *= 2;
+      if (new_length > size_) {
+        if (new_length > capacity_) {
+          reallocate(grow_capacity((int_size_t)new_length));
         }
-
-        reserve(new_capacity);
-
         if (use_new_delete) {
           // initialize the rest to default
           for (int_size_t i = size_; i < new_length; ++i) {
             new (data_ + i, x) item_t;
           }
         }
-
-        size_ = (int_size_t)new_length;
-      } else {
-        if (trace) printf("case 3: shrinking dynarray\n");
-
-        if (use_new_delete) {
-          int_size_t len = size_; // avoid aliases
-          while (len > new_length) {
-            --len;
-            data_[len].~item_t();
-          }
+      } else if (use_new_delete) {
+        for (int_size_t i = (int_size_t)new_length; i != size_; ++i) {
+          data_[i].~item_t();
         }
-        size_ = (int_size_t)new_length;
-        //if (size_ == 0) reset();
       }
+      size_ = (int_size_t)new_length;
     }
 
     /// Reserve an amount of memory to use with this array.
     /// Use this before you start a loop with push_back calls, for example.
     void reserve(int_size_t new_capacity) {
-      if (new_capacity >= size_) {
-        dynarray_dummy_t x;
-        item_t *new_data = (item_t *)allocator_t::malloc(sizeof(item_t) * new_capacity);
-      
-        if (use_new_delete) {
-          // initialize new data_ elements from old ones
-          for (int_size_t i = 0; i != size_; ++i) {
-            new (new_data + i, x) item_t(data_[i]);
-            data_[i].~item_t();
-          }
-        }
-
-        // free up data_
-        if (data_) {
-          allocator_t::free(data_, capacity_ * sizeof(item_t));
-        }
+      if (new_capacity > capacity_) {
+        reallocate(new_capacity);
+      }
+    }
 
-        data_ = new_data;
-        capacity_ = new_capacity;
+    /// Free the memory that is not in use.
+    void shrink_to_fit() {
+      if (size_ == 0) {
+        reset();
+      } else if (size_ != capacity_) {
+        reallocate(size_);
       }
     }
 
@@ -248,6 +347,9 @@ namespace octet { namespace containers {
     void pop_back() {
       assert(size_ != 0);
       size_--;
+      if (use_new_delete) {
+        data_[size_].~item_t();
+      }
     }
 
     /// Reset the array to zero size, freeing up the data.
@@ -265,6 +367,19 @@ namespace octet { namespace containers {
       size_ = 0;
       capacity_ = 0;
     }
+
+    /// Exchange the contents of two arrays without copying.
+    void swap(dynarray &rhs) {
+      item_t *d = data_; data_ = rhs.data_; rhs.data_ = d;
+      int_size_t s = size_; size_ = rhs.size_; rhs.size_ = s;
+      int_size_t c = capacity_; capacity_ = rhs.capacity_; rhs.capacity_ = c;
+    }
+  };
+
+  /// Arrays only point to their items, so arrays of arrays can be moved with memcpy.
+  template <class item_t, class allocator_t, bool use_new_delete, class int_size_t>
+  struct is_relocatable<dynarray<item_t, allocator_t, use_new_delete, int_size_t> > {
+    enum { value = true };
   };
 
   inline void vformat(dynarray <char> &ary, const char *fmt, va_list v) {
@@ -302,5 +417,92 @@ namespace octet { namespace containers {
     va_end(v);
   }
 
+  #if OCTET_UNIT_TEST
+    class dynarray_unit_test {
+      // an item that points to itself, so it can't be moved with memmove.
+      struct tracked {
+        tracked *self;
+        int value;
+        static int &num_live() { static int n; return n; }
+
+        tracked(int value_ = 0) : self(this), value(value_) { num_live()++; }
+        tracked(const tracked &rhs) : self(this), value(rhs.value) { assert(rhs.self == &rhs); num_live()++; }
+        tracked(tracked &&rhs) : self(this), value(rhs.value) { assert(rhs.self == &rhs); rhs.value = -1; num_live()++; }
+        tracked &operator=(const tracked &rhs) { value = rhs.value; return *this; }
+        ~tracked() { assert(self == this); self = 0; num_live()--; }
+      };
+
+      // the items are intact and hold the expected values.
+      template <class array_t> static bool check(array_t &ary, const int *values, unsigned num) {
+        if (ary.size() != num) return false;
+        for (unsigned i = 0; i != num; ++i) {
+          if (ary[i].self != &ary[i] || ary[i].value != values[i]) return false;
+        }
+        return true;
+      }
+
+      template <class array_t> static void test() {
+        {
+          array_t ary;
+          for (int i = 0; i != 20; ++i) {
+            ary.emplace_back(i);
+          }
+          assert(tracked::num_live() == 20);
+
+          // insert into the middle, with and without growing.
+          ary.reserve(40);
+          tracked more[] = { tracked(100), tracked(101), tracked(102) };
+          ary.insert(typename array_t::iterator(&ary, 5), more, more + 3);
+          ary.insert(ary.begin(), tracked(200));
+          ary.insert(ary.end(), more, more + 1);
+          ary.shrink_to_fit();
+          ary.insert(typename array_t::iterator(&ary, 24), more + 1, more + 3);
+          static const int inserted[] = {
+            200, 0, 1, 2, 3, 4, 100, 101, 102, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 101, 102, 100
+          };
+          assert(check(ary, inserted, 27));
+
+          // insert part of the array into itself.
+          ary.insert(typename array_t::iterator(&ary, 2), &ary[0], &ary[3]);
+          static const int self_inserted[] = {
+            200, 0, 200, 0, 1, 1, 2, 3, 4, 100, 101, 102, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 101, 102, 100
+          };
+          assert(check(ary, self_inserted, 30));
+
+          // erase ranges from the front, middle and back.
+          ary.erase(ary.begin(), typename array_t::iterator(&ary, 3));
+          ary.erase(typename array_t::iterator(&ary, 5), typename array_t::iterator(&ary, 15));
+          ary.erase(typename array_t::iterator(&ary, ary.size() - 2), ary.end());
+          ary.erase(0);
+          static const int erased[] = { 1, 1, 2, 3, 11, 12, 13, 14, 15, 16, 17, 18, 19, 101 };
+          assert(check(ary, erased, 14));
+          assert(tracked::num_live() == 14 + 3);
+
+          // emplace an item of the array while it grows.
+          ary.shrink_to_fit();
+          ary.emplace_back(ary[0]);
+          ary.push_back(ary[1]);
+          assert(ary.back().value == 1 && ary[14].value == 1 && ary.size() == 16);
+
+          array_t copy(ary);
+          array_t moved(std::move(copy));
+          assert(copy.size() == 0 && moved.size() == 16);
+          moved.resize(14);
+          assert(check(moved, erased, 14));
+          moved.resize(4);
+          moved.resize(6);
+          assert(moved[5].value == 0 && moved[5].self == &moved[5]);
+        }
+        assert(tracked::num_live() == 0);
+      }
+
+    public:
+      dynarray_unit_test() {
+        test<dynarray<tracked> >();
+        test<dynarray<tracked, allocator, true, uint64_t> >();
+      }
+    };
+    static dynarray_unit_test dynarray_unit_test;
+  #endif
 } }
 
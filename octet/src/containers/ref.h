@@ -90,4 +90,9 @@ namespace octet { namespace containers {
       item = 0;
     }
   };
+
+  /// Refs are just pointers, so arrays of refs can be moved with memcpy.
+  template <class item_t, class allocator_t> struct is_relocatable<ref<item_t, allocator_t> > {
+    enum { value = true };
+  };
 } }
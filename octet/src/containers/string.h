@@ -13,6 +13,13 @@
 //
 
 namespace octet { namespace containers {
+  class string;
+
+  /// Strings only point to their text, so arrays of strings can be moved with memcpy.
+  template <> struct is_relocatable<string> {
+    enum { value = true };
+  };
+
   /// The string class is used to hold persistant text strings.
   ///
   /// Only use this class as a data member in another class. Do not pass strings as parameters
@@ -53,6 +53,8 @@ namespace octet { namespace loaders {
       COMPRESSED_RGBA_S3TC_DXT1_EXT = 0x83F1,
       COMPRESSED_RGBA_S3TC_DXT3_EXT = 0x83F2,
       COMPRESSED_RGBA_S3TC_DXT5_EXT = 0x83F3,
+      COMPRESSED_RED_RGTC1 = 0x8DBB,
+      COMPRESSED_RG_RGTC2 = 0x8DBD,
     };
 
     struct dds_header {
@@ -103,217 +105,305 @@ namespace octet { namespace loaders {
       return val[0] + val[1] * 0x100 + val[2] * 0x10000 + val[3] * 0x1000000;
     }
 
-    // rrrrrggggggbbbbb
-    // rrrrrggggggbbbbb
-    // 0011223344556677
-    // 8899aabbccddeeff
-    void hack_dxt1(uint8_t *dest, const uint8_t *src, unsigned stride, bool always_use_four_colours) {
-      uint16_t color0 = src[0] + src[1] * 256;
-      uint16_t color1 = src[2] + src[3] * 256;
-      src += 4;
-
-      uint8_t r0 = ( ( ( color0 >> 11 ) & 0x1f ) * (0xffff / 0x1f)) >> 8;
-      uint8_t g0 = ( ( ( color0 >> 6 ) & 0x3f ) * (0xffff / 0x3f)) >> 8;
-      uint8_t b0 = ( ( ( color0 >> 0 ) & 0x1f ) * (0xffff / 0x1f)) >> 8;
-      uint8_t r1 = ( ( ( color1 >> 11 ) & 0x1f ) * (0xffff / 0x1f)) >> 8;
-      uint8_t g1 = ( ( ( color1 >> 6 ) & 0x3f ) * (0xffff / 0x3f)) >> 8;
-      uint8_t b1 = ( ( ( color1 >> 0 ) & 0x1f ) * (0xffff / 0x1f)) >> 8;
-
-      // if it were not for the patent, some other code would go here
-      dest[0] = ( r0 + r1 ) >> 1;
-      dest[1] = ( g0 + g1 ) >> 1;
-      dest[2] = ( b0 + b1 ) >> 1;
-      dest[3] = 0xff;
+    static void swap(uint8_t &a, uint8_t &b) {
+      uint8_t t = a; a =  b; b = t;
     }
 
-    // quantised alpha
-    void hack_dxt3(uint8_t *dest, const uint8_t *src, unsigned stride) {
-      dest[3] = ( src[0] + src[1] ) >> 1;
+    // reverse the first num_rows rows of 2 bit colour indices (one byte per row).
+    static void flip_color_rows(uint8_t *block, unsigned num_rows) {
+      uint8_t *rows = block + 4;
+      for (unsigned i = 0; i < num_rows / 2; ++i) {
+        swap(rows[i], rows[num_rows - 1 - i]);
+      }
     }
 
-    // interpolated alpha
-    void hack_dxt5(uint8_t *dest, const uint8_t *src, unsigned stride) {
-      dest[3] = ( src[0] + src[1] ) >> 1;
+    // reverse the first num_rows rows of DXT3 explicit alpha (two bytes per row).
+    static void flip_explicit_alpha_rows(uint8_t *block, unsigned num_rows) {
+      for (unsigned i = 0; i < num_rows / 2; ++i) {
+        swap(block[i*2+0], block[(num_rows-1-i)*2+0]);
+        swap(block[i*2+1], block[(num_rows-1-i)*2+1]);
+      }
     }
 
-    // see http://www.opengl.org/registry/specs/EXT/texture_compression_s3tc.txt
-    // a s3tc dirty hack.
-    void hack_s3(uint8_t *image, unsigned dxt, unsigned width, unsigned height, const uint8_t *src, const uint8_t *src_max) {
-      unsigned max_bytes = (width) * (height) * 8;
-      if (dxt != 1) max_bytes *= 2;
-      //if (src_max - src > max_bytes) return; // oops
-
-      for (unsigned y = 0; y != height; ++y) {
-        uint8_t *dest = (uint8_t *)( image + y * (width * 4) );
-        for (unsigned x = 0; x != width; ++x) {
-          if (dxt == 1) {
-            hack_dxt1(dest, src+8, width * 4, false);
-            src += 8;
-          } else if (dxt <= 3) {
-            hack_dxt1(dest, src+8, width * 4, true);
-            hack_dxt3(dest, src, width * 4);
-            src += 16;
-          } else {
-            hack_dxt1(dest, src+8, width * 4, true);
-            hack_dxt5(dest, src, width * 4);
-            src += 16;
-          }
-          dest += 4;
-        }
+    // reverse the first num_rows rows of 3 bit DXT5 alpha or RGTC indices (12 bits per row).
+    static void flip_alpha_rows(uint8_t *block, unsigned num_rows) {
+      uint64_t bits = 0;
+      for (unsigned i = 0; i != 6; ++i) {
+        bits |= (uint64_t)block[2 + i] << ( i * 8 );
+      }
+      uint64_t flipped = bits;
+      for (unsigned y = 0; y != num_rows; ++y) {
+        unsigned shift = ( num_rows - 1 - y ) * 12;
+        flipped &= ~( (uint64_t)0xfff << shift );
+        flipped |= ( ( bits >> ( y * 12 ) ) & 0xfff ) << shift;
+      }
+      for (unsigned i = 0; i != 6; ++i) {
+        block[2 + i] = (uint8_t)( flipped >> ( i * 8 ) );
       }
     }
 
-    static void swap(uint32_t &a, uint32_t &b) {
-      uint32_t t = a; a =  b; b = t;
+    // flip one level of a compressed image upside down.
+    // rows of blocks are swapped and the rows inside each block are reversed.
+    static void flip_level(uint8_t *data, unsigned format, unsigned width, unsigned height) {
+      unsigned block_bytes = get_block_bytes(format);
+      unsigned xblocks = ( width + 3 ) / 4;
+      unsigned yblocks = ( height + 3 ) / 4;
+      unsigned row_bytes = xblocks * block_bytes;
+      for (unsigned y = 0; y < yblocks / 2; ++y) {
+        uint8_t *p1 = data + y * row_bytes;
+        uint8_t *p2 = data + ( yblocks - 1 - y ) * row_bytes;
+        for (unsigned i = 0; i != row_bytes; ++i) {
+          swap(p1[i], p2[i]);
+        }
+      }
+
+      // small levels only use the first rows of their blocks.
+      unsigned num_rows = height < 4 ? height : 4;
+      for (unsigned i = 0; i != xblocks * yblocks; ++i) {
+        uint8_t *block = data + i * block_bytes;
+        switch (format) {
+          case COMPRESSED_RGB_S3TC_DXT1_EXT: case COMPRESSED_RGBA_S3TC_DXT1_EXT: {
+            flip_color_rows(block, num_rows);
+          } break;
+          case COMPRESSED_RGBA_S3TC_DXT3_EXT: {
+            flip_explicit_alpha_rows(block, num_rows);
+            flip_color_rows(block + 8, num_rows);
+          } break;
+          case COMPRESSED_RGBA_S3TC_DXT5_EXT: {
+            flip_alpha_rows(block, num_rows);
+            flip_color_rows(block + 8, num_rows);
+          } break;
+          case COMPRESSED_RED_RGTC1: {
+            flip_alpha_rows(block, num_rows);
+          } break;
+          case COMPRESSED_RG_RGTC2: {
+            flip_alpha_rows(block, num_rows);
+            flip_alpha_rows(block + 8, num_rows);
+          } break;
+        }
+      }
     }
 
-    static void swap(uint8_t &a, uint8_t &b) {
-      uint8_t t = a; a =  b; b = t;
+    // expand a 565 colour to 8 bits per channel.
+    static void unpack_565(uint8_t *dest, unsigned c) {
+      unsigned r = ( c >> 11 ) & 0x1f, g = ( c >> 5 ) & 0x3f, b = c & 0x1f;
+      dest[0] = (uint8_t)( ( r << 3 ) | ( r >> 2 ) );
+      dest[1] = (uint8_t)( ( g << 2 ) | ( g >> 4 ) );
+      dest[2] = (uint8_t)( ( b << 3 ) | ( b >> 2 ) );
+      dest[3] = 0xff;
+    }
+  public:
+    /// The four colours of a DXT colour block.
+    /// In DXT1, if color0 <= color1 there are three colours and transparent black.
+    static void get_color_palette(uint8_t palette[4][4], const uint8_t *src, bool dxt1) {
+      unsigned c0 = src[0] + src[1] * 256;
+      unsigned c1 = src[2] + src[3] * 256;
+      unpack_565(palette[0], c0);
+      unpack_565(palette[1], c1);
+      for (unsigned i = 0; i != 3; ++i) {
+        unsigned a = palette[0][i], b = palette[1][i];
+        if (c0 > c1 || !dxt1) {
+          palette[2][i] = (uint8_t)( ( 2 * a + b ) / 3 );
+          palette[3][i] = (uint8_t)( ( a + 2 * b ) / 3 );
+        } else {
+          palette[2][i] = (uint8_t)( ( a + b ) / 2 );
+          palette[3][i] = 0;
+        }
+      }
+      palette[2][3] = 0xff;
+      palette[3][3] = c0 > c1 || !dxt1 ? 0xff : 0;
     }
 
-    static void swap3(uint8_t *p1, uint8_t *p2) {
-      // 00011122 23334445 55666777
-      // 44455566 67770001 11222333
-      unsigned s1 = p1[0] + p1[1] * 0x100 + p1[2] * 0x10000;
-      unsigned s2 = p2[0] + p2[1] * 0x100 + p2[2] * 0x10000;
-      s1 = ( s1 >> 12 ) | ( s1 << 12 );
-      s2 = ( s2 >> 12 ) | ( s2 << 12 );
-      p1[0] = (s2 >> 0) & 0xff;
-      p1[1] = (s2 >> 8) & 0xff;
-      p1[2] = (s2 >> 16) & 0xff;
-      p2[0] = (s1 >> 0) & 0xff;
-      p2[1] = (s1 >> 8) & 0xff;
-      p2[2] = (s1 >> 16) & 0xff;
+    /// The eight values of a DXT5 alpha or RGTC block.
+    static void get_alpha_palette(uint8_t palette[8], const uint8_t *src) {
+      unsigned a0 = src[0], a1 = src[1];
+      palette[0] = (uint8_t)a0;
+      palette[1] = (uint8_t)a1;
+      if (a0 > a1) {
+        for (unsigned i = 2; i != 8; ++i) {
+          palette[i] = (uint8_t)( ( ( 8 - i ) * a0 + ( i - 1 ) * a1 ) / 7 );
+        }
+      } else {
+        for (unsigned i = 2; i != 6; ++i) {
+          palette[i] = (uint8_t)( ( ( 6 - i ) * a0 + ( i - 1 ) * a1 ) / 5 );
+        }
+        palette[6] = 0;
+        palette[7] = 0xff;
+      }
     }
 
-    void flip_dxt1(dynarray<uint8_t> &image, unsigned width, unsigned height) {
-      unsigned offset = 0;
-      while (width >= 4 && height >= 4) {
-        unsigned xmax = width < 4 ? 1 : width/4;
-        unsigned ymax = height < 4 ? 1 : height/4;
-        if (offset + xmax * ymax * 8 > image.size()) break; 
-        for (unsigned y = 0; y < height/8; y++) {
-          uint8_t *p1 = &image[offset + (y * xmax) * 8];
-          uint8_t *p2 = &image[offset + ((ymax - y - 1) * xmax) * 8];
-          for (unsigned x = 0; x < width/4; x++) {
-            swap((uint32_t&)p1[0], (uint32_t&)p2[0]);
-            swap(p1[4], p2[7]);
-            swap(p1[5], p2[6]);
-            swap(p1[6], p2[5]);
-            swap(p1[7], p2[4]);
-            p1 += 8;
-            p2 += 8;
-          }
+    /// Decode a DXT colour block (8 bytes) to 4x4 RGBA pixels.
+    static void decode_color_block(uint8_t *dest, unsigned stride, const uint8_t *src, bool dxt1) {
+      uint8_t palette[4][4];
+      get_color_palette(palette, src, dxt1);
+      for (unsigned y = 0; y != 4; ++y) {
+        unsigned bits = src[4 + y];
+        for (unsigned x = 0; x != 4; ++x) {
+          memcpy(dest + y * stride + x * 4, palette[( bits >> ( x * 2 ) ) & 3], 4);
         }
-        width >>= 1;
-        height >>= 1;
-        offset += xmax * ymax * 8;
       }
     }
 
-    void flip_dxt3(dynarray<uint8_t> &image, unsigned width, unsigned height) {
-      unsigned offset = 0;
-      while (width >= 4 && height >= 4) {
-        unsigned xmax = width < 4 ? 1 : width/4;
-        unsigned ymax = height < 4 ? 1 : height/4;
-        if (offset + xmax * ymax * 16 > image.size()) break; 
-        for (unsigned y = 0; y < height/8; y++) {
-          uint8_t *p1 = &image[offset + (y * xmax) * 16];
-          uint8_t *p2 = &image[offset + ((ymax - y - 1) * xmax) * 16];
-          for (unsigned x = 0; x < width/4; x++) {
-            swap(p1[0], p2[6]);
-            swap(p1[1], p2[7]);
-            swap(p1[2], p2[4]);
-            swap(p1[3], p2[5]);
-            swap(p1[4], p2[2]);
-            swap(p1[5], p2[3]);
-            swap(p1[6], p2[0]);
-            swap(p1[7], p2[1]);
-            p1 += 8;
-            p2 += 8;
-            swap((uint32_t&)p1[0], (uint32_t&)p2[0]);
-            swap(p1[4], p2[7]);
-            swap(p1[5], p2[6]);
-            swap(p1[6], p2[5]);
-            swap(p1[7], p2[4]);
-            p1 += 8;
-            p2 += 8;
-          }
+    /// Decode a DXT5 alpha or RGTC block (8 bytes) to one channel of 4x4 pixels.
+    /// pixel_bytes is the distance between pixels.
+    static void decode_alpha_block(uint8_t *dest, unsigned stride, unsigned pixel_bytes, const uint8_t *src) {
+      uint8_t palette[8];
+      get_alpha_palette(palette, src);
+      uint64_t bits = 0;
+      for (unsigned i = 0; i != 6; ++i) {
+        bits |= (uint64_t)src[2 + i] << ( i * 8 );
+      }
+      for (unsigned y = 0; y != 4; ++y) {
+        for (unsigned x = 0; x != 4; ++x) {
+          dest[y * stride + x * pixel_bytes] = palette[( bits >> ( ( y * 4 + x ) * 3 ) ) & 7];
         }
-        width >>= 1;
-        height >>= 1;
-        offset += xmax * ymax * 16;
       }
     }
 
-    void flip_dxt5(dynarray<uint8_t> &image, unsigned width, unsigned height) {
-      unsigned offset = 0;
-      while (width >= 4 && height >= 4) {
-        unsigned xmax = width < 4 ? 1 : width/4;
-        unsigned ymax = height < 4 ? 1 : height/4;
-        if (offset + xmax * ymax * 16 > image.size()) break; 
-        for (unsigned y = 0; y < height/8; y++) {
-          uint8_t *p1 = &image[offset + (y * xmax) * 16];
-          uint8_t *p2 = &image[offset + ((ymax - y - 1) * xmax) * 16];
-          for (unsigned x = 0; x < width/4; x++) {
-            // swap alphas
-            swap(p1[0], p2[0]);
-            swap(p1[1], p2[1]);
-            // swap 3 bit indices
-            swap3(p1+2, p2+5);
-            swap3(p1+5, p2+2);
-            p1 += 8;
-            p2 += 8;
-            swap((uint32_t&)p1[0], (uint32_t&)p2[0]);
-            swap(p1[4], p2[7]);
-            swap(p1[5], p2[6]);
-            swap(p1[6], p2[5]);
-            swap(p1[7], p2[4]);
-            p1 += 8;
-            p2 += 8;
+    /// Bytes in a 4x4 block of a compressed format, 0 if not supported.
+    static unsigned get_block_bytes(unsigned format) {
+      switch (format) {
+        case COMPRESSED_RGB_S3TC_DXT1_EXT: case COMPRESSED_RGBA_S3TC_DXT1_EXT: case COMPRESSED_RED_RGTC1: return 8;
+        case COMPRESSED_RGBA_S3TC_DXT3_EXT: case COMPRESSED_RGBA_S3TC_DXT5_EXT: case COMPRESSED_RG_RGTC2: return 16;
+      }
+      return 0;
+    }
+
+    /// Bytes in one level of a compressed image.
+    static size_t get_size(unsigned format, unsigned width, unsigned height) {
+      return (size_t)( ( width + 3 ) / 4 ) * ( ( height + 3 ) / 4 ) * get_block_bytes(format);
+    }
+
+    /// Decode one level of a compressed image to RGBA. Returns the number of bytes used from src.
+    /// Blocks go left to right and bottom to top, like the pixels.
+    /// RGTC images decode to red (and green) with blue 0 and alpha 255.
+    static size_t decode(uint8_t *dest, unsigned format, const uint8_t *src, unsigned width, unsigned height) {
+      unsigned block_bytes = get_block_bytes(format);
+      if (!block_bytes) return 0;
+
+      unsigned xblocks = ( width + 3 ) / 4;
+      unsigned yblocks = ( height + 3 ) / 4;
+      unsigned stride = width * 4;
+      uint8_t block[4*4*4];
+      for (unsigned by = 0; by != yblocks; ++by) {
+        for (unsigned bx = 0; bx != xblocks; ++bx) {
+          const uint8_t *s = src + ( by * xblocks + bx ) * block_bytes;
+          switch (format) {
+            case COMPRESSED_RGB_S3TC_DXT1_EXT: case COMPRESSED_RGBA_S3TC_DXT1_EXT: {
+              decode_color_block(block, 16, s, true);
+              if (format == COMPRESSED_RGB_S3TC_DXT1_EXT) {
+                for (unsigned i = 0; i != 16; ++i) block[i*4+3] = 0xff;
+              }
+            } break;
+            case COMPRESSED_RGBA_S3TC_DXT3_EXT: {
+              decode_color_block(block, 16, s + 8, false);
+              for (unsigned i = 0; i != 16; ++i) {
+                unsigned a = ( s[i/2] >> ( ( i & 1 ) * 4 ) ) & 15;
+                block[i*4+3] = (uint8_t)( a * 17 );
+              }
+            } break;
+            case COMPRESSED_RGBA_S3TC_DXT5_EXT: {
+              decode_color_block(block, 16, s + 8, false);
+              decode_alpha_block(block + 3, 16, 4, s);
+            } break;
+            case COMPRESSED_RED_RGTC1: case COMPRESSED_RG_RGTC2: {
+              memset(block, 0, sizeof(block));
+              decode_alpha_block(block, 16, 4, s);
+              if (format == COMPRESSED_RG_RGTC2) decode_alpha_block(block + 1, 16, 4, s + 8);
+              for (unsigned i = 0; i != 16; ++i) block[i*4+3] = 0xff;
+            } break;
+          }
+
+          // clip the block to the image.
+          unsigned w = width - bx * 4 < 4 ? width - bx * 4 : 4;
+          unsigned h = height - by * 4 < 4 ? height - by * 4 : 4;
+          for (unsigned y = 0; y != h; ++y) {
+            memcpy(dest + ( by * 4 + y ) * stride + bx * 16, block + y * 16, w * 4);
           }
         }
-        width >>= 1;
-        height >>= 1;
-        offset += xmax * ymax * 16;
       }
+      return (size_t)xblocks * yblocks * block_bytes;
     }
-  public:
-    // get an opengl texture from a file in memory
-    void get_image(dynarray<uint8_t> &image, uint16_t &format, uint16_t &width, uint16_t &height, const uint8_t *src, const uint8_t *src_max) {
-      // convert the data
+
+    /// Get the compressed blocks of a file in memory, flipped to GL order.
+    /// All the mip levels in the file are kept, one after another, and mip_levels is set to the number found.
+    void get_image(dynarray<uint8_t> &image, uint16_t &format, uint16_t &width, uint16_t &height, uint8_t &mip_levels, const uint8_t *src, const uint8_t *src_max) {
+      if (src_max - src < (int)sizeof(dds_header)) return;
+
       dds_header *header = (dds_header*)src;
 
       if (le4(header->magic) != dds_magic) return;
 
       unsigned pf_flags = le4(header->pf.flags);
-
+      uint8_t *fourcc = header->pf.fourcc;
+      unsigned new_format = 0;
       if (pf_flags & ddpf_fourcc) {
-        uint8_t *fourcc = header->pf.fourcc;
-        if (fourcc[0] == 'D' && fourcc[1] == 'X' && fourcc[2] == 'T') {
-          width = le4(header->width);
-          height = le4(header->height);
-
-          format =
-            fourcc[3] == '1' ? COMPRESSED_RGB_S3TC_DXT1_EXT :
-            fourcc[3] == '3' ? COMPRESSED_RGBA_S3TC_DXT3_EXT :
-            fourcc[3] == '5' ? COMPRESSED_RGBA_S3TC_DXT5_EXT :
-            0
-          ;
-          unsigned size = (unsigned)(src_max - src - 128);
-          image.resize(size);
-          memcpy(&image[0], src + 128, size);
-
-          // dds textures are upside down, flip them!
-          switch (format) {
-            case COMPRESSED_RGB_S3TC_DXT1_EXT: flip_dxt1(image, width, height); break;
-            case COMPRESSED_RGBA_S3TC_DXT3_EXT: flip_dxt3(image, width, height); break;
-            case COMPRESSED_RGBA_S3TC_DXT5_EXT: flip_dxt5(image, width, height); break;
-          }
-          return;
+        if (!memcmp(fourcc, "DXT1", 4)) {
+          new_format = pf_flags & ddpf_alphapixels ? COMPRESSED_RGBA_S3TC_DXT1_EXT : COMPRESSED_RGB_S3TC_DXT1_EXT;
+        } else if (!memcmp(fourcc, "DXT3", 4)) {
+          new_format = COMPRESSED_RGBA_S3TC_DXT3_EXT;
+        } else if (!memcmp(fourcc, "DXT5", 4)) {
+          new_format = COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        } else if (!memcmp(fourcc, "ATI1", 4) || !memcmp(fourcc, "BC4U", 4)) {
+          new_format = COMPRESSED_RED_RGTC1;
+        } else if (!memcmp(fourcc, "ATI2", 4) || !memcmp(fourcc, "BC5U", 4)) {
+          new_format = COMPRESSED_RG_RGTC2;
         }
       }
-      printf("warning: DDS decoder only supports DXTn\n");
+
+      if (!new_format) {
+        printf("warning: DDS decoder only supports DXT1, DXT3, DXT5, BC4 and BC5\n");
+        return;
+      }
+
+      if (le4(header->caps.caps2) & (ddscaps2_cubemap|ddscaps2_volume)) {
+        printf("warning: DDS cube maps and volume textures are not supported\n");
+        return;
+      }
+
+      unsigned w = le4(header->width);
+      unsigned h = le4(header->height);
+      unsigned num_levels = le4(header->flags) & ddsd_mipmapcount ? le4(header->mipmap_count) : 1;
+      if (num_levels < 1) num_levels = 1;
+      if (num_levels > 16) num_levels = 16;
+
+      // keep the levels that are present in the file.
+      const uint8_t *data = src + sizeof(dds_header);
+      size_t bytes_left = src_max - data, size = 0;
+      unsigned level = 0;
+      for (; level != num_levels; ++level) {
+        unsigned lw = w >> level ? w >> level : 1;
+        unsigned lh = h >> level ? h >> level : 1;
+        size_t level_size = get_size(new_format, lw, lh);
+        if (size + level_size > bytes_left) break;
+        size += level_size;
+      }
+      if (!level) {
+        printf("warning: DDS file is truncated\n");
+        return;
+      }
+
+      format = (uint16_t)new_format;
+      width = (uint16_t)w;
+      height = (uint16_t)h;
+      mip_levels = (uint8_t)level;
+      image.resize((unsigned)size);
+      memcpy(image.data(), data, size);
+
+      // dds textures are upside down, flip them!
+      uint8_t *dest = image.data();
+      for (unsigned i = 0; i != level; ++i) {
+        unsigned lw = w >> i ? w >> i : 1;
+        unsigned lh = h >> i ? h >> i : 1;
+        flip_level(dest, new_format, lw, lh);
+        dest += get_size(new_format, lw, lh);
+      }
+    }
+
+    /// Get the top level of a file in memory (and any mip levels that follow it).
+    void get_image(dynarray<uint8_t> &image, uint16_t &format, uint16_t &width, uint16_t &height, const uint8_t *src, const uint8_t *src_max) {
+      uint8_t mip_levels = 1;
+      get_image(image, format, width, height, mip_levels, src, src_max);
     }
   };
 }}
@@ -0,0 +1,481 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+//
+// DXT (S3TC) and RGTC texture encoder
+//
+// DXT1 and DXT5 for colour textures, BC4 (RGTC1) and BC5 (RGTC2) for
+// single channel textures and normal maps.
+//
+// Colour blocks find the principal axis of the colours and then either use
+// the extreme colours on the axis (fast), refine them by least squares (normal)
+// or try every way of splitting the colours into four clusters along the axis (high).
+// Rows of blocks are encoded in parallel on the job system.
+//
+// See http://www.opengl.org/registry/specs/EXT/texture_compression_s3tc.txt
+// and http://www.opengl.org/registry/specs/ARB/texture_compression_rgtc.txt
+//
+
+namespace octet { namespace loaders {
+  /// Compress images to DXT1, DXT5, BC4 or BC5.
+  ///
+  /// Example:
+  ///
+  ///     dxt_encoder enc(dxt_encoder::quality_normal);
+  ///     dynarray<uint8_t> blocks(dxt_encoder::get_size(dxt_encoder::COMPRESSED_RGBA_S3TC_DXT5_EXT, w, h));
+  ///     enc.encode(blocks.data(), dxt_encoder::COMPRESSED_RGBA_S3TC_DXT5_EXT, rgba, w, h, 4);
+  class dxt_encoder {
+  public:
+    enum quality_t {
+      quality_fast,    // extreme colours on the principal axis
+      quality_normal,  // least squares refinement of the end points
+      quality_high,    // cluster fit
+    };
+
+    enum {
+      COMPRESSED_RGB_S3TC_DXT1_EXT = 0x83F0,
+      COMPRESSED_RGBA_S3TC_DXT5_EXT = 0x83F3,
+      COMPRESSED_RED_RGTC1 = 0x8DBB,
+      COMPRESSED_RG_RGTC2 = 0x8DBD,
+    };
+
+  private:
+    quality_t quality;
+
+    // quantise a colour to 565, rounding to the nearest expanded value.
+    static unsigned pack_565(const float *c) {
+      int r = (int)( c[0] * ( 31.0f / 255 ) + 0.5f );
+      int g = (int)( c[1] * ( 63.0f / 255 ) + 0.5f );
+      int b = (int)( c[2] * ( 31.0f / 255 ) + 0.5f );
+      r = r < 0 ? 0 : r > 31 ? 31 : r;
+      g = g < 0 ? 0 : g > 63 ? 63 : g;
+      b = b < 0 ? 0 : b > 31 ? 31 : b;
+      return ( r << 11 ) | ( g << 5 ) | b;
+    }
+
+    // the colour the decoder will see for a 565 value.
+    static void unpack_565(float *dest, unsigned c) {
+      unsigned r = ( c >> 11 ) & 0x1f, g = ( c >> 5 ) & 0x3f, b = c & 0x1f;
+      dest[0] = (float)( ( r << 3 ) | ( r >> 2 ) );
+      dest[1] = (float)( ( g << 2 ) | ( g >> 4 ) );
+      dest[2] = (float)( ( b << 3 ) | ( b >> 2 ) );
+    }
+
+    // choose the nearest palette colour for each pixel. returns the squared error.
+    // pixels and palette are RGBA, alpha is ignored.
+    static unsigned select_color_indices(uint32_t &indices, const uint8_t *pixels, const uint8_t palette[4][4]) {
+      #if OCTET_SSE
+        // four pixels at a time, distances in 32 bit lanes.
+        __m128i zero = _mm_setzero_si128();
+        __m128i rgb_mask = _mm_set1_epi32(0x00ffffff);
+        __m128i pal[4];
+        for (unsigned k = 0; k != 4; ++k) {
+          uint32_t c;
+          memcpy(&c, palette[k], 4);
+          pal[k] = _mm_and_si128(_mm_set1_epi32((int)c), rgb_mask);
+        }
+        unsigned error = 0;
+        indices = 0;
+        for (unsigned i = 0; i != 16; i += 4) {
+          __m128i p = _mm_and_si128(_mm_loadu_si128((const __m128i*)( pixels + i * 4 )), rgb_mask);
+          __m128i plo = _mm_unpacklo_epi8(p, zero);
+          __m128i phi = _mm_unpackhi_epi8(p, zero);
+          __m128i dist[4];
+          for (unsigned k = 0; k != 4; ++k) {
+            __m128i c = _mm_unpacklo_epi8(pal[k], zero);
+            __m128i dlo = _mm_sub_epi16(plo, c);
+            __m128i dhi = _mm_sub_epi16(phi, c);
+            // (r*r + g*g, b*b) for each pixel, then add the pairs.
+            __m128i slo = _mm_madd_epi16(dlo, dlo);
+            __m128i shi = _mm_madd_epi16(dhi, dhi);
+            __m128i a = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(slo), _mm_castsi128_ps(shi), _MM_SHUFFLE(2, 0, 2, 0)));
+            __m128i b = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(slo), _mm_castsi128_ps(shi), _MM_SHUFFLE(3, 1, 3, 1)));
+            dist[k] = _mm_add_epi32(a, b);
+          }
+
+          // index of the smallest, preferring lower indices.
+          __m128i best = dist[0];
+          __m128i best_index = zero;
+          for (unsigned k = 1; k != 4; ++k) {
+            __m128i less = _mm_cmplt_epi32(dist[k], best);
+            best = _mm_or_si128(_mm_and_si128(less, dist[k]), _mm_andnot_si128(less, best));
+            best_index = _mm_or_si128(_mm_and_si128(less, _mm_set1_epi32(k)), _mm_andnot_si128(less, best_index));
+          }
+
+          uint32_t e[4], idx[4];
+          _mm_storeu_si128((__m128i*)e, best);
+          _mm_storeu_si128((__m128i*)idx, best_index);
+          for (unsigned j = 0; j != 4; ++j) {
+            error += e[j];
+            indices |= idx[j] << ( ( i + j ) * 2 );
+          }
+        }
+        return error;
+      #else
+        unsigned error = 0;
+        indices = 0;
+        for (unsigned i = 0; i != 16; ++i) {
+          const uint8_t *p = pixels + i * 4;
+          unsigned best = ~0u, best_index = 0;
+          for (unsigned k = 0; k != 4; ++k) {
+            int dr = p[0] - palette[k][0], dg = p[1] - palette[k][1], db = p[2] - palette[k][2];
+            unsigned d = (unsigned)( dr * dr + dg * dg + db * db );
+            if (d < best) {
+              best = d;
+              best_index = k;
+            }
+          }
+          error += best;
+          indices |= best_index << ( i * 2 );
+        }
+        return error;
+      #endif
+    }
+
+    // make a colour block from two 565 end points. returns the squared error.
+    static unsigned make_color_block(uint8_t *dest, const uint8_t *pixels, unsigned c0, unsigned c1) {
+      // four colour mode needs c0 > c1. If they are equal, index 0 is still c0.
+      if (c0 < c1) {
+        unsigned t = c0; c0 = c1; c1 = t;
+      }
+      dest[0] = (uint8_t)c0;
+      dest[1] = (uint8_t)( c0 >> 8 );
+      dest[2] = (uint8_t)c1;
+      dest[3] = (uint8_t)( c1 >> 8 );
+
+      uint8_t palette[4][4];
+      dds_decoder::get_color_palette(palette, dest, true);
+      if (c0 == c1) {
+        // DXT1 would have black at index 3 and DXT5 would not, so only use index 0.
+        for (unsigned k = 1; k != 4; ++k) memcpy(palette[k], palette[0], 4);
+      }
+      uint32_t indices = 0;
+      unsigned error = select_color_indices(indices, pixels, palette);
+      dest[4] = (uint8_t)indices;
+      dest[5] = (uint8_t)( indices >> 8 );
+      dest[6] = (uint8_t)( indices >> 16 );
+      dest[7] = (uint8_t)( indices >> 24 );
+      return error;
+    }
+
+    // least squares end points a and b for pixels x[i] = alpha[i] * a + (1 - alpha[i]) * b.
+    // sums are: alpha^2, beta^2, alpha * beta, alpha * x, beta * x.
+    static bool solve_end_points(float *a, float *b, float alpha2, float beta2, float alphabeta, const float *alphax, const float *betax) {
+      float det = alpha2 * beta2 - alphabeta * alphabeta;
+      if (det < 1e-6f) return false;
+      float factor = 1.0f / det;
+      for (unsigned i = 0; i != 3; ++i) {
+        a[i] = ( alphax[i] * beta2 - betax[i] * alphabeta ) * factor;
+        b[i] = ( betax[i] * alpha2 - alphax[i] * alphabeta ) * factor;
+      }
+      return true;
+    }
+
+    // recalculate the end points from the indices of a block.
+    static bool refine_end_points(unsigned &c0, unsigned &c1, const uint8_t *pixels, const uint8_t *block) {
+      // weight of c0 for each index.
+      static const float weights[4] = { 1.0f, 0.0f, 2.0f / 3, 1.0f / 3 };
+      uint32_t indices = block[4] | ( block[5] << 8 ) | ( block[6] << 16 ) | ( (uint32_t)block[7] << 24 );
+      float alpha2 = 0, beta2 = 0, alphabeta = 0;
+      float alphax[3] = { 0, 0, 0 }, betax[3] = { 0, 0, 0 };
+      for (unsigned i = 0; i != 16; ++i) {
+        float alpha = weights[( indices >> ( i * 2 ) ) & 3];
+        float beta = 1 - alpha;
+        alpha2 += alpha * alpha;
+        beta2 += beta * beta;
+        alphabeta += alpha * beta;
+        for (unsigned j = 0; j != 3; ++j) {
+          alphax[j] += alpha * pixels[i*4+j];
+          betax[j] += beta * pixels[i*4+j];
+        }
+      }
+      float a[3], b[3];
+      if (!solve_end_points(a, b, alpha2, beta2, alphabeta, alphax, betax)) return false;
+      c0 = pack_565(a);
+      c1 = pack_565(b);
+      return true;
+    }
+
+    // try every split of the pixels, sorted along the axis, into four runs of
+    // c0, 2/3 c0 + 1/3 c1, 1/3 c0 + 2/3 c1 and c1.
+    static void cluster_fit(unsigned &c0, unsigned &c1, const uint8_t *pixels, const float *mean, const float *axis) {
+      // sort the pixels along the axis.
+      unsigned order[16];
+      float proj[16];
+      for (unsigned i = 0; i != 16; ++i) {
+        const uint8_t *p = pixels + i * 4;
+        float d = ( p[0] - mean[0] ) * axis[0] + ( p[1] - mean[1] ) * axis[1] + ( p[2] - mean[2] ) * axis[2];
+        unsigned j = i;
+        for (; j > 0 && proj[j-1] < d; --j) {
+          proj[j] = proj[j-1];
+          order[j] = order[j-1];
+        }
+        proj[j] = d;
+        order[j] = i;
+      }
+
+      // prefix sums of the sorted pixels.
+      float sums[17][3];
+      sums[0][0] = sums[0][1] = sums[0][2] = 0;
+      for (unsigned i = 0; i != 16; ++i) {
+        const uint8_t *p = pixels + order[i] * 4;
+        for (unsigned j = 0; j != 3; ++j) {
+          sums[i+1][j] = sums[i][j] + p[j];
+        }
+      }
+
+      float best_error = FLT_MAX;
+      for (unsigned i = 0; i <= 16; ++i) {
+        for (unsigned j = i; j <= 16; ++j) {
+          for (unsigned k = j; k <= 16; ++k) {
+            // pixels [0, i) are c0, [i, j) are 2/3, [j, k) are 1/3 and [k, 16) are c1.
+            float n0 = (float)i, n2 = (float)( j - i ), n3 = (float)( k - j ), n1 = (float)( 16 - k );
+            float alpha2 = n0 + n2 * ( 4.0f / 9 ) + n3 * ( 1.0f / 9 );
+            float beta2 = n1 + n2 * ( 1.0f / 9 ) + n3 * ( 4.0f / 9 );
+            float alphabeta = ( n2 + n3 ) * ( 2.0f / 9 );
+            float alphax[3], betax[3];
+            for (unsigned c = 0; c != 3; ++c) {
+              float s0 = sums[i][c], s2 = sums[j][c] - sums[i][c], s3 = sums[k][c] - sums[j][c], s1 = sums[16][c] - sums[k][c];
+              alphax[c] = s0 + s2 * ( 2.0f / 3 ) + s3 * ( 1.0f / 3 );
+              betax[c] = s1 + s2 * ( 1.0f / 3 ) + s3 * ( 2.0f / 3 );
+            }
+
+            float a[3], b[3];
+            if (!solve_end_points(a, b, alpha2, beta2, alphabeta, alphax, betax)) continue;
+
+            // the error of the exact least squares end points is a lower bound, so skip this split
+            // if it can't beat the best so far. (errors are less the sum of x^2 which is the same for all splits)
+            float bound = -( a[0] * alphax[0] + a[1] * alphax[1] + a[2] * alphax[2] + b[0] * betax[0] + b[1] * betax[1] + b[2] * betax[2] );
+            if (bound >= best_error) continue;
+
+            // error of the quantised end points.
+            unsigned qa = pack_565(a), qb = pack_565(b);
+            unpack_565(a, qa);
+            unpack_565(b, qb);
+            float error = 0;
+            for (unsigned c = 0; c != 3; ++c) {
+              error += a[c] * a[c] * alpha2 + b[c] * b[c] * beta2 + 2 * ( a[c] * b[c] * alphabeta - a[c] * alphax[c] - b[c] * betax[c] );
+            }
+            if (error < best_error) {
+              best_error = error;
+              c0 = qa;
+              c1 = qb;
+            }
+          }
+        }
+      }
+    }
+
+    // encode 16 RGBA pixels as a DXT colour block.
+    void encode_color_block(uint8_t *dest, const uint8_t *pixels) const {
+      float mean[3] = { 0, 0, 0 };
+      for (unsigned i = 0; i != 16; ++i) {
+        for (unsigned j = 0; j != 3; ++j) mean[j] += pixels[i*4+j];
+      }
+      for (unsigned j = 0; j != 3; ++j) mean[j] *= 1.0f / 16;
+
+      // covariance matrix: rr, rg, rb, gg, gb, bb
+      float cov[6] = { 0, 0, 0, 0, 0, 0 };
+      for (unsigned i = 0; i != 16; ++i) {
+        float r = pixels[i*4+0] - mean[0], g = pixels[i*4+1] - mean[1], b = pixels[i*4+2] - mean[2];
+        cov[0] += r * r; cov[1] += r * g; cov[2] += r * b;
+        cov[3] += g * g; cov[4] += g * b; cov[5] += b * b;
+      }
+
+      // power method for the principal axis, starting from the largest row.
+      float axis[3] = { cov[0] + cov[1] + cov[2], cov[1] + cov[3] + cov[4], cov[2] + cov[4] + cov[5] };
+      unsigned iterations = quality == quality_fast ? 2 : 6;
+      for (unsigned n = 0; n != iterations; ++n) {
+        float x = axis[0] * cov[0] + axis[1] * cov[1] + axis[2] * cov[2];
+        float y = axis[0] * cov[1] + axis[1] * cov[3] + axis[2] * cov[4];
+        float z = axis[0] * cov[2] + axis[1] * cov[4] + axis[2] * cov[5];
+        float len = std::max(std::max(std::abs(x), std::abs(y)), std::abs(z));
+        if (len < 1e-6f) break;
+        axis[0] = x / len; axis[1] = y / len; axis[2] = z / len;
+      }
+
+      // range fit: the extreme pixels along the axis.
+      unsigned imin = 0, imax = 0;
+      float pmin = FLT_MAX, pmax = -FLT_MAX;
+      for (unsigned i = 0; i != 16; ++i) {
+        float d = pixels[i*4+0] * axis[0] + pixels[i*4+1] * axis[1] + pixels[i*4+2] * axis[2];
+        if (d < pmin) { pmin = d; imin = i; }
+        if (d > pmax) { pmax = d; imax = i; }
+      }
+
+      float fmax[3] = { (float)pixels[imax*4+0], (float)pixels[imax*4+1], (float)pixels[imax*4+2] };
+      float fmin[3] = { (float)pixels[imin*4+0], (float)pixels[imin*4+1], (float)pixels[imin*4+2] };
+      unsigned c0 = pack_565(fmax), c1 = pack_565(fmin);
+      unsigned error = make_color_block(dest, pixels, c0, c1);
+      if (quality == quality_fast || error == 0) return;
+
+      uint8_t trial[8];
+      if (quality == quality_high) {
+        cluster_fit(c0, c1, pixels, mean, axis);
+        unsigned e = make_color_block(trial, pixels, c0, c1);
+        if (e < error) {
+          error = e;
+          memcpy(dest, trial, 8);
+        }
+      }
+
+      // least squares from the current indices, while it gets better.
+      for (unsigned n = 0; n != 2; ++n) {
+        if (!refine_end_points(c0, c1, pixels, dest)) break;
+        unsigned e = make_color_block(trial, pixels, c0, c1);
+        if (e >= error) break;
+        error = e;
+        memcpy(dest, trial, 8);
+      }
+    }
+
+    // choose the nearest palette value for each pixel. returns the squared error.
+    static unsigned make_alpha_block(uint8_t *dest, const uint8_t *values, unsigned a0, unsigned a1) {
+      dest[0] = (uint8_t)a0;
+      dest[1] = (uint8_t)a1;
+      uint8_t palette[8];
+      dds_decoder::get_alpha_palette(palette, dest);
+
+      unsigned error = 0;
+      uint64_t indices = 0;
+      for (unsigned i = 0; i != 16; ++i) {
+        int v = values[i];
+        unsigned best = ~0u, best_index = 0;
+        for (unsigned k = 0; k != 8; ++k) {
+          unsigned d = (unsigned)( ( v - palette[k] ) * ( v - palette[k] ) );
+          if (d < best) {
+            best = d;
+            best_index = k;
+          }
+        }
+        error += best;
+        indices |= (uint64_t)best_index << ( i * 3 );
+      }
+      for (unsigned i = 0; i != 6; ++i) {
+        dest[2 + i] = (uint8_t)( indices >> ( i * 8 ) );
+      }
+      return error;
+    }
+
+    // encode 16 values as a DXT5 alpha or RGTC block.
+    void encode_alpha_block(uint8_t *dest, const uint8_t *values) const {
+      unsigned vmin = 255, vmax = 0;
+      for (unsigned i = 0; i != 16; ++i) {
+        vmin = values[i] < vmin ? values[i] : vmin;
+        vmax = values[i] > vmax ? values[i] : vmax;
+      }
+
+      // eight value mode needs a0 > a1.
+      unsigned error = make_alpha_block(dest, values, vmax, vmin);
+      if (quality == quality_fast || error == 0) return;
+
+      // six value mode has 0 and 255 as well, which helps blocks with a few extreme values.
+      unsigned imin = 255, imax = 0;
+      for (unsigned i = 0; i != 16; ++i) {
+        unsigned v = values[i];
+        if (v != 0 && v != 255) {
+          imin = v < imin ? v : imin;
+          imax = v > imax ? v : imax;
+        }
+      }
+      if (imin > imax) imin = imax = 0;
+      uint8_t trial[8];
+      unsigned e = make_alpha_block(trial, values, imin, imax);
+      if (e < error) {
+        error = e;
+        memcpy(dest, trial, 8);
+      }
+
+      // shrinking the range by one step can land the palette closer to the values.
+      if (quality == quality_high && vmax - vmin > 2) {
+        for (int d0 = -1; d0 <= 0; ++d0) {
+          for (int d1 = 0; d1 <= 1; ++d1) {
+            unsigned a0 = vmax + d0, a1 = vmin + d1;
+            if (a0 <= a1) continue;
+            e = make_alpha_block(trial, values, a0, a1);
+            if (e < error) {
+              error = e;
+              memcpy(dest, trial, 8);
+            }
+          }
+        }
+      }
+    }
+
+    // encode a row of blocks.
+    void encode_row(uint8_t *dest, unsigned format, const uint8_t *src, unsigned width, unsigned height, unsigned num_comps, unsigned by) const {
+      unsigned xblocks = ( width + 3 ) / 4;
+      uint8_t pixels[16*4];
+      uint8_t values[16];
+      for (unsigned bx = 0; bx != xblocks; ++bx) {
+        // fetch the block as RGBA, repeating the edges of the image.
+        for (unsigned y = 0; y != 4; ++y) {
+          unsigned py = by * 4 + y < height ? by * 4 + y : height - 1;
+          for (unsigned x = 0; x != 4; ++x) {
+            unsigned px = bx * 4 + x < width ? bx * 4 + x : width - 1;
+            const uint8_t *p = src + ( py * width + px ) * num_comps;
+            uint8_t *d = pixels + ( y * 4 + x ) * 4;
+            d[0] = p[0];
+            d[1] = num_comps >= 2 ? p[1] : p[0];
+            d[2] = num_comps >= 3 ? p[2] : p[0];
+            d[3] = num_comps == 4 ? p[3] : num_comps == 2 ? p[1] : 0xff;
+          }
+        }
+
+        switch (format) {
+          case COMPRESSED_RGB_S3TC_DXT1_EXT: {
+            encode_color_block(dest, pixels);
+            dest += 8;
+          } break;
+          case COMPRESSED_RGBA_S3TC_DXT5_EXT: {
+            for (unsigned i = 0; i != 16; ++i) values[i] = pixels[i*4+3];
+            encode_alpha_block(dest, values);
+            encode_color_block(dest + 8, pixels);
+            dest += 16;
+          } break;
+          case COMPRESSED_RED_RGTC1: case COMPRESSED_RG_RGTC2: {
+            for (unsigned i = 0; i != 16; ++i) values[i] = pixels[i*4+0];
+            encode_alpha_block(dest, values);
+            dest += 8;
+            if (format == COMPRESSED_RG_RGTC2) {
+              for (unsigned i = 0; i != 16; ++i) values[i] = pixels[i*4+1];
+              encode_alpha_block(dest, values);
+              dest += 8;
+            }
+          } break;
+        }
+      }
+    }
+  public:
+    dxt_encoder(quality_t quality_=quality_normal) {
+      quality = quality_;
+    }
+
+    /// Bytes needed for one level of a compressed image.
+    static size_t get_size(unsigned format, unsigned width, unsigned height) {
+      return dds_decoder::get_size(format, width, height);
+    }
+
+    /// Encode one level of an image with num_comps bytes per pixel (1-4) to format.
+    /// Returns the number of bytes written to dest.
+    /// One and two channel images are treated as grey and grey-alpha; BC4 uses the first channel and BC5 the first two.
+    size_t encode(uint8_t *dest, unsigned format, const uint8_t *src, unsigned width, unsigned height, unsigned num_comps) const {
+      bool supported = format == COMPRESSED_RGB_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT5_EXT ||
+        format == COMPRESSED_RED_RGTC1 || format == COMPRESSED_RG_RGTC2;
+      if (!supported || num_comps < 1 || num_comps > 4 || !width || !height) return 0;
+      size_t size = get_size(format, width, height);
+
+      unsigned row_bytes = ( ( width + 3 ) / 4 ) * dds_decoder::get_block_bytes(format);
+      unsigned yblocks = ( height + 3 ) / 4;
+      job_scheduler::get()->parallel_for(0, yblocks, 1, [&](unsigned y0, unsigned y1) {
+        for (unsigned by = y0; by != y1; ++by) {
+          encode_row(dest + by * row_bytes, format, src, width, height, num_comps, by);
+        }
+      });
+      return size;
+    }
+  };
+}}
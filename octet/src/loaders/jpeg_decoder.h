@@ -8,11 +8,30 @@
 // jpeg file decoder - tiny and fast
 //
 // See http://en.wikipedia.org/wiki/JPEG
-// 
+//
+// Huffman codes of up to nine bits are decoded with one table lookup.
+// The inverse DCT is the fixed point AAN (Arai, Agui and Nakajima) algorithm,
+// with the AAN scale factors folded into the quantisation tables.
+// Colour conversion and chroma upsampling use SSE2 when OCTET_SSE is set.
+//
+// Baseline images are decoded a MCU at a time straight to RGBA.
+// Progressive images (and baseline images with separate scans per component)
+// collect coefficients over several scans and are converted at the end.
+// If the file has restart markers, the restart intervals are decoded in parallel.
+//
 namespace octet { namespace loaders {
   class jpeg_decoder {
     enum { debug = 0 };
 
+    enum {
+      // huffman codes this long or shorter are decoded by table lookup.
+      lookahead_bits = 9,
+
+      // fixed point bits in the AAN multipliers and extra bits kept between the idct passes.
+      aan_const_bits = 8,
+      aan_pass1_bits = 2,
+    };
+
     // image dimensions
     unsigned precision;
     unsigned width;
@@ -32,22 +51,88 @@ namespace octet { namespace loaders {
     unsigned num_mcu_blocks;
     unsigned num_components_in_scan;
 
-    // skip a number of bits in the file.
-    // there is a special case where every 0xff byte is followed by 0x00
-    static void skip_bits(unsigned bits, unsigned &acc, const uint8_t *&src, int &shift) {
-      shift -= bits;
-      while (shift < 0) {
-        // grab more bytes
-        uint8_t byte = *src++;
-        acc = acc * 256 + byte;
-        if (byte == 0xff) {
-          // in JPEG, an 0xff byte is followed by a zero
-          // do not advance past any other 0xff marker
-          src += src[0] == 0x00 ? 1 : -1;
+    // the image is tiled by mcus_x * mcus_y MCUs of max_hsamp * max_vsamp blocks.
+    unsigned max_hsamp;
+    unsigned max_vsamp;
+    unsigned mcus_x;
+    unsigned mcus_y;
+
+    // the current scan may have a different grid if it has only one component.
+    unsigned scan_mcus_x;
+    unsigned scan_mcus_y;
+
+    // number of MCUs between restart markers, 0 for none.
+    unsigned restart_interval;
+
+    // true if we are collecting coefficients over several scans.
+    bool buffered;
+
+    // coefficients in natural order, 64 per block, for buffered images.
+    dynarray<int16_t> coeff_store[3];
+
+    // Reads bits from the entropy coded data, most significant bit first.
+    // In JPEG, an 0xff byte is followed by a zero which we skip.
+    // Any other 0xff xx is a marker and ends the data; after that we read zeros.
+    struct bit_reader {
+      const uint8_t *src;
+      const uint8_t *src_max;
+      uint64_t bits;
+      int count;
+      bool marker;
+      bool corrupt;
+
+      void init(const uint8_t *src_, const uint8_t *src_max_) {
+        src = src_;
+        src_max = src_max_;
+        bits = 0;
+        count = 0;
+        marker = false;
+        corrupt = false;
+      }
+
+      // make sure there are at least 57 bits in the buffer.
+      void refill() {
+        while (count <= 56) {
+          unsigned byte = 0;
+          if (!marker && src < src_max) {
+            byte = src[0];
+            if (byte != 0xff) {
+              src++;
+            } else if (src + 1 < src_max && src[1] == 0x00) {
+              src += 2;
+            } else {
+              marker = true;
+              byte = 0;
+            }
+          }
+          bits |= (uint64_t)byte << ( 56 - count );
+          count += 8;
         }
-        shift += 8;
       }
-    }
+
+      unsigned peek(unsigned n) const {
+        return (unsigned)( bits >> ( 64 - n ) );
+      }
+
+      void skip(unsigned n) {
+        bits <<= n;
+        count -= n;
+      }
+
+      unsigned get_bits(unsigned n) {
+        if (!n) return 0;
+        unsigned value = peek(n);
+        skip(n);
+        return value;
+      }
+
+      // read a value with n bits. Values with a leading zero are negative.
+      int get_signed(unsigned n) {
+        if (!n) return 0;
+        unsigned v = get_bits(n);
+        return v < ( 1u << ( n-1 ) ) ? (int)v - (int)( 1u << n ) + 1 : (int)v;
+      }
+    };
 
     // this is a component usually Y (brightness), Cb (blueness) and Cr (redness)
     // from the file.
@@ -58,6 +143,10 @@ namespace octet { namespace loaders {
       uint8_t hsamp;
       uint8_t vsamp;
       uint8_t quantisation_table;
+
+      // size of the component in blocks, rounded up to whole MCUs.
+      unsigned blocks_w;
+      unsigned blocks_h;
     } components[4];
 
     // this is a component that is used for a particluar "scan"
@@ -67,15 +156,13 @@ namespace octet { namespace loaders {
       uint8_t comp;
       uint8_t ac_table;
       uint8_t dc_table;
-      unsigned width_in_blocks;
-      unsigned height_in_blocks;
-      int last_dc;
     } scan_components[4];
 
     // quantisation table. We multiply the dc and ac coefficients by these numbers.
     // this is the lossy part of the compression
     struct quant_table {
-      float table[64];
+      // multipliers in natural (not zig-zag) order, scaled by the AAN factors and 1 << aan_pass1_bits.
+      int32_t table[64];
     } quant_tables[4];
 
     // A huffman table maps variable length codes to lengths and values.
@@ -88,20 +175,39 @@ namespace octet { namespace loaders {
       uint16_t maxcodes[17];
       uint16_t offset[17];
 
+      // (length << 8) | value for codes of up to lookahead_bits, 0 for longer codes.
+      uint16_t lookahead[1 << lookahead_bits];
+
+      // for AC tables: (coefficient << 8) | (run << 4) | total bits, when the code and
+      // the coefficient together fit in lookahead_bits. 0 if not.
+      int16_t fast_ac[1 << lookahead_bits];
+
       // decode a variable length huffman code
-      // we grab the next 16 bits and look in the maxcodes table to see how many
+      // short codes come straight from the lookahead table.
+      // for longer ones, we grab the next 16 bits and look in the maxcodes table to see how many
       // bits the code has. After that, we strip the right hand bits and
       // look up the code in a table.
-      unsigned decode(unsigned &acc, const uint8_t *&src, int &shift) {
-        unsigned i = min_len;
-        unsigned short acc16 = acc >> shift;
+      // There must be at least 16 bits in the reader.
+      unsigned decode(bit_reader &br) const {
+        unsigned entry = lookahead[br.peek(lookahead_bits)];
+        if (entry) {
+          br.skip(entry >> 8);
+          return entry & 0xff;
+        }
+
+        unsigned i = min_len > lookahead_bits ? min_len : (unsigned)lookahead_bits;
+        unsigned acc16 = br.peek(16);
+        for (; i < 16 && acc16 > maxcodes[i]; ++i) {
+        }
 
-        // find the shortest code that this could be
-        for (; acc16 > maxcodes[i]; ++i) {
+        if (i >= 16) {
+          br.corrupt = true;
+          br.skip(16);
+          return 0;
         }
 
-        unsigned code = ( acc16 >> (15-i) ) - offset[i];
-        skip_bits(i + 1, acc, src, shift);
+        unsigned code = ( ( acc16 >> (15-i) ) - offset[i] ) & 0xff;
+        br.skip(i + 1);
         return huffval[code];
       }
     } huffman_tables[2][4];
@@ -113,11 +219,36 @@ namespace octet { namespace loaders {
       huffman_table *dc_table;
       huffman_table *ac_table;
       quant_table *quant;
-      scan_component *scan_comp;
-    } mcu_blocks[8];
+      uint8_t comp;
+      uint8_t scan_index;
+
+      // position of the block in the MCU.
+      uint8_t bx;
+      uint8_t by;
+
+      // where the pixels of the block go in the mcu planes.
+      unsigned offset;
+      unsigned stride;
+    } mcu_blocks[10];
 
-    float dct_coeffs[8*64];
-    float ycrcb_values[8*64];
+    // decoded pixels of one MCU, one plane per component.
+    // Each thread has its own.
+    struct mcu_planes {
+      uint8_t planes[3][16*16];
+    };
+
+    // entropy decoder state that is reset at each restart marker.
+    struct scan_state {
+      bit_reader br;
+      int last_dc[4];
+      unsigned eobrun;
+
+      void init(const uint8_t *src, const uint8_t *src_max) {
+        br.init(src, src_max);
+        last_dc[0] = last_dc[1] = last_dc[2] = last_dc[3] = 0;
+        eobrun = 0;
+      }
+    };
 
     unsigned u2(const uint8_t *src) {
       return src[0] * 256 + src[1];
@@ -125,7 +256,7 @@ namespace octet { namespace loaders {
 
     // dct coefficients are stored in zig-zag order because the top
     // left is far more common.
-    uint8_t zig_zag(unsigned i) {
+    static const uint8_t *zig_zag() {
       static const uint8_t zig_zag_[64] = {
         0, 1, 8, 16, 9, 2, 3, 10,
         17, 24, 32, 25, 18, 11, 4, 5,
@@ -136,221 +267,586 @@ namespace octet { namespace loaders {
         58, 59, 52, 45, 38, 31, 39, 46,
         53, 60, 61, 54, 47, 55, 62, 63,
       };
-      return i < 63 ? zig_zag_[i] : 63;
-    }
-
-    // negative numbers need to be twiddled as all numbers coming in are positive.
-    static int extend(unsigned bits, unsigned &acc, const uint8_t *&src, int &shift) {
-      uint16_t acc16 = acc >> shift;
-      unsigned v = acc16 >> (16 - bits);
-      return v < ( 1u << ( bits-1 ) ) ? (int)v + ( -1 << bits ) + 1 : (int)v;
+      return zig_zag_;
     }
 
     // decode one block of an MCU which may contain many blocks
     // The Y component may have four blocks, for example, and only one each of Cr, Cb
-    void decode_mcu_block(unsigned block_num, unsigned &acc, const uint8_t *&src, int &shift, float *outptr) {
-      mcu_block &block = mcu_blocks[block_num];
+    // coeffs must be zero on entry. Returns the number of coefficients up to the last non-zero one.
+    OCTET_HOT unsigned decode_mcu_block(const mcu_block &block, scan_state &st, int16_t *coeffs) {
+      const uint8_t *zz = zig_zag();
+      bit_reader &br = st.br;
 
-      unsigned value = block.dc_table->decode(acc, src, shift);
+      if (br.count < 32) br.refill();
+      unsigned value = block.dc_table->decode(br);
 
-      int dc = 0;
-      if (value) {
-        dc = extend(value, acc, src, shift);
-        skip_bits(value, acc, src, shift);
-        //if (debug) printf("dc=%d\n", dc);
-      }
-      int abs_dc = block.scan_comp->last_dc += dc;
-      outptr[0] = abs_dc * block.quant->table[0];
+      int dc = br.get_signed(value & 15);
+      coeffs[0] = (int16_t)( st.last_dc[block.scan_index] += dc );
+
+      const huffman_table *ac_table = block.ac_table;
+      unsigned end = 1;
+      for (unsigned ac_coef = 1; ac_coef < 64; ++ac_coef) {
+        // 16 bits of code and 10 bits of value
+        if (br.count < 32) br.refill();
+
+        // most coefficients are small and have short codes.
+        int fast = ac_table->fast_ac[br.peek(lookahead_bits)];
+        if (fast) {
+          ac_coef += ( fast >> 4 ) & 15;
+          br.skip(fast & 15);
+          if (ac_coef > 63) {
+            br.corrupt = true;
+            break;
+          }
+          coeffs[zz[ac_coef]] = (int16_t)( fast >> 8 );
+          end = ac_coef + 1;
+          continue;
+        }
 
-      for (int ac_coef = 1; ac_coef < 64; ++ac_coef) {
-        unsigned value = block.ac_table->decode(acc, src, shift);
+        unsigned value = ac_table->decode(br);
         unsigned skip = value >> 4;
         value &= 0x0f;
-        ac_coef += skip;
 
         if (value) {
-          int ac = extend(value, acc, src, shift);
-          skip_bits(value, acc, src, shift);
-          //if (debug) printf("ac=%d,%d coef=%d zig_zag=%d\n", skip, ac, ac_coef, zig_zag(ac_coef));
-          outptr[zig_zag(ac_coef)] = (float)ac * block.quant->table[ac_coef];
-        } else if (skip != 15) {
+          ac_coef += skip;
+          if (ac_coef > 63) {
+            br.corrupt = true;
+            break;
+          }
+          coeffs[zz[ac_coef]] = (int16_t)br.get_signed(value);
+          end = ac_coef + 1;
+        } else if (skip == 15) {
+          ac_coef += 15;
+        } else {
           break;
         }
       }
-      if (debug) {
-        for (int j = 0; j != 8; ++j) {
-          for (int i = 0; i != 8; ++i) {
-            printf("%3.0f ", outptr[i+j*8]);
+      return end;
+    }
+
+    // progressive: first scan of the DC coefficient.
+    void decode_dc_first(const mcu_block &block, scan_state &st, int16_t *coeffs) {
+      bit_reader &br = st.br;
+      if (br.count < 32) br.refill();
+      unsigned value = block.dc_table->decode(br);
+      int dc = st.last_dc[block.scan_index] += br.get_signed(value & 15);
+      coeffs[0] = (int16_t)( dc * ( 1 << successive_low ) );
+    }
+
+    // progressive: add one more bit to the DC coefficient.
+    void decode_dc_refine(scan_state &st, int16_t *coeffs) {
+      bit_reader &br = st.br;
+      if (br.count < 32) br.refill();
+      if (br.get_bits(1)) coeffs[0] |= (int16_t)( 1 << successive_low );
+    }
+
+    // progressive: first scan of a band of AC coefficients.
+    // A run of blocks with no coefficients in the band is coded as a single "end of band run".
+    void decode_ac_first(const mcu_block &block, scan_state &st, int16_t *coeffs) {
+      if (st.eobrun) {
+        st.eobrun--;
+        return;
+      }
+
+      const uint8_t *zz = zig_zag();
+      bit_reader &br = st.br;
+      for (unsigned k = spectral_start; k <= spectral_end; ++k) {
+        if (br.count < 32) br.refill();
+        unsigned value = block.ac_table->decode(br);
+        unsigned run = value >> 4;
+        unsigned size = value & 15;
+        if (size) {
+          k += run;
+          if (k > 63) {
+            br.corrupt = true;
+            return;
+          }
+          coeffs[zz[k]] = (int16_t)( br.get_signed(size) * ( 1 << successive_low ) );
+        } else if (run == 15) {
+          k += 15;
+        } else {
+          st.eobrun = ( 1u << run ) - 1;
+          if (run) st.eobrun += br.get_bits(run);
+          return;
+        }
+      }
+    }
+
+    // progressive: refine a non-zero coefficient by one bit.
+    static void refine_coeff(bit_reader &br, int16_t &coeff, int p1) {
+      if (br.count < 16) br.refill();
+      if (br.get_bits(1) && ( coeff & p1 ) == 0) {
+        coeff = (int16_t)( coeff >= 0 ? coeff + p1 : coeff - p1 );
+      }
+    }
+
+    // progressive: add one more bit to a band of AC coefficients.
+    // New coefficients are +1 or -1, and existing non-zero coefficients get a correction bit.
+    void decode_ac_refine(const mcu_block &block, scan_state &st, int16_t *coeffs) {
+      const uint8_t *zz = zig_zag();
+      bit_reader &br = st.br;
+      int p1 = 1 << successive_low;
+      unsigned k = spectral_start;
+
+      if (!st.eobrun) {
+        for (; k <= spectral_end; ++k) {
+          if (br.count < 32) br.refill();
+          unsigned value = block.ac_table->decode(br);
+          int run = value >> 4;
+          int new_coeff = 0;
+          if (value & 15) {
+            new_coeff = br.get_bits(1) ? p1 : -p1;
+          } else if (run != 15) {
+            st.eobrun = 1u << run;
+            if (run) st.eobrun += br.get_bits(run);
+            break;
+          }
+
+          // skip run zero coefficients, refining the non-zero ones on the way.
+          for (; k <= spectral_end; ++k) {
+            int16_t &coeff = coeffs[zz[k]];
+            if (coeff) {
+              refine_coeff(br, coeff, p1);
+            } else if (--run < 0) {
+              break;
+            }
+          }
+
+          if (new_coeff) {
+            if (k > spectral_end) {
+              br.corrupt = true;
+              return;
+            }
+            coeffs[zz[k]] = (int16_t)new_coeff;
           }
-          printf("\n");
         }
       }
+
+      if (st.eobrun) {
+        // in an end of band run, refine the rest of the band.
+        for (; k <= spectral_end; ++k) {
+          int16_t &coeff = coeffs[zz[k]];
+          if (coeff) refine_coeff(br, coeff, p1);
+        }
+        st.eobrun--;
+      }
+    }
+
+    // clamp to 0..255 range without using branches.
+    static uint8_t clamp(int v) {
+      v &= ~( v >> 31 );
+      return (uint8_t)( v | ( ( 255 - v ) >> 31 ) );
     }
 
-    // one dimensional inverse DCT.
-    // c0 is the DC term and c1..c7 increase in frequency
-    // example: c0 = 128, c1..c7 = 0 -> 128, 128, 128, 128, 128, 128, 128, 128
-    // todo: improve this!
-    OCTET_HOT void idct(float &c0, float &c1, float &c2, float &c3, float &c4, float &c5, float &c6, float &c7) {
-      float c2c6_1 = (c2 + c6) * 0.541196100f;
-      float c2c6_2 = c2c6_1 + c6 * -1.847759065f;
-      float c2c6_3 = c2c6_1 + c2 * 0.765366865f;
-    
-      float c0c4_1 = c0 + c4;
-      float c0c4_2 = c0 - c4;
-    
-      float ceven_1 = c0c4_1 + c2c6_3;
-      float ceven_2 = c0c4_1 - c2c6_3;
-      float ceven_3 = c0c4_2 + c2c6_2;
-      float ceven_4 = c0c4_2 - c2c6_2;
-    
-      float c1c7 = c7 + c1;
-      float c3c5 = c5 + c3;
-      float c7c3 = c7 + c3;
-      float c5c1 = c5 + c1;
-      float codd_0 = (c7c3 + c5c1) * 1.175875602f;
-    
-      float codd_4 = c7 * 0.298631336f;
-      float codd_3 = c5 * 2.053119869f;
-      float codd_2 = c3 * 3.072711026f;
-      float codd_1 = c1 * 1.501321110f;
-      c1c7 = c1c7 * -0.899976223f;
-      c3c5 = c3c5 * -2.562915447f;
-      c7c3 = c7c3 * -1.961570560f;
-      c5c1 = c5c1 * -0.390180644f;
-    
-      c7c3 += codd_0;
-      c5c1 += codd_0;
-    
-      codd_4 += c1c7 + c7c3;
-      codd_3 += c3c5 + c5c1;
-      codd_2 += c3c5 + c7c3;
-      codd_1 += c1c7 + c5c1;
-    
-      c0 = ceven_1 + codd_1;
-      c7 = ceven_1 - codd_1;
-      c1 = ceven_3 + codd_2;
-      c6 = ceven_3 - codd_2;
-      c2 = ceven_4 + codd_3;
-      c5 = ceven_4 - codd_3;
-      c3 = ceven_2 + codd_4;
-      c4 = ceven_2 - codd_4;
+    // a * b in AAN fixed point.
+    static int aan_mul(int a, int b) {
+      return ( a * b ) >> aan_const_bits;
     }
 
-    // Two dimensional inverse DCT
-    // we can do the rows and columns separately.
-    // Optimisations include spotting blank rows and columns, but this
-    // is just a reference design.
-    void inverse_dct(float *inptr) {
-      // do rows
-      for (unsigned i = 0; i != 8; ++i) {
-        idct(inptr[8*0+i], inptr[8*1+i], inptr[8*2+i], inptr[8*3+i], inptr[8*4+i], inptr[8*5+i], inptr[8*6+i], inptr[8*7+i]);
+    // Two dimensional inverse DCT using the AAN algorithm in fixed point.
+    // we can do the columns and then the rows separately.
+    // Blocks with only a DC term are very common and are just filled.
+    OCTET_HOT static void inverse_dct(const int16_t *inptr, unsigned num_coeffs, const int32_t *quant, uint8_t *outptr, unsigned stride) {
+      // cos(pi/4) etc. in aan_const_bits fixed point
+      const int fix_1_082392200 = 277;
+      const int fix_1_414213562 = 362;
+      const int fix_1_847759065 = 473;
+      const int fix_2_613125930 = 669;
+
+      // pass 2 divides by 8 and removes the pass 1 bits. Add 128 and round at the same time.
+      const int out_shift = aan_pass1_bits + 3;
+      const int out_bias = ( 128 << out_shift ) + ( 1 << ( out_shift - 1 ) );
+
+      if (num_coeffs <= 1) {
+        uint8_t v = clamp(( inptr[0] * quant[0] + out_bias ) >> out_shift);
+        for (unsigned j = 0; j != 8; ++j) {
+          memset(outptr + j * stride, v, 8);
+        }
+        return;
       }
 
+      int workspace[64];
+
       // do columns
       for (unsigned i = 0; i != 8; ++i) {
-        idct(inptr[8*i+0], inptr[8*i+1], inptr[8*i+2], inptr[8*i+3], inptr[8*i+4], inptr[8*i+5], inptr[8*i+6], inptr[8*i+7]);
+        const int16_t *in = inptr + i;
+        const int32_t *q = quant + i;
+        int *ws = workspace + i;
+        if (!( in[8] | in[16] | in[24] | in[32] | in[40] | in[48] | in[56] )) {
+          int dc = in[0] * q[0];
+          ws[0] = ws[8] = ws[16] = ws[24] = ws[32] = ws[40] = ws[48] = ws[56] = dc;
+          continue;
+        }
+
+        // even part
+        int tmp0 = in[0] * q[0];
+        int tmp1 = in[16] * q[16];
+        int tmp2 = in[32] * q[32];
+        int tmp3 = in[48] * q[48];
+
+        int tmp10 = tmp0 + tmp2;
+        int tmp11 = tmp0 - tmp2;
+        int tmp13 = tmp1 + tmp3;
+        int tmp12 = aan_mul(tmp1 - tmp3, fix_1_414213562) - tmp13;
+
+        tmp0 = tmp10 + tmp13;
+        tmp3 = tmp10 - tmp13;
+        tmp1 = tmp11 + tmp12;
+        tmp2 = tmp11 - tmp12;
+
+        // odd part
+        int tmp4 = in[8] * q[8];
+        int tmp5 = in[24] * q[24];
+        int tmp6 = in[40] * q[40];
+        int tmp7 = in[56] * q[56];
+
+        int z13 = tmp6 + tmp5;
+        int z10 = tmp6 - tmp5;
+        int z11 = tmp4 + tmp7;
+        int z12 = tmp4 - tmp7;
+
+        tmp7 = z11 + z13;
+        tmp11 = aan_mul(z11 - z13, fix_1_414213562);
+        int z5 = aan_mul(z10 + z12, fix_1_847759065);
+        tmp10 = aan_mul(z12, fix_1_082392200) - z5;
+        tmp12 = aan_mul(z10, -fix_2_613125930) + z5;
+
+        tmp6 = tmp12 - tmp7;
+        tmp5 = tmp11 - tmp6;
+        tmp4 = tmp10 + tmp5;
+
+        ws[0] = tmp0 + tmp7;
+        ws[56] = tmp0 - tmp7;
+        ws[8] = tmp1 + tmp6;
+        ws[48] = tmp1 - tmp6;
+        ws[16] = tmp2 + tmp5;
+        ws[40] = tmp2 - tmp5;
+        ws[32] = tmp3 + tmp4;
+        ws[24] = tmp3 - tmp4;
+      }
+
+      // do rows
+      for (unsigned j = 0; j != 8; ++j) {
+        const int *ws = workspace + j * 8;
+        uint8_t *out = outptr + j * stride;
+        if (!( ws[1] | ws[2] | ws[3] | ws[4] | ws[5] | ws[6] | ws[7] )) {
+          memset(out, clamp(( ws[0] + out_bias ) >> out_shift), 8);
+          continue;
+        }
+
+        // even part
+        int tmp10 = ws[0] + ws[4] + out_bias;
+        int tmp11 = ws[0] - ws[4] + out_bias;
+        int tmp13 = ws[2] + ws[6];
+        int tmp12 = aan_mul(ws[2] - ws[6], fix_1_414213562) - tmp13;
+
+        int tmp0 = tmp10 + tmp13;
+        int tmp3 = tmp10 - tmp13;
+        int tmp1 = tmp11 + tmp12;
+        int tmp2 = tmp11 - tmp12;
+
+        // odd part
+        int z13 = ws[5] + ws[3];
+        int z10 = ws[5] - ws[3];
+        int z11 = ws[1] + ws[7];
+        int z12 = ws[1] - ws[7];
+
+        int tmp7 = z11 + z13;
+        tmp11 = aan_mul(z11 - z13, fix_1_414213562);
+        int z5 = aan_mul(z10 + z12, fix_1_847759065);
+        tmp10 = aan_mul(z12, fix_1_082392200) - z5;
+        tmp12 = aan_mul(z10, -fix_2_613125930) + z5;
+
+        int tmp6 = tmp12 - tmp7;
+        int tmp5 = tmp11 - tmp6;
+        int tmp4 = tmp10 + tmp5;
+
+        out[0] = clamp(( tmp0 + tmp7 ) >> out_shift);
+        out[7] = clamp(( tmp0 - tmp7 ) >> out_shift);
+        out[1] = clamp(( tmp1 + tmp6 ) >> out_shift);
+        out[6] = clamp(( tmp1 - tmp6 ) >> out_shift);
+        out[2] = clamp(( tmp2 + tmp5 ) >> out_shift);
+        out[5] = clamp(( tmp2 - tmp5 ) >> out_shift);
+        out[4] = clamp(( tmp3 + tmp4 ) >> out_shift);
+        out[3] = clamp(( tmp3 - tmp4 ) >> out_shift);
       }
+    }
+
+    // YCbCr to RGB in 12.4 fixed point, see http://en.wikipedia.org/wiki/YCbCr
+    // chroma is scaled by 128 and the constants by 8192 so that
+    // (chroma * constant) >> 16 has four fraction bits, like _mm_mulhi_epi16.
+    enum {
+      cr_to_r = 11485,  // 1.402
+      cb_to_g = 2819,   // 0.34414
+      cr_to_g = 5850,   // 0.71414
+      cb_to_b = 14516,  // 1.772
+    };
 
-      if (debug) {
-        for (int j = 0; j != 8; ++j) {
-          for (int i = 0; i != 8; ++i) {
-            printf("%f ", inptr[i+j*8]);
+    // chroma terms for the scalar colour conversion, calculated the same way as the SSE2 version.
+    // a function static, so that threads decoding at the same time only build it once.
+    static const int16_t (*color_tables())[256] {
+      static struct tables_t {
+        int16_t tables[4][256];
+
+        tables_t() {
+          static const int k[4] = { cr_to_r, cb_to_g, cr_to_g, cb_to_b };
+          for (unsigned t = 0; t != 4; ++t) {
+            for (int c = 0; c != 256; ++c) {
+              tables[t][c] = (int16_t)( ( ( c - 128 ) * 128 * k[t] ) >> 16 );
+            }
           }
-          printf("\n");
         }
+      } t;
+      return t.tables;
+    }
+
+    // convert a row of Y to RGBA
+    static void color_convert_greyscale(uint8_t *outptr, const uint8_t *y, unsigned count) {
+      unsigned i = 0;
+      #if OCTET_SSE
+        __m128i alpha = _mm_set1_epi8((char)0xff);
+        for (; i + 8 <= count; i += 8) {
+          __m128i y8 = _mm_loadl_epi64((const __m128i*)(y + i));
+          __m128i yy = _mm_unpacklo_epi8(y8, y8);
+          __m128i ya = _mm_unpacklo_epi8(y8, alpha);
+          _mm_storeu_si128((__m128i*)(outptr + i * 4), _mm_unpacklo_epi16(yy, ya));
+          _mm_storeu_si128((__m128i*)(outptr + i * 4 + 16), _mm_unpackhi_epi16(yy, ya));
+        }
+      #endif
+      for (; i != count; ++i) {
+        outptr[i*4+0] = outptr[i*4+1] = outptr[i*4+2] = y[i];
+        outptr[i*4+3] = 0xff;
       }
     }
 
-    // clamp to 0..255 range without using branches.
-    // fabsf is usually implemented in hardware (with fast math options)
-    OCTET_HOT uint8_t clamp(float v) {
-      // v + fabsf(v) = 2v when v > 0
-      // v + fabsf(v) = 0  when v < 0
-      float clamp0 = v + fabsf(v);
-
-      // v - fabsf(v-n) = n when v > n
-      // v - fabsf(v-n) = 2v - n when v < n
-      return (uint8_t)( ( clamp0 - fabsf( clamp0 - (255.999f * 2) ) ) * 0.25f + 128 );
+    // convert a row of Y, Cb and Cr to RGBA
+    static void color_convert(uint8_t *outptr, const uint8_t *y, const uint8_t *cb, const uint8_t *cr, unsigned count) {
+      unsigned i = 0;
+      #if OCTET_SSE
+        __m128i zero = _mm_setzero_si128();
+        __m128i alpha = _mm_set1_epi8((char)0xff);
+        __m128i bias = _mm_set1_epi16(128);
+        __m128i round = _mm_set1_epi16(8);
+        __m128i k_cr_r = _mm_set1_epi16(cr_to_r);
+        __m128i k_cb_g = _mm_set1_epi16(cb_to_g);
+        __m128i k_cr_g = _mm_set1_epi16(cr_to_g);
+        __m128i k_cb_b = _mm_set1_epi16(cb_to_b);
+        for (; i + 8 <= count; i += 8) {
+          __m128i y16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(y + i)), zero);
+          __m128i cb16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(cb + i)), zero);
+          __m128i cr16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(cr + i)), zero);
+          y16 = _mm_add_epi16(_mm_slli_epi16(y16, 4), round);
+          cb16 = _mm_slli_epi16(_mm_sub_epi16(cb16, bias), 7);
+          cr16 = _mm_slli_epi16(_mm_sub_epi16(cr16, bias), 7);
+
+          __m128i r = _mm_add_epi16(y16, _mm_mulhi_epi16(cr16, k_cr_r));
+          __m128i g = _mm_sub_epi16(_mm_sub_epi16(y16, _mm_mulhi_epi16(cb16, k_cb_g)), _mm_mulhi_epi16(cr16, k_cr_g));
+          __m128i b = _mm_add_epi16(y16, _mm_mulhi_epi16(cb16, k_cb_b));
+
+          __m128i r8 = _mm_packus_epi16(_mm_srai_epi16(r, 4), zero);
+          __m128i g8 = _mm_packus_epi16(_mm_srai_epi16(g, 4), zero);
+          __m128i b8 = _mm_packus_epi16(_mm_srai_epi16(b, 4), zero);
+          __m128i rg = _mm_unpacklo_epi8(r8, g8);
+          __m128i ba = _mm_unpacklo_epi8(b8, alpha);
+          _mm_storeu_si128((__m128i*)(outptr + i * 4), _mm_unpacklo_epi16(rg, ba));
+          _mm_storeu_si128((__m128i*)(outptr + i * 4 + 16), _mm_unpackhi_epi16(rg, ba));
+        }
+      #endif
+      const int16_t (*tables)[256] = color_tables();
+      for (; i != count; ++i) {
+        int y16 = ( y[i] << 4 ) + 8;
+        outptr[i*4+0] = clamp(( y16 + tables[0][cr[i]] ) >> 4);
+        outptr[i*4+1] = clamp(( y16 - tables[1][cb[i]] - tables[2][cr[i]] ) >> 4);
+        outptr[i*4+2] = clamp(( y16 + tables[3][cb[i]] ) >> 4);
+        outptr[i*4+3] = 0xff;
+      }
     }
 
-    // convert from Y to RGB
-    // The 0.125 scaling factor is because the DCT data has a scale of 8
-    void color_convert_444_greyscale(uint8_t *outptr, int stride, float *inptr) {
-      for (unsigned j = 0; j != 8; ++j) {
-        for (unsigned i = 0; i != 8; ++i) {
-          float y = inptr[0];
-          inptr++;
-          outptr[0] = clamp(128 + y * 0.125f);
-          outptr[1] = clamp(128 + y * 0.125f);
-          outptr[2] = clamp(128 + y * 0.125f);
-          outptr[3] = 0xff;
-          outptr += 4;
+    // double the width of a row of chroma samples.
+    static void upsample_2x(uint8_t *dest, const uint8_t *src, unsigned count) {
+      unsigned i = 0;
+      #if OCTET_SSE
+        for (; i + 8 <= count; i += 8) {
+          __m128i c8 = _mm_loadl_epi64((const __m128i*)(src + i));
+          _mm_storeu_si128((__m128i*)(dest + i * 2), _mm_unpacklo_epi8(c8, c8));
         }
-        outptr += stride - 32;
+      #endif
+      for (; i != count; ++i) {
+        dest[i*2] = dest[i*2+1] = src[i];
       }
     }
 
-    // convert from YCrCb to RGB
-    // See http://en.wikipedia.org/wiki/YCbCr
-    // The 0.125 scaling factor is because the DCT data has a scale of 8
-    void color_convert_444(uint8_t *outptr, int stride, float *inptr) {
-      for (unsigned j = 0; j != 8; ++j) {
-        for (unsigned i = 0; i != 8; ++i) {
-          float y = inptr[0];
-          float cb = inptr[64];
-          float cr = inptr[128];
-          inptr++;
-          outptr[0] = clamp(128 + y * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y * 0.125f + cb * (1.772f * 0.125f));
-          outptr[3] = 0xff;
-          outptr += 4;
+    // convert the planes of a decoded MCU to RGBA.
+    // outptr is the top left pixel, rows go down by stride bytes (which may be negative).
+    void color_convert_mcu(uint8_t *outptr, int stride, const mcu_planes &mp) {
+      const uint8_t (*planes)[16*16] = mp.planes;
+      unsigned mcu_width = max_hsamp * 8;
+      unsigned mcu_height = max_vsamp * 8;
+      if (num_components == 1) {
+        for (unsigned j = 0; j != mcu_height; ++j) {
+          color_convert_greyscale(outptr + (int)j * stride, planes[0] + j * mcu_width, mcu_width);
         }
-        outptr += stride - 32;
+        return;
+      }
+
+      // chroma is one block per MCU: upsample it to the luma size.
+      uint8_t cb_row[16], cr_row[16];
+      for (unsigned j = 0; j != mcu_height; ++j) {
+        const uint8_t *cb = planes[1] + ( j * 8 / mcu_height ) * 8;
+        const uint8_t *cr = planes[2] + ( j * 8 / mcu_height ) * 8;
+        if (max_hsamp == 2) {
+          upsample_2x(cb_row, cb, 8);
+          upsample_2x(cr_row, cr, 8);
+          cb = cb_row;
+          cr = cr_row;
+        }
+        color_convert(outptr + (int)j * stride, planes[0] + j * mcu_width, cb, cr, mcu_width);
       }
     }
 
-    // convert from YCrCb to RGB
-    // See http://en.wikipedia.org/wiki/YCbCr
-    // The 0.125 scaling factor is because the DCT data has a scale of 8
-    void color_convert_411(uint8_t *outptr, int stride, float *inptr) {
-      for (unsigned j = 0; j != 8; ++j) {
-        for (unsigned i = 0; i != 8; ++i) {
-          float y0 = inptr[0x00];
-          float y1 = inptr[0x40];
-          float y2 = inptr[0x80];
-          float y3 = inptr[0xc0];
-          float cb = inptr[0x100];
-          float cr = inptr[0x140];
-          inptr++;
-          outptr[0] = clamp(128 + y0 * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y0 * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y0 * 0.125f + cb * (1.772f * 0.125f));
-          outptr[3] = 0xff;
-          outptr += 4;
-          outptr[0] = clamp(128 + y1 * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y1 * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y1 * 0.125f + cb * (1.772f * 0.125f));
-          outptr[3] = 0xff;
-          outptr += stride - 4;
-          outptr[0] = clamp(128 + y2 * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y2 * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y2 * 0.125f + cb * (1.772f * 0.125f));
-          outptr[3] = 0xff;
-          outptr += 4;
-          outptr[0] = clamp(128 + y3 * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y3 * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y3 * 0.125f + cb * (1.772f * 0.125f));
-          outptr[3] = 0xff;
-          outptr += -stride + 4;
+    // find the entropy coded data of each restart interval in a scan.
+    // returns the end of the scan (the next marker that is not a restart marker).
+    static const uint8_t *find_restart_segments(const uint8_t *src, const uint8_t *src_end, dynarray<const uint8_t *> &starts) {
+      starts.resize(0);
+      starts.push_back(src);
+      while (src + 1 < src_end) {
+        src = (const uint8_t *)memchr(src, 0xff, src_end - 1 - src);
+        if (!src) return src_end;
+        unsigned code = src[1];
+        if (code == 0x00 || code == 0xff) {
+          // stuffed zero or fill byte
+          src += code == 0x00 ? 2 : 1;
+        } else if (code >= 0xd0 && code <= 0xd7) {
+          src += 2;
+          starts.push_back(src);
+        } else {
+          return src;
+        }
+      }
+      return src_end;
+    }
+
+    // decode the MCUs of a scan from mcu_begin to mcu_end.
+    // Called from several threads at once with different restart intervals.
+    void decode_mcus(scan_state &st, unsigned mcu_begin, unsigned mcu_end, uint8_t *image_base, int stride) {
+      int16_t coeffs[64];
+      mcu_planes mp;
+      bool interleaved = num_components_in_scan != 1;
+      bool progressive = sof_code == 0xc2;
+      unsigned padded_height = mcus_y * max_vsamp * 8;
+
+      for (unsigned mcu = mcu_begin; mcu != mcu_end; ++mcu) {
+        unsigned x = mcu % scan_mcus_x;
+        unsigned y = mcu / scan_mcus_x;
+        for (unsigned b = 0; b != num_mcu_blocks; ++b) {
+          const mcu_block &block = mcu_blocks[b];
+          if (!buffered) {
+            memset(coeffs, 0, sizeof(coeffs));
+            unsigned num_coeffs = decode_mcu_block(block, st, coeffs);
+            inverse_dct(coeffs, num_coeffs, block.quant->table, mp.planes[block.comp] + block.offset, block.stride);
+            continue;
+          }
+
+          // non-interleaved scans have one block per MCU.
+          const component &c = components[block.comp];
+          unsigned bx = interleaved ? x * c.hsamp + block.bx : x;
+          unsigned by = interleaved ? y * c.vsamp + block.by : y;
+          int16_t *dest = coeff_store[block.comp].data() + ( by * c.blocks_w + bx ) * 64;
+          if (!progressive) {
+            decode_mcu_block(block, st, dest);
+          } else if (spectral_start == 0) {
+            if (successive_high == 0) {
+              decode_dc_first(block, st, dest);
+            } else {
+              decode_dc_refine(st, dest);
+            }
+          } else {
+            if (successive_high == 0) {
+              decode_ac_first(block, st, dest);
+            } else {
+              decode_ac_refine(block, st, dest);
+            }
+          }
+        }
+
+        if (!buffered) {
+          // the image is stored bottom row first.
+          color_convert_mcu(image_base + ( padded_height - 1 - y * max_vsamp * 8 ) * stride + x * max_hsamp * 8 * 4, -stride, mp);
+        }
+      }
+    }
+
+    // decode a scan, running restart intervals in parallel.
+    // returns the end of the scan.
+    const uint8_t *decode_scan(const uint8_t *src, const uint8_t *src_end, uint8_t *image_base, int stride) {
+      dynarray<const uint8_t *> starts;
+      const uint8_t *scan_end = find_restart_segments(src, src_end, starts);
+
+      unsigned num_mcus = scan_mcus_x * scan_mcus_y;
+      unsigned interval = restart_interval ? restart_interval : num_mcus;
+      unsigned num_intervals = ( num_mcus + interval - 1 ) / interval;
+      if (starts.size() != num_intervals) {
+        log("jpeg_decoder: %u restart intervals, expected %u\n", (unsigned)starts.size(), num_intervals);
+      }
+
+      std::atomic<int> num_corrupt(0);
+      unsigned grain = interval >= 64 ? 1 : 64 / interval;
+      job_scheduler::get()->parallel_for(0, num_intervals, grain, [&](unsigned i0, unsigned i1) {
+        scan_state st;
+        for (unsigned i = i0; i != i1; ++i) {
+          // missing intervals read zeros.
+          const uint8_t *seg = i < starts.size() ? starts[i] : scan_end;
+          const uint8_t *seg_end = i + 1 < starts.size() ? starts[i+1] - 2 : scan_end;
+          st.init(seg, seg_end);
+          unsigned mcu_end = ( i + 1 ) * interval;
+          decode_mcus(st, i * interval, mcu_end < num_mcus ? mcu_end : num_mcus, image_base, stride);
+          if (st.br.corrupt) num_corrupt++;
+        }
+      });
+
+      if (num_corrupt) printf("warning: bad JPEG data\n");
+      return scan_end;
+    }
+
+    // convert the coefficients of a buffered image to RGBA, a row of MCUs at a time.
+    void finish_buffered(dynarray<uint8_t> &image, uint16_t &format) {
+      width = mcus_x * max_hsamp * 8;
+      height = mcus_y * max_vsamp * 8;
+      int stride = width * 4;
+      size_t base = image.size();
+      image.resize(base + height * stride);
+      format = 0x1908; // GL_RGBA
+      uint8_t *image_base = image.data() + base;
+
+      job_scheduler::get()->parallel_for(0, mcus_y, 1, [&](unsigned y0, unsigned y1) {
+        mcu_planes mp;
+        for (unsigned y = y0; y != y1; ++y) {
+          for (unsigned x = 0; x != mcus_x; ++x) {
+            for (unsigned comp = 0; comp != num_components; ++comp) {
+              const component &c = components[comp];
+              const int16_t *store = coeff_store[comp].data();
+              unsigned plane_stride = c.hsamp * 8;
+              for (unsigned by = 0; by != c.vsamp; ++by) {
+                for (unsigned bx = 0; bx != c.hsamp; ++bx) {
+                  const int16_t *coeffs = store + ( ( y * c.vsamp + by ) * c.blocks_w + x * c.hsamp + bx ) * 64;
+                  uint8_t *dest = mp.planes[comp] + by * 8 * plane_stride + bx * 8;
+                  inverse_dct(coeffs, 64, quant_tables[c.quantisation_table].table, dest, plane_stride);
+                }
+              }
+            }
+            color_convert_mcu(image_base + ( height - 1 - y * max_vsamp * 8 ) * stride + x * max_hsamp * 8 * 4, -stride, mp);
+          }
         }
-        outptr += stride*2 - 64;
+      });
+
+      buffered = false;
+      for (unsigned comp = 0; comp != 3; ++comp) {
+        coeff_store[comp].reset();
       }
     }
 
     // JPEG files are split up into chunks starting with 0xff
-    unsigned decode_chunk(const uint8_t *src, dynarray<uint8_t> &image, uint16_t &format) {
+    unsigned decode_chunk(const uint8_t *src, const uint8_t *src_end, dynarray<uint8_t> &image, uint16_t &format) {
       if (debug) printf("decode_chunk %02x\n", src[1]);
 
       unsigned length = 2;
@@ -365,8 +861,8 @@ namespace octet { namespace loaders {
           width = u2(src + 7);
           num_components = src[9];
 
-          if (src[1] != 0xc0) {
-            printf("warning: only baseline JPEG is supported - disable progressive\n");
+          if (src[1] != 0xc0 && src[1] != 0xc1 && src[1] != 0xc2) {
+            printf("warning: only baseline and progressive huffman JPEGs are supported\n");
             return 0;
           }
 
@@ -391,14 +887,37 @@ namespace octet { namespace loaders {
             c.quantisation_table = src[10 + i*3 + 2] & 3;
             if (debug) printf("id=%d h=%d v=%d q=%d\n", c.id, c.hsamp, c.vsamp, c.quantisation_table);
           }
-          
+
+          // luma may be 1x1, 2x1, 1x2 or 2x2 blocks. chroma is always 1x1.
+          if (num_components == 1) {
+            components[0].hsamp = components[0].vsamp = 1;
+          } else {
+            const component &y = components[0];
+            if (y.hsamp < 1 || y.hsamp > 2 || y.vsamp < 1 || y.vsamp > 2 ||
+                components[1].hsamp != 1 || components[1].vsamp != 1 ||
+                components[2].hsamp != 1 || components[2].vsamp != 1) {
+              printf("warning: only 4:4:4, 4:2:2, 4:4:0 and 4:2:0 JPEGs are supported\n");
+              return 0;
+            }
+          }
+
+          max_hsamp = components[0].hsamp;
+          max_vsamp = components[0].vsamp;
+          mcus_x = ( width + max_hsamp * 8 - 1 ) / ( max_hsamp * 8 );
+          mcus_y = ( height + max_vsamp * 8 - 1 ) / ( max_vsamp * 8 );
+          for (unsigned i = 0; i != num_components; ++i) {
+            component &c = components[i];
+            c.blocks_w = mcus_x * c.hsamp;
+            c.blocks_h = mcus_y * c.vsamp;
+          }
+          buffered = false;
         } break;
 
         // huffman tables
         case 0xc4: {
           length = u2(src + 2) + 2;
-          src += 4;
           const uint8_t *src_max = src + length;
+          src += 4;
           while (src + 17 <= src_max) {
             unsigned index = src[0];
             unsigned is_ac = (index >> 4) & 1;
@@ -411,9 +930,11 @@ namespace octet { namespace loaders {
             }
             src += 17;
             if (src + count > src_max || count > 256) return 0;
+            memset(h.huffval, 0, sizeof(h.huffval));
             memcpy(h.huffval, src, count);
             src += count;
 
+            memset(h.lookahead, 0, sizeof(h.lookahead));
             unsigned dest = 0;
             unsigned code = 0;
             h.min_len = 0;
@@ -426,6 +947,15 @@ namespace octet { namespace loaders {
               }
               for (unsigned i = 0; i != num_codes[len-1]; ++i) {
                 if (debug) printf("code=%04x len=%d\n", ( ( code + i ) << (16 - len) ), len );
+                if (len <= lookahead_bits) {
+                  // every lookahead index that starts with this code.
+                  unsigned first = ( code + i ) << ( lookahead_bits - len );
+                  unsigned num = 1 << ( lookahead_bits - len );
+                  if (first + num > ( 1 << lookahead_bits )) return 0;
+                  for (unsigned j = 0; j != num; ++j) {
+                    h.lookahead[first + j] = (uint16_t)( ( len << 8 ) | h.huffval[dest + i] );
+                  }
+                }
               }
               dest += num_codes[len-1];
               code = code + num_codes[len-1];
@@ -434,7 +964,21 @@ namespace octet { namespace loaders {
               if (debug) printf("h.maxcodes[%d] = %04x\n", len-1, h.maxcodes[len-1]);
             }
             h.maxcodes[16] = 0xffff;
-            
+
+            // combine short codes with their coefficient bits.
+            memset(h.fast_ac, 0, sizeof(h.fast_ac));
+            for (unsigned i = 0; is_ac && i != ( 1 << lookahead_bits ); ++i) {
+              unsigned entry = h.lookahead[i];
+              unsigned len = entry >> 8;
+              unsigned run = ( entry >> 4 ) & 15;
+              unsigned bits = entry & 15;
+              if (!entry || !bits || len + bits > lookahead_bits) continue;
+              unsigned v = ( i >> ( lookahead_bits - len - bits ) ) & ( ( 1 << bits ) - 1 );
+              int coeff = v < ( 1u << ( bits-1 ) ) ? (int)v - (int)( 1u << bits ) + 1 : (int)v;
+              if (coeff < -128 || coeff > 127) continue;
+              h.fast_ac[i] = (int16_t)( coeff * 256 + run * 16 + len + bits );
+            }
+
             if (debug) printf("DHT %d\n", index);
           }
         } break;
@@ -447,23 +991,36 @@ namespace octet { namespace loaders {
         // end
         case 0xd9: {
           if (debug) printf("EOI\n");
+          if (buffered) finish_buffered(image, format);
+        } break;
+
+        // restart interval
+        case 0xdd: {
+          length = u2(src + 2) + 2;
+          if (length < 6) return 0;
+          restart_interval = u2(src + 4);
+          if (debug) printf("DRI %d\n", restart_interval);
         } break;
 
         // image data
         case 0xda: {
           const uint8_t *src0 = src;
           length = u2(src + 2) + 2;
+          const uint8_t *src_max = src + length;
           src += 4;
           num_components_in_scan = *src++;
-          unsigned max_hsamp = 1;
-          unsigned max_vsamp = 1;
           num_mcu_blocks = 0;
-          const uint8_t *src_max = src + length;
+          if (!mcus_x || num_components_in_scan < 1 || num_components_in_scan > num_components) {
+            return 0;
+          }
+
+          // one component scans are not interleaved. Their MCU is a single block.
+          bool interleaved = num_components_in_scan != 1;
           for (unsigned i = 0; i != num_components_in_scan; ++i) {
             scan_component &sc = scan_components[i];
             unsigned id = *src++;
-            sc.ac_table = *src & 0x0f;
-            sc.dc_table = *src++ >> 4;
+            sc.ac_table = *src & 0x03;
+            sc.dc_table = ( *src++ >> 4 ) & 0x03;
             unsigned comp = 0;
             while (comp < num_components) {
               if (components[comp].id == id) break;
@@ -471,32 +1028,27 @@ namespace octet { namespace loaders {
             }
             if (comp >= num_components) return 0;
             component &c = components[comp];
-            max_hsamp = c.hsamp > max_hsamp ? c.hsamp : max_hsamp;
-            max_vsamp = c.vsamp > max_vsamp ? c.vsamp : max_vsamp;
             sc.comp = comp;
             if (debug) printf("SOS comp=%d ac=%d dc=%d\n", comp, sc.ac_table, sc.dc_table);
-            unsigned samps = c.hsamp * c.vsamp;
-
-            if (num_mcu_blocks + samps > sizeof(mcu_blocks)/sizeof(mcu_blocks[0])) {
-              printf("too many mcu blocks\n");
-              return 0;
-            }
 
-            for (unsigned j = 0; j != samps; ++j) {
-              mcu_block &m = mcu_blocks[num_mcu_blocks++];
-              m.dc_table = &huffman_tables[0][sc.dc_table];
-              m.ac_table = &huffman_tables[1][sc.ac_table];
-              m.quant = &quant_tables[c.quantisation_table];
-              m.scan_comp = &sc;
+            // blocks of a component go left to right, top to bottom in the MCU.
+            unsigned hsamp = interleaved ? c.hsamp : 1;
+            unsigned vsamp = interleaved ? c.vsamp : 1;
+            unsigned plane_stride = c.hsamp * 8;
+            for (unsigned by = 0; by != vsamp; ++by) {
+              for (unsigned bx = 0; bx != hsamp; ++bx) {
+                mcu_block &m = mcu_blocks[num_mcu_blocks++];
+                m.dc_table = &huffman_tables[0][sc.dc_table];
+                m.ac_table = &huffman_tables[1][sc.ac_table];
+                m.quant = &quant_tables[c.quantisation_table];
+                m.comp = (uint8_t)comp;
+                m.scan_index = (uint8_t)i;
+                m.bx = (uint8_t)bx;
+                m.by = (uint8_t)by;
+                m.offset = by * 8 * plane_stride + bx * 8;
+                m.stride = plane_stride;
+              }
             }
-
-            sc.last_dc = 0;
-          }
-
-          // at present, we only support YCrCb in 4:4:4
-          if (num_mcu_blocks != 1 && num_mcu_blocks != 3 && num_mcu_blocks != 6) {
-            printf("only 4:4:4 and 4:1:1 greyscale and ycrcb supported (%d mcu blocks)\n", num_mcu_blocks);
-            return 0;
           }
 
           spectral_start = *src++;
@@ -505,59 +1057,69 @@ namespace octet { namespace loaders {
           successive_low = *src++ & 0x0f;
           if (src > src_max) return 0;
 
-          for (unsigned i = 0; i != num_components_in_scan; ++i) {
-            scan_component &sc = scan_components[i];
-            component &c = components[sc.comp];
-            sc.width_in_blocks = width * c.hsamp / max_hsamp;
-            sc.height_in_blocks = height * c.hsamp / max_hsamp;
+          if (sof_code == 0xc2) {
+            // DC scans may be interleaved, AC scans have one component and a band of coefficients.
+            bool dc_scan = spectral_start == 0;
+            if (( dc_scan && spectral_end != 0 ) || ( !dc_scan && ( spectral_end < spectral_start || spectral_end > 63 || interleaved ) ) ||
+                successive_low > 13 || ( successive_high && successive_high != successive_low + 1 )) {
+              printf("warning: bad progressive JPEG scan\n");
+              return 0;
+            }
           }
 
-          width = (width + max_hsamp * 8 - 1) & ~(max_hsamp * 8 - 1);
-          height = (height + max_vsamp * 8 - 1) & ~(max_vsamp * 8 - 1);
-
-          unsigned xmax = ( width + max_hsamp * 8 - 1 ) / (max_hsamp * 8);
-          unsigned ymax = ( height + max_vsamp * 8 - 1 ) / (max_vsamp * 8);
-
-          unsigned acc = 0;
-          int shift = 0;
-          skip_bits(16, acc, src, shift);
-          
-          int stride = width * 4;
-
-          unsigned size = width * height * 4;
-          size_t base = image.size();
-          image.resize(base + size);
-          format = 0x1908; // GL_RGBA
-
-          uint8_t *image_base = image.data() + base;
-
-          for (unsigned y = 0; y != ymax; ++y) {
-            for (unsigned x = 0; x != xmax; ++x) {
-              float *coeffs = dct_coeffs;
-              memset(coeffs, 0, 64 * num_mcu_blocks * sizeof(float));
-              for (unsigned b = 0; b < num_mcu_blocks; ++b) {
-                decode_mcu_block(b, acc, src, shift, coeffs);
-                inverse_dct(coeffs);
-                coeffs += 64;
-              }
-              if (num_mcu_blocks == 1) {
-                // assume 4:4:4 Greyscale
-                color_convert_444_greyscale(&image_base[((height - 1 - y * 8) * stride) + (x * 8 * 4)], -stride, dct_coeffs);
-              } else if (num_mcu_blocks == 3) {
-                // assume 4:4:4 YCbCr
-                color_convert_444(&image_base[((height - 1 - y * 8) * stride) + (x * 8 * 4)], -stride, dct_coeffs);
-              } else if (num_mcu_blocks == 6) {
-                // assume 4:1:1 YCbCr
-                color_convert_411(&image_base[((height - 1 - y * 16) * stride) + (x * 16 * 4)], -stride, dct_coeffs);
-              }
+          if (interleaved) {
+            scan_mcus_x = mcus_x;
+            scan_mcus_y = mcus_y;
+          } else {
+            // the component is not padded to whole MCUs in a non-interleaved scan.
+            const component &c = components[scan_components[0].comp];
+            scan_mcus_x = ( ( width * c.hsamp + max_hsamp - 1 ) / max_hsamp + 7 ) / 8;
+            scan_mcus_y = ( ( height * c.vsamp + max_vsamp - 1 ) / max_vsamp + 7 ) / 8;
+          }
+
+          // progressive images and images with a scan per component are decoded to coefficients first.
+          if (!buffered && ( sof_code == 0xc2 || num_components_in_scan != num_components )) {
+            buffered = true;
+            for (unsigned comp = 0; comp != num_components; ++comp) {
+              const component &c = components[comp];
+              coeff_store[comp].resize(c.blocks_w * c.blocks_h * 64);
+              memset(coeff_store[comp].data(), 0, c.blocks_w * c.blocks_h * 64 * sizeof(int16_t));
             }
           }
-          skip_bits(shift, acc, src, shift);
+
+          uint8_t *image_base = 0;
+          int stride = 0;
+          if (!buffered) {
+            stride = mcus_x * max_hsamp * 8 * 4;
+            size_t base = image.size();
+            image.resize(base + mcus_y * max_vsamp * 8 * stride);
+            format = 0x1908; // GL_RGBA
+            image_base = image.data() + base;
+          }
+
+          src = decode_scan(src, src_end, image_base, stride);
+
+          if (!buffered) {
+            width = mcus_x * max_hsamp * 8;
+            height = mcus_y * max_vsamp * 8;
+          }
           length = (unsigned)(src - src0);
         } break;
 
         // quantisation tables (the lossy bit)
         case 0xdb: {
+          // AAN scale factors, cos(k*pi/16) * sqrt(2) products for row and column in 2.14 fixed point.
+          static const uint16_t aan_scales[64] = {
+            16384, 22725, 21407, 19266, 16384, 12873,  8867,  4520,
+            22725, 31521, 29692, 26722, 22725, 17855, 12299,  6270,
+            21407, 29692, 27969, 25172, 21407, 16819, 11585,  5906,
+            19266, 26722, 25172, 22654, 19266, 15137, 10426,  5315,
+            16384, 22725, 21407, 19266, 16384, 12873,  8867,  4520,
+            12873, 17855, 16819, 15137, 12873, 10114,  6967,  3552,
+             8867, 12299, 11585, 10426,  8867,  6967,  4799,  2446,
+             4520,  6270,  5906,  5315,  4520,  3552,  2446,  1247,
+          };
+          const uint8_t *zz = zig_zag();
           length = u2(src + 2) + 2;
           const uint8_t *src_max = src + length;
           src += 4;
@@ -565,8 +1127,11 @@ namespace octet { namespace loaders {
             unsigned prec = (src[0] >> 4) & 1;
             unsigned n = src[0] & 0x0f;
             src++;
+            if (src + 64 * (prec + 1) > src_max) return 0;
             for (unsigned i = 0; i != 64; ++i) {
-              quant_tables[n&3].table[i] = (float)( prec ? u2(src) : *src );
+              uint32_t q = prec ? u2(src) : *src;
+              unsigned k = zz[i];
+              quant_tables[n&3].table[k] = (int32_t)( ( q * aan_scales[k] + ( 1 << ( 13 - aan_pass1_bits ) ) ) >> ( 14 - aan_pass1_bits ) );
               src += prec + 1;
             }
             if (debug) printf("DQT %d %d\n", prec, n);
@@ -588,20 +1153,33 @@ namespace octet { namespace loaders {
       return length;
     }
   public:
+    jpeg_decoder() {
+      memset(huffman_tables, 0, sizeof(huffman_tables));
+      memset(quant_tables, 0, sizeof(quant_tables));
+      width = height = num_components = 0;
+      mcus_x = mcus_y = 0;
+      restart_interval = 0;
+      buffered = false;
+    }
+
     // get an opengl texture from a file in memory
     void get_image(dynarray<uint8_t> &image, uint16_t &format, uint16_t &width_, uint16_t &height_, const uint8_t *src, const uint8_t *src_max) {
-      while (src < src_max) {
+      while (src + 1 < src_max) {
         if (src[0] != 0xff) {
           printf("warning: bad JPEG file\n");
           return;
         }
-        unsigned length = decode_chunk(src, image, format);
+        unsigned length = decode_chunk(src, src_max, image, format);
         if (!length) {
           printf("warning: bad JPEG file @ chunk %02x\n", src[1]);
           return;
         }
         src += length;
       }
+
+      // a truncated progressive image: show what we have.
+      if (buffered) finish_buffered(image, format);
+
       width_ = width;
       height_ = height;
       num_components = 3;
@@ -8,72 +8,585 @@
 // jpeg file encoder - tiny and fast
 //
 // See http://en.wikipedia.org/wiki/JPEG
-// 
+//
+// Baseline JPEG with the example quantisation and huffman tables from the standard (Annex K),
+// scaled by a quality factor like libjpeg.
+// The forward DCT is the float AAN algorithm with the AAN scale factors folded into the quantiser.
+// Each row of MCUs is a restart interval, so rows are encoded in parallel.
+//
 namespace octet { namespace loaders {
+  /// Baseline JPEG encoder.
+  ///
+  /// Example (a screenshot from the back buffer, which is bottom row first):
+  ///
+  ///     dynarray<uint8_t> pixels(width * height * 4), jpeg;
+  ///     glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+  ///     jpeg_encoder enc;
+  ///     enc.encode(jpeg, width, height, -width * 4, pixels.data() + (height - 1) * width * 4);
   class jpeg_encoder {
+    // worst case size of an encoded block: 64 codes of 16 + 11 bits, all stuffed.
+    enum { max_block_bytes = 64 * 27 * 2 / 8 + 16 };
+
+    // huffman codes for each symbol.
+    struct huffman_code {
+      uint16_t code[256];
+      uint8_t size[256];
+    };
+
+    // AAN scaled reciprocals of the quantisation tables, transposed like the DCT output.
+    float divisors[2][64];
+
+    // quantisation tables in zig-zag order, as they go in the file.
+    uint8_t quant[2][64];
+
+    huffman_code dc_codes[2];
+    huffman_code ac_codes[2];
+
+    unsigned width;
+    unsigned height;
+    unsigned num_components;
+    unsigned bytes_per_pixel;
+    unsigned hsamp;
+    unsigned vsamp;
+    unsigned mcus_x;
+    unsigned mcus_y;
+
+    // Writes bits most significant bit first with 0xff bytes followed by a zero.
+    struct bit_writer {
+      dynarray<uint8_t> *out;
+      uint8_t *dest;
+      uint8_t *dest_max;
+      uint64_t bits;
+      unsigned count;
+
+      void init(dynarray<uint8_t> &out_) {
+        out = &out_;
+        out->resize(4096);
+        dest = out->data();
+        dest_max = dest + out->size();
+        bits = 0;
+        count = 0;
+      }
+
+      // make room for another block.
+      void reserve() {
+        if (dest_max - dest < max_block_bytes) {
+          size_t used = dest - out->data();
+          out->resize(out->size() * 2 + max_block_bytes);
+          dest = out->data() + used;
+          dest_max = out->data() + out->size();
+        }
+      }
+
+      void flush() {
+        // four bytes at once if none of them is 0xff.
+        if (count >= 32) {
+          uint32_t word = (uint32_t)( bits >> ( count - 32 ) );
+          uint32_t inv = ~word;
+          if (!( ( inv - 0x01010101 ) & ~inv & 0x80808080 )) {
+            dest[0] = (uint8_t)( word >> 24 );
+            dest[1] = (uint8_t)( word >> 16 );
+            dest[2] = (uint8_t)( word >> 8 );
+            dest[3] = (uint8_t)word;
+            dest += 4;
+            count -= 32;
+          }
+        }
+        while (count >= 8) {
+          count -= 8;
+          uint8_t byte = (uint8_t)( bits >> count );
+          *dest++ = byte;
+          if (byte == 0xff) *dest++ = 0x00;
+        }
+      }
+
+      // up to 32 bits at a time.
+      void put(unsigned code, unsigned size) {
+        bits = ( bits << size ) | code;
+        count += size;
+        if (count >= 32) flush();
+      }
+
+      // pad the last byte with ones and shrink the buffer.
+      void finish() {
+        unsigned pad = ( 8 - ( count & 7 ) ) & 7;
+        put(( 1 << pad ) - 1, pad);
+        flush();
+        out->resize(dest - out->data());
+      }
+    };
+
+    static const uint8_t *zig_zag() {
+      static const uint8_t zz[64] = {
+         0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+        12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+        35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+        58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+      };
+      return zz;
+    }
+
+    // the standard huffman tables: 16 code counts followed by the symbols.
+    static const uint8_t *std_dc_table(unsigned i) {
+      static const uint8_t tables[2][16+12] = {
+        {
+          0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0,
+          0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+        },
+        {
+          0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+          0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+        },
+      };
+      return tables[i];
+    }
+
+    static const uint8_t *std_ac_table(unsigned i) {
+      static const uint8_t tables[2][16+162] = {
+        {
+          0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d,
+          0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+          0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+          0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+          0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+          0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+          0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+          0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+          0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+          0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+          0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+          0xf9, 0xfa,
+        },
+        {
+          0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77,
+          0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+          0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+          0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+          0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+          0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+          0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+          0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+          0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+          0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+          0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+          0xf9, 0xfa,
+        },
+      };
+      return tables[i];
+    }
+
+    // canonical huffman codes from the code counts (Annex C).
+    static void build_codes(huffman_code &h, const uint8_t *table) {
+      memset(&h, 0, sizeof(h));
+      const uint8_t *symbols = table + 16;
+      unsigned code = 0;
+      for (unsigned len = 1; len <= 16; ++len) {
+        for (unsigned i = 0; i != table[len-1]; ++i) {
+          unsigned symbol = *symbols++;
+          h.code[symbol] = (uint16_t)code++;
+          h.size[symbol] = (uint8_t)len;
+        }
+        code *= 2;
+      }
+    }
+
+    // the example tables from the standard, scaled by quality as in libjpeg.
+    void build_quant(int quality) {
+      static const uint8_t std_quant[2][64] = {
+        {
+          16, 11, 10, 16,  24,  40,  51,  61,
+          12, 12, 14, 19,  26,  58,  60,  55,
+          14, 13, 16, 24,  40,  57,  69,  56,
+          14, 17, 22, 29,  51,  87,  80,  62,
+          18, 22, 37, 56,  68, 109, 103,  77,
+          24, 35, 55, 64,  81, 104, 113,  92,
+          49, 64, 78, 87, 103, 121, 120, 101,
+          72, 92, 95, 98, 112, 100, 103,  99,
+        },
+        {
+          17, 18, 24, 47, 99, 99, 99, 99,
+          18, 21, 26, 66, 99, 99, 99, 99,
+          24, 26, 56, 99, 99, 99, 99, 99,
+          47, 66, 99, 99, 99, 99, 99, 99,
+          99, 99, 99, 99, 99, 99, 99, 99,
+          99, 99, 99, 99, 99, 99, 99, 99,
+          99, 99, 99, 99, 99, 99, 99, 99,
+          99, 99, 99, 99, 99, 99, 99, 99,
+        },
+      };
+
+      // cos(k*pi/16) * sqrt(2), 1 for k = 0
+      static const float aan_scales[8] = {
+        1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
+        1.0f, 0.785694958f, 0.541196100f, 0.275899379f,
+      };
+
+      quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+      int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+
+      const uint8_t *zz = zig_zag();
+      for (unsigned t = 0; t != 2; ++t) {
+        for (unsigned i = 0; i != 64; ++i) {
+          unsigned k = zz[i];
+          int q = ( std_quant[t][k] * scale + 50 ) / 100;
+          q = q < 1 ? 1 : q > 255 ? 255 : q;
+          quant[t][i] = (uint8_t)q;
+          divisors[t][( k & 7 ) * 8 + ( k >> 3 )] = 1.0f / ( q * aan_scales[k >> 3] * aan_scales[k & 7] * 8 );
+        }
+      }
+    }
+
+    // one pass of the AAN forward DCT on the columns of a block.
+    // The inner loops go across the columns so that the compiler can vectorise them.
+    static void fdct_columns(float *d) {
+      for (unsigned c = 0; c != 8; ++c) {
+        float tmp0 = d[0*8+c] + d[7*8+c];
+        float tmp7 = d[0*8+c] - d[7*8+c];
+        float tmp1 = d[1*8+c] + d[6*8+c];
+        float tmp6 = d[1*8+c] - d[6*8+c];
+        float tmp2 = d[2*8+c] + d[5*8+c];
+        float tmp5 = d[2*8+c] - d[5*8+c];
+        float tmp3 = d[3*8+c] + d[4*8+c];
+        float tmp4 = d[3*8+c] - d[4*8+c];
+
+        // even part
+        float tmp10 = tmp0 + tmp3;
+        float tmp13 = tmp0 - tmp3;
+        float tmp11 = tmp1 + tmp2;
+        float tmp12 = tmp1 - tmp2;
+
+        d[0*8+c] = tmp10 + tmp11;
+        d[4*8+c] = tmp10 - tmp11;
+
+        float z1 = ( tmp12 + tmp13 ) * 0.707106781f;
+        d[2*8+c] = tmp13 + z1;
+        d[6*8+c] = tmp13 - z1;
+
+        // odd part
+        tmp10 = tmp4 + tmp5;
+        tmp11 = tmp5 + tmp6;
+        tmp12 = tmp6 + tmp7;
+
+        float z5 = ( tmp10 - tmp12 ) * 0.382683433f;
+        float z2 = 0.541196100f * tmp10 + z5;
+        float z4 = 1.306562965f * tmp12 + z5;
+        float z3 = tmp11 * 0.707106781f;
+
+        float z11 = tmp7 + z3;
+        float z13 = tmp7 - z3;
+
+        d[5*8+c] = z13 + z2;
+        d[3*8+c] = z13 - z2;
+        d[1*8+c] = z11 + z4;
+        d[7*8+c] = z11 - z4;
+      }
+    }
+
+    // zig-zag order of a transposed block.
+    static const uint8_t *zig_zag_transposed() {
+      static struct table_t {
+        uint8_t zz[64];
+
+        table_t() {
+          const uint8_t *src = zig_zag();
+          for (unsigned i = 0; i != 64; ++i) {
+            zz[i] = (uint8_t)( ( src[i] & 7 ) * 8 + ( src[i] >> 3 ) );
+          }
+        }
+      } t;
+      return t.zz;
+    }
+
+    static void transpose(float *d) {
+      for (unsigned i = 0; i != 8; ++i) {
+        for (unsigned j = i + 1; j != 8; ++j) {
+          float t = d[i*8+j];
+          d[i*8+j] = d[j*8+i];
+          d[j*8+i] = t;
+        }
+      }
+    }
+
+    // number of bits needed for the magnitude of a coefficient (the "category").
+    static unsigned num_bits(unsigned v) {
+      static struct table_t {
+        uint8_t bits[256];
+
+        table_t() {
+          bits[0] = 0;
+          for (unsigned i = 1; i != 256; ++i) {
+            bits[i] = bits[i >> 1] + 1;
+          }
+        }
+      } t;
+      return v < 256 ? t.bits[v] : t.bits[v >> 8] + 8;
+    }
+
+    // transform, quantise and huffman code one 8x8 block of samples centred on zero.
+    void encode_block(bit_writer &bw, float *samples, unsigned table, int &last_dc) {
+      // the result is transposed, which we allow for when reading it in zig-zag order.
+      fdct_columns(samples);
+      transpose(samples);
+      fdct_columns(samples);
+
+      const float *div = divisors[table];
+      int coeffs[64];
+      for (unsigned i = 0; i != 64; ++i) {
+        // round to nearest without a branch, as the value is positive before the cast.
+        int q = (int)( samples[i] * div[i] + 16384.5f ) - 16384;
+        coeffs[i] = q < -1023 ? -1023 : q > 1023 ? 1023 : q;
+      }
+      const uint8_t *zz = zig_zag_transposed();
+
+      bw.reserve();
+
+      // DC is coded as the difference from the previous block of this component.
+      const huffman_code &dc = dc_codes[table];
+      int diff = coeffs[0] - last_dc;
+      last_dc = coeffs[0];
+      unsigned mag = diff < 0 ? -diff : diff;
+      unsigned size = num_bits(mag);
+      // the huffman code and the value bits go in one put.
+      unsigned bits = ( diff < 0 ? diff - 1 : diff ) & ( ( 1 << size ) - 1 );
+      bw.put(( dc.code[size] << size ) | bits, dc.size[size] + size);
+
+      // AC is coded as (run of zeros, size) symbols followed by the bits.
+      const huffman_code &ac = ac_codes[table];
+      unsigned run = 0;
+      for (unsigned i = 1; i != 64; ++i) {
+        int v = coeffs[zz[i]];
+        if (!v) {
+          run++;
+          continue;
+        }
+        while (run >= 16) {
+          bw.put(ac.code[0xf0], ac.size[0xf0]);
+          run -= 16;
+        }
+        mag = v < 0 ? -v : v;
+        size = num_bits(mag);
+        unsigned symbol = ( run << 4 ) | size;
+        bits = ( v < 0 ? v - 1 : v ) & ( ( 1 << size ) - 1 );
+        bw.put(( ac.code[symbol] << size ) | bits, ac.size[symbol] + size);
+        run = 0;
+      }
+
+      // end of block
+      if (run) bw.put(ac.code[0x00], ac.size[0x00]);
+    }
+
+    // encode a row of MCUs as one restart interval.
+    void encode_row(dynarray<uint8_t> &out, unsigned mcu_y, int stride, const uint8_t *src) {
+      bit_writer bw;
+      bw.init(out);
+      int last_dc[3] = { 0, 0, 0 };
+
+      unsigned mcu_w = hsamp * 8;
+      unsigned mcu_h = vsamp * 8;
+
+      // samples of one MCU centred on zero: Y, Cb and Cr at full resolution.
+      float y_plane[16*16];
+      float cb_plane[16*16];
+      float cr_plane[16*16];
+      float block[64];
+
+      // byte offsets of the pixels in a row, repeating the right hand edge.
+      dynarray<unsigned> x_offsets(mcus_x * mcu_w);
+      for (unsigned x = 0; x != mcus_x * mcu_w; ++x) {
+        x_offsets[x] = ( x < width ? x : width - 1 ) * bytes_per_pixel;
+      }
+
+      // and the rows, repeating the bottom edge.
+      const uint8_t *rows[16];
+      for (unsigned j = 0; j != mcu_h; ++j) {
+        unsigned y = mcu_y * mcu_h + j;
+        rows[j] = src + (int)( y < height ? y : height - 1 ) * stride;
+      }
+
+      for (unsigned mcu_x = 0; mcu_x != mcus_x; ++mcu_x) {
+        const unsigned *xo = x_offsets.data() + mcu_x * mcu_w;
+        if (num_components == 1) {
+          for (unsigned j = 0; j != 8; ++j) {
+            for (unsigned i = 0; i != 8; ++i) {
+              block[j*8+i] = rows[j][xo[i]] - 128.0f;
+            }
+          }
+          encode_block(bw, block, 0, last_dc[0]);
+          continue;
+        }
+
+        for (unsigned j = 0; j != mcu_h; ++j) {
+          const uint8_t *row = rows[j];
+          float *yp = y_plane + j * mcu_w, *cbp = cb_plane + j * mcu_w, *crp = cr_plane + j * mcu_w;
+          for (unsigned i = 0; i != mcu_w; ++i) {
+            const uint8_t *p = row + xo[i];
+            float r = p[0], g = p[1], b = p[2];
+            yp[i] = 0.299f * r + 0.587f * g + 0.114f * b - 128.0f;
+            cbp[i] = -0.168736f * r - 0.331264f * g + 0.5f * b;
+            crp[i] = 0.5f * r - 0.418688f * g - 0.081312f * b;
+          }
+        }
+
+        if (hsamp == 1) {
+          encode_block(bw, y_plane, 0, last_dc[0]);
+          encode_block(bw, cb_plane, 1, last_dc[1]);
+          encode_block(bw, cr_plane, 1, last_dc[2]);
+          continue;
+        }
+
+        for (unsigned by = 0; by != 2; ++by) {
+          for (unsigned bx = 0; bx != 2; ++bx) {
+            for (unsigned j = 0; j != 8; ++j) {
+              for (unsigned i = 0; i != 8; ++i) {
+                block[j*8+i] = y_plane[( by * 8 + j ) * 16 + bx * 8 + i];
+              }
+            }
+            encode_block(bw, block, 0, last_dc[0]);
+          }
+        }
+
+        // chroma is the average of 2x2 pixels.
+        float *planes[2] = { cb_plane, cr_plane };
+        for (unsigned c = 0; c != 2; ++c) {
+          const float *plane = planes[c];
+          for (unsigned j = 0; j != 8; ++j) {
+            for (unsigned i = 0; i != 8; ++i) {
+              const float *p = plane + j * 32 + i * 2;
+              block[j*8+i] = ( p[0] + p[1] + p[16] + p[17] ) * 0.25f;
+            }
+          }
+          encode_block(bw, block, 1, last_dc[c+1]);
+        }
+      }
+
+      bw.finish();
+    }
+
+    static void put_u2(dynarray<uint8_t> &data, unsigned value) {
+      data.push_back((uint8_t)( value >> 8 ));
+      data.push_back((uint8_t)value);
+    }
+
+    static void put_marker(dynarray<uint8_t> &data, unsigned marker, unsigned length) {
+      data.push_back(0xff);
+      data.push_back((uint8_t)marker);
+      put_u2(data, length);
+    }
+
+    void put_headers(dynarray<uint8_t> &data) {
+      // SOI
+      data.push_back(0xff);
+      data.push_back(0xd8);
+
+      static const uint8_t jfif[] = { 'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00 };
+      put_marker(data, 0xe0, 2 + sizeof(jfif));
+      for (unsigned i = 0; i != sizeof(jfif); ++i) data.push_back(jfif[i]);
+
+      unsigned num_tables = num_components == 1 ? 1 : 2;
+      put_marker(data, 0xdb, 2 + num_tables * 65);
+      for (unsigned t = 0; t != num_tables; ++t) {
+        data.push_back((uint8_t)t);
+        for (unsigned i = 0; i != 64; ++i) data.push_back(quant[t][i]);
+      }
+
+      // SOF0
+      put_marker(data, 0xc0, 8 + num_components * 3);
+      data.push_back(8);
+      put_u2(data, height);
+      put_u2(data, width);
+      data.push_back((uint8_t)num_components);
+      for (unsigned c = 0; c != num_components; ++c) {
+        data.push_back((uint8_t)( c + 1 ));
+        data.push_back((uint8_t)( c == 0 ? hsamp * 16 + vsamp : 0x11 ));
+        data.push_back((uint8_t)( c == 0 ? 0 : 1 ));
+      }
+
+      for (unsigned t = 0; t != num_tables; ++t) {
+        const uint8_t *tables[2] = { std_dc_table(t), std_ac_table(t) };
+        unsigned sizes[2] = { 16 + 12, 16 + 162 };
+        for (unsigned is_ac = 0; is_ac != 2; ++is_ac) {
+          put_marker(data, 0xc4, 3 + sizes[is_ac]);
+          data.push_back((uint8_t)( is_ac * 16 + t ));
+          for (unsigned i = 0; i != sizes[is_ac]; ++i) data.push_back(tables[is_ac][i]);
+        }
+      }
+
+      // DRI: one row of MCUs per restart interval.
+      put_marker(data, 0xdd, 4);
+      put_u2(data, mcus_x);
+
+      // SOS
+      put_marker(data, 0xda, 6 + num_components * 2);
+      data.push_back((uint8_t)num_components);
+      for (unsigned c = 0; c != num_components; ++c) {
+        data.push_back((uint8_t)( c + 1 ));
+        data.push_back((uint8_t)( c == 0 ? 0x00 : 0x11 ));
+      }
+      data.push_back(0);
+      data.push_back(63);
+      data.push_back(0);
+    }
   public:
     jpeg_encoder() {
+      build_codes(dc_codes[0], std_dc_table(0));
+      build_codes(dc_codes[1], std_dc_table(1));
+      build_codes(ac_codes[0], std_ac_table(0));
+      build_codes(ac_codes[1], std_ac_table(1));
     }
 
-    bool encode(dynarray<uint8_t> data, uint32_t width, uint32_t height, int stride, const uint8_t *src) {
-      /*if ((height & 7) != 0 || (width & 7) != 0) {
+    /// Encode an image as a JPEG file, appending it to data.
+    /// src is the top left pixel and rows are stride bytes apart (negative for bottom-up images).
+    /// Pixels are 1 (grey), 3 (RGB) or 4 (RGBA, alpha is ignored) bytes.
+    /// quality is 1 to 100; subsample stores chroma at half resolution (4:2:0).
+    bool encode(dynarray<uint8_t> &data, uint32_t width_, uint32_t height_, int stride, const uint8_t *src, unsigned bytes_per_pixel_=4, int quality=90, bool subsample=true) {
+      if (width_ == 0 || height_ == 0 || width_ > 65535 || height_ > 65535 || !src) {
+        return false;
+      }
+
+      if (bytes_per_pixel_ != 1 && bytes_per_pixel_ != 3 && bytes_per_pixel_ != 4) {
+        printf("warning: jpeg_encoder: %d bytes per pixel\n", bytes_per_pixel_);
         return false;
       }
 
-      // guess
-      data.reserve(width * height / 2);
-
-      static const uint8_t hdr[] = {
-        0xff, 0xd8, // SOI
-        0xff, 0xe0, 0x00, 0x10, // APP0
-          'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x01, 0x00, 0x48, 0x00, 0x48, 0x00, 0x00,
-
-        0xff, 0xdb, 0x00, 0x43, // DQT
-          0x00,
-          0x03, 0x02, 0x02, 0x03, 0x02, 0x02, 0x03, 0x03,
-          0x03, 0x03, 0x04, 0x03, 0x03, 0x04, 0x05, 0x08,
-          0x05, 0x05, 0x04, 0x04, 0x05, 0x0a, 0x07, 0x07,
-          0x06, 0x08, 0x0c, 0x0a, 0x0c, 0x0c, 0x0b, 0x0a,
-          0x0b, 0x0b, 0x0d, 0x0e, 0x12, 0x10, 0x0d, 0x0e,
-          0x11, 0x0e, 0x0b, 0x0b, 0x10, 0x16, 0x10, 0x11,
-          0x13, 0x14, 0x15, 0x15, 0x15, 0x0c, 0x0f, 0x17,
-          0x18, 0x16, 0x14, 0x18, 0x12, 0x14, 0x15, 0x14,
-        0xff, 0xdb, 0x00, 0x43, // DQT
-          0x01,
-          0x03, 0x04, 0x04, 0x05, 0x04, 0x05, 0x09, 0x05,
-          0x05, 0x09, 0x14, 0x0d, 0x0b, 0x0d, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-        0xff, 0xc0, 0x00, 0x11, // SOF0
-          0x08, 0x02, 0x00, 0x02, 0x00, 0x03, 0x01, 0x11, 0x00, 0x02, 0x11, 0x01, 0x03, 0x11, 0x01,
-        0xff, 0xc4, 0x00, 0x1e, // DHT
-          0x00, 0x01, 0x00, 0x03, 0x00, 0x02, 0x03, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-          0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x06, 0x05, 0x07, 0x09, 0x08, 0x0a,
-        0xff, 0xc4, 0x00, 0x55, // DHT
-          0x10, 0x00, 0x02, 0x00, 0x03, 0x04, 0x05, 0x08, 0x06, 0x06, 0x04, 0x0b, 0x05, 0x07, 0x05, 0x00,
-          0x00, 0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x61, 0x07,
-          0x14, 0x53, 0x71, 0x81, 0x92, 0xb1, 0xf0, 0x08, 0x13, 0x34, 0x72, 0x91, 0xa1, 0x09, 0x22, 0x32,
-          0x42, 0xc1, 0xd1, 0x23, 0x52, 0xe1, 0xf1, 0x15, 0x16, 0x17, 0x36, 0x43, 0x62, 0x73, 0x82, 0x94,
-          0xb2, 0xd2, 0x24, 0x55, 0x63, 0xa3, 0xc2, 0x18, 0x33, 0x35, 0x64, 0x74, 0x93, 0xa2, 0x25, 0x44,
-          0x45, 0x54, 0x83,
-        0xff, 0xc4, 0x00, 0x1d, // DHT
-          0x01, 0x01, 0x01, 0x01, 0x00, 0x02, 0x03, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-          0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09,
-        0xff, 0xc4, 0x00, 0x43, // DHT
-          0x11, 0x01, 0x00, 0x01, 0x02, 0x03, 0x05, 0x02, 0x0b, 0x06, 0x04, 0x05, 0x04, 0x03, 0x01, 0x00,
-          0x00, 0x00, 0x01, 0x02, 0x11, 0x03, 0x04, 0x31, 0x05, 0x12, 0x21, 0x32, 0x51, 0x06, 0x41, 0x07,
-          0x13, 0x14, 0x22, 0x61, 0x71, 0x81, 0x91, 0xa1, 0xb1, 0xd1, 0x15, 0x34, 0x42, 0x53, 0x72, 0xf0,
-          0x52, 0x62, 0xc1, 0xe1, 0x23, 0x82, 0x92, 0xa2, 0xc2, 0x24, 0x43, 0xb2, 0xd2, 0x33, 0x63, 0x73,
-          0x93,
-        0xff, 0xda, 0x00, 0x0c, // SOS
-          0x03, 0x01, 0x00, 0x02, 0x11, 0x03, 0x11, 0x00, 0x3f, 0x00, 0xfd, 0x7f, 
-      };*/
-      return 0;
+      width = width_;
+      height = height_;
+      bytes_per_pixel = bytes_per_pixel_;
+      num_components = bytes_per_pixel == 1 ? 1 : 3;
+      hsamp = vsamp = num_components == 3 && subsample ? 2 : 1;
+      mcus_x = ( width + hsamp * 8 - 1 ) / ( hsamp * 8 );
+      mcus_y = ( height + vsamp * 8 - 1 ) / ( vsamp * 8 );
+
+      build_quant(quality);
+      put_headers(data);
+
+      // encode the rows in parallel, then join them with restart markers.
+      dynarray<dynarray<uint8_t> > rows(mcus_y);
+      job_scheduler::get()->parallel_for(0, mcus_y, 1, [&](unsigned y0, unsigned y1) {
+        for (unsigned y = y0; y != y1; ++y) {
+          encode_row(rows[y], y, stride, src);
+        }
+      });
+
+      size_t total = data.size() + 2;
+      for (unsigned y = 0; y != mcus_y; ++y) {
+        total += rows[y].size() + 2;
+      }
+      data.reserve(total);
+
+      for (unsigned y = 0; y != mcus_y; ++y) {
+        size_t pos = data.size();
+        data.resize(pos + rows[y].size());
+        memcpy(data.data() + pos, rows[y].data(), rows[y].size());
+        if (y != mcus_y - 1) {
+          data.push_back(0xff);
+          data.push_back((uint8_t)( 0xd0 + ( y & 7 ) ));
+        }
+      }
+
+      // EOI
+      data.push_back(0xff);
+      data.push_back(0xd9);
+      return true;
     }
   };
 }}
-
@@ -0,0 +1,385 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+//
+// fast LZ77 block compression for binary archives
+//
+// The format is byte oriented like LZ4: each sequence is a token with the number
+// of literals in the top four bits and the match length - 4 in the bottom four,
+// followed by more length bytes if a field is 15, the literals and a two byte offset.
+// The last sequence is just literals. There is no entropy coding, so decoding is
+// mostly memcpy and runs at memory speed.
+//
+// The compressor finds matches with a single hash table of recent positions and
+// skips ahead faster in data that does not compress.
+//
+// Filters rearrange data before compression so that similar bytes are together:
+// "shuffle" stores the first byte of every element, then the second and so on,
+// which helps with floats; "delta" stores the difference from the previous
+// element, which turns index buffers into small numbers.
+//
+namespace octet { namespace loaders {
+  class lz_codec {
+    enum {
+      hash_bits = 14,
+      min_match = 4,
+      max_offset = 0xffff,
+
+      // the end of a block is always literals, so the decoder can copy 8 bytes at a time.
+      last_literals = 5,
+      match_find_limit = 12,
+    };
+
+    static uint32_t read32(const uint8_t *p) {
+      uint32_t value;
+      memcpy(&value, p, 4);
+      return value;
+    }
+
+    static uint64_t read64(const uint8_t *p) {
+      uint64_t value;
+      memcpy(&value, p, 8);
+      return value;
+    }
+
+    static unsigned hash(uint32_t value) {
+      return (value * 2654435761u) >> (32 - hash_bits);
+    }
+
+    // number of equal bytes at the start of two 64 bit words which differ.
+    static unsigned equal_bytes(uint64_t diff) {
+      unsigned n = 0;
+      while (!(diff & 0xff)) {
+        diff >>= 8;
+        n++;
+      }
+      return n;
+    }
+
+    // write a length of 15 or more as extra bytes.
+    static uint8_t *put_length(uint8_t *dest, size_t length) {
+      for (; length >= 255; length -= 255) *dest++ = 255;
+      *dest++ = (uint8_t)length;
+      return dest;
+    }
+
+    // write one sequence, returns NULL if it does not fit.
+    static uint8_t *put_sequence(uint8_t *dest, uint8_t *dest_max, const uint8_t *literals, size_t num_literals, size_t offset, size_t match_length) {
+      if ((size_t)(dest_max - dest) < 1 + num_literals + num_literals / 255 + 1 + 2 + match_length / 255 + 1) {
+        return NULL;
+      }
+
+      uint8_t *token = dest++;
+      size_t ml = match_length ? match_length - min_match : 0;
+      *token = (uint8_t)((num_literals < 15 ? num_literals : 15) << 4);
+      if (num_literals >= 15) dest = put_length(dest, num_literals - 15);
+      memcpy(dest, literals, num_literals);
+      dest += num_literals;
+
+      if (match_length) {
+        *token |= (uint8_t)(ml < 15 ? ml : 15);
+        *dest++ = (uint8_t)offset;
+        *dest++ = (uint8_t)(offset >> 8);
+        if (ml >= 15) dest = put_length(dest, ml - 15);
+      }
+      return dest;
+    }
+
+    // read an extended length, returns false at the end of the input.
+    static bool get_length(size_t &length, const uint8_t *&src, const uint8_t *src_max) {
+      unsigned byte;
+      do {
+        if (src == src_max) return false;
+        byte = *src++;
+        length += byte;
+      } while (byte == 255);
+      return true;
+    }
+
+  public:
+    /// filters for compress_filtered()
+    enum filter_t {
+      filter_none = 0,
+
+      /// shuffle the bytes of 32 bit elements, good for float vertex data.
+      filter_shuffle4 = 1,
+
+      /// differences of 16 bit elements, then shuffled, good for 16 bit indices.
+      filter_delta16 = 2,
+
+      /// differences of 32 bit elements, then shuffled, good for 32 bit indices.
+      filter_delta32 = 3,
+
+      num_filters = 4,
+    };
+
+    /// largest possible compressed size of a block.
+    static size_t max_compressed_size(size_t size) {
+      return size + size / 255 + 16;
+    }
+
+    /// Compress a block. Returns the compressed size, or zero if it does not fit in dest_max bytes.
+    /// Matches are within a block, so blocks can be decompressed on their own.
+    static size_t compress(uint8_t *dest, size_t dest_max, const uint8_t *src, size_t size) {
+      uint8_t *op = dest;
+      uint8_t *op_max = dest + dest_max;
+      const uint8_t *anchor = src;
+      const uint8_t *end = src + size;
+
+      if (size >= match_find_limit) {
+        dynarray<uint32_t> table(1 << hash_bits);
+        memset(table.data(), 0, table.size() * sizeof(uint32_t));
+
+        const uint8_t *match_limit = end - last_literals;
+        const uint8_t *ip_limit = end - match_find_limit;
+        const uint8_t *ip = src + 1;
+
+        while (ip < ip_limit) {
+          uint32_t value = read32(ip);
+          uint32_t &slot = table[hash(value)];
+          const uint8_t *ref = src + slot;
+          slot = (uint32_t)(ip - src);
+
+          if (ref >= ip || ip - ref > max_offset || read32(ref) != value) {
+            // skip faster the longer we go without a match.
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+          }
+
+          // extend the match backwards and forwards.
+          while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+            ip--;
+            ref--;
+          }
+          const uint8_t *p = ip + min_match;
+          const uint8_t *q = ref + min_match;
+          for (;;) {
+            if (p + 8 > match_limit) {
+              while (p < match_limit && *p == *q) { p++; q++; }
+              break;
+            }
+            uint64_t diff = read64(p) ^ read64(q);
+            if (diff) {
+              p += equal_bytes(diff);
+              break;
+            }
+            p += 8;
+            q += 8;
+          }
+
+          op = put_sequence(op, op_max, anchor, ip - anchor, ip - ref, p - ip);
+          if (!op) return 0;
+          ip = anchor = p;
+
+          if (ip < ip_limit) {
+            table[hash(read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+          }
+        }
+      }
+
+      op = put_sequence(op, op_max, anchor, end - anchor, 0, 0);
+      return op ? op - dest : 0;
+    }
+
+    /// Decompress a block of exactly size bytes. Returns false if the data is corrupt.
+    static bool decompress(uint8_t *dest, size_t size, const uint8_t *src, size_t src_size) {
+      uint8_t *op = dest;
+      uint8_t *op_end = dest + size;
+      const uint8_t *src_max = src + src_size;
+
+      while (src != src_max) {
+        unsigned token = *src++;
+
+        size_t num_literals = token >> 4;
+        if (num_literals == 15 && !get_length(num_literals, src, src_max)) return false;
+        if (num_literals > (size_t)(src_max - src) || num_literals > (size_t)(op_end - op)) return false;
+        memcpy(op, src, num_literals);
+        op += num_literals;
+        src += num_literals;
+
+        if (src == src_max) break;
+
+        if (src_max - src < 2) return false;
+        size_t offset = src[0] + (src[1] << 8);
+        src += 2;
+        size_t length = token & 15;
+        if (length == 15 && !get_length(length, src, src_max)) return false;
+        length += min_match;
+
+        if (offset == 0 || offset > (size_t)(op - dest) || length > (size_t)(op_end - op)) return false;
+        const uint8_t *ref = op - offset;
+        if (offset >= 8 && (size_t)(op_end - op) >= length + 8) {
+          // may copy up to 7 bytes too many, which the next sequence overwrites.
+          uint8_t *match_end = op + length;
+          for (; op < match_end; op += 8, ref += 8) {
+            memcpy(op, ref, 8);
+          }
+          op = match_end;
+        } else {
+          for (size_t i = 0; i != length; ++i) op[i] = ref[i];
+          op += length;
+        }
+      }
+      return op == op_end;
+    }
+
+    /// Apply a filter to elements of src, writing to dest. Any bytes after the last whole
+    /// element are copied unchanged.
+    static void apply_filter(uint8_t *dest, const uint8_t *src, size_t size, filter_t filter) {
+      if (filter == filter_delta16) {
+        size_t n = size / 2;
+        uint16_t prev = 0;
+        for (size_t i = 0; i != n; ++i) {
+          uint16_t value;
+          memcpy(&value, src + i * 2, 2);
+          uint16_t delta = (uint16_t)(value - prev);
+          prev = value;
+          dest[i] = (uint8_t)delta;
+          dest[n + i] = (uint8_t)(delta >> 8);
+        }
+        memcpy(dest + n * 2, src + n * 2, size - n * 2);
+      } else if (filter == filter_shuffle4 || filter == filter_delta32) {
+        size_t n = size / 4;
+        uint32_t prev = 0;
+        for (size_t i = 0; i != n; ++i) {
+          uint32_t value;
+          memcpy(&value, src + i * 4, 4);
+          if (filter == filter_delta32) {
+            uint32_t delta = value - prev;
+            prev = value;
+            value = delta;
+          }
+          dest[i] = (uint8_t)value;
+          dest[n + i] = (uint8_t)(value >> 8);
+          dest[n * 2 + i] = (uint8_t)(value >> 16);
+          dest[n * 3 + i] = (uint8_t)(value >> 24);
+        }
+        memcpy(dest + n * 4, src + n * 4, size - n * 4);
+      } else {
+        memcpy(dest, src, size);
+      }
+    }
+
+    /// Undo a filter, writing the original elements to dest.
+    static void remove_filter(uint8_t *dest, const uint8_t *src, size_t size, filter_t filter) {
+      if (filter == filter_delta16) {
+        size_t n = size / 2;
+        uint16_t value = 0;
+        for (size_t i = 0; i != n; ++i) {
+          value = (uint16_t)(value + src[i] + (src[n + i] << 8));
+          memcpy(dest + i * 2, &value, 2);
+        }
+        memcpy(dest + n * 2, src + n * 2, size - n * 2);
+      } else if (filter == filter_shuffle4 || filter == filter_delta32) {
+        size_t n = size / 4;
+        uint32_t prev = 0;
+        for (size_t i = 0; i != n; ++i) {
+          uint32_t value = src[i] | (src[n + i] << 8) | (src[n * 2 + i] << 16) | ((uint32_t)src[n * 3 + i] << 24);
+          if (filter == filter_delta32) {
+            value += prev;
+            prev = value;
+          }
+          memcpy(dest + i * 4, &value, 4);
+        }
+        memcpy(dest + n * 4, src + n * 4, size - n * 4);
+      } else {
+        memcpy(dest, src, size);
+      }
+    }
+
+    /// Find the filter that makes data compress best by trying each one on a sample.
+    /// Returns filter_none unless a filter saves at least an eighth.
+    static filter_t choose_filter(const uint8_t *src, size_t size) {
+      size_t sample = size < 0x10000 ? size : 0x10000;
+      sample &= ~(size_t)3;
+      if (sample < 256) return filter_none;
+
+      dynarray<uint8_t> filtered(sample);
+      dynarray<uint8_t> compressed(max_compressed_size(sample));
+      size_t best_size = compress(compressed.data(), compressed.size(), src, sample);
+      best_size -= best_size / 8;
+      filter_t best = filter_none;
+      for (unsigned f = filter_none + 1; f != num_filters; ++f) {
+        apply_filter(filtered.data(), src, sample, (filter_t)f);
+        size_t csize = compress(compressed.data(), compressed.size(), filtered.data(), sample);
+        if (csize < best_size) {
+          best_size = csize;
+          best = (filter_t)f;
+        }
+      }
+      return best;
+    }
+  };
+
+  #if OCTET_UNIT_TEST
+    class lz_codec_unit_test {
+      // compress and decompress size bytes, returns the compressed size.
+      static size_t round_trip(const uint8_t *src, size_t size) {
+        dynarray<uint8_t> compressed(lz_codec::max_compressed_size(size));
+        size_t csize = lz_codec::compress(compressed.data(), compressed.size(), src, size);
+        assert(csize != 0 && csize <= compressed.size());
+
+        dynarray<uint8_t> result(size + 1);
+        result[size] = 0xcd;
+        assert(lz_codec::decompress(result.data(), size, compressed.data(), csize));
+        assert(!memcmp(result.data(), src, size));
+        assert(result[size] == 0xcd);
+
+        // truncated blocks must fail, not crash.
+        if (csize > 1) {
+          assert(!lz_codec::decompress(result.data(), size, compressed.data(), csize - 1));
+        }
+        return csize;
+      }
+
+    public:
+      lz_codec_unit_test() {
+        // text, a run of one byte, noise and a mixture bigger than the match window.
+        dynarray<uint8_t> data(0x30000);
+        uint32_t seed = 1;
+        for (unsigned i = 0; i != data.size(); ++i) {
+          seed = seed * 1664525 + 1013904223;
+          if (i < 0x1000) {
+            data[i] = "the quick brown fox jumps over the lazy dog. "[i % 45];
+          } else if (i < 0x2000) {
+            data[i] = 'z';
+          } else if (i < 0x3000) {
+            data[i] = (uint8_t)(seed >> 24);
+          } else {
+            data[i] = i & 0x100 ? (uint8_t)(seed >> 24) : data[i - 0x3000];
+          }
+        }
+
+        for (unsigned size = 1; size != 64; ++size) {
+          round_trip(data.data(), size);
+          round_trip(data.data() + 0x2000, size);
+        }
+        assert(round_trip(data.data(), 0x1000) < 0x100);
+        assert(round_trip(data.data() + 0x1000, 0x1000) < 0x40);
+        assert(round_trip(data.data() + 0x2000, 0x1000) <= lz_codec::max_compressed_size(0x1000));
+        round_trip(data.data(), data.size());
+
+        // output that does not fit is rejected.
+        uint8_t small[16];
+        assert(lz_codec::compress(small, sizeof(small), data.data() + 0x2000, 0x100) == 0);
+
+        // filters are undone exactly, including bytes after the last whole element.
+        dynarray<uint8_t> filtered(1027), restored(1027);
+        for (unsigned f = lz_codec::filter_none; f != lz_codec::num_filters; ++f) {
+          lz_codec::apply_filter(filtered.data(), data.data() + 0x2000, filtered.size(), (lz_codec::filter_t)f);
+          lz_codec::remove_filter(restored.data(), filtered.data(), filtered.size(), (lz_codec::filter_t)f);
+          assert(!memcmp(restored.data(), data.data() + 0x2000, restored.size()));
+        }
+
+        // rising 32 bit indices compress better with a delta filter.
+        dynarray<uint32_t> indices(0x1000);
+        for (unsigned i = 0; i != indices.size(); ++i) indices[i] = i * 3 + (i & 1);
+        assert(lz_codec::choose_filter((const uint8_t*)indices.data(), indices.size() * 4) == lz_codec::filter_delta32);
+      }
+    };
+    static lz_codec_unit_test lz_codec_unit_test;
+  #endif
+}}
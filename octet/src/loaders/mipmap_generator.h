@@ -0,0 +1,358 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+//
+// Mipmap chain generator
+//
+// Each level is made from the one above it with a separable windowed sinc
+// (Kaiser or Lanczos) or box filter. Colour channels are converted from sRGB to
+// linear light before filtering and back again afterwards, so that
+// a black and white checkerboard becomes the right shade of grey.
+//
+// Alpha tested textures (foliage, fences) get thinner with every level
+// as the alpha is averaged. With alpha_ref set, the alpha of each level is scaled so
+// that the fraction of pixels passing the test matches the top level.
+//
+// Rows of each level are generated in parallel on the job system.
+//
+
+namespace octet { namespace loaders {
+  /// Generate a chain of mipmaps down to 1x1 in the layout glTexImage2D expects.
+  ///
+  /// Example:
+  ///
+  ///     mipmap_generator gen(mipmap_generator::filter_kaiser);
+  ///     dynarray<uint8_t> levels(mipmap_generator::get_size(w, h, 4));
+  ///     memcpy(levels.data(), rgba, w * h * 4);
+  ///     unsigned num_levels = gen.generate(levels.data(), w, h, 4);
+  class mipmap_generator {
+  public:
+    enum filter_t {
+      filter_box,      // average of 2x2 pixels, fast but aliases
+      filter_kaiser,   // Kaiser windowed sinc, sharp with little ringing
+      filter_lanczos,  // Lanczos 3 windowed sinc, a little sharper, a little more ringing
+    };
+
+  private:
+    filter_t filter;
+
+    // colour channels are sRGB encoded
+    bool srgb;
+
+    // texture repeats, so the filter wraps around the edges.
+    bool wrap;
+
+    // alpha test reference value (0-1) to preserve coverage for, or 0 to leave alpha alone.
+    float alpha_ref;
+
+    // one source pixel contributing to a destination pixel.
+    struct tap {
+      uint32_t index;
+      float weight;
+    };
+
+    // taps for every destination pixel along one axis.
+    // taps[first[i] .. first[i+1]-1] make destination pixel i.
+    struct axis_taps {
+      dynarray<uint32_t> first;
+      dynarray<tap> taps;
+    };
+
+    // 8 bit to float and back again.
+    struct colour_tables {
+      // sRGB code to linear light.
+      float srgb_to_linear[256];
+
+      // linear value half way between two sRGB codes. code i+1 starts at thresholds[i].
+      float thresholds[256];
+
+      // smallest possible code for linear values in [i/4096, (i+1)/4096)
+      uint8_t coarse[4097];
+
+      // byte to 0-1.
+      float unorm[256];
+
+      static double decode(double s) {
+        return s <= 0.04045 ? s / 12.92 : pow((s + 0.055) / 1.055, 2.4);
+      }
+
+      colour_tables() {
+        for (unsigned i = 0; i != 256; ++i) {
+          srgb_to_linear[i] = (float)decode(i / 255.0);
+          thresholds[i] = i == 255 ? 2.0f : (float)decode((i + 0.5) / 255.0);
+          unorm[i] = i * (1.0f / 255);
+        }
+
+        unsigned code = 0;
+        for (unsigned i = 0; i != 4097; ++i) {
+          while (code != 255 && thresholds[code] <= i * (1.0f / 4096)) ++code;
+          coarse[i] = (uint8_t)code;
+        }
+      }
+
+      // nearest sRGB code to a linear value in [0, 1]
+      uint8_t encode(float v) const {
+        unsigned code = coarse[(int)(v * 4096)];
+        while (v >= thresholds[code]) ++code;
+        return (uint8_t)code;
+      }
+    };
+
+    static const colour_tables &get_tables() {
+      static colour_tables t;
+      return t;
+    }
+
+    static float sinc(float x) {
+      if (fabsf(x) < 1e-5f) return 1;
+      x *= 3.14159265358979f;
+      return sinf(x) / x;
+    }
+
+    // modified bessel function of the first kind, for the Kaiser window.
+    static float bessel_i0(float x) {
+      float sum = 1, term = 1, x2 = x * x * 0.25f;
+      for (unsigned k = 1; k != 32 && term > sum * 1e-8f; ++k) {
+        term *= x2 / (float)(k * k);
+        sum += term;
+      }
+      return sum;
+    }
+
+    // half width of the filter in destination pixels.
+    float get_radius() const {
+      return filter == filter_box ? 0.5f : 3.0f;
+    }
+
+    // filter kernel at distance x destination pixels from the centre.
+    float evaluate(float x) const {
+      float radius = get_radius();
+      if (fabsf(x) > radius) return 0;
+      switch (filter) {
+        case filter_box: {
+          return 1;
+        }
+        case filter_kaiser: {
+          const float alpha = 4.0f;
+          float t = x / radius;
+          return sinc(x) * bessel_i0(alpha * sqrtf(std::max(0.0f, 1 - t * t))) / bessel_i0(alpha);
+        }
+        default: {
+          return sinc(x) * sinc(x / radius);
+        }
+      }
+    }
+
+    // source index for a filter tap, which may be off the edge.
+    unsigned edge(int i, unsigned size) const {
+      if (wrap) {
+        i %= (int)size;
+        return i < 0 ? i + size : i;
+      } else {
+        return i < 0 ? 0 : i >= (int)size ? size - 1 : i;
+      }
+    }
+
+    // work out the filter taps for resampling src_size pixels to dest_size.
+    void make_taps(axis_taps &at, unsigned src_size, unsigned dest_size) const {
+      float scale = (float)src_size / dest_size;
+      float radius = get_radius() * scale;
+      at.first.resize(dest_size + 1);
+      at.taps.resize(0);
+      for (unsigned i = 0; i != dest_size; ++i) {
+        at.first[i] = at.taps.size();
+        float centre = (i + 0.5f) * scale;
+        int j0 = (int)floorf(centre - radius);
+        int j1 = (int)ceilf(centre + radius);
+        float total = 0;
+        for (int j = j0; j <= j1; ++j) {
+          float w = evaluate((j + 0.5f - centre) / scale);
+          if (w == 0) continue;
+          tap t = { edge(j, src_size), w };
+          at.taps.push_back(t);
+          total += w;
+        }
+        for (unsigned k = at.first[i]; k != at.taps.size(); ++k) {
+          at.taps[k].weight /= total;
+        }
+      }
+      at.first[dest_size] = at.taps.size();
+    }
+
+    // channel c of a num_comps image is alpha
+    static bool is_alpha(unsigned c, unsigned num_comps) {
+      return (num_comps == 2 || num_comps == 4) && c == num_comps - 1;
+    }
+
+    // scale the alpha channel of a level so that the number of pixels above alpha_ref is target.
+    void preserve_coverage(uint8_t *pixels, unsigned num_pixels, unsigned num_comps, unsigned target) const {
+      unsigned histogram[256];
+      memset(histogram, 0, sizeof(histogram));
+      uint8_t *alpha = pixels + num_comps - 1;
+      for (unsigned i = 0; i != num_pixels; ++i) {
+        histogram[alpha[i * num_comps]]++;
+      }
+
+      // find the smallest alpha that needs to pass the test to give the nearest coverage.
+      unsigned count = 0, threshold = 256;
+      while (threshold != 0 && count < target && (int)(count + histogram[threshold-1] - target) < (int)(target - count)) {
+        count += histogram[--threshold];
+      }
+      if (threshold == 256 || threshold == 0) return;
+
+      // scale so that alpha=threshold passes the test and alpha=threshold-1 does not.
+      float ref = alpha_ref * 255;
+      unsigned pass = (unsigned)ref + 1;
+      float scale = ref / ( threshold - 0.5f );
+      uint8_t table[256];
+      for (unsigned i = 0; i != 256; ++i) {
+        float a = i * scale + 0.5f;
+        unsigned v = a > 255 ? 255 : (unsigned)a;
+        v = i < threshold ? std::min(v, pass - 1) : std::max(v, pass);
+        table[i] = (uint8_t)v;
+      }
+      for (unsigned i = 0; i != num_pixels; ++i) {
+        alpha[i * num_comps] = table[alpha[i * num_comps]];
+      }
+    }
+
+    // number of pixels passing the alpha test.
+    unsigned get_coverage(const uint8_t *pixels, unsigned num_pixels, unsigned num_comps) const {
+      unsigned count = 0;
+      float ref = alpha_ref * 255;
+      const uint8_t *alpha = pixels + num_comps - 1;
+      for (unsigned i = 0; i != num_pixels; ++i) {
+        count += alpha[i * num_comps] > ref;
+      }
+      return count;
+    }
+
+  public:
+    /// srgb: colour channels are gamma encoded. alpha_ref: alpha test value to keep coverage for (0 for none).
+    /// wrap: the texture repeats; otherwise the edge pixels are extended.
+    mipmap_generator(filter_t filter_=filter_kaiser, bool srgb_=true, float alpha_ref_=0, bool wrap_=true) {
+      filter = filter_;
+      srgb = srgb_;
+      alpha_ref = alpha_ref_;
+      wrap = wrap_;
+    }
+
+    /// Settings for textures that hold data rather than colours, such as normal and height maps:
+    /// the channels are filtered as they are and the edges do not wrap unless asked to.
+    static mipmap_generator for_data(filter_t filter_=filter_kaiser, bool wrap_=false) {
+      return mipmap_generator(filter_, false, 0, wrap_);
+    }
+
+    /// Size of level in one dimension (GL rules: halve and round down, but never less than 1)
+    static unsigned get_level_size(unsigned size, unsigned level) {
+      size >>= level;
+      return size ? size : 1;
+    }
+
+    /// Number of levels in a full chain down to 1x1.
+    static unsigned get_num_levels(unsigned width, unsigned height) {
+      unsigned num_levels = 1;
+      while (width > 1 || height > 1) {
+        width >>= 1;
+        height >>= 1;
+        num_levels++;
+      }
+      return num_levels;
+    }
+
+    /// Bytes needed for a full chain of levels.
+    static size_t get_size(unsigned width, unsigned height, unsigned num_comps) {
+      size_t size = 0;
+      unsigned num_levels = get_num_levels(width, height);
+      for (unsigned level = 0; level != num_levels; ++level) {
+        size += (size_t)get_level_size(width, level) * get_level_size(height, level) * num_comps;
+      }
+      return size;
+    }
+
+    /// Filter one level (src) down to the next (dest). Images have num_comps bytes per pixel (1-4).
+    /// One and two channel images are grey and grey-alpha.
+    void downsample(uint8_t *dest, unsigned dest_width, unsigned dest_height, const uint8_t *src, unsigned src_width, unsigned src_height, unsigned num_comps) const {
+      if (num_comps < 1 || num_comps > 4 || !dest_width || !dest_height || !src_width || !src_height) return;
+
+      axis_taps xt, yt;
+      make_taps(xt, src_width, dest_width);
+      make_taps(yt, src_height, dest_height);
+
+      const colour_tables &tables = get_tables();
+      const float *to_float[4];
+      bool linear[4];
+      for (unsigned c = 0; c != num_comps; ++c) {
+        linear[c] = !srgb || is_alpha(c, num_comps);
+        to_float[c] = linear[c] ? tables.unorm : tables.srgb_to_linear;
+      }
+
+      unsigned src_stride = src_width * num_comps;
+      job_scheduler::get()->parallel_for(0, dest_height, 4, [&](unsigned y0, unsigned y1) {
+        dynarray<float> row(src_stride);
+        for (unsigned y = y0; y != y1; ++y) {
+          // filter vertically into a row of linear values.
+          memset(row.data(), 0, src_stride * sizeof(float));
+          for (unsigned k = yt.first[y]; k != yt.first[y+1]; ++k) {
+            const uint8_t *s = src + yt.taps[k].index * src_stride;
+            float w = yt.taps[k].weight;
+            float *r = row.data();
+            for (unsigned x = 0; x != src_width; ++x) {
+              for (unsigned c = 0; c != num_comps; ++c) {
+                r[c] += to_float[c][s[c]] * w;
+              }
+              r += num_comps;
+              s += num_comps;
+            }
+          }
+
+          // then horizontally into the destination.
+          uint8_t *d = dest + y * dest_width * num_comps;
+          for (unsigned x = 0; x != dest_width; ++x) {
+            float sum[4] = { 0, 0, 0, 0 };
+            for (unsigned k = xt.first[x]; k != xt.first[x+1]; ++k) {
+              const float *r = row.data() + xt.taps[k].index * num_comps;
+              float w = xt.taps[k].weight;
+              for (unsigned c = 0; c != num_comps; ++c) {
+                sum[c] += r[c] * w;
+              }
+            }
+            for (unsigned c = 0; c != num_comps; ++c) {
+              // windowed sinc filters ring, so clamp.
+              float v = sum[c] < 0 ? 0 : sum[c] > 1 ? 1 : sum[c];
+              d[c] = linear[c] ? (uint8_t)(v * 255 + 0.5f) : tables.encode(v);
+            }
+            d += num_comps;
+          }
+        }
+      });
+    }
+
+    /// Generate the whole chain. levels must hold get_size() bytes with level 0 at the start.
+    /// The other levels follow level 0. Returns the number of levels.
+    unsigned generate(uint8_t *levels, unsigned width, unsigned height, unsigned num_comps) const {
+      if (num_comps < 1 || num_comps > 4 || !width || !height) return 0;
+
+      bool coverage = alpha_ref > 0 && alpha_ref < 1 && (num_comps == 2 || num_comps == 4);
+      unsigned num_levels = get_num_levels(width, height);
+      unsigned num_pixels = width * height;
+      float target = coverage ? (float)get_coverage(levels, num_pixels, num_comps) / num_pixels : 0;
+
+      uint8_t *src = levels;
+      for (unsigned level = 1; level != num_levels; ++level) {
+        unsigned sw = get_level_size(width, level - 1), sh = get_level_size(height, level - 1);
+        unsigned dw = get_level_size(width, level), dh = get_level_size(height, level);
+        uint8_t *dest = src + sw * sh * num_comps;
+        downsample(dest, dw, dh, src, sw, sh, num_comps);
+        if (coverage) {
+          preserve_coverage(dest, dw * dh, num_comps, (unsigned)(target * dw * dh + 0.5f));
+        }
+        src = dest;
+      }
+      return num_levels;
+    }
+  };
+}}
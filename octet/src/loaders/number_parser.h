@@ -0,0 +1,135 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// parse numbers from text files.
+//
+// atof and strtod are slow with locales and need a zero terminated string,
+// these work on a range of characters and leave the pointer after the number.
+//
+namespace octet { namespace loaders {
+  /// Parse numbers in text without calling the C library.
+  class number_parser {
+  public:
+    /// skip spaces and tabs
+    static const uint8_t *skip_space(const uint8_t *src, const uint8_t *end) {
+      while (src != end && (*src == ' ' || *src == '\t')) ++src;
+      return src;
+    }
+
+    /// skip spaces, tabs and line ends
+    static const uint8_t *skip_white_space(const uint8_t *src, const uint8_t *end) {
+      while (src != end && *src <= ' ' && *src != 0) ++src;
+      return src;
+    }
+
+    /// parse a number like -1.25e-3.
+    /// returns false if there are no digits.
+    static bool parse_float(float &result, const uint8_t *&src, const uint8_t *end) {
+      static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+      };
+
+      const uint8_t *p = src;
+      bool negative = false;
+      if (p != end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+      // keep up to 19 significant digits in an integer.
+      uint64_t mantissa = 0;
+      int exponent = 0;
+      unsigned digits = 0;
+      bool any = false;
+      for (; p != end && (unsigned)(*p - '0') < 10; ++p, any = true) {
+        if (digits < 19) {
+          mantissa = mantissa * 10 + (*p - '0');
+          digits += mantissa != 0;
+        } else {
+          exponent++;
+        }
+      }
+      if (p != end && *p == '.') {
+        for (++p; p != end && (unsigned)(*p - '0') < 10; ++p, any = true) {
+          if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa != 0;
+            exponent--;
+          }
+        }
+      }
+      if (!any) return false;
+
+      if (p != end && (*p == 'e' || *p == 'E')) {
+        const uint8_t *q = p + 1;
+        bool negative_exp = false;
+        if (q != end && (*q == '-' || *q == '+')) negative_exp = *q++ == '-';
+        if (q != end && (unsigned)(*q - '0') < 10) {
+          int e = 0;
+          for (; q != end && (unsigned)(*q - '0') < 10; ++q) {
+            if (e < 10000) e = e * 10 + (*q - '0');
+          }
+          exponent += negative_exp ? -e : e;
+          p = q;
+        }
+      }
+
+      double value = (double)mantissa;
+      if (value != 0) {
+        if (exponent < -400) exponent = -400;
+        if (exponent > 400) exponent = 400;
+        for (; exponent > 22; exponent -= 22) value *= 1e22;
+        for (; exponent < -22; exponent += 22) value /= 1e22;
+        value = exponent < 0 ? value / powers[-exponent] : value * powers[exponent];
+      }
+      result = (float)(negative ? -value : value);
+      src = p;
+      return true;
+    }
+
+    /// parse an integer like -123.
+    /// returns false if there are no digits.
+    static bool parse_int(int &result, const uint8_t *&src, const uint8_t *end) {
+      const uint8_t *p = src;
+      bool negative = p != end && *p == '-';
+      if (negative) ++p;
+      if (p == end || (unsigned)(*p - '0') >= 10) return false;
+      int value = 0;
+      for (; p != end && (unsigned)(*p - '0') < 10; ++p) {
+        value = value * 10 + (*p - '0');
+      }
+      result = negative ? -value : value;
+      src = p;
+      return true;
+    }
+
+    /// parse white space separated floats from a zero terminated string, adding them to values.
+    /// returns the number of values added.
+    static unsigned parse_floats(dynarray<float> &values, const char *text) {
+      if (!text) return 0;
+      const uint8_t *src = (const uint8_t *)text;
+      const uint8_t *end = src + strlen(text);
+      unsigned start = values.size();
+      float value = 0;
+      for (src = skip_white_space(src, end); parse_float(value, src, end); src = skip_white_space(src, end)) {
+        values.push_back(value);
+      }
+      return values.size() - start;
+    }
+
+    /// parse white space separated integers from a zero terminated string, adding them to values.
+    /// returns the number of values added.
+    static unsigned parse_ints(dynarray<int> &values, const char *text) {
+      if (!text) return 0;
+      const uint8_t *src = (const uint8_t *)text;
+      const uint8_t *end = src + strlen(text);
+      unsigned start = values.size();
+      int value = 0;
+      for (src = skip_white_space(src, end); parse_int(value, src, end); src = skip_white_space(src, end)) {
+        values.push_back(value);
+      }
+      return values.size() - start;
+    }
+  };
+}}
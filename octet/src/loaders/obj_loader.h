@@ -6,6 +6,13 @@
 //
 // load an OBJ file.
 //
+// The mapped file is split into chunks at line ends and the chunks are parsed in parallel.
+// Each chunk keeps its own positions, uvs, normals and triangles with indices
+// relative to the chunk, which are made absolute once the sizes of all the chunks are known.
+//
+// Face corners with the same position, uv and normal share one vertex.
+// Parsing is done without the C library, which is slow with locales and temporary strings.
+//
 namespace octet { namespace loaders {
   /// Class for loading OBJ files.
   class obj_loader {
@@ -15,238 +22,444 @@ namespace octet { namespace loaders {
 
     /// Load an OBJ file
     /// http://en.wikipedia.org/wiki/Wavefront_.obj_file
+    /// Each object ("o") becomes a scene node with one mesh per material.
+    /// Materials ("usemtl") are looked up in the resource dictionary by name, or are grey if not found.
     bool load(const char *url, resource_dict &dict, visual_scene *scene) {
-      dynarray<uint8_t> file;
-      app_utils::get_url(file, url);
-      if (file.size() == 0) return false;
-
-      const uint8_t *eof = file.data() + file.size();
       this->dict = &dict;
-      material_index = 0;
-      
-      for (const uint8_t *src = file.data(); src != eof; ) {
-        while (*src == ' ' && src != eof) ++src;
+      if (!parse(url)) return false;
+
+      dynarray<mesh::vertex> vertices;
+      dynarray<uint32_t> indices;
+      for (unsigned i = 0; i != runs.size(); ) {
+        // runs of one object are together.
+        unsigned j = i;
+        while (j != runs.size() && runs[j].object == runs[i].object) ++j;
+
+        scene_node *node = scene ? scene->add_scene_node() : new scene_node();
+        string &name = object_names[runs[i].object];
+        if (name.size()) dict.set_resource(name.c_str(), node);
+
+        // one mesh per material in the object.
+        std::stable_sort(runs.data() + i, runs.data() + j);
+        for (unsigned k = i; k != j; ) {
+          unsigned l = k;
+          while (l != j && runs[l].material == runs[k].material) ++l;
+
+          build_mesh(vertices, indices, runs.data() + k, l - k);
+
+          mesh *msh = new mesh();
+          msh->set_default_attributes();
+          msh->set_vertices(vertices);
+          msh->set_indices(indices);
+          msh->calc_aabb();
+          mesh_instance *mi = new mesh_instance(node, msh, get_material(runs[k].material));
+          if (scene) scene->add_mesh_instance(mi);
+          k = l;
+        }
+        i = j;
+      }
+
+      release();
+      return true;
+    }
+
+    /// Get the triangles of an OBJ file as a flat vertex and index array.
+    /// This does not use GL, so it can run on a worker thread.
+    bool get_mesh_data(const char *url, dynarray<mesh::vertex> &vertices, dynarray<uint32_t> &indices) {
+      dict = 0;
+      if (!parse(url)) return false;
+
+      build_mesh(vertices, indices, runs.data(), runs.size());
+
+      release();
+      return true;
+    }
+
+  private:
+    enum {
+      // bytes of file per parallel chunk.
+      chunk_size = 1 << 20,
+    };
+
+    // 1-based indices of the position, uv and normal of a face corner. 0 for none.
+    struct corner {
+      uint32_t pos;
+      uint32_t uv;
+      uint32_t normal;
+    };
+
+    // usemtl or o in a chunk, before triangle "triangle" of the chunk.
+    struct state_change {
+      uint32_t triangle;
+      bool is_object;
+      const uint8_t *name;
+      uint32_t name_len;
+    };
+
+    // negative (relative) index of a corner, fixed up when the chunk's position in the file is known.
+    struct relative_index {
+      uint32_t slot;
+      int32_t offset;
+      uint32_t kind;
+    };
+
+    // results of parsing one chunk of the file.
+    struct chunk {
+      const uint8_t *begin;
+      const uint8_t *end;
+
+      dynarray<vec3p> positions;
+      dynarray<vec2p> uvs;
+      dynarray<vec3p> normals;
+
+      // three corners per triangle, polygons are fans.
+      dynarray<corner> corners;
+      dynarray<relative_index> relative;
+      dynarray<state_change> changes;
+
+      // first position, uv and normal of the chunk in the whole file.
+      uint32_t base[3];
+      bool error;
+    };
+
+    // triangles [first, last) of a chunk that share an object and a material.
+    struct run {
+      uint32_t object;
+      uint32_t material;
+      uint32_t chunk;
+      uint32_t first;
+      uint32_t last;
+
+      bool operator <(const run &rhs) const {
+        return material < rhs.material;
+      }
+    };
+
+    resource_dict *dict;
+
+    dynarray<chunk> chunks;
+    dynarray<run> runs;
+
+    dynarray<vec3p> src_vertices;
+    dynarray<vec2p> src_uvs;
+    dynarray<vec3p> src_normals;
+
+    // material names to indices.
+    dictionary<uint32_t> material_index;
+    dynarray<string> material_names;
+    dynarray<ref<material> > materials;
+
+    dynarray<string> object_names;
+
+    // parse up to max_values floats. returns the number found.
+    static unsigned parse_floats(float *values, unsigned max_values, const uint8_t *src, const uint8_t *end) {
+      unsigned num_values = 0;
+      src = number_parser::skip_space(src, end);
+      while (num_values != max_values && number_parser::parse_float(values[num_values], src, end)) {
+        num_values++;
+        src = number_parser::skip_space(src, end);
+      }
+      return num_values;
+    }
+
+    // store one index of a corner. negative indices count back from the last one read so far.
+    static void set_index(chunk &c, uint32_t &dest, int value, unsigned kind, unsigned count) {
+      if (value > 0) {
+        dest = (uint32_t)value;
+      } else if (value < 0) {
+        dest = 0;
+        relative_index r = { (uint32_t)(&dest - &c.corners[0].pos), (int32_t)count + value, kind };
+        c.relative.push_back(r);
+      } else {
+        c.error = true;
+      }
+    }
+
+    // parse "f 1/2/3 4/5/6 7/8/9 ..." into triangles.
+    static void parse_face(chunk &c, dynarray<corner> &poly, const uint8_t *src, const uint8_t *end) {
+      poly.resize(0);
+      for (src = number_parser::skip_space(src, end); src != end; src = number_parser::skip_space(src, end)) {
+        int values[3] = { 0, 0, 0 };
+        if (!number_parser::parse_int(values[0], src, end)) {
+          c.error = true;
+          return;
+        }
+        for (unsigned i = 1; i != 3 && src != end && *src == '/'; ++i) {
+          ++src;
+          number_parser::parse_int(values[i], src, end);
+        }
+        corner cn = { (uint32_t)values[0], (uint32_t)values[1], (uint32_t)values[2] };
+        poly.push_back(cn);
+      }
+      if (poly.size() < 3) return;
+
+      // fan of triangles around the first corner.
+      for (unsigned i = 2; i != poly.size(); ++i) {
+        const corner *src_corners[3] = { &poly[0], &poly[i-1], &poly[i] };
+        for (unsigned j = 0; j != 3; ++j) {
+          // push_back grows the array geometrically.
+          corner empty = { 0, 0, 0 };
+          c.corners.push_back(empty);
+          corner &d = c.corners.back();
+          const corner &s = *src_corners[j];
+          set_index(c, d.pos, (int)s.pos, 0, c.positions.size());
+          if (s.uv) set_index(c, d.uv, (int)s.uv, 1, c.uvs.size());
+          if (s.normal) set_index(c, d.normal, (int)s.normal, 2, c.normals.size());
+        }
+      }
+    }
+
+    // parse the lines of one chunk.
+    static void parse_chunk(chunk &c) {
+      dynarray<corner> poly;
+      float values[3];
+      c.error = false;
+      for (const uint8_t *src = c.begin, *eof = c.end; src != eof; ) {
+        src = number_parser::skip_space(src, eof);
         const uint8_t *begin = src;
-        while (*src != '\n' && *src != '\r' && src != eof) ++src;
+        while (src != eof && *src != '\n' && *src != '\r') ++src;
         const uint8_t *end = src;
-        src += src != eof && *src == '\r';
-        src += src != eof && *src == '\n';
-        if (begin != end ) switch (begin[0]) {
-          case '#': {
-            fwrite(begin, 1, end-begin, stdout);
-          } break;
-          case 'o': {
-            flush();
-            fwrite(begin, 1, end-begin, stdout);
-            if (begin[1] == ' ') obj_name.assign((const char*)begin + 2, (const char*)end);
-            node = new scene_node(mat4t(), atom_);
-          } break;
-          case 'g': {
-            fwrite(begin, 1, end-begin, stdout);
-            if (begin[1] == ' ') group_name.assign((const char*)begin + 2, (const char*)end);
-          } break;
+        while (src != eof && (*src == '\n' || *src == '\r')) ++src;
+
+        size_t len = end - begin;
+        if (len < 2) continue;
+        bool space1 = begin[1] == ' ' || begin[1] == '\t';
+        bool space2 = len > 2 && (begin[2] == ' ' || begin[2] == '\t');
+        switch (begin[0]) {
           case 'v': {
-            //fwrite(begin, 1, end-begin, stdout);
-            if (begin[1] == ' ') {
-              atofv(values, begin+2, end);
-              if (values.size() == 3) {
-                src_vertices.push_back(vec3p(values[0], values[1], values[2]));
+            if (space1) {
+              if (parse_floats(values, 3, begin + 2, end) == 3) {
+                c.positions.push_back(vec3p(values[0], values[1], values[2]));
               }
-            } else if (begin[1] == 't' && begin[2] == ' ') {
-              atofv(values, begin+3, end);
-              if (values.size() == 2) {
-                src_uvs.push_back(vec2p(values[0], values[1]));
+            } else if (begin[1] == 't' && space2) {
+              if (parse_floats(values, 3, begin + 3, end) >= 2) {
+                c.uvs.push_back(vec2p(values[0], values[1]));
               }
-            } else if (begin[1] == 'n' && begin[2] == ' ') {
-              atofv(values, begin+3, end);
-              if (values.size() == 3) {
-                src_normals.push_back(vec3p(values[0], values[1], values[2]));
+            } else if (begin[1] == 'n' && space2) {
+              if (parse_floats(values, 3, begin + 3, end) == 3) {
+                c.normals.push_back(vec3p(values[0], values[1], values[2]));
               }
             }
           } break;
           case 'f': {
-            //fwrite(begin, 1, end-begin, stdout);
-            if (begin[1] == ' ') {
-              unsigned slashes = 0;
-              mesh::vertex v[6];
-              atoiv(ivalues, slashes, begin + 2, end);
-              size_t num_values = ivalues.size() - slashes;
-              size_t num_comps = ivalues.size() / num_values;
-              size_t num_idx = ivalues.size() / num_comps;
-              if (num_idx > 4 || num_comps > 3) {
-                printf("warning: bad obj file face\n");
-                return false;
-              }
-              mesh::vertex vtx[4];
-              memset(vtx, 0, sizeof(vtx));
-              if (num_comps >= 1) {
-                size_t d = 0;
-                for (size_t i = 0; i < ivalues.size(); i += num_comps) {
-                  int iv = ivalues[i];
-                  vtx[d++].pos = src_vertices[iv < 0 ? src_vertices.size() + iv : iv];
-                }
-              }
-              if (num_comps >= 2) {
-                size_t d = 0;
-                for (size_t i = 1; i < ivalues.size(); i += num_comps) {
-                  int iv = ivalues[i];
-                  vtx[d++].uv = src_uvs[iv < 0 ? src_uvs.size() + iv : iv];
-                }
-              }
-              if (num_comps >= 3) {
-                size_t d = 0;
-                for (size_t i = 2; i < ivalues.size(); i += num_comps) {
-                  int iv = ivalues[i];
-                  vtx[d++].normal = src_normals[iv < 0 ? src_normals.size() + iv : iv];
-                }
-              }
-
-              face f;
-              f.vtx[0] = vtx[0];
-              f.vtx[1] = vtx[1];
-              f.vtx[2] = vtx[2];
-              f.material_index = material_index;
-              faces.push_back(f);
-              if (num_idx == 4) {
-                f.vtx[0] = vtx[0];
-                f.vtx[1] = vtx[2];
-                f.vtx[2] = vtx[3];
-                f.material_index = material_index;
-                faces.push_back(f);
-              }
-            }
+            if (space1) parse_face(c, poly, begin + 2, end);
           } break;
-          default: {
-            fwrite(begin, 1, end-begin, stdout);
-            printf("unknown\n");
-            return false;
+          case 'o': {
+            if (space1) {
+              const uint8_t *name = number_parser::skip_space(begin + 2, end);
+              state_change sc = { c.corners.size() / 3, true, name, (uint32_t)(end - name) };
+              c.changes.push_back(sc);
+            }
           } break;
           case 'u': {
-            fwrite(begin, 1, end-begin, stdout);
-            if (begin+7 < end && !memcmp(begin, "usemtl ", 7)) {
-              size_t len = end - (begin+7);
-              size_t i = 0;
-              for (; i != materials.size(); ++i) {
-                if (
-                  materials[i].size() == len &&
-                  !memcmp(materials[i].c_str(), begin+7, len)
-                ) {
-                  break;
-                }
-              }
-
-              if (i == materials.size()) {
-                materials.push_back(string((const char*)begin+7, (unsigned)len));
-              }
-
-              material_index = (uint32_t)i;
+            if (len > 7 && !memcmp(begin, "usemtl", 6) && (begin[6] == ' ' || begin[6] == '\t')) {
+              const uint8_t *name = number_parser::skip_space(begin + 7, end);
+              state_change sc = { c.corners.size() / 3, false, name, (uint32_t)(end - name) };
+              c.changes.push_back(sc);
             }
           } break;
+          default: {
+            // comments, g, s, mtllib etc.
+          } break;
         }
       }
-      flush();
+    }
 
-      return true;
+    // material number for a name.
+    uint32_t find_material(const uint8_t *name, unsigned len) {
+      string key((const char*)name, len);
+      if (!material_index.contains(key.c_str())) {
+        material_index[key.c_str()] = material_names.size();
+        material_names.push_back(key);
+      }
+      return material_index[key.c_str()];
     }
-  private:
-    dynarray<vec3p> src_vertices;
-    dynarray<vec3p> src_normals;
-    dynarray<vec2p> src_uvs;
-    dynarray<uint32_t> src_material;
-    dynarray<string> materials;
 
-    string obj_name;
-    string group_name;
-    resource_dict *dict;
-    scene_node *node;
+    // end the current run of triangles and start a new one.
+    void add_run(uint32_t object, uint32_t material, uint32_t chunk_index, uint32_t first, uint32_t last) {
+      if (first == last) return;
+      run r = { object, material, chunk_index, first, last };
+      runs.push_back(r);
+    }
+
+    // read the file and split the triangles into runs of one object and material.
+    bool parse(const char *url) {
+      release();
+
+      // parse the file in place; the map is not zero terminated, so always check eof first.
+      ref<file_map> file = app_utils::map_url(url);
+      if (!file || file->get_size() == 0) return false;
+      file->advise(file_map::hint_sequential);
 
-    struct face {
-      mesh::vertex vtx[3];
-      int material_index;
+      const uint8_t *data = file->get_data();
+      const uint8_t *eof = data + file->get_size();
 
-      bool operator <(const face &rhs) {
-        return material_index < rhs.material_index;
+      // split at line ends.
+      unsigned num_chunks = (unsigned)( ( file->get_size() + chunk_size - 1 ) / chunk_size );
+      chunks.resize(num_chunks);
+      const uint8_t *src = data;
+      for (unsigned i = 0; i != num_chunks; ++i) {
+        const uint8_t *end = eof - src > chunk_size ? src + chunk_size : eof;
+        while (end != eof && end[-1] != '\n') ++end;
+        chunks[i].begin = src;
+        chunks[i].end = end;
+        src = end;
       }
-    };
 
-    dynarray<face> faces;
-    dynarray<uint32_t> indices;
-    dynarray<float> values;
-    dynarray<int> ivalues;
-    uint32_t material_index;
-
-    // convert an ascii sequence of integers like "1 3 9 12 34" to an array of integers
-    void atoiv(dynarray<int> &values, unsigned &slashes, const uint8_t *src, const uint8_t *end) {
-      values.resize(0);
-      slashes = 0;
-
-      while (src != end && *src > 0 && *src <= ' ') ++src;
-      while(src != end) {
-        int whole = 0, msign = 1;
-        if (src != end && *src == '-') { msign = -1; src++; }
-        while (src != end && *src >= '0' && *src <= '9') whole = whole * 10 + (*src++ - '0');
-        values.push_back(whole * msign);
-        while (src != end && *src > 0 && *src <= ' ') ++src;
-        if (src != end && *src == '/') { slashes++; src++; }
+      job_scheduler::get()->parallel_for(0, num_chunks, 1, [&](unsigned i0, unsigned i1) {
+        for (unsigned i = i0; i != i1; ++i) parse_chunk(chunks[i]);
+      });
+
+      // gather the positions, uvs and normals.
+      uint32_t totals[3] = { 0, 0, 0 };
+      for (unsigned i = 0; i != num_chunks; ++i) {
+        chunk &c = chunks[i];
+        c.base[0] = totals[0];
+        c.base[1] = totals[1];
+        c.base[2] = totals[2];
+        totals[0] += c.positions.size();
+        totals[1] += c.uvs.size();
+        totals[2] += c.normals.size();
       }
-    }
+      src_vertices.resize(totals[0]);
+      src_uvs.resize(totals[1]);
+      src_normals.resize(totals[2]);
+
+      bool error = false;
+      job_scheduler::get()->parallel_for(0, num_chunks, 1, [&](unsigned i0, unsigned i1) {
+        for (unsigned i = i0; i != i1; ++i) {
+          chunk &c = chunks[i];
+          for (unsigned j = 0; j != c.positions.size(); ++j) src_vertices[c.base[0] + j] = c.positions[j];
+          for (unsigned j = 0; j != c.uvs.size(); ++j) src_uvs[c.base[1] + j] = c.uvs[j];
+          for (unsigned j = 0; j != c.normals.size(); ++j) src_normals[c.base[2] + j] = c.normals[j];
+          c.positions.reset();
+          c.uvs.reset();
+          c.normals.reset();
 
-    void atofv(dynarray<float> &values, const uint8_t *src, const uint8_t *end) {
-      values.resize(0);
-
-      while (*src > 0 && *src <= ' ') ++src;
-      while(src != end) {
-        double whole = 0, msign = 1;
-        if (*src == '-') { msign = -1; src++; }
-        if( !(*src >= '0' && *src <= '9') && *src != '.' ) break;
-        while (*src >= '0' && *src <= '9') whole = whole * 10 + (*src++ - '0');
-        if (*src == '.') {
-          src++;
-          double frac = 0, v = 1;
-          while (*src >= '0' && *src <= '9') { frac = frac * 10 + (*src++ - '0'); v *= 10; }
-          whole += frac / v;
+          // relative indices count back from the position in the whole file.
+          uint32_t *slots = &c.corners[0].pos;
+          for (unsigned j = 0; j != c.relative.size(); ++j) {
+            const relative_index &r = c.relative[j];
+            slots[r.slot] = (uint32_t)( (int32_t)c.base[r.kind] + r.offset + 1 );
+          }
+          c.relative.reset();
+
+          // check that all the indices are in range.
+          for (unsigned j = 0; j != c.corners.size(); ++j) {
+            const corner &cn = c.corners[j];
+            if (cn.pos - 1 >= totals[0] || cn.uv > totals[1] || cn.normal > totals[2]) {
+              c.error = true;
+              break;
+            }
+          }
         }
-        if (*src == 'e' || *src == 'E') {
-          int esign = 1;
-          src++;
-          if (*src == '-') { esign = -1; src++; }
-          else if (*src == '+') src++;
-          int exp = 0;
-          while (*src >= '0' && *src <= '9') { exp = exp * 10 + (*src++ - '0'); }
-          whole = whole * pow(10.0, exp * esign);
+      });
+
+      for (unsigned i = 0; i != num_chunks; ++i) {
+        error = error || chunks[i].error;
+      }
+      if (error) {
+        printf("warning: bad obj file face in %s\n", url);
+        release();
+        return false;
+      }
+
+      // walk the objects and materials in file order.
+      material_names.resize(0);
+      find_material((const uint8_t*)"", 0);
+      object_names.push_back(string());
+      uint32_t object = 0, material = 0;
+      for (unsigned i = 0; i != num_chunks; ++i) {
+        chunk &c = chunks[i];
+        uint32_t first = 0;
+        for (unsigned j = 0; j != c.changes.size(); ++j) {
+          const state_change &sc = c.changes[j];
+          add_run(object, material, i, first, sc.triangle);
+          first = sc.triangle;
+          if (sc.is_object) {
+            // an object with no triangles so far is just renamed.
+            if (runs.size() && runs.back().object == object) {
+              object_names.push_back(string());
+              object++;
+            }
+            object_names[object].set((const char*)sc.name, sc.name_len);
+          } else {
+            material = find_material(sc.name, sc.name_len);
+          }
         }
-        values.push_back((float)(whole * msign));
-        while (*src > 0 && *src <= ' ') ++src;
+        c.changes.reset();
+        add_run(object, material, i, first, c.corners.size() / 3);
       }
+      return true;
     }
 
-    void flush() {
-      std::sort(faces.begin(), faces.end());
-      face *f = 0;
-      gl_resource *vertices = new gl_resource(GL_ARRAY_BUFFER, faces.size() * sizeof(f->vtx));
+    // make vertices and indices for some runs of triangles, sharing identical corners.
+    void build_mesh(dynarray<mesh::vertex> &vertices, dynarray<uint32_t> &indices, const run *r, unsigned num_runs) {
+      unsigned num_corners = 0;
+      for (unsigned i = 0; i != num_runs; ++i) {
+        num_corners += ( r[i].last - r[i].first ) * 3;
+      }
+
+      vertices.resize(0);
+      indices.resize(num_corners);
 
-      {
-        gl_resource::wolock vl(vertices);
-        for (size_t i = 0; i != faces.size(); ++i) {
-          memcpy(vl.u8() + i * sizeof(f->vtx), faces[i].vtx, sizeof(f->vtx));
+      // a hash table keyed by the position index: the vertices made from each position are
+      // chained together and told apart by their uv and normal indices.
+      // corners mostly visit positions in order, so this stays in cache where a general hash of
+      // the whole corner would not.
+      dynarray<uint32_t> first_vertex(src_vertices.size());
+      memset(first_vertex.data(), 0xff, first_vertex.size() * sizeof(uint32_t));
+      dynarray<uint32_t> next_vertex;
+      dynarray<uint64_t> vertex_key;
+
+      // vec3p and vec2p start at zero.
+      mesh::vertex vtx;
+      uint32_t *index = indices.data();
+      for (unsigned i = 0; i != num_runs; ++i) {
+        const chunk &c = chunks[r[i].chunk];
+        const corner *cn = c.corners.data() + r[i].first * 3;
+        const corner *cn_end = c.corners.data() + r[i].last * 3;
+        for (; cn != cn_end; ++cn) {
+          uint64_t key = cn->uv | (uint64_t)cn->normal << 32;
+          uint32_t &head = first_vertex[cn->pos - 1];
+          uint32_t v = head;
+          while (v != ~0u && vertex_key[v] != key) v = next_vertex[v];
+          if (v == ~0u) {
+            v = vertices.size();
+            vtx.pos = src_vertices[cn->pos - 1];
+            vtx.uv = cn->uv ? src_uvs[cn->uv - 1] : vec2p(0, 0);
+            vtx.normal = cn->normal ? src_normals[cn->normal - 1] : vec3p(0, 0, 0);
+            vertices.push_back(vtx);
+            vertex_key.push_back(key);
+            next_vertex.push_back(head);
+            head = v;
+          }
+          *index++ = v;
         }
       }
+    }
 
-      int prev_mi = -1;
-      for (size_t i = 0; i != faces.size(); ++i) {
-        if (faces[i].material_index != prev_mi) {
-          mesh *msh = new mesh();
-          msh->set_default_attributes();
-          msh->set_vertices(vertices);
-          material *mat = new material(vec4(0.5f, 0.5f, 0.5f, 1));
-          mesh_instance *mi = new mesh_instance(node, msh, mat);
-        }
+    // shared material for a usemtl name.
+    material *get_material(uint32_t index) {
+      if (materials.size() <= index) materials.resize(material_names.size());
+      if (!materials[index]) {
+        material *mat = dict ? dict->get_material(material_names[index].c_str()) : 0;
+        materials[index] = mat ? mat : new material(vec4(0.5f, 0.5f, 0.5f, 1));
       }
+      return materials[index];
+    }
 
-      faces.resize(0);
-      src_vertices.resize(0);
-      src_uvs.resize(0);
-      src_normals.resize(0);
+    // free the parsed data.
+    void release() {
+      chunks.reset();
+      runs.reset();
+      src_vertices.reset();
+      src_uvs.reset();
+      src_normals.reset();
+      material_index.reset();
+      material_names.reset();
+      materials.reset();
+      object_names.reset();
     }
   };
 }}
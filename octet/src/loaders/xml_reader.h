@@ -0,0 +1,430 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// read an XML file in place.
+//
+// The file is mapped copy on write and tokenized in a single pass.
+// Names, attribute values and text are zero terminated and unescaped inside the map,
+// so the elements only hold pointers and no strings are allocated.
+//
+// This is not a streaming reader: the whole file stays mapped and every element is
+// kept in an index, as COLLADA refers to "#id"s in any order. Peak memory is the
+// file plus the index.
+//
+// This is not a general purpose XML parser: there is no DTD support, namespaces
+// are just part of the name and text after the first child element is ignored.
+//
+namespace octet { namespace loaders {
+  /// Class for reading XML files such as COLLADA. The whole document is read in place
+  /// and indexed, so elements can be visited in any order.
+  class xml_reader {
+  public:
+    /// name="value" pair of an element.
+    struct attr {
+      const char *name;
+      const char *value;
+    };
+
+    /// XML element.
+    class element {
+      const char *name;
+      const char *text;
+      const attr *attrs;
+      unsigned num_attrs;
+      element *first;
+      element *next;
+      void *user_data;
+
+      friend class xml_reader;
+    public:
+      /// name of the element, eg. "node" for <node>
+      const char *get_name() const {
+        return name;
+      }
+
+      /// text of the element with leading and trailing white space removed, or NULL if there is none.
+      const char *get_text() const {
+        return text;
+      }
+
+      /// value of an attribute, or NULL if the element does not have it.
+      const char *get_attribute(const char *attr_name) const {
+        for (unsigned i = 0; i != num_attrs; ++i) {
+          if (!strcmp(attrs[i].name, attr_name)) return attrs[i].value;
+        }
+        return NULL;
+      }
+
+      /// number of attributes
+      unsigned get_num_attributes() const {
+        return num_attrs;
+      }
+
+      /// attribute by index
+      const attr &get_attribute(unsigned i) const {
+        return attrs[i];
+      }
+
+      /// first child element, or the first with a name if the name is not NULL.
+      element *first_child(const char *child_name = NULL) const {
+        element *elem = first;
+        while (elem && child_name && strcmp(elem->name, child_name)) elem = elem->next;
+        return elem;
+      }
+
+      /// next sibling element, or the next with a name if the name is not NULL.
+      element *next_sibling(const char *sibling_name = NULL) const {
+        element *elem = next;
+        while (elem && sibling_name && strcmp(elem->name, sibling_name)) elem = elem->next;
+        return elem;
+      }
+
+      /// a pointer for the user's use, initially NULL.
+      void *get_user_data() const {
+        return user_data;
+      }
+
+      /// set the user pointer.
+      void set_user_data(void *value) {
+        user_data = value;
+      }
+    };
+
+  private:
+    ref<file_map> file;
+    dynarray<element> elements;
+    dynarray<attr> attrs;
+    element *root;
+
+    static bool is_space(char c) {
+      return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    static bool is_name_end(char c) {
+      return is_space(c) || c == '>' || c == '/' || c == '=' || c == 0;
+    }
+
+    // append a unicode character to dest as utf-8
+    static char *put_utf8(char *dest, unsigned code) {
+      if (code < 0x80) {
+        *dest++ = (char)code;
+      } else if (code < 0x800) {
+        *dest++ = (char)(0xc0 | (code >> 6));
+        *dest++ = (char)(0x80 | (code & 0x3f));
+      } else if (code < 0x10000) {
+        *dest++ = (char)(0xe0 | (code >> 12));
+        *dest++ = (char)(0x80 | ((code >> 6) & 0x3f));
+        *dest++ = (char)(0x80 | (code & 0x3f));
+      } else {
+        *dest++ = (char)(0xf0 | (code >> 18));
+        *dest++ = (char)(0x80 | ((code >> 12) & 0x3f));
+        *dest++ = (char)(0x80 | ((code >> 6) & 0x3f));
+        *dest++ = (char)(0x80 | (code & 0x3f));
+      }
+      return dest;
+    }
+
+    // replace &amp; &lt; &#123; etc. in [src, end) and zero terminate.
+    // the result is never longer than the source, so this works in place.
+    static void unescape(char *src, char *end) {
+      char *dest = (char*)memchr(src, '&', end - src);
+      if (!dest) {
+        *end = 0;
+        return;
+      }
+
+      src = dest;
+      while (src != end) {
+        if (*src != '&') {
+          *dest++ = *src++;
+          continue;
+        }
+
+        char *semi = src + 1;
+        while (semi != end && *semi != ';' && semi - src < 12) ++semi;
+        if (semi == end || *semi != ';') {
+          // not an entity, keep the '&'
+          *dest++ = *src++;
+          continue;
+        }
+
+        const char *name = src + 1;
+        size_t len = semi - name;
+        if (len >= 2 && name[0] == '#') {
+          unsigned code = 0;
+          if (name[1] == 'x' || name[1] == 'X') {
+            for (const char *p = name + 2; p != semi; ++p) {
+              unsigned c = (unsigned char)*p;
+              code = code * 16 + (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+            }
+          } else {
+            for (const char *p = name + 1; p != semi; ++p) {
+              code = code * 10 + (*p - '0');
+            }
+          }
+          dest = put_utf8(dest, code & 0x1fffff);
+        } else if (len == 3 && !strncmp(name, "amp", 3)) {
+          *dest++ = '&';
+        } else if (len == 2 && !strncmp(name, "lt", 2)) {
+          *dest++ = '<';
+        } else if (len == 2 && !strncmp(name, "gt", 2)) {
+          *dest++ = '>';
+        } else if (len == 4 && !strncmp(name, "quot", 4)) {
+          *dest++ = '"';
+        } else if (len == 4 && !strncmp(name, "apos", 4)) {
+          *dest++ = '\'';
+        } else {
+          // unknown entity, keep it as it is
+          memmove(dest, src, semi + 1 - src);
+          dest += semi + 1 - src;
+        }
+        src = semi + 1;
+      }
+      *dest = 0;
+    }
+
+    // skip past a terminator such as "-->", returns NULL at the end of the file
+    static char *skip_past(char *src, const char *terminator) {
+      char *p = strstr(src, terminator);
+      return p ? p + strlen(terminator) : NULL;
+    }
+
+    // set the text of the top element from [begin, end) if it has no text or children yet.
+    static void add_text(element *parent, char *begin, char *end) {
+      if (!parent || parent->text || parent->first) return;
+      while (begin != end && is_space(*begin)) ++begin;
+      while (end != begin && is_space(end[-1])) --end;
+      if (begin == end) return;
+      unescape(begin, end);
+      parent->text = begin;
+    }
+
+    // tokenize the file, building the element tree.
+    // the map is writable and has a zero after the end.
+    bool parse() {
+      char *src = (char*)file->access_data();
+      char *eof = src + file->get_size();
+
+      // skip the utf-8 byte order mark
+      if (eof - src >= 3 && !memcmp(src, "\xef\xbb\xbf", 3)) src += 3;
+
+      // every element and attribute starts with '<' or '=', so these never reallocate
+      // and we can use pointers to them as we go.
+      unsigned max_elements = 0, max_attrs = 0;
+      for (const char *p = src; p != eof; ++p) {
+        max_elements += *p == '<';
+        max_attrs += *p == '=';
+      }
+      elements.reserve(max_elements ? max_elements : 1);
+      attrs.reserve(max_attrs ? max_attrs : 1);
+
+      // the open elements and their last children
+      dynarray<element*> stack;
+      dynarray<element*> last_child;
+      stack.reserve(64);
+      last_child.reserve(64);
+
+      while (src != eof) {
+        char *lt = (char*)memchr(src, '<', eof - src);
+        element *parent = stack.empty() ? NULL : stack.back();
+        if (!lt) {
+          break;
+        }
+
+        if (lt != src) {
+          add_text(parent, src, lt);
+        }
+
+        src = lt + 1;
+        if (*src == '?') {
+          src = skip_past(src, "?>");
+        } else if (!strncmp(src, "!--", 3)) {
+          src = skip_past(src, "-->");
+        } else if (!strncmp(src, "![CDATA[", 8)) {
+          char *begin = src + 8;
+          src = skip_past(begin, "]]>");
+          if (src) {
+            char *end = src - 3;
+            if (parent && !parent->text && !parent->first) {
+              *end = 0;
+              parent->text = begin;
+            }
+          }
+        } else if (*src == '!') {
+          // <!DOCTYPE ...>, possibly with an internal subset
+          char *p = src;
+          int depth = 0;
+          for (; *p && (*p != '>' || depth); ++p) {
+            depth += (*p == '[') - (*p == ']');
+          }
+          src = *p ? p + 1 : NULL;
+        } else if (*src == '/') {
+          // end tag
+          char *name = ++src;
+          while (!is_name_end(*src)) ++src;
+          if (!parent || strncmp(parent->name, name, src - name) || parent->name[src - name] != 0) {
+            printf("warning: unexpected end tag in xml\n");
+            return false;
+          }
+          src = (char*)memchr(src, '>', eof - src);
+          if (src) src++;
+          stack.pop_back();
+          last_child.pop_back();
+        } else {
+          // start tag
+          elements.resize(elements.size() + 1);
+          element *elem = &elements.back();
+          memset(elem, 0, sizeof(*elem));
+          elem->attrs = attrs.data() + attrs.size();
+
+          if (parent) {
+            if (last_child.back()) {
+              last_child.back()->next = elem;
+            } else {
+              parent->first = elem;
+            }
+            last_child.back() = elem;
+          } else if (!root) {
+            root = elem;
+          } else {
+            printf("warning: more than one root element in xml\n");
+            return false;
+          }
+
+          char *name = src;
+          while (!is_name_end(*src)) ++src;
+          if (src == name) {
+            printf("warning: bad tag in xml\n");
+            return false;
+          }
+          char *name_end = src;
+
+          // attributes
+          for (;;) {
+            while (is_space(*src)) ++src;
+            if (*src == '>' || *src == '/' || *src == 0) break;
+
+            char *attr_name = src;
+            while (!is_name_end(*src)) ++src;
+            char *attr_name_end = src;
+            while (is_space(*src)) ++src;
+            if (*src != '=' || attr_name == attr_name_end) {
+              printf("warning: bad attribute in xml\n");
+              return false;
+            }
+            ++src;
+            while (is_space(*src)) ++src;
+            char quote = *src;
+            if (quote != '"' && quote != '\'') {
+              printf("warning: unquoted attribute in xml\n");
+              return false;
+            }
+            char *value = ++src;
+            src = strchr(src, quote);
+            if (!src) {
+              printf("warning: unterminated attribute in xml\n");
+              return false;
+            }
+            char *value_end = src++;
+            *attr_name_end = 0;
+            unescape(value, value_end);
+
+            attr a = { attr_name, value };
+            attrs.push_back(a);
+            elem->num_attrs++;
+          }
+
+          char end_char = *src;
+          *name_end = 0;
+          elem->name = name;
+
+          if (end_char == '/') {
+            // <empty/>
+            if (src[1] != '>') {
+              printf("warning: bad empty tag in xml\n");
+              return false;
+            }
+            src += 2;
+          } else if (end_char == '>') {
+            src++;
+            stack.push_back(elem);
+            last_child.push_back(NULL);
+          } else {
+            printf("warning: unterminated tag in xml\n");
+            return false;
+          }
+        }
+
+        if (!src) {
+          printf("warning: unexpected end of xml\n");
+          return false;
+        }
+      }
+
+      if (!stack.empty() || !root) {
+        printf("warning: unexpected end of xml\n");
+        return false;
+      }
+      return true;
+    }
+
+  public:
+    xml_reader() {
+      root = NULL;
+    }
+
+    /// Read an XML file. Returns false if the file is not found or is not well formed.
+    /// The file is mapped copy on write: pages are copied as the tokenizer writes to them,
+    /// so there is no separate read of the whole file into a buffer.
+    bool load(const char *url) {
+      elements.reset();
+      attrs.reset();
+      root = NULL;
+
+      file = app_utils::map_url(url, file_map::mode_copy_on_write);
+      if (!file || file->get_size() == 0 || !file->access_data()) {
+        file = NULL;
+        return false;
+      }
+      return parse();
+    }
+
+    /// Parse XML text from memory. The text is copied.
+    bool load(const char *text, size_t size) {
+      elements.reset();
+      attrs.reset();
+      root = NULL;
+
+      file = new file_map((uint64_t)size);
+      if (size == 0 || !file->access_data()) {
+        file = NULL;
+        return false;
+      }
+      memcpy(file->access_data(), text, size);
+      return parse();
+    }
+
+    /// The top level element, NULL if nothing is loaded.
+    element *get_root() const {
+      return root;
+    }
+
+    /// The number of elements in the file.
+    unsigned get_num_elements() const {
+      return elements.size();
+    }
+
+    /// Element by index, in document order.
+    element *get_element(unsigned i) {
+      return &elements[i];
+    }
+
+    /// Index of an element, from 0 to get_num_elements()-1 in document order.
+    unsigned get_index(const element *elem) const {
+      return (unsigned)(elem - elements.data());
+    }
+  };
+}}
@@ -6,352 +6,540 @@
 //
 //
 // zip deflate format decoder
-// 
+//
+// Huffman codes are decoded with a lookup table indexed by the next table_bits
+// of the bitstream. Longer codes go through a second level table.
+// Bits are read from a 64 bit buffer which is refilled a word at a time,
+// which is enough for a whole length/distance pair without another refill.
+//
+// The decoder can also stop when the output is full and carry on later
+// (see begin() and inflate()), which zip_file uses to stream large entries.
+//
 namespace octet { namespace loaders {
   class zip_decoder {
-    enum { debug = 1 };
+    enum {
+      lit_table_bits = 10,
+      dist_table_bits = 8,
+      len_table_bits = 7,
+
+      max_code_length = 15,
+      num_lit_symbols = 288,
+      num_dist_symbols = 32,
+
+      // table entries: bits 0-7 code length (or table bits for a link), bits 8-15 link sub-table bits, bits 16-31 symbol or link offset.
+      invalid_entry = 0xffff0000,
+    };
 
+    // a two level Huffman decoding table.
     struct huffman_table {
-      uint8_t min_lit_length;
-      uint8_t max_lit_length;
-      uint8_t min_dist_length;
-      uint8_t max_dist_length;
-
-      //uint8_t lit_lengths[288];
-      uint16_t lit_codes[288];
-      uint16_t lit_limits[18];
-      uint16_t lit_base[18];
-
-      //uint8_t dist_lengths[32];
-      uint16_t dist_codes[32];
-      uint16_t dist_limits[18];
-      uint16_t dist_base[18];
+      dynarray<uint32_t> entries;
+      unsigned table_bits;
     };
 
-    huffman_table fixed_;
-    huffman_table var_;
-
-    // on ARM we can do this faster with the "rev" instruction
-    inline static uint16_t rev16(uint16_t value) {
-      // small table version.
-      //static const uint8_t r16[] = { 0x0, 0x8, 0x4, 0xc, 0x2, 0xa, 0x6, 0xe, 0x1, 0x9, 0x5, 0xd, 0x3, 0xb, 0x7, 0xf };
-      //return r16[value&0x0f] * 0x1000 | r16[(value>>4)&0x0f] * 0x100 | r16[(value>>8)&0x0f] * 0x10 | r16[value>>12];
-
-      // this table is probably too big to be efficient. L1 cache misses are very expensive.
-      static const uint8_t r256[] = {
-        0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0, 
-        0x00+0x10, 0x80+0x10, 0x40+0x10, 0xc0+0x10, 0x20+0x10, 0xa0+0x10, 0x60+0x10, 0xe0+0x10, 
-        0x00+8, 0x80+8, 0x40+8, 0xc0+8, 0x20+8, 0xa0+8, 0x60+8, 0xe0+8, 
-        0x00+0x10+8, 0x80+0x10+8, 0x40+0x10+8, 0xc0+0x10+8, 0x20+0x10+8, 0xa0+0x10+8, 0x60+0x10+8, 0xe0+0x10+8, 
-        0x00+ 4, 0x80+ 4, 0x40+ 4, 0xc0+ 4, 0x20+ 4, 0xa0+ 4, 0x60+ 4, 0xe0+ 4, 
-        0x00+0x10+ 4, 0x80+0x10+ 4, 0x40+0x10+ 4, 0xc0+0x10+ 4, 0x20+0x10+ 4, 0xa0+0x10+ 4, 0x60+0x10+ 4, 0xe0+0x10+ 4, 
-        0x00+8+ 4, 0x80+8+ 4, 0x40+8+ 4, 0xc0+8+ 4, 0x20+8+ 4, 0xa0+8+ 4, 0x60+8+ 4, 0xe0+8+ 4, 
-        0x00+0x10+8+ 4, 0x80+0x10+8+ 4, 0x40+0x10+8+ 4, 0xc0+0x10+8+ 4, 0x20+0x10+8+ 4, 0xa0+0x10+8+ 4, 0x60+0x10+8+ 4, 0xe0+0x10+8+ 4, 
-        0x00+ 2, 0x80+ 2, 0x40+ 2, 0xc0+ 2, 0x20+ 2, 0xa0+ 2, 0x60+ 2, 0xe0+ 2, 
-        0x00+0x10+ 2, 0x80+0x10+ 2, 0x40+0x10+ 2, 0xc0+0x10+ 2, 0x20+0x10+ 2, 0xa0+0x10+ 2, 0x60+0x10+ 2, 0xe0+0x10+ 2, 
-        0x00+8+ 2, 0x80+8+ 2, 0x40+8+ 2, 0xc0+8+ 2, 0x20+8+ 2, 0xa0+8+ 2, 0x60+8+ 2, 0xe0+8+ 2, 
-        0x00+0x10+8+ 2, 0x80+0x10+8+ 2, 0x40+0x10+8+ 2, 0xc0+0x10+8+ 2, 0x20+0x10+8+ 2, 0xa0+0x10+8+ 2, 0x60+0x10+8+ 2, 0xe0+0x10+8+ 2, 
-        0x00+ 4+ 2, 0x80+ 4+ 2, 0x40+ 4+ 2, 0xc0+ 4+ 2, 0x20+ 4+ 2, 0xa0+ 4+ 2, 0x60+ 4+ 2, 0xe0+ 4+ 2, 
-        0x00+0x10+ 4+ 2, 0x80+0x10+ 4+ 2, 0x40+0x10+ 4+ 2, 0xc0+0x10+ 4+ 2, 0x20+0x10+ 4+ 2, 0xa0+0x10+ 4+ 2, 0x60+0x10+ 4+ 2, 0xe0+0x10+ 4+ 2, 
-        0x00+8+ 4+ 2, 0x80+8+ 4+ 2, 0x40+8+ 4+ 2, 0xc0+8+ 4+ 2, 0x20+8+ 4+ 2, 0xa0+8+ 4+ 2, 0x60+8+ 4+ 2, 0xe0+8+ 4+ 2, 
-        0x00+0x10+8+ 4+ 2, 0x80+0x10+8+ 4+ 2, 0x40+0x10+8+ 4+ 2, 0xc0+0x10+8+ 4+ 2, 0x20+0x10+8+ 4+ 2, 0xa0+0x10+8+ 4+ 2, 0x60+0x10+8+ 4+ 2, 0xe0+0x10+8+ 4+ 2, 
-        0x00+ 1, 0x80+ 1, 0x40+ 1, 0xc0+ 1, 0x20+ 1, 0xa0+ 1, 0x60+ 1, 0xe0+ 1, 
-        0x00+0x10+ 1, 0x80+0x10+ 1, 0x40+0x10+ 1, 0xc0+0x10+ 1, 0x20+0x10+ 1, 0xa0+0x10+ 1, 0x60+0x10+ 1, 0xe0+0x10+ 1, 
-        0x00+8+ 1, 0x80+8+ 1, 0x40+8+ 1, 0xc0+8+ 1, 0x20+8+ 1, 0xa0+8+ 1, 0x60+8+ 1, 0xe0+8+ 1, 
-        0x00+0x10+8+ 1, 0x80+0x10+8+ 1, 0x40+0x10+8+ 1, 0xc0+0x10+8+ 1, 0x20+0x10+8+ 1, 0xa0+0x10+8+ 1, 0x60+0x10+8+ 1, 0xe0+0x10+8+ 1, 
-        0x00+ 4+ 1, 0x80+ 4+ 1, 0x40+ 4+ 1, 0xc0+ 4+ 1, 0x20+ 4+ 1, 0xa0+ 4+ 1, 0x60+ 4+ 1, 0xe0+ 4+ 1, 
-        0x00+0x10+ 4+ 1, 0x80+0x10+ 4+ 1, 0x40+0x10+ 4+ 1, 0xc0+0x10+ 4+ 1, 0x20+0x10+ 4+ 1, 0xa0+0x10+ 4+ 1, 0x60+0x10+ 4+ 1, 0xe0+0x10+ 4+ 1, 
-        0x00+8+ 4+ 1, 0x80+8+ 4+ 1, 0x40+8+ 4+ 1, 0xc0+8+ 4+ 1, 0x20+8+ 4+ 1, 0xa0+8+ 4+ 1, 0x60+8+ 4+ 1, 0xe0+8+ 4+ 1, 
-        0x00+0x10+8+ 4+ 1, 0x80+0x10+8+ 4+ 1, 0x40+0x10+8+ 4+ 1, 0xc0+0x10+8+ 4+ 1, 0x20+0x10+8+ 4+ 1, 0xa0+0x10+8+ 4+ 1, 0x60+0x10+8+ 4+ 1, 0xe0+0x10+8+ 4+ 1, 
-        0x00+ 2+ 1, 0x80+ 2+ 1, 0x40+ 2+ 1, 0xc0+ 2+ 1, 0x20+ 2+ 1, 0xa0+ 2+ 1, 0x60+ 2+ 1, 0xe0+ 2+ 1, 
-        0x00+0x10+ 2+ 1, 0x80+0x10+ 2+ 1, 0x40+0x10+ 2+ 1, 0xc0+0x10+ 2+ 1, 0x20+0x10+ 2+ 1, 0xa0+0x10+ 2+ 1, 0x60+0x10+ 2+ 1, 0xe0+0x10+ 2+ 1, 
-        0x00+8+ 2+ 1, 0x80+8+ 2+ 1, 0x40+8+ 2+ 1, 0xc0+8+ 2+ 1, 0x20+8+ 2+ 1, 0xa0+8+ 2+ 1, 0x60+8+ 2+ 1, 0xe0+8+ 2+ 1, 
-        0x00+0x10+8+ 2+ 1, 0x80+0x10+8+ 2+ 1, 0x40+0x10+8+ 2+ 1, 0xc0+0x10+8+ 2+ 1, 0x20+0x10+8+ 2+ 1, 0xa0+0x10+8+ 2+ 1, 0x60+0x10+8+ 2+ 1, 0xe0+0x10+8+ 2+ 1, 
-        0x00+ 4+ 2+ 1, 0x80+ 4+ 2+ 1, 0x40+ 4+ 2+ 1, 0xc0+ 4+ 2+ 1, 0x20+ 4+ 2+ 1, 0xa0+ 4+ 2+ 1, 0x60+ 4+ 2+ 1, 0xe0+ 4+ 2+ 1, 
-        0x00+0x10+ 4+ 2+ 1, 0x80+0x10+ 4+ 2+ 1, 0x40+0x10+ 4+ 2+ 1, 0xc0+0x10+ 4+ 2+ 1, 0x20+0x10+ 4+ 2+ 1, 0xa0+0x10+ 4+ 2+ 1, 0x60+0x10+ 4+ 2+ 1, 0xe0+0x10+ 4+ 2+ 1, 
-        0x00+8+ 4+ 2+ 1, 0x80+8+ 4+ 2+ 1, 0x40+8+ 4+ 2+ 1, 0xc0+8+ 4+ 2+ 1, 0x20+8+ 4+ 2+ 1, 0xa0+8+ 4+ 2+ 1, 0x60+8+ 4+ 2+ 1, 0xe0+8+ 4+ 2+ 1, 
-        0x00+0x10+8+ 4+ 2+ 1, 0x80+0x10+8+ 4+ 2+ 1, 0x40+0x10+8+ 4+ 2+ 1, 0xc0+0x10+8+ 4+ 2+ 1, 0x20+0x10+8+ 4+ 2+ 1, 0xa0+0x10+8+ 4+ 2+ 1, 0x60+0x10+8+ 4+ 2+ 1, 0xe0+0x10+8+ 4+ 2+ 1, 
-      };
-      return r256[value&0xff] << 8 | r256[(value>>8)&0xff];
+    huffman_table fixed_lit_;
+    huffman_table fixed_dist_;
+    huffman_table var_lit_;
+    huffman_table var_dist_;
+    huffman_table len_table_;
+
+    // bit reader state
+    const uint8_t *src;
+    const uint8_t *src_max;
+    uint64_t bitbuf;
+    unsigned bitcount;
+
+    // number of zero bytes added past the end of the source.
+    unsigned overrun;
+
+    // start of the output, for checking distances.
+    uint8_t *dest_start;
+
+    // where we are in the stream when inflate() returns early.
+    enum state_t {
+      state_block,      // next is a block header
+      state_stored,     // copying an uncompressed block
+      state_huffman,    // decoding a compressed block
+      state_done,
+      state_error,
+    };
 
-      //value = ( ( value >> 1 ) & 0x5555 ) | ( ( value & 0x5555 ) << 1 );
-      //value = ( ( value >> 2 ) & 0x3333 ) | ( ( value & 0x3333 ) << 2 );
-      //value = ( ( value >> 4 ) & 0x0f0f ) | ( ( value & 0x0f0f ) << 4 );
-      //value = ( ( value >> 8 ) & 0x00ff ) | ( ( value & 0x00ff ) << 8 );
-      //return value;
+    state_t state;
+    bool is_last_block;
+    unsigned stored_left;
+    unsigned match_left;
+    unsigned match_distance;
+    const huffman_table *cur_lit;
+    const huffman_table *cur_dist;
+
+    // reverse the bottom "bits" bits of value. deflate codes are sent msb first in an lsb first stream.
+    static unsigned reverse_bits(unsigned value, unsigned bits) {
+      unsigned result = 0;
+      for (unsigned i = 0; i != bits; ++i) {
+        result = ( result << 1 ) | ( value & 1 );
+        value >>= 1;
+      }
+      return result;
     }
 
-    bool build_huffman(uint8_t *lengths, unsigned num_lengths, uint8_t &min_length, uint8_t &max_length, uint16_t *codes, uint16_t *limits, uint16_t *base) {
-      min_length = 16;
-      max_length = 0;
-      for (unsigned i = 0; i != num_lengths; ++i) {
-        if (debug) printf("%d,", lengths[i]);
-        if (lengths[i]) {
-          if (min_length > lengths[i]) min_length = lengths[i];
-          if (max_length < lengths[i]) max_length = lengths[i];
+    static uint64_t load_u64(const uint8_t *p) {
+      // note: this will have to be fixed on PPC and other big-endian devices
+      uint64_t value;
+      memcpy(&value, p, sizeof(value));
+      return value;
+    }
+
+    // make sure that there are at least 56 bits in the bit buffer.
+    void refill() {
+      if (src + 8 <= src_max) {
+        bitbuf |= load_u64(src) << bitcount;
+        src += (63 - bitcount) >> 3;
+        bitcount |= 56;
+      } else {
+        // near the end, read bytes and pad with zeros.
+        while (bitcount <= 56) {
+          uint64_t byte = 0;
+          if (src < src_max) {
+            byte = *src++;
+          } else {
+            overrun++;
+          }
+          bitbuf |= byte << bitcount;
+          bitcount += 8;
         }
       }
-      if (debug) printf("\n");
+    }
 
-      if (debug) printf("min_length=%d\n", min_length);
-      if (debug) printf("max_length=%d\n", max_length);
+    // true if we have used any of the padding bytes.
+    bool overrun_error() const {
+      return overrun * 8 > bitcount;
+    }
 
-      if ( min_length <= 0 || min_length > max_length || max_length > 16 ) {
-        return false;
+    unsigned get_bits(unsigned bits) {
+      unsigned value = (unsigned)bitbuf & ( (1u << bits) - 1 );
+      bitbuf >>= bits;
+      bitcount -= bits;
+      return value;
+    }
+
+    // give back whole bytes in the bit buffer so that src points to the next byte.
+    bool align_to_byte() {
+      get_bits(bitcount & 7);
+      unsigned bytes = bitcount >> 3;
+      if (bytes < overrun) return false;
+      src -= bytes - overrun;
+      bitbuf = 0;
+      bitcount = 0;
+      overrun = 0;
+      return true;
+    }
+
+    // build a two level decoding table from code lengths.
+    static bool build_huffman(huffman_table &table, const uint8_t *lengths, unsigned num_lengths, unsigned table_bits) {
+      unsigned count[max_code_length+1];
+      memset(count, 0, sizeof(count));
+      for (unsigned i = 0; i != num_lengths; ++i) {
+        if (lengths[i] > max_code_length) return false;
+        count[lengths[i]]++;
       }
+      count[0] = 0;
 
+      // canonical codes: first code of each length. reject over-subscribed codes.
+      unsigned next_code[max_code_length+2];
       unsigned code = 0;
-      unsigned huffcode = 0;
-      for (unsigned length = min_length; length <= max_length; ++length) {
-        base[length-min_length] = huffcode - code;
-        for (unsigned i = 0; i != num_lengths; ++i) {
-          if (lengths[i] == length) {
-            codes[code++] = i;
-            //dump_bits(huffcode << (16-length), 16, "huffcode");
-            huffcode++;
+      int left = 1;
+      for (unsigned len = 1; len <= max_code_length; ++len) {
+        code = ( code + count[len-1] ) << 1;
+        next_code[len] = code;
+        left = ( left << 1 ) - (int)count[len];
+        if (left < 0) return false;
+      }
+
+      unsigned table_size = 1u << table_bits;
+      table.table_bits = table_bits;
+      table.entries.resize(table_size);
+      uint32_t *entries = table.entries.data();
+      for (unsigned i = 0; i != table_size; ++i) entries[i] = invalid_entry;
+
+      // first pass: direct entries, and the longest code for each long prefix.
+      unsigned codes[num_lit_symbols];
+      uint8_t sub_bits[1 << lit_table_bits];
+      memset(sub_bits, 0, table_size);
+      for (unsigned sym = 0; sym != num_lengths; ++sym) {
+        unsigned len = lengths[sym];
+        if (!len) continue;
+        unsigned rev = reverse_bits(next_code[len]++, len);
+        codes[sym] = rev;
+        if (len <= table_bits) {
+          uint32_t entry = ( sym << 16 ) | len;
+          for (unsigned i = rev; i < table_size; i += 1u << len) {
+            entries[i] = entry;
           }
+        } else {
+          unsigned prefix = rev & ( table_size - 1 );
+          if (len - table_bits > sub_bits[prefix]) sub_bits[prefix] = (uint8_t)( len - table_bits );
         }
-        limits[length-min_length] = (uint16_t)( ( huffcode << (16-length) ) - 1 );
-        if (debug) printf("length %d: lim=%04x base=%04x\n", length, ( huffcode << (16-length) ) - 1, base[length-min_length]);
-        if (( huffcode << (16-length) ) - 1 > 0xffff) {
-          if (debug) printf("invalid huffman table\n");
-          return false;
-        }
-        huffcode *= 2;
       }
 
-      // prevent escape from bitstream decoding loop.
-      limits[max_length+1-min_length] = 0xffff;
+      // allocate the second level tables after the first.
+      for (unsigned prefix = 0; prefix != table_size; ++prefix) {
+        if (!sub_bits[prefix]) continue;
+        unsigned offset = table.entries.size();
+        unsigned size = 1u << sub_bits[prefix];
+        table.entries.resize(offset + size);
+        entries = table.entries.data();
+        for (unsigned i = 0; i != size; ++i) entries[offset + i] = invalid_entry;
+        entries[prefix] = ( offset << 16 ) | ( sub_bits[prefix] << 8 ) | table_bits;
+      }
+
+      // second pass: fill the second level tables.
+      for (unsigned sym = 0; sym != num_lengths; ++sym) {
+        unsigned len = lengths[sym];
+        if (len <= table_bits) continue;
+        unsigned rev = codes[sym];
+        uint32_t link = entries[rev & ( table_size - 1 )];
+        unsigned offset = link >> 16;
+        unsigned bits = ( link >> 8 ) & 0xff;
+        unsigned sub_len = len - table_bits;
+        uint32_t entry = ( sym << 16 ) | len;
+        for (unsigned i = rev >> table_bits; i < ( 1u << bits ); i += 1u << sub_len) {
+          entries[offset + i] = entry;
+        }
+      }
       return true;
     }
 
-    /// debug function for dumping bit fields
-    void dump_bits(unsigned value, unsigned bits, const char *name) {
-      char tmp[64];
-      assert(bits<63);
-      for (unsigned i = 0; i != bits; ++i) tmp[i] = ( ( value >> (bits-1-i) ) & 1 ) + '0';
-      tmp[bits] = 0;
-      printf("[%s] %s\n", tmp, name);
+    // decode one symbol. There must be at least max_code_length bits in the buffer.
+    // returns 0xffff for invalid codes.
+    unsigned decode_symbol(const huffman_table &table) {
+      const uint32_t *entries = table.entries.data();
+      uint32_t entry = entries[bitbuf & ( ( 1u << table.table_bits ) - 1 )];
+      if (entry & 0xff00) {
+        unsigned bits = ( entry >> 8 ) & 0xff;
+        unsigned index = (unsigned)( bitbuf >> table.table_bits ) & ( ( 1u << bits ) - 1 );
+        entry = entries[( entry >> 16 ) + index];
+      }
+      unsigned len = entry & 0xff;
+      bitbuf >>= len;
+      bitcount -= len;
+      return entry >> 16;
     }
 
-    /// peek a fixed number of little-endian bits from the bitstream
-    /// note: this will have to be fixed on PPC and other big-endian devices
-    unsigned peek(const uint8_t *src, unsigned bitptr, unsigned bits, const char *name) {
-      unsigned i = bitptr >> 3, j = bitptr & 7;
-      unsigned value = ( (unsigned&)src[i] >> j ) & ( (1u << bits) - 1 );
-      if (name) dump_bits(value, bits, name);
-      return value;
+    // read the header of an uncompressed block.
+    bool begin_uncompressed() {
+      if (!align_to_byte()) return false;
+      if (src + 4 > src_max) return false;
+      unsigned bytes_to_copy = src[0] | ( src[1] << 8 );
+      unsigned clength = src[2] | ( src[3] << 8 );
+      src += 4;
+
+      if (bytes_to_copy != (clength^0xffff)) return false;
+      if (bytes_to_copy > (size_t)(src_max - src)) return false;
+      stored_left = bytes_to_copy;
+      state = state_stored;
+      return true;
     }
 
-    unsigned decode_uncompressed(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) {
-      bitptr = ( bitptr + 7 ) & ~7;
-      unsigned bytes_to_copy = peek(src, bitptr, 16, "bytes_to_copy");
-      unsigned clength = peek(src, bitptr + 16, 16, "store length check");
-      bitptr += 32;
-
-      if (bytes_to_copy != (clength^0xffff)) return ~0;
-      if (dest + bytes_to_copy > dest_max) return ~0;
-      if ((src + bitptr/8) + bytes_to_copy > src_max) return ~0;
-
-      memcpy(dest, src + bitptr/8, bytes_to_copy);
+    // copy as much of an uncompressed block as will fit.
+    void decode_uncompressed(uint8_t *&dest, uint8_t *dest_max) {
+      unsigned bytes_to_copy = stored_left;
+      if (bytes_to_copy > (size_t)(dest_max - dest)) bytes_to_copy = (unsigned)(dest_max - dest);
+      memcpy(dest, src, bytes_to_copy);
       dest += bytes_to_copy;
-      bitptr += bytes_to_copy * 8;
-      return bitptr;
+      src += bytes_to_copy;
+      stored_left -= bytes_to_copy;
+      if (!stored_left) state = state_block;
     }
 
-    unsigned decode_lz77(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr, huffman_table *table_) {
+    // copy a match. Matches may overlap the bytes they are copying.
+    static void copy_match(uint8_t *dest, unsigned distance, unsigned length, uint8_t *dest_max) {
+      const uint8_t *from = dest - distance;
+      uint8_t *end = dest + length;
+      if (distance >= 8 && end + 8 <= dest_max) {
+        // eight bytes at a time. We may write up to seven bytes past the end of the match,
+        // but they will be overwritten by the next symbol.
+        do {
+          uint64_t word;
+          memcpy(&word, from, 8);
+          memcpy(dest, &word, 8);
+          dest += 8;
+          from += 8;
+        } while (dest < end);
+      } else if (distance == 1) {
+        memset(dest, *from, length);
+      } else {
+        while (dest != end) {
+          *dest++ = *from++;
+        }
+      }
+    }
+
+    // decode a compressed block until the end of block code or the output is full.
+    bool decode_lz77(uint8_t *&dest, uint8_t *dest_max, const huffman_table &lit, const huffman_table &dist) {
+      static const uint8_t len_extra[] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+      };
+      static const uint16_t len_base[] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+      };
+      static const uint8_t dist_extra[] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+      };
+      static const uint16_t dist_base[] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+      };
+
+      // finish a match that did not fit last time.
+      if (match_left) {
+        unsigned length = match_left;
+        if (length > (size_t)(dest_max - dest)) length = (unsigned)(dest_max - dest);
+        copy_match(dest, match_distance, length, dest_max);
+        dest += length;
+        match_left -= length;
+        if (match_left) return true;
+      }
+
       for(;;) {
-        if (src + bitptr/8 > src_max) return ~0;
-        unsigned peek16 = peek(src, bitptr, 16, NULL);
-        unsigned value = rev16(peek16);
-        unsigned index = 0;
-        while (value > table_->lit_limits[index]) {
-          index++;
+        if (dest == dest_max) {
+          // the rest of the last match goes first on the next call.
+          if (match_left) return true;
+
+          // the output is full, but the block may end here.
+          if (bitcount < 48) refill();
+          uint64_t old_bitbuf = bitbuf;
+          unsigned old_bitcount = bitcount;
+          if (decode_symbol(lit) == 256) {
+            state = state_block;
+          } else {
+            bitbuf = old_bitbuf;
+            bitcount = old_bitcount;
+          }
+          return true;
+        }
+
+        // 48 bits is enough for a literal/length code, its extra bits, a distance code and its extra bits.
+        if (bitcount < 48) {
+          refill();
+          if (overrun_error()) return false;
         }
-        unsigned length = table_->min_lit_length + index;
-        unsigned offset = ( value >> ( 16 - length ) );
-        unsigned code = table_->lit_codes[offset - table_->lit_base[index]];
-        bitptr += length;
-        if (debug) dump_bits(peek16, length, "code");
 
+        unsigned code = decode_symbol(lit);
         if (code < 256) {
-          if (dest+1 > dest_max) return ~0;
-          *dest++ = code;
-          if (debug) printf("%02x\n", code);
+          *dest++ = (uint8_t)code;
         } else if (code == 256) {
-          return bitptr;
+          state = state_block;
+          return true;
         } else {
-          unsigned block_length;
-          unsigned distance;
-          {
-            if (debug) printf("[%d]\n", code);
-            static const uint8_t extra[] = {
-              0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
-            };
-            static const uint8_t base[] = {
-              3-3, 4-3, 5-3, 6-3, 7-3, 8-3, 9-3, 10-3,
-              11-3, 13-3, 15-3, 17-3, 19-3, 23-3, 27-3, 31-3,
-              35-3, 43-3, 51-3, 59-3, 67-3, 83-3, 99-3, 115-3,
-              131-3, 163-3, 195-3, 227-3, 258-3,
-            };
-            if (code-257 > sizeof(extra)) return ~0;
-            unsigned extra_length = extra[ code-257 ];
-            block_length = base[ code-257 ] + 3 + peek(src, bitptr, extra_length, "extra");
-            bitptr += extra_length;
-          }
-          {
-            //if (src + (bitptr + table_->max_dist_length)/8 > src_max ) return ~0;
-            unsigned peek16 = peek(src, bitptr, 16, NULL);
-            unsigned value = rev16(peek16);
-            unsigned index = 0;
-            while (value > table_->dist_limits[index]) {
-              index++;
-            }
-            unsigned length = table_->min_dist_length + index;
-            unsigned offset = ( value >> ( 16 - length ) );
-            unsigned code = table_->dist_codes[offset - table_->dist_base[index]];
-            bitptr += length;
-
-            if (debug) printf("{%d}\n", code);
-            static const uint8_t extra[] = {
-              0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13, 0, 0, 0,
-            };
-            static const uint16_t base[] = {
-              1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
-            };
-            if (code > sizeof(extra)) return ~0;
-            unsigned extra_length = extra[ code ];
-            distance = base[ code ] + peek(src, bitptr, extra_length, "extra");
-            bitptr += extra_length;
+          code -= 257;
+          if (code >= sizeof(len_base)/sizeof(len_base[0])) return false;
+          unsigned length = len_base[code] + get_bits(len_extra[code]);
+
+          unsigned dcode = decode_symbol(dist);
+          if (dcode >= sizeof(dist_base)/sizeof(dist_base[0])) return false;
+          unsigned distance = dist_base[dcode] + get_bits(dist_extra[dcode]);
+
+          if (distance > (size_t)(dest - dest_start)) return false;
+          if (length > (size_t)(dest_max - dest)) {
+            // out of room: copy what fits and keep the rest for the next call.
+            match_left = length - (unsigned)(dest_max - dest);
+            match_distance = distance;
+            length = (unsigned)(dest_max - dest);
           }
 
-          if (debug) printf("length=%d distance=%d\n", block_length, distance);
-
-          if (dest+block_length > dest_max) return ~0;
-
-          for(unsigned i = 0; i != block_length; ++i) {
-            dest[0] = dest[-(int)distance];
-            dest++;
-          }
+          copy_match(dest, distance, length, dest_max);
+          dest += length;
         }
       }
     }
 
-    unsigned decode_fixed(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) {
-      return decode_lz77(dest, dest_max, src, src_max, bitptr, &fixed_);
-    }
-
-    unsigned decode_variable(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) {
-      unsigned num_lit_codes = peek(src, bitptr, 5, "num_lit_codes") + 257;
-      unsigned num_dist_codes = peek(src, bitptr+5, 5, "num_dist_codes") + 1;
-      unsigned num_length_codes = peek(src, bitptr+10, 4, "num_length_codes") + 4;
-      
-      bitptr += 14;
-
-      uint8_t lengths[288 + 32];
-      memset(lengths, 0, 20);
-      if (src + bitptr/8 + num_length_codes > src_max ) return ~0;
+    // read the code lengths of a compressed block with its own Huffman codes.
+    bool begin_variable() {
+      refill();
+      unsigned num_lit_codes = get_bits(5) + 257;
+      unsigned num_dist_codes = get_bits(5) + 1;
+      unsigned num_length_codes = get_bits(4) + 4;
+      if (num_lit_codes > 286 || num_dist_codes > 30) return false;
+
+      uint8_t lengths[num_lit_symbols + num_dist_symbols];
+      memset(lengths, 0, 19);
+      static const uint8_t order[] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
       for (unsigned i = 0; i != num_length_codes; ++i) {
-        static const uint8_t order[] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
-        lengths[order[i]] = peek(src, bitptr, 3, "length code lenghs");
-        bitptr += 3;
+        // up to 57 bits, one more than refill() guarantees.
+        if (bitcount < 3) refill();
+        lengths[order[i]] = (uint8_t)get_bits(3);
       }
-      
-      uint16_t codes[19];
-      uint16_t limits[18];
-      uint16_t base[18];
-      uint8_t min_length;
-      uint8_t max_length;
-      if (!build_huffman(lengths, 19, min_length, max_length, codes, limits, base)) return ~0;
-      
+
+      if (!build_huffman(len_table_, lengths, 19, len_table_bits)) return false;
+
       unsigned todo = num_lit_codes + num_dist_codes;
       for(unsigned done = 0; done < todo;) {
-        if (src + bitptr/8 + max_length > src_max ) return ~0;
-        unsigned peek16 = peek(src, bitptr, 16, NULL);
-        unsigned value = rev16(peek16);
-        unsigned index = 0;
-        while (value > limits[index]) {
-          index++;
-        }
-        unsigned length = min_length + index;
-        unsigned offset = ( value >> ( 16 - length ) );
-        unsigned code = codes[offset - base[index]];
-        bitptr += length;
-        if (debug) dump_bits(peek16, length, "length");
-        //fprintf(source_.debug(), "code=%03x\n", code);
+        refill();
+        if (overrun_error()) return false;
+        unsigned code = decode_symbol(len_table_);
         unsigned copy = 1;
         if (code < 16) {
         } else if(code == 16) {
-          if (src + (bitptr+2)/8 > src_max ) return ~0;
-          copy = peek(src, bitptr, 2, NULL) + 3;
-          bitptr += 2;
-          if (done == 0) return ~0;
+          if (done == 0) return false;
+          copy = get_bits(2) + 3;
           code = lengths[ done-1 ];
         } else if(code == 17) {
-          if (src + (bitptr+3)/8 > src_max ) return ~0;
-          copy = peek(src, bitptr, 3, NULL) + 3;
-          bitptr += 3;
+          copy = get_bits(3) + 3;
           code = 0;
         } else if(code == 18) {
-          if (src + (bitptr+7)/8 > src_max ) return ~0;
-          copy = peek(src, bitptr, 7, NULL) + 11;
-          bitptr += 7;
+          copy = get_bits(7) + 11;
           code = 0;
         } else {
-          return ~0;
+          return false;
         }
-        if (done + copy > todo) return ~0;
-        do {
-          lengths[done++] = code;
-        } while( --copy );
+        if (done + copy > todo) return false;
+        memset(lengths + done, code, copy);
+        done += copy;
       }
 
-      if (debug) printf("lengths done\n");
+      // the end of block code must be present.
+      if (!lengths[256]) return false;
 
       if(
-        !build_huffman(lengths, num_lit_codes, var_.min_lit_length, var_.max_lit_length, var_.lit_codes, var_.lit_limits, var_.lit_base) ||
-        !build_huffman(lengths+num_lit_codes, num_dist_codes, var_.min_dist_length, var_.max_dist_length, var_.dist_codes, var_.dist_limits, var_.dist_base)
+        !build_huffman(var_lit_, lengths, num_lit_codes, lit_table_bits) ||
+        !build_huffman(var_dist_, lengths+num_lit_codes, num_dist_codes, dist_table_bits)
       ) {
-        return ~0;
+        return false;
       }
-      return decode_lz77(dest, dest_max, src, src_max, bitptr, &var_);
+      cur_lit = &var_lit_;
+      cur_dist = &var_dist_;
+      state = state_huffman;
+      return true;
     }
   public:
     zip_decoder() {
-      uint8_t lit_lengths[288];
-      uint8_t dist_lengths[32];
+      uint8_t lit_lengths[num_lit_symbols];
+      uint8_t dist_lengths[num_dist_symbols];
       memset(lit_lengths +   0, 8, 144 - 0);
       memset(lit_lengths + 144, 9, 256-144);
       memset(lit_lengths + 256, 7, 280-256);
       memset(lit_lengths + 280, 8, 288-280);
       memset(dist_lengths, 5, 32);
-      build_huffman(lit_lengths, 288, fixed_.min_lit_length, fixed_.max_lit_length, fixed_.lit_codes, fixed_.lit_limits, fixed_.lit_base);
-      build_huffman(dist_lengths, 32, fixed_.min_dist_length, fixed_.max_dist_length, fixed_.dist_codes, fixed_.dist_limits, fixed_.dist_base);
+      build_huffman(fixed_lit_, lit_lengths, num_lit_symbols, lit_table_bits);
+      build_huffman(fixed_dist_, dist_lengths, num_dist_symbols, dist_table_bits);
+
+      begin(0, 0);
     }
 
-    void decode(uint8_t *dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max) {
-      unsigned bitptr = 0;
-      unsigned is_last_block;
-
-      // for each "deflate" block:
-      do {
-        // prevent (bitptr / 8) from overflowing (>512Mib)
-        src += bitptr / 8;
-        bitptr %= 8;
-
-        // three bits determine kind and exit condition
-        is_last_block = peek(src, bitptr, 1, "deflate last") != 0;
-        unsigned kind = peek(src, bitptr + 1, 2, "deflate kind");
-
-        bitptr += 3;
-        switch (kind) {
-        case 0: bitptr = decode_uncompressed(dest, dest_max, src, src_max, bitptr); break;
-        case 1: bitptr = decode_fixed(dest, dest_max, src, src_max, bitptr); break;
-        case 2: bitptr = decode_variable(dest, dest_max, src, src_max, bitptr); break;
-        default: return;
+    /// Start decoding a raw deflate stream in [src, src_max).
+    /// The source must stay valid until the stream is decoded.
+    void begin(const uint8_t *src_, const uint8_t *src_max_) {
+      src = src_;
+      src_max = src_max_;
+      bitbuf = 0;
+      bitcount = 0;
+      overrun = 0;
+      dest_start = 0;
+      state = state_block;
+      is_last_block = false;
+      stored_left = 0;
+      match_left = 0;
+      match_distance = 0;
+      cur_lit = cur_dist = 0;
+    }
+
+    /// Decode more of the stream into [dest, dest_max), advancing dest.
+    /// window is the start of the output still in memory: matches may refer back to it,
+    /// so keep at least 32k bytes of history between calls.
+    /// returns false if the stream is corrupt.
+    bool inflate(uint8_t *window, uint8_t *&dest, uint8_t *dest_max) {
+      dest_start = window;
+      for (;;) {
+        switch (state) {
+          case state_block: {
+            if (is_last_block) {
+              state = overrun_error() ? state_error : state_done;
+              break;
+            }
+
+            // three bits determine kind and exit condition
+            refill();
+            is_last_block = get_bits(1) != 0;
+            unsigned kind = get_bits(2);
+            bool ok = false;
+            switch (kind) {
+              case 0: ok = begin_uncompressed(); break;
+              case 1: ok = true; cur_lit = &fixed_lit_; cur_dist = &fixed_dist_; state = state_huffman; break;
+              case 2: ok = begin_variable(); break;
+            }
+            if (!ok) state = state_error;
+          } break;
+          case state_stored: {
+            decode_uncompressed(dest, dest_max);
+            if (state == state_stored) return true;
+          } break;
+          case state_huffman: {
+            if (!decode_lz77(dest, dest_max, *cur_lit, *cur_dist)) {
+              state = state_error;
+            } else if (state == state_huffman) {
+              return true;
+            }
+          } break;
+          case state_done: return true;
+          default: return false;
         }
-      } while( !is_last_block && bitptr != ~0);
+      }
+    }
+
+    /// true when the last block has been decoded.
+    bool is_done() const {
+      return state == state_done;
+    }
+
+    /// Inflate a raw deflate stream from [src, src_max) to [dest, dest_max).
+    /// returns false if the stream is corrupt or the output does not fit.
+    bool decode(uint8_t *dest, uint8_t *dest_max, const uint8_t *src_, const uint8_t *src_max_) {
+      begin(src_, src_max_);
+      return inflate(dest, dest, dest_max) && is_done();
     }
   };
-}}
 
+  #if OCTET_UNIT_TEST
+    class zip_decoder_unit_test {
+    public:
+      zip_decoder_unit_test() {
+        zip_decoder decoder;
+
+        // a fixed block of five 9 bit literals then a dynamic block with all 19 code length codes.
+        // this needs 57 bits of code lengths at a bit position where refill() only gives 56.
+        static const uint8_t dynamic[] = {
+          0x3a, 0x71, 0xe2, 0xc4, 0x89, 0x13, 0x80, 0x02, 0xf0, 0x24, 0x49, 0x92,
+          0x24, 0xc9, 0xb6, 0x6d, 0xc7, 0xba, 0xe6, 0x3f, 0x89, 0xb5, 0x00, 0x02,
+        };
+        uint8_t out[16];
+        assert(decoder.decode(out, out + 13, dynamic, dynamic + sizeof(dynamic)));
+        assert(!memcmp(out, "\xc8\xc8\xc8\xc8\xc8" "aaaaaaaa", 13));
+
+        // "abc" * 100: three literals and two long matches.
+        // decode it a few bytes at a time so that the matches are split between calls.
+        static const uint8_t abc[] = { 0x4b, 0x4c, 0x4a, 0x4e, 0x1c, 0x45, 0xc4, 0x21, 0x00 };
+        uint8_t text[300];
+        for (unsigned chunk = 1; chunk <= 64; ++chunk) {
+          memset(text, 0, sizeof(text));
+          decoder.begin(abc, abc + sizeof(abc));
+          uint8_t *dest = text;
+          while (!decoder.is_done()) {
+            uint8_t *dest_max = dest + chunk < text + sizeof(text) ? dest + chunk : text + sizeof(text);
+            uint8_t *old_dest = dest;
+            if (!decoder.inflate(text, dest, dest_max) || dest == old_dest) break;
+          }
+          assert(decoder.is_done() && dest == text + sizeof(text));
+          for (unsigned i = 0; i != sizeof(text); ++i) {
+            assert(text[i] == "abc"[i % 3]);
+          }
+        }
+
+        // corrupt streams must fail, not crash.
+        uint8_t bad[sizeof(dynamic)];
+        memcpy(bad, dynamic, sizeof(bad));
+        bad[10] ^= 0xff;
+        assert(!decoder.decode(out, out + 13, bad, bad + sizeof(bad)));
+      }
+    };
+    static zip_decoder_unit_test zip_decoder_unit_test;
+  #endif
+}}
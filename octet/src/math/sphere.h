@@ -38,9 +38,14 @@ namespace octet { namespace math {
       return aabb(center, vec3(radius));
     }
 
-    // get transformed sphere assuming mat is orthonormal.
+    // get transformed sphere. With a non-uniform scale, the radius grows to fit the largest axis.
     sphere get_transform(const mat4t &mat) const {
-      return sphere(get_center(), get_radius());
+      float sx = squared(mat.x().xyz());
+      float sy = squared(mat.y().xyz());
+      float sz = squared(mat.z().xyz());
+      float smax = sx > sy ? sx : sy;
+      smax = smax > sz ? smax : sz;
+      return sphere((get_center().xyz1() * mat).xyz(), get_radius() * sqrtf(smax));
     }
 
     const char *toString(char *dest, size_t len) const {
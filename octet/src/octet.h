@@ -99,6 +99,10 @@
   // data storage in containers
   #include "containers/containers.h"
 
+  // worker threads and jobs (the platform runs main thread jobs every frame)
+  #include "resources/job.h"
+  #include "resources/stream_queue.h"
+
   // target specific support: Windows, Mac, Linux, PS Vita
   #include "platform/machine_specific.h"
   #include "platform/args_parser.h"
@@ -148,7 +152,10 @@
   #include "helpers/helper_fps_controller.h"
 
   // asset loaders
+  #include "loaders/number_parser.h"
+  #include "loaders/xml_reader.h"
   #include "loaders/collada_builder.h"
+  #include "loaders/obj_loader.h"
 
   // forward references
   #include "resources/resources.inl"
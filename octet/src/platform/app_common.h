@@ -22,6 +22,7 @@ namespace octet {
     attribute_blendindices = 7,
     attribute_texcoord = 8,
     attribute_uv = 8,
+    attribute_instance = 9, // per-instance mat4, uses 9..12
     attribute_tangent = 14,
     attribute_bitangent = 15,
     attribute_binormal = 15,
@@ -81,8 +82,8 @@ namespace octet {
     bool is_gles3;
     video_capture video_capture_;
 
-    // queue of files to load
-    dynarray<string> load_queue;
+    // queue of files to load in the background. Dropped files are added here.
+    stream_queue load_queue;
 
   public:
     app_common() {
@@ -99,6 +100,9 @@ namespace octet {
     }
 
     void begin_frame() {
+      // start new loads and finish off any that need the GL context, eg. texture uploads.
+      load_queue.update();
+
       //char buf[256+5];
       //printf("p %s\n", prev_keys.toString(buf, sizeof(buf)));
       //printf("k %s\n\n", keys.toString(buf, sizeof(buf)));
@@ -168,7 +172,8 @@ namespace octet {
       frame_number++;
     }
 
-    dynarray<string> &access_load_queue() {
+    /// queue for streaming assets. Files dropped on the window appear in get_finished().
+    stream_queue &access_load_queue() {
       return load_queue;
     }
 
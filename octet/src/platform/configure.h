@@ -36,6 +36,25 @@
   #define GL_UNIFORM_BUFFER 0
 #endif
 
+// hardware instancing needs glDrawElementsInstanced and glVertexAttribDivisor (GL3.3/ES3).
+// The OSX legacy context and ES2 devices draw instances one at a time.
+#ifndef OCTET_INSTANCING
+  #if OCTET_MAC || defined(__APPLE__) || defined(OCTET_GLES2) || defined(OCTET_VITA)
+    #define OCTET_INSTANCING 0
+  #else
+    #define OCTET_INSTANCING 1
+  #endif
+#endif
+
+// vertex array objects (GL3/ES3). The same platforms fall back to glVertexAttribPointer per draw.
+#ifndef OCTET_VAO
+  #if OCTET_MAC || defined(__APPLE__) || defined(OCTET_GLES2) || defined(OCTET_VITA)
+    #define OCTET_VAO 0
+  #else
+    #define OCTET_VAO 1
+  #endif
+#endif
+
 // use <> to include from standard directories
 // use "" to include from our own project
 #include <stdio.h>
@@ -44,6 +63,7 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <math.h>
+#include <float.h>
 #include <assert.h>
 #include <string>
 #include <vector>
@@ -51,14 +71,33 @@
 #include <deque>
 #include <queue>
 #include <algorithm>
+#include <utility>
+#include <type_traits>
 #include <numeric>
 #include <iostream>
 #include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
 
 #if defined(WIN32)
   #include <direct.h>
 #endif
 
+// thread local storage for plain data (used by the job scheduler and the pool allocators).
+#ifdef WIN32
+  #define OCTET_THREAD_LOCAL __declspec(thread)
+#else
+  #define OCTET_THREAD_LOCAL __thread
+#endif
+
+// SSE2 intrinsics for the image decoders.
+#if OCTET_SSE
+  #include <emmintrin.h>
+#endif
+
 namespace octet {
   /// write some text to log.txt
   inline static FILE * log(const char *fmt, ...) {
@@ -277,12 +277,13 @@ namespace octet {
     }
 
     static void handle_file_drop(app *app, HDROP drop) {
-      dynarray<string> &queue = app->access_load_queue();
+      stream_queue &queue = app->access_load_queue();
       unsigned num_files = DragQueryFileW(drop, 0xFFFFFFFF, 0, 0);
       for (unsigned i = 0; i != num_files; ++i) {
         TCHAR utf16_filename[MAX_PATH];
         DragQueryFile(drop, i, utf16_filename, sizeof(utf16_filename));
-        queue.push_back(utf16_filename);
+        // retain the request so that the app can collect it with get_finished()
+        queue.add(new stream_request(string(utf16_filename)), true);
       }
       DragFinish(drop);
     }
@@ -51,15 +51,39 @@ namespace octet { namespace resources {
 
     /// open a zip file for a given URL
     static zip_file *get_zip_file(const char *url) {
+      // assets are loaded on worker threads, so guard the cache.
+      static std::mutex lock;
       static dictionary<ref<zip_file> > zip_files;
+      std::lock_guard<std::mutex> guard(lock);
       int index = zip_files.get_index(url);
       if (index == -1) {
-        return zip_files[url] = new zip_file(get_path(url));
+        string path;
+        return zip_files[url] = new zip_file(get_path(path, url));
       } else {
         return zip_files.get_value(index);
       }
     }
   
+    /// Split a url like zip://assets/pack.zip/file.dae into an open zip file and a name in the archive.
+    static zip_file *get_zip_url(const char *url, const char *&file) {
+      const char *zip = strstr(url + 6, ".zip");
+      if (!zip) return NULL;
+      int path_len = (int)(zip - (url + 6) + 4);
+      string zip_url;
+      zip_url.set(url + 6, path_len);
+      file = (url + 6) + path_len;
+      file += file[0] == '/';
+      return get_zip_file(zip_url.c_str());
+    }
+
+    /// Open a file in a zip archive for sequential reading, given a zip:// URL.
+    /// Only the parts that are read are decompressed. Returns NULL if the file can't be found.
+    static zip_stream *open_zip_stream(const char *url) {
+      const char *file = 0;
+      zip_file *zip = strncmp(url, "zip://", 6) ? NULL : get_zip_url(url, file);
+      return zip ? zip->open_stream(file) : NULL;
+    }
+
     /// utility function to set rgb values in a buffer.
     static void setrgb(dynarray<unsigned char> &buffer, int size, int x, int y, unsigned rgb, unsigned a = 0xff) {
       buffer[(y*size+x)*4+0] = rgb >> 16;
@@ -69,12 +93,18 @@ namespace octet { namespace resources {
     }
   
     /// Convert a url into a file path.
+    /// Note: the result is overwritten by the next call, use get_path(path, url) on worker threads.
     static const char *get_path(const char *url) {
+      static string path;
+      return get_path(path, url);
+    }
+
+    /// Convert a url into a file path, stored in path.
+    static const char *get_path(string &path, const char *url) {
       if (url == NULL) return "";
 
       string url_str;
       url_str.urldecode(url);
-      static string path;
 
       if (url[0] == '/' || (url[0] >= 'A' && url[0] <= 'Z' && url[1] == ':')) {
         path = url_str;
@@ -85,35 +115,61 @@ namespace octet { namespace resources {
       return path;
     }
 
-    /// Get a file into a buffer, given a URL.
-    static void get_url(dynarray<unsigned char> &buffer, const char *url) {
+    /// Map a file into memory, given a URL. Returns NULL if the file can't be found.
+    /// The result is reference counted, hold it in a ref<file_map>.
+    /// Plain files are paged in on demand and are not copied.
+    /// Use file_map::mode_copy_on_write for a private, writable map with a zero byte after the end,
+    /// for parsers that tokenize in place.
+    static file_map *map_url(const char *url, file_map::mode_t mode = file_map::mode_read) {
       if (!strncmp(url, "zip://", 6)) {
-        const char *zip = strstr(url + 6, ".zip");
-        if (zip) {
-          int path_len = (int)(zip - (url + 6) + 4);
-          string zip_url;
-          zip_url.set(url + 6, path_len);
-          const char *file = (url + 6) + path_len;
-          file += file[0] == '/';
-          zip_file *zip = get_zip_file(zip_url.c_str());
-          zip->get_file(buffer, file);
+        // stored entries are views of the archive, compressed ones are inflated.
+        const char *file = 0;
+        zip_file *zip = get_zip_url(url, file);
+        file_map *result = zip ? zip->map_file(file) : NULL;
+        if (result && mode != file_map::mode_read && !result->access_data()) {
+          // a stored entry is a read only view, copy it.
+          ref<file_map> view = result;
+          result = new file_map(view->get_size());
+          if (view->get_size()) memcpy(result->access_data(), view->get_data(), (size_t)view->get_size());
         }
+        return result;
       } else if (!strncmp(url, "http://", 7)) {
-        // http
+        dynarray<unsigned char> buffer;
+        get_url(buffer, url);
+        if (buffer.size() == 0) return NULL;
+        file_map *result = new file_map((uint64_t)buffer.size());
+        memcpy(result->access_data(), buffer.data(), buffer.size());
+        return result;
       } else {
-        const char *path = get_path(url);
-        FILE *file = fopen(path, "rb");
-        if (!file) {
+        string path_str;
+        const char *path = get_path(path_str, url);
+        file_map *result = new file_map(path, mode);
+        if (result->get_error()) {
           char tmp[1024];
           printf("file %s not found. cwd=%s\n", path, getcwd(tmp, sizeof(tmp)));
-        } else {
-          fseek(file, 0, SEEK_END);
-          unsigned size = (unsigned)ftell(file);
+          delete result;
+          return NULL;
+        }
+        return result;
+      }
+    }
+
+    /// Get a file into a buffer, given a URL.
+    static void get_url(dynarray<unsigned char> &buffer, const char *url) {
+      if (!strncmp(url, "zip://", 6)) {
+        const char *file = 0;
+        zip_file *zip = get_zip_url(url, file);
+        if (zip) zip->get_file(buffer, file);
+      } else if (!strncmp(url, "http://", 7)) {
+        // http
+      } else {
+        ref<file_map> map = map_url(url);
+        if (map) {
+          unsigned size = (unsigned)map->get_size();
+          map->advise(file_map::hint_sequential);
           buffer.reserve(size+1); // 1 more byte for zero terminator on a text file
           buffer.resize(size);
-          fseek(file, 0, SEEK_SET);
-          fread(buffer.data(), 1, buffer.size(), file);
-          fclose(file);
+          if (size) memcpy(buffer.data(), map->get_data(), size);
         }
       }
     }
@@ -185,17 +241,116 @@ namespace octet { namespace resources {
 
     /// Utility function for making textures from arrays of bytes.
     /// gl_kind is GL_RGB or GL_RGBA
-    static GLuint make_texture(unsigned gl_kind, uint8_t *image, unsigned size, unsigned in_format, unsigned width, unsigned height) {
-      //assert(buffer.size() == width * height * 4);
+    /// RGB and RGBA images get mipmaps made on the CPU with gen. The default is a box filter
+    /// that clamps at the edges, like glGenerateMipmap; use a sharper filter, srgb or wrap if the texture needs it.
+    static GLuint make_texture(unsigned gl_kind, uint8_t *image, unsigned size, unsigned in_format, unsigned width, unsigned height, const mipmap_generator &gen = mipmap_generator(mipmap_generator::filter_box, false, 0, false)) {
+      unsigned num_comps = in_format == GL_RGBA ? 4 : in_format == GL_RGB ? 3 : 0;
+      if (num_comps && size < width * height * num_comps) {
+        log("make_texture: %d bytes is too small for %dx%d\n", size, width, height);
+        return 0;
+      }
+
       // make a new texture handle
       GLuint handle = 0;
       glGenTextures(1, &handle);
       glActiveTexture(GL_TEXTURE0);
       glBindTexture(GL_TEXTURE_2D, handle);
 
-      glTexImage2D(GL_TEXTURE_2D, 0, gl_kind, width, height, 0, in_format, GL_UNSIGNED_BYTE, (void*)image);
+      if (num_comps) {
+        // upload explicit levels rather than stalling in glGenerateMipmap.
+        // the levels are tightly packed, so rows are byte aligned.
+        dynarray<uint8_t> levels((unsigned)mipmap_generator::get_size(width, height, num_comps));
+        memcpy(levels.data(), image, width * height * num_comps);
+        unsigned num_levels = gen.generate(levels.data(), width, height, num_comps);
+        GLint old_alignment = 4;
+        glGetIntegerv(GL_UNPACK_ALIGNMENT, &old_alignment);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        uint8_t *src = levels.data();
+        for (unsigned level = 0; level != num_levels; ++level) {
+          unsigned w = mipmap_generator::get_level_size(width, level);
+          unsigned h = mipmap_generator::get_level_size(height, level);
+          glTexImage2D(GL_TEXTURE_2D, level, gl_kind, w, h, 0, in_format, GL_UNSIGNED_BYTE, (void*)src);
+          src += w * h * num_comps;
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, old_alignment);
+      } else {
+        glTexImage2D(GL_TEXTURE_2D, 0, gl_kind, width, height, 0, in_format, GL_UNSIGNED_BYTE, (void*)image);
+        glGenerateMipmap(GL_TEXTURE_2D);
+      }
+
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      return handle;
+    }
+
+    /// True if GL can take a DXT or RGTC format directly.
+    static bool is_compressed_format_supported(unsigned format) {
+      // read once. textures are only made on the main thread.
+      static dynarray<GLint> formats;
+      static bool s3tc = false, rgtc = false, initialised = false;
+      if (!initialised) {
+        initialised = true;
+        GLint num_formats = 0;
+        glGetIntegerv(GL_NUM_COMPRESSED_TEXTURE_FORMATS, &num_formats);
+        formats.resize(num_formats);
+        if (num_formats) glGetIntegerv(GL_COMPRESSED_TEXTURE_FORMATS, formats.data());
+
+        // some drivers leave formats out of the list, so check the extensions too.
+        const char *extensions = (const char*)glGetString(GL_EXTENSIONS);
+        if (extensions) {
+          s3tc = strstr(extensions, "texture_compression_s3tc") != 0;
+          rgtc = strstr(extensions, "texture_compression_rgtc") != 0;
+        }
+      }
+
+      for (unsigned i = 0; i != formats.size(); ++i) {
+        if ((unsigned)formats[i] == format) return true;
+      }
+
+      // DXT1-5 are 0x83F0-0x83F3, RGTC is 0x8DBB-0x8DBE
+      if (format >= 0x83F0 && format <= 0x83F3) return s3tc;
+      if (format >= 0x8DBB && format <= 0x8DBE) return rgtc;
+      return false;
+    }
 
-      glGenerateMipmap(GL_TEXTURE_2D);
+    /// Upload the mip levels of a DXT or RGTC image to the bound texture.
+    /// If GL can't take the format, the levels are decoded to RGBA in software, which uses 4-8 times the memory.
+    static void upload_compressed(unsigned target, unsigned format, const uint8_t *src, unsigned width, unsigned height, unsigned num_levels) {
+      bool direct = is_compressed_format_supported(format);
+      if (!direct) {
+        static bool warned = false;
+        if (!warned) printf("warning: no GL support for compressed format %04x, decoding in software\n", format);
+        warned = true;
+      }
+
+      dynarray<uint8_t> pixels;
+      for (unsigned level = 0; level != num_levels; ++level) {
+        unsigned w = mipmap_generator::get_level_size(width, level);
+        unsigned h = mipmap_generator::get_level_size(height, level);
+        unsigned size = (unsigned)dds_decoder::get_size(format, w, h);
+        if (direct) {
+          glCompressedTexImage2D(target, level, format, w, h, 0, size, (void*)src);
+        } else {
+          pixels.resize(w * h * 4);
+          dds_decoder::decode(pixels.data(), format, src, w, h);
+          glTexImage2D(target, level, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, (void*)pixels.data());
+        }
+        src += size;
+      }
+
+      // DDS files may stop before 1x1.
+      if (num_levels < mipmap_generator::get_num_levels(width, height)) {
+        glTexParameteri(target, GL_TEXTURE_MAX_LEVEL, num_levels - 1);
+      }
+    }
+
+    /// Make a texture from DXT or RGTC blocks with num_levels mip levels, one after another.
+    static GLuint make_compressed_texture(unsigned format, const uint8_t *src, unsigned width, unsigned height, unsigned num_levels) {
+      GLuint handle = 0;
+      glGenTextures(1, &handle);
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D, handle);
+      upload_compressed(GL_TEXTURE_2D, format, src, width, height, num_levels);
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
       return handle;
@@ -0,0 +1,125 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// layout of binary archives written by binary_writer.
+//
+
+namespace octet { namespace resources {
+  /// Layout of the chunked binary archive shared by binary_writer and binary_reader.
+  ///
+  /// An archive is a header, a set of chunks and a chunk table at the end:
+  ///
+  ///     header      magic, version, size of the archive and where the chunk table is.
+  ///     data        bulk payloads (mesh buffers, pixels, animation channels), each aligned.
+  ///     stream      the visitor's structure: atoms, sizes, references and small values.
+  ///     toc         optional table of contents for archives that are loaded on demand.
+  ///     chunk table kind, offset and size of each chunk.
+  ///
+  /// All offsets are relative to the start of the archive, so an archive can be
+  /// embedded in another file or a zip and read from a view of it.
+  /// Large payloads are aligned so that they can be used in place in a mapped file.
+  ///
+  /// An archive with a table of contents holds each resource of a dictionary as a separate
+  /// entry of the stream. References to other entries are negative ids (-1 - entry index),
+  /// so any entry can be read on its own. See resource_dict::save_archive().
+  ///
+  /// The data and stream chunks may be compressed (chunk_compressed). A compressed chunk is
+  /// a series of blocks compressed separately with loaders::lz_codec, then the size of each
+  /// block and a compressed_trailer, so the blocks can be decompressed in parallel.
+  /// Large payloads may also be filtered (lz_codec::filter_t) before compression; the filter
+  /// is in the top byte of the payload's offset.
+  ///
+  /// Version 1 archives ("octet\r\n\x1a" followed by the stream with inline payloads)
+  /// are still readable.
+  class binary_format {
+  public:
+    enum {
+      version = 3,
+
+      /// alignment of the chunks and of large payloads in the data chunk.
+      alignment = 64,
+
+      /// payloads of this size or more go in the data chunk, smaller ones are inline.
+      min_blob_size = 128,
+
+      /// chunk kinds
+      chunk_data = 0x41544144,   // 'DATA'
+      chunk_stream = 0x4d525453, // 'STRM'
+      chunk_toc = 0x20434f54,    // 'TOC '
+
+      /// chunk flags
+      chunk_compressed = 1,
+
+      /// uncompressed size of the blocks of a compressed chunk.
+      block_size = 0x40000,
+
+      /// in the block sizes of a compressed chunk, the block is stored uncompressed.
+      block_stored = 0x80000000,
+
+      /// the filter of a payload is in the top byte of its offset.
+      filter_shift = 56,
+    };
+
+    /// archive header, at offset zero.
+    struct header {
+      char magic[8];
+      uint32_t version;
+      uint32_t header_size;
+      uint64_t archive_size;
+      uint64_t chunk_table_offset;
+      uint32_t num_chunks;
+      uint32_t alignment;
+      uint8_t pad[24];
+    };
+
+    /// chunk table entry.
+    struct chunk {
+      uint32_t kind;
+      uint32_t flags;
+      uint64_t offset;
+      uint64_t size;
+    };
+
+    /// end of a compressed chunk, after the compressed size of each block.
+    struct compressed_trailer {
+      uint64_t raw_size;
+      uint32_t block_size;
+      uint32_t num_blocks;
+    };
+
+    /// start of the table of contents chunk, followed by the entries and the names.
+    struct toc_header {
+      uint32_t num_entries;
+      int32_t active_entry;
+      uint32_t names_size;
+      uint32_t pad;
+    };
+
+    /// table of contents entry.
+    struct toc_entry {
+      uint32_t type;
+      uint32_t name;     // offset of the zero terminated name in the names
+      uint64_t offset;   // position of the entry in the stream chunk
+      uint64_t size;     // size of the entry in the stream chunk
+      uint64_t bytes;    // stream and data bytes, an estimate of the memory the entry needs
+    };
+
+    /// magic number for this version
+    static const char *magic() {
+      return "octet\r\n\x1b";
+    }
+
+    /// magic number of the original unchunked format
+    static const char *legacy_magic() {
+      return "octet\r\n\x1a";
+    }
+
+    /// round up to the alignment
+    static uint64_t align(uint64_t offset) {
+      return (offset + alignment - 1) & ~(uint64_t)(alignment - 1);
+    }
+  };
+} }
@@ -4,22 +4,81 @@
 //
 // Modular Framework for OpenGLES2 rendering on multiple platforms.
 //
-// visitor for writing xml files.
+// visitor for reading binary archives.
 //
 
 namespace octet { namespace resources {
   /// The binary reader is a visitor that is used to load a binary file.
   /// The binary reader will use a factory to create new classes, providied the class is in classes.h
+  ///
+  /// The archive is mapped into memory and read in place. Large payloads are copied once
+  /// from the mapped data chunk to their destination and strings are used where they are.
+  /// Compressed chunks are decompressed in parallel on the job system when the archive is opened.
+  /// Files in the original unchunked format are also read.
   class binary_reader : public visitor {
-    enum { debug = true };
-    hash_map<void *, int> refs;
+  public:
+    /// Finds the other entries of an archive with a table of contents as they are referred to.
+    class entry_loader {
+    public:
+      virtual ~entry_loader() {}
+
+      /// get entry "index", loading it if necessary. Returns NULL on failure.
+      virtual void *get_entry(unsigned index) = 0;
+
+      /// called as soon as the object at the root of an entry is made, before it is read.
+      virtual void set_entry(unsigned index, void *root) = 0;
+    };
+
+  private:
+    enum { debug = false };
     dynarray<void *> id_to_ref;
-    FILE *file;
-    char tmp[256];
 
-    void read(uint8_t *src, size_t bytes) {
-      //if (debug) log("read %08x bytes\n", bytes);
-      fread(src, 1, bytes, file);
+    // the archive, kept mapped while we read it.
+    ref<file_map> map;
+
+    // decompressed chunks
+    ref<file_map> data_map;
+    ref<file_map> stream_map;
+
+    // the visitor's structure.
+    const uint8_t *src;
+    const uint8_t *src_max;
+
+    // the data chunk with the large payloads.
+    const uint8_t *data;
+    uint64_t data_size;
+
+    // the original format has all payloads inline.
+    bool is_legacy;
+
+    // the stream chunk
+    const uint8_t *stream;
+    uint64_t stream_size;
+
+    // table of contents, if there is one.
+    const binary_format::toc_header *toc;
+    const binary_format::toc_entry *toc_entries;
+    const char *toc_names;
+
+    // which entry we are reading (-1 for the whole stream) and who loads the others.
+    int entry;
+    entry_loader *loader;
+
+    // payload of a dynarray between begin_read_dynarray and end_read_dynarray
+    const uint8_t *dynarray_src;
+    size_t dynarray_bytes;
+    loaders::lz_codec::filter_t dynarray_filter;
+
+    void read(uint8_t *dest, size_t bytes) {
+      if (bytes > (size_t)(src_max - src)) {
+        log("error: unexpected end of binary archive\n");
+        set_error(true);
+        memset(dest, 0, bytes);
+        src = src_max;
+        return;
+      }
+      memcpy(dest, src, bytes);
+      src += bytes;
     }
 
     int read_int() {
@@ -31,29 +90,27 @@ namespace octet { namespace resources {
     }
 
     atom_t read_atom() {
-      uint8_t b[4];
-      read(b, 4);
-      int value = b[0] + (b[1] << 8) + (b[2] << 16) + (b[3] << 24);
-      if (debug) log("%*sread %08x (%s)\n", get_depth()*2, "", value, app_utils::get_atom_name((atom_t)value));
-      return (atom_t)value;
+      return (atom_t)read_int();
     }
 
+    // strings are zero terminated in the archive, so we use them in place.
     const char *read_string() {
-      int nchars = 0;
-      for(;;) {
-        int c = fgetc(file);
-        tmp[nchars] = c;
-        if (c == 0) break;
-        nchars += nchars != sizeof(tmp)-1;
+      const uint8_t *end = (const uint8_t *)memchr(src, 0, src_max - src);
+      if (!end) {
+        log("error: unterminated string in binary archive\n");
+        set_error(true);
+        src = src_max;
+        return "";
       }
-      if (debug) log("%*sread %s\n", get_depth()*2, "", tmp);
-      return tmp;
+      const char *result = (const char*)src;
+      src = end + 1;
+      if (debug) log("%*sread %s\n", get_depth()*2, "", result);
+      return result;
     }
 
     bool check_atom(atom_t sid) {
       if (!get_error()) {
         atom_t test = read_atom();
-        log("%*scheck_atom %s\n", get_depth()*2, "", app_utils::get_atom_name(sid));
         if (test != sid) {
           log("error: expected %s\n", app_utils::get_atom_name(sid));
           set_error(true);
@@ -65,20 +122,56 @@ namespace octet { namespace resources {
     bool check_size(size_t size) {
       if (!get_error()) {
         int test = read_int();
-        log("%*scheck_size %d\n", get_depth()*2, "", size);
         if (test != (int)size) {
-          log("error: expected %d bytes\n", size);
+          log("error: expected %d bytes\n", (int)size);
           set_error(true);
         }
       }
       return get_error();
     }
 
+    // find the payload of a visit_bin or dynarray, either in the data chunk or inline.
+    const uint8_t *get_payload(size_t size, loaders::lz_codec::filter_t &filter) {
+      filter = loaders::lz_codec::filter_none;
+      if (get_error()) return NULL;
+
+      if (!is_legacy && size >= binary_format::min_blob_size) {
+        uint64_t offset = (uint32_t)read_int();
+        offset |= (uint64_t)(uint32_t)read_int() << 32;
+        unsigned filter_index = (unsigned)(offset >> binary_format::filter_shift);
+        offset &= ((uint64_t)1 << binary_format::filter_shift) - 1;
+        if (get_error() || offset > data_size || size > data_size - offset || filter_index >= loaders::lz_codec::num_filters) {
+          log("error: bad payload offset in binary archive\n");
+          set_error(true);
+          return NULL;
+        }
+        filter = (loaders::lz_codec::filter_t)filter_index;
+        return data + offset;
+      } else {
+        if (size > (size_t)(src_max - src)) {
+          log("error: unexpected end of binary archive\n");
+          set_error(true);
+          return NULL;
+        }
+        const uint8_t *result = src;
+        src += size;
+        return result;
+      }
+    }
+
     void *get_ref(int id) {
-      log("%*sget_ref %d/%d\n", get_depth()*2, "", id, id_to_ref.size());
-      if (id == (int)id_to_ref.size()) {
+      if (debug) log("%*sget_ref %d/%d\n", get_depth()*2, "", id, id_to_ref.size());
+      if (id < 0 && toc && loader && (unsigned)(-1 - id) < toc->num_entries) {
+        // a reference to another entry of the archive
+        void *result = loader->get_entry((unsigned)(-1 - id));
+        if (!result) {
+          log("error: unable to load entry %s\n", get_entry_name((unsigned)(-1 - id)));
+          set_error(true);
+        }
+        return result;
+      } else if (id == (int)id_to_ref.size()) {
         return NULL;
-      } else if (id > (int)id_to_ref.size()) {
+      } else if (id < 0 || id > (int)id_to_ref.size()) {
         log("error: id overflow\n");
         set_error(true);
         return NULL;
@@ -87,19 +180,275 @@ namespace octet { namespace resources {
       }
     }
 
+    // find the chunks of the archive
+    void open(file_map *map_) {
+      if (debug) log("binary_reader\n");
+      map = map_;
+      id_to_ref.reserve(256);
+      id_to_ref.push_back(NULL);
+      src = src_max = data = stream = NULL;
+      data_size = stream_size = 0;
+      is_legacy = false;
+      toc = NULL;
+      toc_entries = NULL;
+      toc_names = NULL;
+      entry = -1;
+      loader = NULL;
+      dynarray_src = NULL;
+      dynarray_bytes = 0;
+      dynarray_filter = loaders::lz_codec::filter_none;
+
+      if (!map || map->get_error()) {
+        set_error(true);
+        return;
+      }
+
+      const uint8_t *base = map->get_data();
+      uint64_t size = map->get_size();
+      if (size >= 8 && !memcmp(base, binary_format::legacy_magic(), 8)) {
+        // the original format is just the stream
+        src = base + 8;
+        src_max = base + size;
+        is_legacy = true;
+        return;
+      }
+
+      binary_format::header hdr;
+      if (size < sizeof(hdr)) {
+        set_error(true);
+        return;
+      }
+      memcpy(&hdr, base, sizeof(hdr));
+
+      if (memcmp(hdr.magic, binary_format::magic(), 8)) {
+        log("error: not a binary archive\n");
+        set_error(true);
+        return;
+      }
+
+      uint64_t table_size = (uint64_t)hdr.num_chunks * sizeof(binary_format::chunk);
+      if (
+        hdr.version > binary_format::version ||
+        hdr.archive_size > size ||
+        hdr.chunk_table_offset > hdr.archive_size ||
+        table_size > hdr.archive_size - hdr.chunk_table_offset
+      ) {
+        log("error: unsupported or truncated binary archive\n");
+        set_error(true);
+        return;
+      }
+
+      for (unsigned i = 0; i != hdr.num_chunks; ++i) {
+        binary_format::chunk chunk;
+        memcpy(&chunk, base + hdr.chunk_table_offset + i * sizeof(chunk), sizeof(chunk));
+        if (chunk.offset > hdr.archive_size || chunk.size > hdr.archive_size - chunk.offset) {
+          log("error: bad chunk in binary archive\n");
+          set_error(true);
+          return;
+        }
+        const uint8_t *chunk_data = base + chunk.offset;
+        uint64_t chunk_size = chunk.size;
+        if ((chunk.flags & binary_format::chunk_compressed) && (chunk.kind == binary_format::chunk_stream || chunk.kind == binary_format::chunk_data)) {
+          file_map *raw = decompress_chunk(chunk_data, chunk_size);
+          if (!raw) {
+            log("error: bad compressed chunk in binary archive\n");
+            set_error(true);
+            return;
+          }
+          (chunk.kind == binary_format::chunk_stream ? stream_map : data_map) = raw;
+          chunk_data = raw->get_data();
+          chunk_size = raw->get_size();
+        }
+
+        if (chunk.kind == binary_format::chunk_stream) {
+          stream = src = chunk_data;
+          stream_size = chunk_size;
+          src_max = src + chunk_size;
+        } else if (chunk.kind == binary_format::chunk_data) {
+          data = chunk_data;
+          data_size = chunk_size;
+        } else if (chunk.kind == binary_format::chunk_toc) {
+          open_toc(base + chunk.offset, chunk.size);
+        }
+      }
+
+      if (!src) {
+        log("error: no stream in binary archive\n");
+        set_error(true);
+      }
+    }
+
+    // decompress the blocks of a compressed chunk, returns NULL if it is corrupt.
+    file_map *decompress_chunk(const uint8_t *chunk, uint64_t size) {
+      binary_format::compressed_trailer trailer;
+      if (size < sizeof(trailer)) return NULL;
+      memcpy(&trailer, chunk + size - sizeof(trailer), sizeof(trailer));
+
+      // lz_codec can not expand by more than 255 times.
+      uint64_t table_size = (uint64_t)trailer.num_blocks * sizeof(uint32_t);
+      uint64_t block_size = trailer.block_size;
+      if (
+        table_size > size - sizeof(trailer) ||
+        block_size == 0 || block_size > binary_format::block_size ||
+        trailer.raw_size > (uint64_t)trailer.num_blocks * block_size ||
+        trailer.raw_size + block_size <= (uint64_t)trailer.num_blocks * block_size ||
+        trailer.raw_size / 256 > size
+      ) {
+        return NULL;
+      }
+
+      const uint8_t *table = chunk + size - sizeof(trailer) - table_size;
+      dynarray<uint64_t> offsets(trailer.num_blocks + 1);
+      uint64_t offset = 0;
+      for (unsigned i = 0; i != trailer.num_blocks; ++i) {
+        uint32_t block;
+        memcpy(&block, table + i * sizeof(uint32_t), sizeof(uint32_t));
+        offsets[i] = offset;
+        offset += block & ~binary_format::block_stored;
+      }
+      offsets[trailer.num_blocks] = offset;
+      if (offset != (uint64_t)(table - chunk)) return NULL;
+
+      file_map *result = new file_map(trailer.raw_size);
+      uint8_t *dest = result->access_data();
+      std::atomic<bool> ok(true);
+      job_scheduler::get()->parallel_for(0, trailer.num_blocks, 1, [&](unsigned i0, unsigned i1) {
+        for (unsigned i = i0; i != i1; ++i) {
+          uint32_t block;
+          memcpy(&block, table + i * sizeof(uint32_t), sizeof(uint32_t));
+          uint64_t raw_offset = i * block_size;
+          size_t bytes = (size_t)(trailer.raw_size - raw_offset < block_size ? trailer.raw_size - raw_offset : block_size);
+          size_t csize = (size_t)(offsets[i+1] - offsets[i]);
+          if (block & binary_format::block_stored) {
+            if (csize != bytes) ok = false; else memcpy(dest + raw_offset, chunk + offsets[i], bytes);
+          } else if (!loaders::lz_codec::decompress(dest + raw_offset, bytes, chunk + offsets[i], csize)) {
+            ok = false;
+          }
+        }
+      });
+
+      if (!ok) {
+        delete result;
+        return NULL;
+      }
+      return result;
+    }
+
+    // check the table of contents
+    void open_toc(const uint8_t *chunk, uint64_t size) {
+      const binary_format::toc_header *hdr = (const binary_format::toc_header *)chunk;
+      uint64_t entries_size = size >= sizeof(*hdr) ? (uint64_t)hdr->num_entries * sizeof(binary_format::toc_entry) : 0;
+      if (
+        size < sizeof(*hdr) ||
+        entries_size > size - sizeof(*hdr) ||
+        hdr->names_size != size - sizeof(*hdr) - entries_size ||
+        (hdr->names_size && chunk[size - 1] != 0)
+      ) {
+        log("error: bad table of contents in binary archive\n");
+        set_error(true);
+        return;
+      }
+      const binary_format::toc_entry *entries = (const binary_format::toc_entry *)(hdr + 1);
+      for (unsigned i = 0; i != hdr->num_entries; ++i) {
+        if (entries[i].name >= hdr->names_size) {
+          log("error: bad table of contents in binary archive\n");
+          set_error(true);
+          return;
+        }
+      }
+      toc = hdr;
+      toc_entries = entries;
+      toc_names = (const char *)(entries + hdr->num_entries);
+    }
+
   public:
     /// Construct a binary reader for a file.
+    /// The rest of the file is read in one go.
     binary_reader(FILE *file) {
-      if (debug) log("binary_reader\n");
-      id_to_ref.reserve(256);
+      long start = ftell(file);
+      fseek(file, 0, SEEK_END);
+      long end = ftell(file);
+      fseek(file, start, SEEK_SET);
+
+      file_map *buffer = new file_map((uint64_t)(end > start ? end - start : 0));
+      size_t bytes = fread(buffer->access_data(), 1, (size_t)buffer->get_size(), file);
+      if (bytes != buffer->get_size()) {
+        log("error: unable to read binary archive\n");
+      }
+      open(buffer);
+    }
+
+    /// Construct a binary reader for a mapped file or a view of one.
+    binary_reader(file_map *map) {
+      open(map);
+    }
+
+    /// Construct a binary reader for a url.
+    binary_reader(const char *url) {
+      open(app_utils::map_url(url));
+    }
+
+    /// Construct a binary reader for one entry of an archive with a table of contents.
+    /// References to other entries are found with the loader.
+    binary_reader(binary_reader &archive, unsigned index, entry_loader *loader) {
+      map = archive.map;
+      data_map = archive.data_map;
+      stream_map = archive.stream_map;
+      id_to_ref.reserve(64);
       id_to_ref.push_back(NULL);
+      data = archive.data;
+      data_size = archive.data_size;
+      is_legacy = false;
+      stream = archive.stream;
+      stream_size = archive.stream_size;
+      toc = archive.toc;
+      toc_entries = archive.toc_entries;
+      toc_names = archive.toc_names;
+      dynarray_src = NULL;
+      dynarray_bytes = 0;
+      dynarray_filter = loaders::lz_codec::filter_none;
+      entry = (int)index;
+      this->loader = loader;
+      src = src_max = NULL;
+
+      if (archive.get_error() || !toc || index >= toc->num_entries) {
+        set_error(true);
+        return;
+      }
 
-      this->file = file;
-      char tmp[8];
-      fread(tmp, 1, sizeof(tmp), file);
-      if (memcmp(tmp, "octet", 5)) {
+      const binary_format::toc_entry &e = toc_entries[index];
+      if (e.offset > stream_size || e.size > stream_size - e.offset) {
+        log("error: bad entry in binary archive\n");
         set_error(true);
+        return;
       }
+      src = stream + e.offset;
+      src_max = src + e.size;
+    }
+
+    /// Number of entries in the table of contents, zero if there is none.
+    unsigned get_num_entries() const {
+      return toc ? toc->num_entries : 0;
+    }
+
+    /// Name of an entry in the table of contents.
+    const char *get_entry_name(unsigned index) const {
+      return toc_names + toc_entries[index].name;
+    }
+
+    /// Type of an entry in the table of contents.
+    atom_t get_entry_type(unsigned index) const {
+      return (atom_t)toc_entries[index].type;
+    }
+
+    /// Approximate bytes of memory used by an entry.
+    uint64_t get_entry_bytes(unsigned index) const {
+      return toc_entries[index].bytes;
+    }
+
+    /// Entry of the active scene, or -1.
+    int get_active_entry() const {
+      return toc && toc->active_entry >= -1 && toc->active_entry < (int)toc->num_entries ? toc->active_entry : -1;
     }
 
     /// Destroy the reader
@@ -114,6 +463,10 @@ namespace octet { namespace resources {
 
     /// register a reference after creating a new object
     void add_new_ref(void *ref) {
+      if (loader && entry >= 0 && id_to_ref.size() == 1) {
+        // let other entries find this one while we are still reading it.
+        loader->set_entry((unsigned)entry, ref);
+      }
       id_to_ref.push_back(ref);
     }
 
@@ -143,11 +496,10 @@ namespace octet { namespace resources {
 
     /// Read an array reference
     bool begin_read_ref(void *&ref, int index, atom_t &type) {
-      if (debug) log("begin_read_ref\n");
       type = read_atom();
       int id = read_int();
       ref = get_ref(id);
-      if (debug) log("%*sbegin_read_ref %p %d %s\n", get_depth()*2, "", ref, index, app_utils::get_atom_name(type), id);
+      if (debug) log("%*sbegin_read_ref %p %d %s %d\n", get_depth()*2, "", ref, index, app_utils::get_atom_name(type), id);
       return !get_error();
     }
 
@@ -175,15 +527,28 @@ namespace octet { namespace resources {
 
     /// Begin reading a dynarray
     unsigned begin_read_dynarray(unsigned elem_size, atom_t &sid) {
+      dynarray_src = NULL;
+      dynarray_bytes = 0;
       if (!check_atom(atom_dynarray) && !check_atom(sid)) {
-        return (unsigned)read_int() / elem_size;
+        size_t bytes = (unsigned)read_int();
+        const uint8_t *payload = get_payload(bytes, dynarray_filter);
+        if (payload && elem_size) {
+          dynarray_src = payload;
+          dynarray_bytes = bytes;
+          return (unsigned)(bytes / elem_size);
+        }
       }
       return 0;
     }
 
     /// finish reading a dynarray
     void end_read_dynarray(void *ptr, unsigned bytes) {
-      read((uint8_t*)ptr, bytes);
+      if (bytes > dynarray_bytes || (bytes != dynarray_bytes && dynarray_filter != loaders::lz_codec::filter_none)) {
+        log("error: dynarray size mismatch\n");
+        set_error(true);
+        return;
+      }
+      if (bytes) loaders::lz_codec::remove_filter((uint8_t*)ptr, dynarray_src, bytes, dynarray_filter);
     }
 
     /// called after visiting a new object
@@ -197,7 +562,13 @@ namespace octet { namespace resources {
       if (debug) log("%*sbegin_refs %s\n", get_depth()*2, "", app_utils::get_atom_name(sid));
       if (!check_atom(sid) && !check_atom(atom_begin_refs)) {
         size = read_int();
-        return true;
+
+        // every entry takes at least a type and an id.
+        if (size < 0 || (size_t)size > (size_t)(src_max - src) / 8) {
+          log("error: bad array size in binary archive\n");
+          set_error(true);
+        }
+        return !get_error();
       }
       return false;
     }
@@ -212,7 +583,9 @@ namespace octet { namespace resources {
     void visit_bin(void *value, size_t size, atom_t sid, atom_t type) {
       if (debug) log("%*svisit_bin %s %d\n", get_depth()*2, "", app_utils::get_atom_name(sid), size);
       if (!check_atom(type) && !check_atom(sid) && !check_size(size)) {
-        read((uint8_t*)value, size);
+        loaders::lz_codec::filter_t filter;
+        const uint8_t *payload = get_payload(size, filter);
+        if (payload && size) loaders::lz_codec::remove_filter((uint8_t*)value, payload, size, filter);
       }
     }
 
@@ -225,4 +598,3 @@ namespace octet { namespace resources {
 
   };
 } }
-
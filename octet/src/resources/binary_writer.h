@@ -4,21 +4,61 @@
 //
 // Modular Framework for OpenGLES2 rendering on multiple platforms.
 //
-// visitor for writing xml files.
+// visitor for writing binary archives.
 //
 
 namespace octet { namespace resources {
   /// The binary writer is a visitor that writes binary files.
   /// Use this to save game worlds or to do game saves.
+  ///
+  /// Large payloads are written straight to the data chunk of the file as they are visited.
+  /// The structure is collected in memory and written with the chunk table by finish().
+  ///
+  /// With option_compress, the data and the structure are compressed in blocks on the
+  /// job system; the data is compressed a few megabytes at a time as it is written.
   class binary_writer : public visitor {
-    enum { debug = true };
+    enum {
+      debug = false,
+
+      // blocks of data compressed together
+      batch_blocks = 16,
+    };
     hash_map<void *, int> refs;
     int next_id;
     FILE *file;
 
+    // position of the archive in the file, all offsets are relative to this.
+    long archive_start;
+
+    // bytes written to the data chunk so far, before compression.
+    uint64_t data_size;
+
+    // option_compress etc.
+    unsigned options;
+
+    // compressed data: bytes in the file, block sizes and data waiting to be compressed.
+    uint64_t data_file_size;
+    dynarray<uint32_t> data_blocks;
+    dynarray<uint8_t> pending;
+
+    // the visitor's structure, written at the end.
+    dynarray<uint8_t> stream;
+
+    bool finished;
+
+    // entries of an archive with a table of contents, see begin_entry()
+    hash_map<void *, int> entry_refs;
+    void *entry_root;
+    unsigned entry_stream_start;
+    uint64_t entry_data_start;
+    dynarray<binary_format::toc_entry> toc;
+    dynarray<char> toc_names;
+    int active_entry;
+
     void write(const uint8_t *src, size_t bytes) {
-      //if (debug) log("%*swrite %08x bytes\n", get_depth()*2, "", bytes);
-      fwrite(src, 1, bytes, file);
+      unsigned size = stream.size();
+      stream.resize(size + (unsigned)bytes);
+      if (bytes) memcpy(stream.data() + size, src, bytes);
     }
 
     void write_int(int value) {
@@ -38,18 +78,281 @@ namespace octet { namespace resources {
       write((const uint8_t*)value, (int)strlen(value)+1);
     }
 
+    // write zeros to the file up to an aligned offset
+    void pad_file(uint64_t from, uint64_t to) {
+      static const uint8_t zeros[binary_format::alignment] = { 0 };
+      fwrite(zeros, 1, (size_t)(to - from), file);
+    }
+
+    // compress blocks in parallel and write them to the file, returns the bytes written.
+    uint64_t write_compressed(const uint8_t *src, size_t size, dynarray<uint32_t> &sizes) {
+      size_t block_size = binary_format::block_size;
+      size_t max_block = loaders::lz_codec::max_compressed_size(block_size);
+      unsigned num_blocks = (unsigned)((size + block_size - 1) / block_size);
+      dynarray<uint8_t> buffer(num_blocks * max_block);
+      dynarray<uint32_t> block_sizes(num_blocks);
+
+      job_scheduler::get()->parallel_for(0, num_blocks, 1, [&](unsigned i0, unsigned i1) {
+        for (unsigned i = i0; i != i1; ++i) {
+          size_t offset = i * block_size;
+          size_t bytes = size - offset < block_size ? size - offset : block_size;
+          uint8_t *dest = buffer.data() + i * max_block;
+          size_t csize = loaders::lz_codec::compress(dest, max_block, src + offset, bytes);
+          if (csize == 0 || csize >= bytes) {
+            // does not compress
+            memcpy(dest, src + offset, bytes);
+            block_sizes[i] = (uint32_t)bytes | binary_format::block_stored;
+          } else {
+            block_sizes[i] = (uint32_t)csize;
+          }
+        }
+      });
+
+      uint64_t total = 0;
+      for (unsigned i = 0; i != num_blocks; ++i) {
+        size_t csize = block_sizes[i] & ~binary_format::block_stored;
+        fwrite(buffer.data() + i * max_block, 1, csize, file);
+        sizes.push_back(block_sizes[i]);
+        total += csize;
+      }
+      return total;
+    }
+
+    // write the block sizes and trailer of a compressed chunk, returns the bytes written.
+    uint64_t write_trailer(const dynarray<uint32_t> &sizes, uint64_t raw_size) {
+      binary_format::compressed_trailer trailer;
+      trailer.raw_size = raw_size;
+      trailer.block_size = binary_format::block_size;
+      trailer.num_blocks = sizes.size();
+      fwrite(sizes.data(), sizeof(uint32_t), sizes.size(), file);
+      fwrite(&trailer, 1, sizeof(trailer), file);
+      return sizes.size() * sizeof(uint32_t) + sizeof(trailer);
+    }
+
+    // compress whole blocks of the pending data, or all of it at the end.
+    void flush_data(bool final) {
+      size_t bytes = pending.size();
+      if (!final) bytes -= bytes % binary_format::block_size;
+      if (bytes == 0) return;
+
+      data_file_size += write_compressed(pending.data(), bytes, data_blocks);
+      unsigned remaining = pending.size() - (unsigned)bytes;
+      memmove(pending.data(), pending.data() + bytes, remaining);
+      pending.resize(remaining);
+    }
+
+    // add bytes to the data chunk
+    void write_data(const void *src, size_t bytes) {
+      if (!bytes) return;
+      if (!(options & option_compress)) {
+        fwrite(src, 1, bytes, file);
+        data_file_size += bytes;
+        return;
+      }
+
+      unsigned size = pending.size();
+      pending.resize(size + (unsigned)bytes);
+      memcpy(pending.data() + size, src, bytes);
+      if (pending.size() >= batch_blocks * binary_format::block_size) {
+        flush_data(false);
+      }
+    }
+
+    // add zeros to the data chunk up to an aligned offset
+    void pad_data(uint64_t from, uint64_t to) {
+      static const uint8_t zeros[binary_format::alignment] = { 0 };
+      write_data(zeros, (size_t)(to - from));
+    }
+
+    // get the id of a reference, references to other entries are negative.
+    int get_id(void *ref, bool &is_new) {
+      is_new = false;
+      if (ref != entry_root && entry_refs.contains(ref)) {
+        return -entry_refs[ref];
+      }
+
+      int &id = refs[ref];
+      if (id == 0) {
+        id = next_id++;
+        is_new = true;
+      }
+      return id;
+    }
+
+    // write a large payload to the data chunk and its offset to the stream.
+    void write_blob(const void *value, size_t size) {
+      uint64_t offset = binary_format::align(data_size);
+      pad_data(data_size, offset);
+
+      loaders::lz_codec::filter_t filter = loaders::lz_codec::filter_none;
+      if (options & option_filter) {
+        filter = loaders::lz_codec::choose_filter((const uint8_t*)value, size);
+      }
+      if (filter != loaders::lz_codec::filter_none) {
+        dynarray<uint8_t> filtered(size);
+        loaders::lz_codec::apply_filter(filtered.data(), (const uint8_t*)value, size, filter);
+        write_data(filtered.data(), size);
+      } else {
+        write_data(value, size);
+      }
+      data_size = offset + size;
+
+      uint64_t word = offset | (uint64_t)filter << binary_format::filter_shift;
+      write_int((int)word);
+      write_int((int)(word >> 32));
+    }
+
   public:
+    enum {
+      /// compress the archive
+      option_compress = 1,
+
+      /// choose a filter for each large payload to make it compress better
+      option_filter = 2,
+    };
+
     /// Construct a binary writer from a file
-    binary_writer(FILE *file) {
+    /// The archive starts at the current position of the file, which must be seekable.
+    binary_writer(FILE *file, unsigned options = 0) {
       if (debug) log("%*sbinary_writer\n", get_depth()*2, "");
       next_id = 1;
       this->file = file;
+      this->options = options;
+      archive_start = ftell(file);
+      data_size = 0;
+      data_file_size = 0;
+      finished = false;
+      stream.reserve(0x10000);
+      entry_root = NULL;
+      entry_stream_start = 0;
+      entry_data_start = 0;
+      active_entry = -1;
 
-      fwrite("octet\r\n\x1a", 1, 8, file);
+      // the header is written again by finish()
+      binary_format::header hdr;
+      memset(&hdr, 0, sizeof(hdr));
+      fwrite(&hdr, 1, sizeof(hdr), file);
     }
 
-    /// Destroy the writer
+    /// Destroy the writer, finishing the archive if finish() has not been called.
     ~binary_writer() {
+      finish();
+    }
+
+    /// Say that a resource will be written as entry "index" of the table of contents.
+    /// References to it from other entries will load it by index.
+    void add_entry_ref(void *ref, unsigned index) {
+      entry_refs[ref] = (int)index + 1;
+    }
+
+    /// Start writing a resource as an entry that can be read on its own.
+    /// Visit a ref<> to the resource with sid atom_ and then call end_entry().
+    void begin_entry(void *root) {
+      refs.clear();
+      next_id = 1;
+      entry_root = root;
+      entry_stream_start = stream.size();
+      entry_data_start = data_size;
+    }
+
+    /// Finish writing an entry and add it to the table of contents.
+    void end_entry(const char *name, atom_t type) {
+      binary_format::toc_entry entry;
+      entry.type = (uint32_t)type;
+      entry.name = toc_names.size();
+      entry.offset = entry_stream_start;
+      entry.size = stream.size() - entry_stream_start;
+      entry.bytes = entry.size + data_size - entry_data_start;
+      toc.push_back(entry);
+
+      for (const char *p = name; ; ++p) {
+        toc_names.push_back(*p);
+        if (!*p) break;
+      }
+      entry_root = NULL;
+    }
+
+    /// Which entry is the active scene, if any.
+    void set_active_entry(int index) {
+      active_entry = index;
+    }
+
+    /// Write the structure, the chunk table and the header.
+    /// Returns false if the file could not be written.
+    bool finish() {
+      if (finished) return true;
+      finished = true;
+
+      // header | data | stream | toc | chunk table
+      binary_format::chunk chunks[3];
+      memset(chunks, 0, sizeof(chunks));
+      unsigned num_chunks = toc.size() ? 3 : 2;
+      chunks[0].kind = binary_format::chunk_data;
+      chunks[0].offset = sizeof(binary_format::header);
+      if (options & option_compress) {
+        flush_data(true);
+        data_file_size += write_trailer(data_blocks, data_size);
+        chunks[0].flags = binary_format::chunk_compressed;
+      }
+      chunks[0].size = data_file_size;
+
+      uint64_t pos = chunks[0].offset + chunks[0].size;
+      chunks[1].kind = binary_format::chunk_stream;
+      chunks[1].offset = binary_format::align(pos);
+      pad_file(pos, chunks[1].offset);
+      if (options & option_compress) {
+        dynarray<uint32_t> stream_blocks;
+        chunks[1].size = write_compressed(stream.data(), stream.size(), stream_blocks);
+        chunks[1].size += write_trailer(stream_blocks, stream.size());
+        chunks[1].flags = binary_format::chunk_compressed;
+      } else {
+        chunks[1].size = stream.size();
+        fwrite(stream.data(), 1, stream.size(), file);
+      }
+
+      pos = chunks[1].offset + chunks[1].size;
+      if (toc.size()) {
+        binary_format::toc_header toc_hdr;
+        memset(&toc_hdr, 0, sizeof(toc_hdr));
+        toc_hdr.num_entries = toc.size();
+        toc_hdr.active_entry = active_entry;
+        toc_hdr.names_size = toc_names.size();
+
+        chunks[2].kind = binary_format::chunk_toc;
+        chunks[2].offset = binary_format::align(pos);
+        chunks[2].size = sizeof(toc_hdr) + toc.size() * sizeof(toc[0]) + toc_names.size();
+        pad_file(pos, chunks[2].offset);
+        fwrite(&toc_hdr, 1, sizeof(toc_hdr), file);
+        fwrite(toc.data(), sizeof(toc[0]), toc.size(), file);
+        fwrite(toc_names.data(), 1, toc_names.size(), file);
+        pos = chunks[2].offset + chunks[2].size;
+      }
+
+      uint64_t table_offset = binary_format::align(pos);
+      pad_file(pos, table_offset);
+      fwrite(chunks, sizeof(chunks[0]), num_chunks, file);
+
+      binary_format::header hdr;
+      memset(&hdr, 0, sizeof(hdr));
+      memcpy(hdr.magic, binary_format::magic(), sizeof(hdr.magic));
+      hdr.version = binary_format::version;
+      hdr.header_size = sizeof(hdr);
+      hdr.archive_size = table_offset + num_chunks * sizeof(chunks[0]);
+      hdr.chunk_table_offset = table_offset;
+      hdr.num_chunks = num_chunks;
+      hdr.alignment = binary_format::alignment;
+
+      long end = ftell(file);
+      fseek(file, archive_start, SEEK_SET);
+      fwrite(&hdr, 1, sizeof(hdr), file);
+      fseek(file, end, SEEK_SET);
+
+      if (ferror(file)) {
+        log("error: unable to write binary archive\n");
+        set_error(true);
+        return false;
+      }
+      return true;
     }
 
     /// Write a dictionary entry.
@@ -61,12 +364,8 @@ namespace octet { namespace resources {
         write_int(0);
         return false;
       } else {
-        int &id = refs[ref];
-        bool is_new = id == 0;
-
-        if (is_new) {
-          id = next_id++;
-        }
+        bool is_new = false;
+        int id = get_id(ref, is_new);
 
         write_atom(type);
         write_string(sid);
@@ -85,12 +384,8 @@ namespace octet { namespace resources {
         write_int(0);
         return false;
       } else {
-        int &id = refs[ref];
-        bool is_new = id == 0;
-
-        if (is_new) {
-          id = next_id++;
-        }
+        bool is_new = false;
+        int id = get_id(ref, is_new);
 
         write_atom(type);
         write_atom(sid);
@@ -108,12 +403,8 @@ namespace octet { namespace resources {
         write_int(0);
         return false;
       } else {
-        int &id = refs[ref];
-        bool is_new = id == 0;
-
-        if (is_new) {
-          id = next_id++;
-        }
+        bool is_new = false;
+        int id = get_id(ref, is_new);
 
         write_atom(type);
         write_int(id);
@@ -154,11 +445,16 @@ namespace octet { namespace resources {
     }
 
     /// Write an opaque binary object
+    /// Large objects go in the data chunk, aligned, small ones in the stream.
     void visit_bin(void *value, size_t size, atom_t sid, atom_t type) {
       write_atom(type);
       write_atom(sid);
       write_int((int)size);
-      write((const uint8_t*)value, size);
+      if (size >= binary_format::min_blob_size) {
+        write_blob(value, size);
+      } else {
+        write((const uint8_t*)value, size);
+      }
     }
 
     /// Write a string
@@ -169,4 +465,3 @@ namespace octet { namespace resources {
     }
   };
 } }
-
@@ -5,76 +5,389 @@
 // Modular Framework for OpenGLES2 rendering on multiple platforms.
 //
 // map a file to memory
+//
 
-class file_map {
-  #ifdef WIN32
-    HANDLE file_handle;
-    HANDLE mapping_handle;
-  #else
-    int file_handle;
-  #endif
-  uint64_t size;
-  const uint8_t *data;
-  const char *error;
-public:
-  file_map(const char *file_name) {
-    error = 0;
-    data = 0;
-    size = 0;
-
-    if (file_name == NULL) {
-      error = "no file name";
-      return;
-    }
+namespace octet { namespace resources {
+  /// Memory mapped file.
+  ///
+  /// The operating system pages the file in on demand, so large assets can be
+  /// parsed in place without reading them into a buffer first.
+  ///
+  /// Example:
+  ///
+  ///     ref<file_map> map = new file_map("assets/big.dae");
+  ///     map->advise(file_map::hint_sequential);
+  ///     parse(map->get_data(), map->get_data() + map->get_size());
+  ///
+  /// A file_map can also be a view of a sub-range of another file_map
+  /// or an anonymous block of memory (used for inflated zip entries).
+  ///
+  /// Whole file maps made with mode_copy_on_write and anonymous maps have a zero byte
+  /// after the last byte, so text can be tokenized in place as a C string.
+  ///
+  /// Maps are shared with job_scheduler workers, so the reference count is atomic.
+  class file_map {
+  public:
+    /// How to open the file.
+    enum mode_t {
+      mode_read,        // read only, shared with other readers.
+      mode_read_write,  // writes go back to the file. File is created or resized if a size is given.
+      mode_copy_on_write, // writable private copy. Pages are shared with the file until written; writes are not saved.
+    };
+
+    /// How we expect to access the file, passed to madvise()
+    enum hint_t {
+      hint_normal,
+      hint_sequential,  // read from start to end once (parsers).
+      hint_random,      // random access (zip directories, archives).
+      hint_willneed,    // start reading ahead now.
+      hint_dontneed,    // we are done with these pages.
+    };
+
+  private:
+    std::atomic<int> ref_cnt;
 
     #ifdef WIN32
-      mapping_handle = INVALID_HANDLE_VALUE;
+      HANDLE file_handle;
+      HANDLE mapping_handle;
+    #else
+      int file_handle;
+    #endif
+
+    // the root map of a view keeps the file handle open. Views of views refer to the root.
+    ref<file_map> parent;
+
+    // offset of data in the file, for making views of views.
+    uint64_t file_offset;
 
-      file_handle = CreateFileA(
-        file_name, GENERIC_READ, FILE_SHARE_READ, 0,
-        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0
-      );
+    // the whole mapping, page aligned. This is what we unmap.
+    uint8_t *base;
+    uint64_t base_size;
 
-      if (file_handle == INVALID_HANDLE_VALUE) {
-        error = "could not open file";
+    // the bytes visible to the user.
+    uint8_t *data;
+    uint64_t size;
+
+    mode_t mode;
+    bool is_anonymous;
+    const char *error;
+
+    void init() {
+      ref_cnt = 0;
+      #ifdef WIN32
+        file_handle = INVALID_HANDLE_VALUE;
+        mapping_handle = NULL;
+      #else
+        file_handle = -1;
+      #endif
+      base = data = 0;
+      base_size = size = file_offset = 0;
+      mode = mode_read;
+      is_anonymous = false;
+      error = 0;
+    }
+
+    // map [offset, offset+length) of the open file, aligned to the granularity.
+    void map_range(uint64_t offset, uint64_t length) {
+      uint64_t gran = get_granularity();
+      uint64_t aligned = offset & ~(gran - 1);
+      base_size = length + (offset - aligned);
+      size = length;
+      file_offset = offset;
+
+      // zero sized maps are legal files, but not legal mappings.
+      if (length == 0) return;
+
+      #ifdef WIN32
+        HANDLE mh = parent ? parent->mapping_handle : mapping_handle;
+        DWORD access = mode == mode_read ? FILE_MAP_READ : mode == mode_copy_on_write ? FILE_MAP_COPY : FILE_MAP_WRITE;
+        base = (uint8_t *)MapViewOfFile(mh, access, (DWORD)(aligned >> 32), (DWORD)aligned, (SIZE_T)base_size);
+        if (!base) {
+          error = "could not map file";
+          return;
+        }
+      #else
+        int fd = parent ? parent->file_handle : file_handle;
+        int prot = mode == mode_read ? PROT_READ : PROT_READ|PROT_WRITE;
+        int flags = mode == mode_copy_on_write ? MAP_PRIVATE : MAP_SHARED;
+        void *res = mmap(0, (size_t)base_size, prot, flags, fd, (off_t)aligned);
+        if (res == MAP_FAILED) {
+          error = "could not map file";
+          base = 0;
+          return;
+        }
+        base = (uint8_t *)res;
+      #endif
+      data = base + (offset - aligned);
+    }
+
+    // map a whole file copy on write with a zero byte after the end.
+    void map_copy_on_write(uint64_t length) {
+      size = length;
+      #ifdef WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        if (length % info.dwPageSize != 0) {
+          // the rest of the last page is zero.
+          mapping_handle = CreateFileMappingA(file_handle, 0, PAGE_WRITECOPY, 0, 0, 0);
+          base = mapping_handle ? (uint8_t *)MapViewOfFile(mapping_handle, FILE_MAP_COPY, 0, 0, 0) : 0;
+          base_size = length;
+          if (!base) error = "could not map file";
+        } else {
+          // no room after the end of the file: read it into memory instead.
+          is_anonymous = true;
+          base_size = length + 1;
+          base = (uint8_t *)VirtualAlloc(0, (SIZE_T)base_size, MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE);
+          DWORD bytes_read = 0;
+          if (!base || (length && (!ReadFile(file_handle, base, (DWORD)length, &bytes_read, 0) || bytes_read != length))) {
+            error = "could not read file";
+          }
+        }
+      #else
+        // reserve a zeroed block one byte bigger than the file and map the file over the start of it.
+        base_size = length + 1;
+        void *res = mmap(0, (size_t)base_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (res == MAP_FAILED) {
+          error = "out of memory";
+          base_size = size = 0;
+          return;
+        }
+        base = (uint8_t *)res;
+        if (length && mmap(base, (size_t)length, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_FIXED, file_handle, 0) == MAP_FAILED) {
+          error = "could not map file";
+        }
+      #endif
+      data = base;
+    }
+
+    // do not copy these things.
+    file_map(const file_map &rhs);
+    void operator=(const file_map &rhs);
+  public:
+    /// Map a whole file. In mode_read_write, a non-zero new_size creates or resizes the file first.
+    file_map(const char *file_name, mode_t mode_=mode_read, uint64_t new_size=0) {
+      init();
+      mode = mode_;
+
+      if (file_name == NULL) {
+        error = "no file name";
         return;
       }
 
-      DWORD sizehi = 0, sizelo = GetFileSize(file_handle, &sizehi);
-      size = ((uint64_t)sizehi << 32) | sizelo;
-      mapping_handle = CreateFileMappingA(file_handle, 0, PAGE_READONLY, 0, 0, 0);
+      #ifdef WIN32
+        bool rw = mode == mode_read_write;
+        file_handle = CreateFileA(
+          file_name, rw ? GENERIC_READ|GENERIC_WRITE : GENERIC_READ, rw ? 0 : FILE_SHARE_READ, 0,
+          rw ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0
+        );
+
+        if (file_handle == INVALID_HANDLE_VALUE) {
+          error = "could not open file";
+          return;
+        }
+
+        uint64_t file_size = new_size;
+        if (mode == mode_copy_on_write) {
+          DWORD sizehi = 0, sizelo = GetFileSize(file_handle, &sizehi);
+          map_copy_on_write(((uint64_t)sizehi << 32) | sizelo);
+          return;
+        } else if (rw && new_size) {
+          LARGE_INTEGER pos;
+          pos.QuadPart = (LONGLONG)new_size;
+          SetFilePointerEx(file_handle, pos, 0, FILE_BEGIN);
+          SetEndOfFile(file_handle);
+        } else {
+          DWORD sizehi = 0, sizelo = GetFileSize(file_handle, &sizehi);
+          file_size = ((uint64_t)sizehi << 32) | sizelo;
+        }
+
+        if (file_size != 0) {
+          mapping_handle = CreateFileMappingA(file_handle, 0, rw ? PAGE_READWRITE : PAGE_READONLY, 0, 0, 0);
 
-      if (mapping_handle == INVALID_HANDLE_VALUE) {
-        error = "could not map file";
+          if (mapping_handle == NULL) {
+            error = "could not map file";
+            return;
+          }
+        }
+      #else
+        bool rw = mode == mode_read_write;
+        file_handle = open(file_name, rw ? O_RDWR|O_CREAT : O_RDONLY, 0644);
+        if (file_handle < 0) {
+          error = "could not open file";
+          return;
+        }
+
+        uint64_t file_size = new_size;
+        if (rw && new_size) {
+          if (ftruncate(file_handle, (off_t)new_size) != 0) {
+            error = "could not resize file";
+            return;
+          }
+        } else {
+          struct stat st;
+          if (fstat(file_handle, &st) != 0) {
+            error = "could not stat file";
+            return;
+          }
+          file_size = (uint64_t)st.st_size;
+        }
+
+        if (mode == mode_copy_on_write) {
+          map_copy_on_write(file_size);
+          return;
+        }
+      #endif
+
+      map_range(0, file_size);
+    }
+
+    /// Make a view of part of another map.
+    /// File backed views get their own page aligned mapping, so they can be unmapped independently.
+    file_map(file_map *parent_, uint64_t offset, uint64_t length) {
+      init();
+      // the root has the file handles; offsets are from the start of the file.
+      parent = parent_->parent ? (file_map*)parent_->parent : parent_;
+      mode = parent_->mode;
+      is_anonymous = parent_->is_anonymous;
+
+      if (offset > parent_->size || length > parent_->size - offset) {
+        error = "view out of range";
         return;
       }
 
-      data = (const uint8_t *)MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
-    #else
-      //file_handle = open(file_name, O_RDONLY);
-      //mmap
-    #endif
-  }
+      if (is_anonymous || parent_->error) {
+        // memory maps can't be remapped, alias the parent's memory.
+        error = parent_->error;
+        data = parent_->data + offset;
+        size = length;
+        file_offset = parent_->file_offset + offset;
+      } else {
+        map_range(parent_->file_offset + offset, length);
+      }
+    }
 
-  ~file_map() {
-    #ifdef WIN32
-      UnmapViewOfFile(data);
-      CloseHandle(file_handle);
-      CloseHandle(mapping_handle);
-    #else
-    #endif
-  }
+    /// Make an anonymous, writable map. This is not backed by a file.
+    file_map(uint64_t length) {
+      init();
+      mode = mode_read_write;
+      is_anonymous = true;
+      size = length;
+      if (length == 0) return;
+
+      // one more byte for the zero after the end.
+      base_size = length + 1;
+
+      #ifdef WIN32
+        base = (uint8_t *)VirtualAlloc(0, (SIZE_T)base_size, MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE);
+        if (!base) error = "out of memory";
+      #else
+        void *res = mmap(0, (size_t)base_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        base = res == MAP_FAILED ? 0 : (uint8_t *)res;
+        if (!base) error = "out of memory";
+      #endif
+      data = base;
+      if (!base) size = base_size = 0;
+    }
+
+    /// Unmap the file.
+    ~file_map() {
+      #ifdef WIN32
+        if (base) {
+          if (is_anonymous) {
+            VirtualFree(base, 0, MEM_RELEASE);
+          } else {
+            UnmapViewOfFile(base);
+          }
+        }
+        if (mapping_handle != NULL) CloseHandle(mapping_handle);
+        if (file_handle != INVALID_HANDLE_VALUE) CloseHandle(file_handle);
+      #else
+        if (base) munmap(base, (size_t)base_size);
+        if (file_handle >= 0) close(file_handle);
+      #endif
+    }
+
+    /// Tell the operating system how we intend to use part of the map.
+    /// The range is widened to page boundaries.
+    void advise(hint_t hint, uint64_t offset=0, uint64_t length=~(uint64_t)0) {
+      if (!data || offset >= size) return;
+      if (length > size - offset) length = size - offset;
+
+      #ifdef WIN32
+        // PrefetchVirtualMemory is Windows 8 only, so let the pager work it out.
+        (void)hint;
+      #else
+        uint64_t gran = get_granularity();
+        uintptr_t start = (uintptr_t)(data + offset) & ~(uintptr_t)(gran - 1);
+        uintptr_t end = (uintptr_t)(data + offset + length);
+        int advice =
+          hint == hint_sequential ? MADV_SEQUENTIAL :
+          hint == hint_random ? MADV_RANDOM :
+          hint == hint_willneed ? MADV_WILLNEED :
+          hint == hint_dontneed ? MADV_DONTNEED :
+          MADV_NORMAL
+        ;
+        // don't throw away anonymous data.
+        if (hint == hint_dontneed && (is_anonymous || mode != mode_read)) return;
+        madvise((void*)start, (size_t)(end - start), advice);
+      #endif
+    }
 
-  const char *get_error() const {
-    return error;
-  }
+    /// Write any changes back to the file (mode_read_write only).
+    void flush() {
+      if (!base || is_anonymous || mode != mode_read_write) return;
+      #ifdef WIN32
+        FlushViewOfFile(base, (SIZE_T)base_size);
+      #else
+        msync(base, (size_t)base_size, MS_SYNC);
+      #endif
+    }
+
+    /// Alignment of view offsets. Views do not need to be aligned, but aligned views waste less memory.
+    static uint64_t get_granularity() {
+      static uint64_t value;
+      if (!value) {
+        #ifdef WIN32
+          SYSTEM_INFO info;
+          GetSystemInfo(&info);
+          value = info.dwAllocationGranularity;
+        #else
+          value = (uint64_t)sysconf(_SC_PAGESIZE);
+        #endif
+      }
+      return value;
+    }
+
+    /// allow ref<file_map>
+    void add_ref() {
+      ref_cnt.fetch_add(1);
+    }
+
+    /// allow ref<file_map>
+    void release() {
+      if (ref_cnt.fetch_sub(1) == 1) {
+        delete this;
+      }
+    }
 
-  const uint8_t *get_data() const {
-    return data;
-  }
+    /// NULL if the file was mapped successfully, otherwise a reason for failure.
+    const char *get_error() const {
+      return error;
+    }
 
-  uint64_t get_size() const {
-    return size;
-  }
-};
+    /// Read only access to the bytes of the file.
+    const uint8_t *get_data() const {
+      return data;
+    }
 
+    /// Writable access to the bytes of the file. NULL if the map is read only.
+    uint8_t *access_data() {
+      return mode != mode_read ? data : 0;
+    }
+
+    /// Number of bytes in the map.
+    uint64_t get_size() const {
+      return size;
+    }
+  };
+} }
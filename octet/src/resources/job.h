@@ -4,52 +4,520 @@
 //
 // Modular Framework for OpenGLES2 rendering on multiple platforms.
 //
-// work in progress
+// Jobs and the worker thread pool
+//
+// A job is a small piece of work that runs on a worker thread.
+// Jobs can depend on other jobs, in which case they run when the last of
+// their dependencies has finished, and they can be counted with a job_counter
+// so that a group of jobs can be waited on.
+//
+// Jobs that must run on the thread that owns the GL context (texture uploads etc.)
+// are marked as main thread jobs and run from app::render() once per frame.
+//
 
 namespace octet { namespace resources {
-  class job : public resource {
-    ref<job> next;
+  class job_scheduler;
+
+  /// A counter for a group of jobs. It is zero when all the jobs are done.
+  ///
+  /// Example:
+  ///
+  ///     job_counter counter;
+  ///     for (unsigned i = 0; i != 10; ++i) {
+  ///       job_scheduler::get()->add(new my_job(i), &counter);
+  ///     }
+  ///     job_scheduler::get()->wait(&counter);
+  class job_counter {
+    std::atomic<int> value;
+
+    job_counter(const job_counter &rhs);
+    void operator=(const job_counter &rhs);
+  public:
+    job_counter(int initial_value=0) : value(initial_value) {
+    }
+
+    /// add some work to the counter.
+    void add(int amount) {
+      value.fetch_add(amount);
+    }
 
+    /// mark one item of work as done.
+    void done() {
+      value.fetch_sub(1);
+    }
+
+    /// true if there is no more work to do.
+    bool is_done() const {
+      return value.load() <= 0;
+    }
+
+    /// amount of work left to do.
+    int get_value() const {
+      return value.load();
+    }
+  };
+
+  /// Base class for jobs. Override kernel() to do the work.
+  ///
+  /// Jobs are shared between threads, so they have their own atomic reference count
+  /// and can be held in a ref<job>.
+  class job {
+  public:
     enum state_t {
-      state_waiting,
+      state_waiting,  // waiting to be added or for dependencies to finish
+      state_queued,   // in a queue ready to run
       state_running,
+      state_done,
     };
 
-    state_t state;
+  private:
+    friend class job_scheduler;
+
+    std::atomic<int> ref_cnt;
 
-    class scheduler {
-      job *waiting;
-      job *running;
+    // things stopping this job from being queued: one for each unfinished dependency
+    // plus one until job_scheduler::add() is called.
+    std::atomic<int> num_blockers;
+
+    std::atomic<int> state;
+
+    // guards continuations and the transition to state_done.
+    std::mutex lock;
+
+    // jobs waiting for us to finish (we hold a reference to them).
+    dynarray<job*> continuations;
+
+    // optional counter to decrement when we are done.
+    job_counter *counter;
+
+    // run on the main (GL) thread, not on a worker.
+    bool main_thread;
+
+    job(const job &rhs);
+    void operator=(const job &rhs);
+  public:
+    /// make a new job. Set main_thread to run the job on the thread that owns the GL context.
+    job(bool main_thread_=false) : ref_cnt(0), num_blockers(1), state(state_waiting) {
+      counter = 0;
+      main_thread = main_thread_;
+    }
+
+    virtual ~job() {
+    }
+
+    /// Do the work.
+    virtual void kernel() = 0;
+
+    /// Return false to postpone a queued job (eg. waiting for an external event).
+    /// A postponed job is tried again at the next job_scheduler::poll(), or when a thread waiting for work has nothing else to do.
+    virtual bool is_ready() {
+      return true;
+    }
+
+    /// Don't run this job until other has finished.
+    /// Call this before the job is added to the scheduler.
+    void depends_on(job *other) {
+      assert(get_state() == state_waiting);
+      std::lock_guard<std::mutex> guard(other->lock);
+      if (other->get_state() != state_done) {
+        add_ref();
+        num_blockers.fetch_add(1);
+        other->continuations.push_back(this);
+      }
+    }
+
+    /// Is this job waiting, queued, running or done?
+    state_t get_state() const {
+      return (state_t)state.load();
+    }
+
+    /// Does this job have to run on the main thread?
+    bool is_main_thread() const {
+      return main_thread;
+    }
+
+    /// allow ref<job>
+    void add_ref() {
+      ref_cnt.fetch_add(1);
+    }
+
+    /// allow ref<job>
+    void release() {
+      if (ref_cnt.fetch_sub(1) == 1) {
+        delete this;
+      }
+    }
+  };
+
+  /// A job made from a function object, such as a C++11 lambda.
+  template <class function_t> class function_job : public job {
+    function_t function;
+  public:
+    function_job(function_t function_, bool main_thread=false) : job(main_thread), function(function_) {
+    }
+
+    void kernel() {
+      function();
+    }
+  };
+
+  /// Make a job from a function object.
+  ///
+  /// Example:
+  ///
+  ///     job_scheduler::get()->add(make_job([=]() { decode(image); }));
+  template <class function_t> job *make_job(function_t function, bool main_thread=false) {
+    return new function_job<function_t>(function, main_thread);
+  }
+
+  /// Fixed size pool of worker threads with work stealing.
+  ///
+  /// Each worker has its own queue. Jobs added from a worker go on its own queue
+  /// and are run newest first (for cache locality). Idle workers steal the
+  /// oldest jobs from other workers. Jobs added from other threads go on a
+  /// shared queue.
+  class job_scheduler {
+    // a double ended queue of jobs with a lock.
+    class job_queue {
+      std::mutex lock;
+      dynarray<job*> items;
+      unsigned head;
     public:
-      scheduler() {
-        waiting = 0;
-        running = 0;
+      job_queue() {
+        head = 0;
       }
 
-      void add_to_waiting(job *jb) {
-        jb->next = waiting;
-        waiting = this;
+      void push_back(job *jb) {
+        std::lock_guard<std::mutex> guard(lock);
+        items.push_back(jb);
+      }
+
+      // newest job
+      job *pop_back() {
+        std::lock_guard<std::mutex> guard(lock);
+        if (items.size() == head) return 0;
+        job *result = items.back();
+        items.pop_back();
+        if (items.size() == head) { items.resize(0); head = 0; }
+        return result;
+      }
+
+      // oldest job
+      job *pop_front() {
+        std::lock_guard<std::mutex> guard(lock);
+        if (items.size() == head) return 0;
+        job *result = items[head++];
+        if (items.size() == head) { items.resize(0); head = 0; }
+        return result;
+      }
+
+      // move all the jobs to result, oldest first.
+      void take_all(dynarray<job*> &result) {
+        std::lock_guard<std::mutex> guard(lock);
+        for (unsigned i = head; i != items.size(); ++i) {
+          result.push_back(items[i]);
+        }
+        items.resize(0);
+        head = 0;
       }
     };
 
-    scheduler *get_scheduler() {
-      static scheduler sch;
-      return &sch;
+    struct worker {
+      job_queue queue;
+      std::thread *thread;
+    };
+
+    dynarray<worker*> workers;
+
+    // jobs added by threads that are not workers.
+    job_queue shared_queue;
+
+    // jobs that must run on the main thread.
+    job_queue main_queue;
+
+    // jobs that were not ready, waiting for requeue_deferred().
+    job_queue deferred;
+
+    // sleeping workers wait for this.
+    std::mutex sleep_lock;
+    std::condition_variable wake;
+    std::atomic<int> num_queued;
+    bool stopping;
+
+    std::thread::id main_thread_id;
+
+    // -1 on non-worker threads
+    static int &worker_index() {
+      static OCTET_THREAD_LOCAL int value = -1;
+      return value;
     }
+
+    static job_scheduler *&instance() {
+      static job_scheduler *value;
+      return value;
+    }
+
+    void push(job *jb) {
+      jb->state.store(job::state_queued);
+      if (jb->main_thread) {
+        main_queue.push_back(jb);
+        return;
+      }
+
+      int index = worker_index();
+      if (index >= 0) {
+        workers[index]->queue.push_back(jb);
+      } else {
+        shared_queue.push_back(jb);
+      }
+
+      num_queued.fetch_add(1);
+      {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+      }
+      wake.notify_one();
+    }
+
+    // find a job: our own queue first, then the shared queue, then steal.
+    job *find_work(int index) {
+      job *result = 0;
+      if (index >= 0) result = workers[index]->queue.pop_back();
+      if (!result) result = shared_queue.pop_front();
+      for (unsigned i = 1; !result && i <= workers.size(); ++i) {
+        unsigned victim = (unsigned)(index + i) % workers.size();
+        if ((int)victim != index) result = workers[victim]->queue.pop_front();
+      }
+      if (result) num_queued.fetch_sub(1);
+      return result;
+    }
+
+    void execute(job *jb) {
+      if (!jb->is_ready()) {
+        // try again later. Pushing it back on its queue would have us pop it again straight away.
+        jb->state.store(job::state_waiting);
+        deferred.push_back(jb);
+        return;
+      }
+
+      jb->state.store(job::state_running);
+      jb->kernel();
+
+      dynarray<job*> continuations;
+      {
+        std::lock_guard<std::mutex> guard(jb->lock);
+        jb->state.store(job::state_done);
+        continuations.reserve(jb->continuations.size());
+        for (unsigned i = 0; i != jb->continuations.size(); ++i) {
+          continuations.push_back(jb->continuations[i]);
+        }
+        jb->continuations.reset();
+      }
+
+      for (unsigned i = 0; i != continuations.size(); ++i) {
+        // the scheduler's reference from add() keeps the job alive once it is queued.
+        job *next = continuations[i];
+        if (next->num_blockers.fetch_sub(1) == 1) {
+          push(next);
+        }
+        next->release();
+      }
+
+      if (jb->counter) jb->counter->done();
+      jb->release();
+    }
+
+    void worker_loop(int index) {
+      worker_index() = index;
+      for (;;) {
+        job *jb = find_work(index);
+        if (jb) {
+          execute(jb);
+        } else {
+          std::unique_lock<std::mutex> guard(sleep_lock);
+          if (stopping) break;
+          if (num_queued.load() == 0) wake.wait(guard);
+        }
+      }
+    }
+
+    // give the jobs that were not ready another chance.
+    // take a copy first, as jobs that are still not ready come straight back.
+    void requeue_deferred() {
+      dynarray<job*> jobs;
+      deferred.take_all(jobs);
+      for (unsigned i = 0; i != jobs.size(); ++i) {
+        push(jobs[i]);
+      }
+    }
+
+    // run a job that is not a main thread job. Returns false if there was nothing to do.
+    bool run_worker_job() {
+      job *jb = find_work(worker_index());
+      if (!jb) return false;
+      execute(jb);
+      return true;
+    }
+
+    static void worker_entry(job_scheduler *sch, int index) {
+      sch->worker_loop(index);
+    }
+
+    job_scheduler(unsigned num_threads) : num_queued(0) {
+      stopping = false;
+      main_thread_id = std::this_thread::get_id();
+      workers.resize(num_threads);
+      for (unsigned i = 0; i != num_threads; ++i) {
+        workers[i] = new worker();
+      }
+      for (unsigned i = 0; i != num_threads; ++i) {
+        workers[i]->thread = new std::thread(worker_entry, this, (int)i);
+      }
+    }
+
   public:
-    job() {
-      scheduler *sch = get_scheduler();
-      sch->add_to_waiting(this);
+    /// Get the scheduler. The first call (from the main thread) starts the worker threads.
+    static job_scheduler *get() {
+      job_scheduler *&value = instance();
+      if (!value) {
+        unsigned num_cpus = std::thread::hardware_concurrency();
+        value = new job_scheduler(num_cpus > 2 ? num_cpus - 1 : 1);
+      }
+      return value;
     }
 
-    virtual ~job() {
+    /// Start the scheduler with a fixed number of worker threads.
+    /// Call this before get() to override the default of one thread per spare CPU.
+    static job_scheduler *startup(unsigned num_threads) {
+      job_scheduler *&value = instance();
+      if (!value) {
+        value = new job_scheduler(num_threads ? num_threads : 1);
+      }
+      return value;
     }
 
-    virtual void kernel() = 0;
-    virtual bool is_ready() = 0;
+    /// Stop the worker threads, if the scheduler has been started.
+    static void shutdown() {
+      job_scheduler *&value = instance();
+      delete value;
+      value = 0;
+    }
+
+    /// Called once per frame by the app on the main thread.
+    /// Run main thread jobs for up to max_seconds (0 for no limit).
+    static void poll(double max_seconds=0) {
+      job_scheduler *value = instance();
+      if (value) value->run_main_thread_jobs(max_seconds);
+    }
+
+    ~job_scheduler() {
+      {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        stopping = true;
+      }
+      wake.notify_all();
+      // workers steal from each other, so join them all before freeing the queues.
+      for (unsigned i = 0; i != workers.size(); ++i) {
+        workers[i]->thread->join();
+      }
+      for (unsigned i = 0; i != workers.size(); ++i) {
+        delete workers[i]->thread;
+        delete workers[i];
+      }
+    }
+
+    /// Number of worker threads.
+    unsigned get_num_threads() const {
+      return workers.size();
+    }
+
+    /// True if we are on the main (GL) thread.
+    bool is_main_thread() const {
+      return std::this_thread::get_id() == main_thread_id;
+    }
+
+    /// Schedule a job. It runs as soon as its dependencies are done.
+    /// If counter is not NULL, it is incremented now and decremented when the job is done.
+    void add(job *jb, job_counter *counter=0) {
+      assert(jb->get_state() == job::state_waiting);
+      jb->add_ref();
+      if (counter) {
+        counter->add(1);
+        jb->counter = counter;
+      }
+      if (jb->num_blockers.fetch_sub(1) == 1) {
+        push(jb);
+      }
+    }
+
+    /// Run one job if there is one, including main thread jobs on the main thread.
+    /// Returns false if there was nothing to do.
+    bool run_one() {
+      job *jb = is_main_thread() ? main_queue.pop_front() : 0;
+      if (!jb) return run_worker_job();
+      execute(jb);
+      return true;
+    }
+
+    /// Wait for a counter to reach zero, running worker jobs while we wait.
+    /// Main thread jobs are left for poll(), so a parallel_for on the main thread does not
+    /// run GL uploads in the middle of an unrelated load. Don't wait here for main thread jobs.
+    void wait(job_counter *counter) {
+      while (!counter->is_done()) {
+        if (!run_worker_job()) {
+          requeue_deferred();
+          std::this_thread::yield();
+        }
+      }
+    }
+
+    /// Run queued main thread jobs for up to max_seconds (0 for no limit).
+    /// Jobs that were not ready are requeued first and only tried once per call.
+    void run_main_thread_jobs(double max_seconds=0) {
+      assert(is_main_thread());
+      requeue_deferred();
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      while (job *jb = main_queue.pop_front()) {
+        execute(jb);
+        if (max_seconds > 0) {
+          std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+          if (elapsed.count() >= max_seconds) break;
+        }
+      }
+    }
+
+    /// Call fn(i0, i1) for sub-ranges [i0, i1) of [begin, end) in parallel and wait for them.
+    /// grain is the smallest range worth giving to a thread.
+    ///
+    /// Example:
+    ///
+    ///     job_scheduler::get()->parallel_for(0, height, 16, [&](unsigned y0, unsigned y1) {
+    ///       for (unsigned y = y0; y != y1; ++y) filter_row(y);
+    ///     });
+    template <class function_t> void parallel_for(unsigned begin, unsigned end, unsigned grain, function_t fn) {
+      if (end <= begin) return;
+      unsigned count = end - begin;
+      if (grain == 0) grain = 1;
+
+      // a few chunks per thread balances the load without too much overhead.
+      unsigned max_chunks = (workers.size() + 1) * 4;
+      unsigned num_chunks = (count + grain - 1) / grain;
+      if (num_chunks > max_chunks) num_chunks = max_chunks;
+      if (num_chunks <= 1) {
+        fn(begin, end);
+        return;
+      }
+
+      job_counter counter;
+      unsigned chunk_size = (count + num_chunks - 1) / num_chunks;
+      unsigned i0 = begin + chunk_size;
+      for (; i0 < end; i0 += chunk_size) {
+        unsigned i1 = end - i0 < chunk_size ? end : i0 + chunk_size;
+        add(make_job([=]() { fn(i0, i1); }), &counter);
+      }
 
-    state_t get_state() {
-      return state;
+      // do the first chunk ourselves.
+      fn(begin, begin + chunk_size);
+      wait(&counter);
     }
   };
 } }
@@ -15,6 +15,12 @@
   atom_t get_type() { return atom_##classname; } \
   static atom_t get_type_static() { return atom_##classname; }
 
+// this macro makes a class allocate from its own pool (see type_pool in allocator.h)
+// use it for small resources that are made and destroyed often.
+#define RESOURCE_POOL(classname) \
+  void *operator new (size_t size) { return type_pool<classname>::malloc(size); } \
+  void operator delete (void *ptr, size_t size) { type_pool<classname>::free(ptr, size); }
+
 namespace octet { namespace resources {
   /// Base class for resources; provides aligned allocation and reference counting.
   class resource {
@@ -58,6 +64,11 @@ namespace octet { namespace resources {
       ref_count++;
     }
 
+    /// How many lives do we have?
+    int get_ref_count() const {
+      return ref_count;
+    }
+
     /// Remove a life from this resource and delete it if it is dead; see the %ref class.
     void release() {
       if (--ref_count == 0) {
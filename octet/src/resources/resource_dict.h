@@ -12,10 +12,126 @@ namespace octet { namespace resources {
   ///
   /// Used to hold resources in a game and access them by name.
   ///
+  /// A dictionary saved with save_archive() can be opened with open_archive(), which only reads
+  /// the table of contents and the active scene. Other resources are read when they are first
+  /// asked for. Call trim() between frames to keep within the memory budget: it drops resources
+  /// that are only held by the dictionary, and they are read again the next time they are asked for.
+  /// Lookups never drop anything, so a pointer from get_mesh() etc. stays valid until the next trim().
+  ///
   class resource_dict : public resource {
     dictionary<ref<resource> > dict;
     ref<scene::visual_scene> active_scene;
 
+    // an entry of the archive opened by open_archive()
+    struct archive_entry {
+      resource *res;        // NULL if not loaded
+      ref<resource> pinned; // holds entries that are not in the dictionary
+      uint64_t bytes;
+      unsigned last_use;
+      bool named;           // in the dictionary under the entry's name
+    };
+
+    // finds other entries as the binary reader comes across them
+    class archive_loader : public binary_reader::entry_loader {
+      resource_dict *owner;
+    public:
+      archive_loader(resource_dict *owner) : owner(owner) {}
+
+      void *get_entry(unsigned index) {
+        return owner->load_archive_entry(index);
+      }
+
+      void set_entry(unsigned index, void *root) {
+        owner->set_archive_entry(index, (resource*)root);
+      }
+    };
+
+    binary_reader *archive;
+    archive_loader loader;
+    dictionary<int> archive_index;
+    dynarray<archive_entry> archive_entries;
+    uint64_t archive_budget;
+    uint64_t archive_bytes;
+    unsigned archive_clock;
+
+    // make a loaded entry visible, including to the entries it refers to.
+    void set_archive_entry(unsigned index, resource *res) {
+      archive_entry &entry = archive_entries[index];
+      entry.res = res;
+      entry.last_use = ++archive_clock;
+      archive_bytes += entry.bytes;
+      if (entry.named) {
+        dict[archive->get_entry_name(index)] = res;
+      } else {
+        entry.pinned = res;
+      }
+    }
+
+    // drop an entry that nothing else is using.
+    void evict_archive_entry(unsigned index) {
+      archive_entry &entry = archive_entries[index];
+      archive_bytes -= entry.bytes;
+      entry.res = NULL;
+      dict[archive->get_entry_name(index)] = NULL;
+    }
+
+    // drop the least recently used entries until we are within the budget.
+    void trim_archive() {
+      while (archive_bytes > archive_budget) {
+        int lru = -1;
+        for (unsigned i = 0; i != archive_entries.size(); ++i) {
+          archive_entry &entry = archive_entries[i];
+          if (entry.res && entry.named && entry.res->get_ref_count() == 1) {
+            if (lru == -1 || entry.last_use < archive_entries[lru].last_use) lru = (int)i;
+          }
+        }
+        if (lru == -1) return;
+        evict_archive_entry((unsigned)lru);
+      }
+    }
+
+    // get an entry of the archive, reading it if it is not loaded.
+    resource *load_archive_entry(unsigned index) {
+      archive_entry &entry = archive_entries[index];
+      if (entry.res) {
+        entry.last_use = ++archive_clock;
+        return entry.res;
+      }
+
+      binary_reader reader(*archive, index, &loader);
+      ref<resource> root;
+      reader.visit(root, atom_);
+
+      if (reader.get_error() || !root) {
+        log("error: unable to load %s from archive\n", archive->get_entry_name(index));
+        if (entry.res) {
+          archive_bytes -= entry.bytes;
+          entry.res = NULL;
+          entry.pinned = NULL;
+          if (entry.named) dict[archive->get_entry_name(index)] = NULL;
+        }
+        return NULL;
+      }
+      return entry.res;
+    }
+
+    // read every entry of the archive, for example before saving.
+    void load_archive() {
+      if (!archive) return;
+      for (unsigned i = 0; i != archive_entries.size(); ++i) {
+        load_archive_entry(i);
+      }
+    }
+
+    void close_archive() {
+      archive_entries.reset();
+      archive_index.reset();
+      archive_bytes = 0;
+      archive_clock = 0;
+      delete archive;
+      archive = NULL;
+    }
+
     #ifdef WIN32
       // vc2010/../
       static const char *prefix() { return "../"; }
@@ -64,11 +180,21 @@ namespace octet { namespace resources {
     }
   public:
     /// Construct a new resource dictionary
-    resource_dict() {
+    resource_dict() : loader(this) {
+      archive = NULL;
+      archive_budget = ~(uint64_t)0;
+      archive_bytes = 0;
+      archive_clock = 0;
+    }
+
+    /// Destroy the dictionary and close the archive, if any.
+    ~resource_dict() {
+      close_archive();
     }
 
     /// Visitor for loading and saving
     virtual void visit(visitor &v) {
+      if (!v.is_reader()) load_archive();
       v.visit(active_scene, atom_active_scene);
       v.visit(dict, atom_dict);
     }
@@ -76,6 +202,35 @@ namespace octet { namespace resources {
     /// Reset the dictionary, clearing all data
     void reset() {
       dict.reset();
+      close_archive();
+    }
+
+    /// Save the dictionary as an archive with a table of contents, one entry per resource,
+    /// so that it can be opened with open_archive(). Returns false if the file can not be written.
+    /// Options are binary_writer::option_compress etc.
+    bool save_archive(const char *path, unsigned options = 0);
+
+    /// Open an archive written by save_archive(), replacing the contents of the dictionary.
+    /// Only the active scene and what it refers to are read now. Other resources are read
+    /// when they are first asked for; trim() drops unused ones to keep within the budget.
+    bool open_archive(const char *url, uint64_t memory_budget = ~(uint64_t)0);
+
+    /// Change the memory budget for resources read from the archive and trim() to fit.
+    void set_memory_budget(uint64_t memory_budget) {
+      archive_budget = memory_budget;
+      trim_archive();
+    }
+
+    /// Drop the least recently used archive resources that only the dictionary holds until we
+    /// are within the memory budget. Call this between frames, when pointers from get_mesh() etc.
+    /// that were not put in a ref<> are no longer in use.
+    void trim() {
+      trim_archive();
+    }
+
+    /// Approximate bytes of memory used by resources read from the archive.
+    uint64_t get_archive_bytes() const {
+      return archive_bytes;
     }
 
     /// does the dictionary have this resource?
@@ -94,9 +249,14 @@ namespace octet { namespace resources {
 
       if (!dict.contains(name)) {
         return NULL;
-      } else {
-        return dict[name];
       }
+
+      resource *res = dict[name];
+      if (archive && archive_index.contains(name)) {
+        int index = archive_index[name];
+        res = index >= 0 ? load_archive_entry((unsigned)index) : res;
+      }
+      return res;
     }
 
     /// As this dict represents a game world, what is the active scene?
@@ -111,6 +271,17 @@ namespace octet { namespace resources {
 
     void set_resource(const char *name, resource *value) {
       if (name && name[0]) {
+        if (archive && archive_index.contains(name)) {
+          // replacing a resource from the archive, forget the entry.
+          int &index = archive_index[name];
+          if (index >= 0) {
+            archive_entry &entry = archive_entries[index];
+            if (entry.res) archive_bytes -= entry.bytes;
+            entry.res = NULL;
+            entry.named = false;
+            index = -1;
+          }
+        }
         dict[name] = value;
       }
     }
@@ -133,6 +304,14 @@ namespace octet { namespace resources {
       return result;
     }
 
+    /// Start loading an image on the worker threads. Returns at once with an image that draws
+    /// as grey until the pixels arrive. The image is added to the dictionary under its url.
+    scene::image *load_image_async(const char *url, stream_queue &queue, int priority=0);
+
+    /// Start loading an OBJ mesh on the worker threads. Returns at once with an empty mesh
+    /// that is filled in on the main thread when the file has been parsed.
+    scene::mesh *load_mesh_async(const char *url, stream_queue &queue, int priority=0);
+
     #define OCTET_CLASS(N, X) N::X *get_##X(const char *id) { resource *res = get_resource(id); return res ? res->get_##X() : 0; }
     //#pragma message("resource_dict.h")
     #include "classes.h"
@@ -145,7 +324,14 @@ namespace octet { namespace resources {
         const char *key = dict.get_key(i);
         if (key) {
           resource *res = dict.get_value(i);
-          if (res->get_type() == type) {
+          if (!res && archive && archive_index.contains(key)) {
+            // only read entries of the right type
+            int index = archive_index[key];
+            if (index >= 0 && archive->get_entry_type((unsigned)index) == type) {
+              res = load_archive_entry((unsigned)index);
+            }
+          }
+          if (res && res->get_type() == type) {
             result.push_back(res);
           }
         }
@@ -159,7 +345,15 @@ namespace octet { namespace resources {
         const char *key = dict.get_key(i);
         if (key) {
           resource *res = dict.get_value(i);
-          const char *type = app_utils::get_atom_name(res->get_type());
+          atom_t type_atom = atom_;
+          if (res) {
+            type_atom = res->get_type();
+          } else if (archive && archive_index.contains(key) && archive_index[key] >= 0) {
+            type_atom = archive->get_entry_type((unsigned)archive_index[key]);
+          } else {
+            continue;
+          }
+          const char *type = app_utils::get_atom_name(type_atom);
           string c_name = key;
           for (char *p = c_name.data(); *p; ++p) {
             if (*p == '-' || *p == '+') *p = '_';
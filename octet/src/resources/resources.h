@@ -21,6 +21,7 @@
   #include "../resources/zip_file.h"
   #include "../resources/app_utils.h"
   #include "../resources/visitor.h"
+  #include "../resources/binary_format.h"
   #include "../resources/binary_writer.h"
   #include "../resources/binary_reader.h"
   #include "../resources/xml_writer.h"
@@ -14,23 +14,32 @@ GLuint octet::resources::resource_dict::get_texture_handle_internal(unsigned gl_
   } else if (url[0] == '#') {
     return app_utils::get_solid_texture(gl_kind, url+1);
   } else {
-    dynarray<uint8_t> buffer;
+    // decode straight from the mapped file.
+    ref<file_map> file = app_utils::map_url(url);
+    if (!file) return 0;
     dynarray<uint8_t> image;
-    app_utils::get_url(buffer, url);
     uint16_t format = 0;
     uint16_t width = 0;
     uint16_t height = 0;
-    const unsigned char *src = &buffer[0];
-    const unsigned char *src_max = src + buffer.size();
-    if (buffer.size() >= 6 && !memcmp(&buffer[0], "GIF89a", 6)) {
+    const unsigned char *src = file->get_data();
+    const unsigned char *src_max = src + file->get_size();
+    size_t size = (size_t)file->get_size();
+    if (size >= 6 && !memcmp(src, "GIF89a", 6)) {
       gif_decoder dec;
       dec.get_image(image, format, width, height, src, src_max);
-    } else if (buffer.size() >= 6 && buffer[0] == 0xff && buffer[1] == 0xd8) {
+    } else if (size >= 6 && src[0] == 0xff && src[1] == 0xd8) {
       jpeg_decoder dec;
       dec.get_image(image, format, width, height, src, src_max);
-    } else if (buffer.size() >= 6 && buffer[0] == 0 && buffer[1] == 0 && buffer[2] == 2) {
+    } else if (size >= 6 && src[0] == 0 && src[1] == 0 && src[2] == 2) {
       tga_decoder dec;
       dec.get_image(image, format, width, height, src, src_max);
+    } else if (size >= 4 && !memcmp(src, "DDS ", 4)) {
+      // keep DXT and RGTC images compressed.
+      dds_decoder dec;
+      uint8_t mip_levels = 1;
+      dec.get_image(image, format, width, height, mip_levels, src, src_max);
+      if (!width || !height || !format) return 0;
+      return app_utils::make_compressed_texture(format, image.data(), width, height, mip_levels);
     } else {
       printf("warning: unknown texture format\n");
       return 0;
@@ -55,3 +64,248 @@ inline octet::resources::resource *octet::resources::resource::new_type(atom_t t
   return NULL;
 }
 
+
+namespace octet { namespace resources {
+  /// Parses an OBJ file on a worker thread and fills in a mesh on the main thread.
+  class mesh_load_request : public stream_request {
+    ref<scene::mesh> target;
+    dynarray<scene::mesh::vertex> vertices;
+    dynarray<uint32_t> indices;
+    bool ok;
+  public:
+    mesh_load_request(scene::mesh *target_, const char *url, int priority) : stream_request(url, priority) {
+      target = target_;
+      ok = false;
+    }
+
+    void load() {
+      loaders::obj_loader loader;
+      ok = loader.get_mesh_data(get_url(), vertices, indices);
+    }
+
+    void finish() {
+      if (ok) {
+        target->set_vertices(vertices);
+        target->set_indices(indices);
+        target->calc_aabb();
+      } else {
+        printf("warning: could not load mesh %s\n", get_url());
+      }
+      target = 0;
+    }
+  };
+} }
+
+inline octet::scene::image *octet::resources::resource_dict::load_image_async(const char *url, stream_queue &queue, int priority) {
+  scene::image *img = get_image(url);
+  if (!img) {
+    img = new scene::image(url);
+    set_resource(url, img);
+  }
+  img->load_async(queue, priority);
+  return img;
+}
+
+inline octet::scene::mesh *octet::resources::resource_dict::load_mesh_async(const char *url, stream_queue &queue, int priority) {
+  scene::mesh *msh = get_mesh(url);
+  if (msh) return msh;
+
+  // an empty mesh draws nothing, but it needs buffers to bind.
+  msh = new scene::mesh();
+  msh->set_default_attributes();
+  gl_resource *vertices = new gl_resource();
+  vertices->allocate(GL_ARRAY_BUFFER, 0);
+  gl_resource *indices = new gl_resource();
+  indices->allocate(GL_ELEMENT_ARRAY_BUFFER, 0);
+  msh->set_vertices(vertices);
+  msh->set_indices(indices);
+  set_resource(url, msh);
+
+  queue.add(new mesh_load_request(msh, url, priority));
+  return msh;
+}
+
+inline bool octet::resources::resource_dict::save_archive(const char *path, unsigned options) {
+  load_archive();
+
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    printf("warning: could not write %s\n", path);
+    return false;
+  }
+
+  // one entry for each resource and one for the active scene if it is not in the dictionary.
+  dynarray<const char *> names;
+  dynarray<resource *> roots;
+  unsigned num_indices = dict.get_num_indices();
+  for (unsigned i = 0; i != num_indices; ++i) {
+    const char *key = dict.get_key(i);
+    if (key && dict.get_value(i)) {
+      names.push_back(key);
+      roots.push_back(dict.get_value(i));
+    }
+  }
+
+  resource *scene = active_scene;
+  int active_entry = -1;
+  for (unsigned i = 0; i != roots.size() && active_entry == -1; ++i) {
+    if (roots[i] == scene) active_entry = (int)i;
+  }
+  if (scene && active_entry == -1) {
+    active_entry = (int)roots.size();
+    names.push_back("");
+    roots.push_back(scene);
+  }
+
+  bool ok = false;
+  {
+    binary_writer writer(file, options);
+    for (unsigned i = 0; i != roots.size(); ++i) {
+      writer.add_entry_ref(roots[i], i);
+    }
+    for (unsigned i = 0; i != roots.size(); ++i) {
+      ref<resource> root = roots[i];
+      writer.begin_entry(roots[i]);
+      writer.visit(root, atom_);
+      writer.end_entry(names[i], roots[i]->get_type());
+    }
+    writer.set_active_entry(active_entry);
+    ok = writer.finish() && !writer.get_error();
+  }
+  fclose(file);
+  return ok;
+}
+
+inline bool octet::resources::resource_dict::open_archive(const char *url, uint64_t memory_budget) {
+  dict.reset();
+  active_scene = 0;
+  close_archive();
+
+  archive = new binary_reader(url);
+  unsigned num_entries = archive->get_num_entries();
+  if (archive->get_error() || num_entries == 0) {
+    printf("warning: %s is not an archive with a table of contents\n", url);
+    close_archive();
+    return false;
+  }
+
+  archive_budget = memory_budget;
+  archive_entries.resize(num_entries);
+  for (unsigned i = 0; i != num_entries; ++i) {
+    archive_entry &entry = archive_entries[i];
+    const char *name = archive->get_entry_name(i);
+    entry.res = NULL;
+    entry.bytes = archive->get_entry_bytes(i);
+    entry.last_use = 0;
+    entry.named = name[0] != 0;
+    if (entry.named) {
+      // the name is there from the start, the resource comes later.
+      archive_index[name] = (int)i;
+      dict[name] = 0;
+    }
+  }
+
+  int active_entry = archive->get_active_entry();
+  if (active_entry >= 0) {
+    resource *res = load_archive_entry((unsigned)active_entry);
+    active_scene = res ? res->get_visual_scene() : 0;
+    if (!active_scene) {
+      printf("warning: could not load the active scene from %s\n", url);
+      return false;
+    }
+  }
+  return true;
+}
+
+#if OCTET_UNIT_TEST
+  namespace octet { namespace resources {
+    /// binary_writer and binary_reader round trip. This lives here as it needs the scene classes.
+    class binary_archive_unit_test {
+      // write an animation of a small node tree, returns the archive.
+      static void write_archive(dynarray<uint8_t> &bytes, scene::animation *anim, unsigned options) {
+        FILE *file = tmpfile();
+        {
+          binary_writer writer(file, options);
+          ref<resource> root = anim;
+          writer.visit(root, atom_);
+          bool finished = writer.finish();
+          assert(finished && !writer.get_error());
+          (void)finished;
+        }
+        bytes.resize((unsigned)ftell(file));
+        rewind(file);
+        size_t bytes_read = fread(bytes.data(), 1, bytes.size(), file);
+        assert(bytes_read == bytes.size());
+        (void)bytes_read;
+        fclose(file);
+      }
+
+      // read the first size bytes of an archive. returns false on an error.
+      static bool read_archive(ref<resource> &root, const dynarray<uint8_t> &bytes, size_t size) {
+        ref<file_map> map = new file_map((uint64_t)size);
+        if (size) memcpy(map->access_data(), bytes.data(), size);
+        binary_reader reader(map);
+        if (!reader.get_error()) reader.visit(root, atom_);
+        return !reader.get_error();
+      }
+
+    public:
+      binary_archive_unit_test() {
+        using namespace scene;
+
+        // a node with two children, animated by 200 matrices. The key frames go in the data chunk.
+        mat4t m;
+        m.loadIdentity();
+        m.translate(1, 2, 3);
+        ref<scene_node> node = new scene_node(m, app_utils::get_atom("unit_test_node"));
+        node->add_child(new scene_node(m, app_utils::get_atom("unit_test_child0")));
+        node->add_child(new scene_node(m, app_utils::get_atom("unit_test_child1")));
+
+        dynarray<float> times(200);
+        dynarray<float> values(200 * 16);
+        for (unsigned i = 0; i != values.size(); ++i) {
+          values[i] = (float)(i % 16 == 0 || i % 16 == 5 || i % 16 == 10 || i % 16 == 15) + (i % 16 == 3 ? i * 0.01f : 0);
+        }
+        for (unsigned i = 0; i != times.size(); ++i) times[i] = i * 0.01f;
+        ref<animation> anim = new animation();
+        anim->add_channel(node, node->get_sid(), atom_transform, atom_, times, values);
+
+        static const unsigned options[] = { 0, binary_writer::option_compress, binary_writer::option_compress | binary_writer::option_filter };
+        for (unsigned i = 0; i != sizeof(options)/sizeof(options[0]); ++i) {
+          dynarray<uint8_t> bytes;
+          write_archive(bytes, anim, options[i]);
+
+          ref<resource> root;
+          bool ok = read_archive(root, bytes, bytes.size());
+          assert(ok);
+          (void)ok;
+          animation *result = root ? root->get_animation() : NULL;
+          assert(result);
+          if (!result) continue;
+
+          assert(result->get_num_channels() == 1 && result->get_end_time() == anim->get_end_time());
+          scene_node *result_node = result->get_target(0)->get_scene_node();
+          assert(result_node && result_node->get_num_children() == 2);
+          assert(result_node->get_child(1)->get_sid() == app_utils::get_atom("unit_test_child1"));
+          assert(!memcmp(result_node->get_child(0)->get_nodeToParent().get(), m.get(), sizeof(mat4t)));
+
+          // the key frames survive, including any filtering.
+          for (float t = 0; t < 2; t += 0.25f) {
+            anim->eval_chan(0, t, node);
+            result->eval_chan(0, t, result_node);
+            assert(!memcmp(node->get_nodeToParent().get(), result_node->get_nodeToParent().get(), sizeof(mat4t)));
+          }
+
+          // truncated archives are errors, not crashes.
+          for (size_t size = 0; size < bytes.size(); size += bytes.size() / 7 + 1) {
+            ref<resource> partial;
+            bool partial_ok = read_archive(partial, bytes, size);
+            assert(!partial_ok);
+            (void)partial_ok;
+          }
+        }
+      }
+    };
+    static binary_archive_unit_test binary_archive_unit_test;
+  } }
+#endif
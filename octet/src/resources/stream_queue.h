@@ -0,0 +1,256 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Asset streaming queue
+//
+// Loads run in two halves: load() reads and decodes on a worker thread
+// and finish() runs on the main thread to make GL objects.
+// The main thread half is limited to a time budget each frame so that
+// loading a large scene does not stall the frame rate.
+//
+
+namespace octet { namespace resources {
+  /// A request to load something in the background. Override load() and finish().
+  class stream_request {
+  public:
+    enum state_t {
+      state_pending,    // waiting in the queue
+      state_loading,    // running load() on a worker
+      state_finishing,  // waiting for finish() on the main thread
+      state_done,
+    };
+
+  private:
+    friend class stream_queue;
+
+    std::atomic<int> ref_cnt;
+    std::atomic<int> state;
+    string url;
+    int priority;
+
+    // keep the request in the queue's finished list when done.
+    bool retain;
+
+    stream_request(const stream_request &rhs);
+    void operator=(const stream_request &rhs);
+  public:
+    /// Make a request to load a url. Higher priorities load first.
+    stream_request(const char *url_, int priority_=0) : ref_cnt(0), state(state_pending) {
+      url = url_;
+      priority = priority_;
+      retain = false;
+    }
+
+    virtual ~stream_request() {
+    }
+
+    /// Worker thread: read and decode the url. Do not call GL functions here.
+    virtual void load() {
+    }
+
+    /// Main thread: make GL objects from the decoded data.
+    virtual void finish() {
+    }
+
+    /// url of the asset to load.
+    const char *get_url() const {
+      return url.c_str();
+    }
+
+    /// Higher priorities load first.
+    int get_priority() const {
+      return priority;
+    }
+
+    /// Where are we in the load?
+    state_t get_state() const {
+      return (state_t)state.load();
+    }
+
+    /// true when finish() has been called.
+    bool is_done() const {
+      return get_state() == state_done;
+    }
+
+    /// allow ref<stream_request>
+    void add_ref() {
+      ref_cnt.fetch_add(1);
+    }
+
+    /// allow ref<stream_request>
+    void release() {
+      if (ref_cnt.fetch_sub(1) == 1) {
+        delete this;
+      }
+    }
+  };
+
+  /// Priority queue of stream_requests. Owned by the app and updated once per frame.
+  ///
+  /// Example:
+  ///
+  ///     ref<image> img = dict.load_image_async("assets/big.jpg", access_load_queue());
+  ///     // img is a grey placeholder until the image has loaded.
+  class stream_queue {
+    // requests waiting to start, lowest priority first.
+    dynarray<stream_request*> pending;
+
+    // completed requests that the app wants to see (eg. dropped files).
+    dynarray<stream_request*> finished;
+
+    // the queue only touches these on the main thread.
+    unsigned num_in_flight;
+    unsigned max_in_flight;
+    double frame_budget;
+
+    job_counter counter;
+
+    stream_queue(const stream_queue &rhs);
+    void operator=(const stream_queue &rhs);
+
+    // we pop from the back, so put new requests below older ones of equal priority.
+    void insert(stream_request *req) {
+      unsigned i = 0;
+      while (i != pending.size() && pending[i]->priority < req->priority) ++i;
+      pending.push_back(req);
+      for (unsigned j = pending.size() - 1; j > i; --j) {
+        pending[j] = pending[j-1];
+      }
+      pending[i] = req;
+    }
+
+    // start as many requests as we are allowed to.
+    void start_pending() {
+      if (pending.size() && !max_in_flight) {
+        max_in_flight = job_scheduler::get()->get_num_threads() * 2;
+      }
+
+      while (pending.size() && num_in_flight < max_in_flight) {
+        stream_request *req = pending.back();
+        pending.pop_back();
+        start(req);
+      }
+    }
+
+    // start the top priority request on the worker threads.
+    void start(stream_request *req) {
+      job_scheduler *sch = job_scheduler::get();
+      num_in_flight++;
+      req->state.store(stream_request::state_loading);
+
+      // the queue holds the reference until finish, so the jobs can use a plain pointer.
+      ref<job> loader = make_job([req]() {
+        req->load();
+        req->state.store(stream_request::state_finishing);
+      });
+
+      stream_queue *queue = this;
+      ref<job> finisher = make_job([req, queue]() {
+        req->finish();
+        req->state.store(stream_request::state_done);
+        queue->num_in_flight--;
+        if (req->retain) {
+          queue->finished.push_back(req);
+        } else {
+          req->release();
+        }
+      }, true);
+
+      finisher->depends_on(loader);
+      sch->add(finisher, &counter);
+      sch->add(loader, &counter);
+    }
+  public:
+    /// Make a new queue. max_in_flight limits the number of decodes at once (0 for two per worker thread).
+    /// frame_budget is the time in seconds to spend on main thread work each frame (0 for no limit).
+    stream_queue(unsigned max_in_flight_=0, double frame_budget_=0.004) {
+      num_in_flight = 0;
+      max_in_flight = max_in_flight_;
+      frame_budget = frame_budget_;
+    }
+
+    /// Wait for everything to finish.
+    ~stream_queue() {
+      flush();
+      for (unsigned i = 0; i != pending.size(); ++i) {
+        pending[i]->release();
+      }
+      for (unsigned i = 0; i != finished.size(); ++i) {
+        finished[i]->release();
+      }
+    }
+
+    /// Add a request. If retain is true, get_finished() will return it when it is done.
+    void add(stream_request *req, bool retain=false) {
+      req->add_ref();
+      req->retain = retain;
+      insert(req);
+    }
+
+    /// Change the priority of a request that has not started yet.
+    void set_priority(stream_request *req, int priority) {
+      for (unsigned i = 0; i != pending.size(); ++i) {
+        if (pending[i] == req) {
+          pending.erase(i);
+          req->priority = priority;
+          insert(req);
+          return;
+        }
+      }
+    }
+
+    /// Call once per frame on the main thread: start new loads and finish completed ones.
+    void update() {
+      start_pending();
+      job_scheduler::poll(frame_budget);
+    }
+
+    /// Block until every request has finished. Use for loading screens.
+    void flush() {
+      job_scheduler *sch = job_scheduler::get();
+      while (pending.size() || num_in_flight) {
+        start_pending();
+
+        // wait() leaves main thread jobs alone, so run the finish() jobs here.
+        while (!counter.is_done()) {
+          if (!sch->run_one()) {
+            job_scheduler::poll();
+            std::this_thread::yield();
+          }
+        }
+      }
+    }
+
+    /// Set the time in seconds to spend finishing requests each frame (0 for no limit).
+    void set_frame_budget(double seconds) {
+      frame_budget = seconds;
+    }
+
+    /// Number of requests that have not started.
+    unsigned get_num_pending() const {
+      return pending.size();
+    }
+
+    /// Number of requests being loaded or waiting for finish().
+    unsigned get_num_in_flight() const {
+      return num_in_flight;
+    }
+
+    /// true if there is nothing to do.
+    bool is_idle() const {
+      return pending.size() == 0 && num_in_flight == 0;
+    }
+
+    /// Move finished requests that were added with retain=true to result.
+    void get_finished(dynarray<ref<stream_request> > &result) {
+      for (unsigned i = 0; i != finished.size(); ++i) {
+        result.push_back(finished[i]);
+        finished[i]->release();
+      }
+      finished.resize(0);
+    }
+  };
+} }
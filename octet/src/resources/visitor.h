@@ -20,7 +20,7 @@ namespace octet { namespace resources {
   /// A visitor pattern can be used to solve a number of problems and provides
   /// "Metadata" for the classes.
   class visitor {
-    enum { debug = true };
+    enum { debug = false };
     unsigned depth;
     bool error;
 
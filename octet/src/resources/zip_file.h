@@ -6,82 +6,299 @@
 //
 
 namespace octet { namespace resources {
+  /// Sequential reader for one entry of a zip file.
+  /// Compressed entries are inflated a piece at a time, so only what is read is decoded.
+  ///
+  /// Example:
+  ///
+  ///     ref<zip_stream> str = zip->open_stream("models/big.dae");
+  ///     uint8_t tmp[4096];
+  ///     while (size_t bytes = str->read(tmp, sizeof(tmp))) parse(tmp, bytes);
+  class zip_stream {
+    enum {
+      // deflate matches reach back up to 32k, so we keep that much history.
+      history_size = 0x8000,
+      chunk_size = 0x10000,
+    };
+
+    std::atomic<int> ref_cnt;
+
+    // keep the archive mapped while we read it.
+    ref<file_map> the_map;
+    const uint8_t *src;
+    uint64_t csize;
+    uint64_t size;
+    uint64_t pos;
+    bool compressed;
+    bool error;
+
+    // compressed entries: decoded bytes are window[read_pos..decoded_end).
+    zip_decoder decoder;
+    dynarray<uint8_t> window;
+    unsigned read_pos;
+    unsigned decoded_end;
+    uint64_t decoded;
+
+    zip_stream(const zip_stream &rhs);
+    void operator=(const zip_stream &rhs);
+
+    // inflate some more bytes into the window. returns false at the end or on an error.
+    bool fill() {
+      if (decoded == size || error) return false;
+      if (window.size() == 0) {
+        window.resize(history_size + chunk_size);
+      }
+      if (decoded_end + chunk_size > window.size()) {
+        // slide the last 32k down to the bottom of the window.
+        memmove(window.data(), window.data() + decoded_end - history_size, history_size);
+        read_pos = decoded_end = history_size;
+      }
+      uint8_t *dest = window.data() + decoded_end;
+      uint64_t todo = size - decoded;
+      uint8_t *dest_max = dest + ( todo < chunk_size ? (unsigned)todo : (unsigned)chunk_size );
+      if (!decoder.inflate(window.data(), dest, dest_max) || dest == window.data() + decoded_end) {
+        error = true;
+        return false;
+      }
+      unsigned bytes = (unsigned)( dest - ( window.data() + decoded_end ) );
+      decoded_end += bytes;
+      decoded += bytes;
+      return true;
+    }
+  public:
+    /// Read an entry of a mapped zip file. Use zip_file::open_stream() to make one of these.
+    zip_stream(file_map *map, const uint8_t *src_, uint64_t csize_, uint64_t usize, bool compressed_) {
+      ref_cnt = 0;
+      the_map = map;
+      src = src_;
+      csize = csize_;
+      size = usize;
+      pos = 0;
+      compressed = compressed_;
+      error = false;
+      read_pos = decoded_end = 0;
+      decoded = 0;
+      if (compressed) {
+        decoder.begin(src, src + csize);
+      }
+      the_map->advise(file_map::hint_sequential, (uint64_t)( src - the_map->get_data() ), csize);
+    }
+
+    /// Copy up to bytes bytes to dest. Returns the number of bytes read, 0 at the end of the entry.
+    size_t read(void *dest, size_t bytes) {
+      uint8_t *out = (uint8_t *)dest;
+      if (bytes > size - pos) bytes = (size_t)( size - pos );
+      size_t done = 0;
+      if (!compressed) {
+        memcpy(out, src + pos, bytes);
+        done = bytes;
+      } else {
+        while (done != bytes) {
+          if (read_pos == decoded_end && !fill()) break;
+          size_t avail = decoded_end - read_pos;
+          if (avail > bytes - done) avail = bytes - done;
+          memcpy(out + done, window.data() + read_pos, avail);
+          read_pos += (unsigned)avail;
+          done += avail;
+        }
+      }
+      pos += done;
+      return done;
+    }
+
+    /// Skip bytes without copying them. Compressed entries still have to be decoded.
+    void skip(uint64_t bytes) {
+      if (bytes > size - pos) bytes = size - pos;
+      if (!compressed) {
+        pos += bytes;
+      } else {
+        while (bytes) {
+          if (read_pos == decoded_end && !fill()) break;
+          unsigned avail = decoded_end - read_pos;
+          if (avail > bytes) avail = (unsigned)bytes;
+          read_pos += avail;
+          pos += avail;
+          bytes -= avail;
+        }
+      }
+    }
+
+    /// Uncompressed size of the entry.
+    uint64_t get_size() const {
+      return size;
+    }
+
+    /// Number of bytes read so far.
+    uint64_t get_pos() const {
+      return pos;
+    }
+
+    /// true when the whole entry has been read.
+    bool is_eof() const {
+      return pos == size || error;
+    }
+
+    /// true if the compressed data is corrupt.
+    bool get_error() const {
+      return error;
+    }
+
+    /// allow ref<zip_stream>
+    void add_ref() {
+      ref_cnt.fetch_add(1);
+    }
+
+    /// allow ref<zip_stream>
+    void release() {
+      if (ref_cnt.fetch_sub(1) == 1) {
+        delete this;
+      }
+    }
+  };
+
   /// Zip file reader, uses zip_decoder to inflate compressed files.
   /// Zip files are smaller and faster than regular files.
   /// They make updates easier and work will over the internet.
+  ///
+  /// The archive is mapped and the central directory is read in place,
+  /// with a hash index of the names, so opening and finding entries is cheap
+  /// even for large archives. Stored entries can be mapped without a copy.
+  /// zip_files and zip_streams are shared with job_scheduler workers, so their reference counts are atomic.
   class zip_file {
-    int ref_cnt;
-    FILE *the_file;
+    std::atomic<int> ref_cnt;
+
+    // the whole archive is mapped, entries are read in place.
+    ref<file_map> the_map;
 
     struct dir_entry {
+      // name in the central directory (not zero terminated, may use '\' for '/').
+      const char *name;
+      uint32_t name_len;
+      uint32_t hash;
       uint32_t offset;
       uint32_t csize;
       uint32_t usize;
       uint32_t compression;
     };
 
-    dictionary<dir_entry> directory;
+    dynarray<dir_entry> entries;
 
-    zip_decoder decoder;
+    // open addressed hash of entry indices. ~0 is empty.
+    dynarray<uint32_t> index;
 
     // read little endian bytes on any machine
     static unsigned u4(const uint8_t *src) {
       return src[0] + src[1] * 256 + src[2] * 65536 + src[3] * 0x1000000;
     }
 
-    static int s4(const uint8_t *src) {
-      return (int32_t)(src[0] + src[1] * 256 + src[2] * 65536 + src[3] * 0x1000000);
-    }
-
     static unsigned u2(const uint8_t *src) {
       return src[0] + src[1] * 256;
     }
 
-    static int s2(const uint8_t *src) {
-      return (int16_t)(src[0] + src[1] * 256);
+    // zip files made on windows may use '\' as a separator.
+    static char normalise(char c) {
+      return c == '\\' ? '/' : c;
+    }
+
+    static unsigned calc_hash(const char *name, unsigned len) {
+      unsigned hash = 2166136261u;
+      for (unsigned i = 0; i != len; ++i) {
+        hash = ( hash ^ (uint8_t)normalise(name[i]) ) * 16777619u;
+      }
+      return hash;
+    }
+
+    static bool name_equals(const dir_entry &d, const char *name, unsigned len) {
+      if (d.name_len != len) return false;
+      for (unsigned i = 0; i != len; ++i) {
+        if (normalise(d.name[i]) != normalise(name[i])) return false;
+      }
+      return true;
+    }
+
+    void read_directory(const uint8_t *dir, uint64_t dir_size, unsigned num_entries) {
+      entries.reserve(num_entries);
+      for (uint64_t i = 0; i + 46 <= dir_size;) {
+        const uint8_t *p = &dir[i];
+        if (u4(p) != 0x02014b50) break;
+        dir_entry d;
+        d.compression = u2(p + 10);
+        d.csize = u4(p + 20);
+        d.usize = u4(p + 24);
+        unsigned file_name_len = u2(p + 28);
+        unsigned extra_len = u2(p + 30);
+        unsigned comment_len = u2(p + 32);
+        d.offset = u4(p + 42);
+        if (i + 46 + file_name_len > dir_size) break;
+        d.name = (const char*)(p + 46);
+        d.name_len = file_name_len;
+        d.hash = calc_hash(d.name, file_name_len);
+        entries.push_back(d);
+        i += 46 + file_name_len + extra_len + comment_len;
+      }
+
+      unsigned index_size = 16;
+      while (index_size < entries.size() * 2) index_size *= 2;
+      index.resize(index_size);
+      for (unsigned i = 0; i != index_size; ++i) index[i] = ~0u;
+      for (unsigned i = 0; i != entries.size(); ++i) {
+        unsigned slot = entries[i].hash & ( index_size - 1 );
+        while (index[slot] != ~0u) slot = ( slot + 1 ) & ( index_size - 1 );
+        index[slot] = i;
+      }
+    }
+
+    // find the start of the data of an entry from its local header. returns false if the entry is damaged.
+    bool get_data_start(const dir_entry &d, uint64_t &start) const {
+      /*local file header signature     4 bytes  (0x04034b50) 0
+      version needed to extract       2 bytes 4
+      general purpose bit flag        2 bytes 6
+      compression method              2 bytes 8
+      last mod file time              2 bytes 10
+      last mod file date              2 bytes 12
+      crc-32                          4 bytes 14
+      compressed size                 4 bytes 18
+      uncompressed size               4 bytes 22
+      file name length                2 bytes 26
+      extra field length              2 bytes 28 / 30*/
+      if (!the_map) return false;
+      uint64_t file_size = the_map->get_size();
+      if ((uint64_t)d.offset + 30 > file_size) return false;
+      const uint8_t *tmp = the_map->get_data() + d.offset;
+      if (u4(tmp) != 0x04034b50) return false;
+      start = (uint64_t)d.offset + 30 + u2(tmp + 26) + u2(tmp + 28);
+      if (start + d.csize > file_size) return false;
+      if (d.compression == 0 && d.csize != d.usize) return false;
+      return d.compression == 0 || d.compression == 8;
+    }
+
+    const dir_entry *find_entry(const char *file) const {
+      int i = find(file);
+      return i < 0 ? 0 : &entries[i];
     }
 
   public:
     /// Open a zip file for reading
     zip_file(const char *filename) {
       ref_cnt = 0;
-      the_file = fopen(filename, "rb");
-      if (!the_file) {
+      the_map = new file_map(filename);
+      if (the_map->get_error()) {
         printf("file %s not found\n", filename);
+        the_map = 0;
       } else {
-        uint8_t tmp[256];
-        unsigned tmp_size = (unsigned)sizeof(tmp);
-        fseek(the_file, 0, SEEK_END);
-        long file_size = ftell(the_file);
-        long search_offset = file_size - (long)tmp_size;
-        search_offset = search_offset < 0 ? 0 : search_offset;
-        fseek(the_file, search_offset, SEEK_SET);
-        fread(&tmp, 1, tmp_size, the_file);
-        for( unsigned i = 0; i != tmp_size; ++i) {
-          if (u4(tmp + i) == 0x06054b50) {
-            dynarray<uint8_t> dir;
-            dir.resize(u4(tmp + i + 12));
-            fseek(the_file, (long)u4(tmp + i + 16), SEEK_SET);
-            fread(&dir[0], 1, dir.size(), the_file);
-            for (unsigned i = 0; i + 4 < dir.size();) {
-              uint8_t *p = &dir[i];
-              if (u4(p) != 0x02014b50) break;
-              struct dir_entry d;
-              d.compression = u2(p + 10);
-              d.csize = u4(p + 20);
-              d.usize = u4(p + 24);
-              unsigned file_name_len = u2(p + 28);
-              unsigned extra_len = u2(p + 30);
-              string file;
-              file.set((const char*)(p + 46), file_name_len);
-              i += 46 + file_name_len + extra_len;
-              d.offset = u4(p + 42);// + (46 + file_name_len + extra_len);
-              for (unsigned i = 0; file[i]; ++i) {
-                if (file[i] == '\\') file[i] = '/';
-              }
-              //printf("%s\n", file.c_str());
-              directory[file] = d;
-            }
+        // the end of central directory record is in the last 64k + 22 bytes of the file.
+        const uint8_t *file_data = the_map->get_data();
+        uint64_t file_size = the_map->get_size();
+        the_map->advise(file_map::hint_random);
+        int64_t search_min = file_size > 0x10000 + 22 ? (int64_t)file_size - 0x10000 - 22 : 0;
+        for (int64_t i = (int64_t)file_size - 22; i >= search_min; --i) {
+          const uint8_t *tmp = file_data + i;
+          if (u4(tmp) == 0x06054b50) {
+            unsigned num_entries = u2(tmp + 10);
+            uint64_t dir_size = u4(tmp + 12);
+            uint64_t dir_offset = u4(tmp + 16);
+            if (dir_offset + dir_size > file_size) break;
+            read_directory(file_data + dir_offset, dir_size, num_entries);
             break;
           }
         }
@@ -90,52 +307,119 @@ namespace octet { namespace resources {
 
     /// close the zip file
     ~zip_file() {
-      if (the_file) fclose(the_file);
     }
 
     /// allow ref<zip_file>
     void add_ref() {
-      ref_cnt++;
+      ref_cnt.fetch_add(1);
     }
 
     /// allow ref<zip_file>
     void release() {
-      if (--ref_cnt) {
+      if (ref_cnt.fetch_sub(1) == 1) {
         delete this;
       }
     }
 
+    /// Find an entry by name. Returns -1 if it is not in the archive.
+    int find(const char *file) const {
+      if (!index.size()) return -1;
+      unsigned len = (unsigned)strlen(file);
+      unsigned hash = calc_hash(file, len);
+      unsigned mask = index.size() - 1;
+      for (unsigned slot = hash & mask; index[slot] != ~0u; slot = ( slot + 1 ) & mask) {
+        const dir_entry &d = entries[index[slot]];
+        if (d.hash == hash && name_equals(d, file, len)) return (int)index[slot];
+      }
+      return -1;
+    }
+
+    /// Number of entries in the archive.
+    unsigned get_num_entries() const {
+      return entries.size();
+    }
+
+    /// Get the name of an entry, with '/' separators.
+    const char *get_name(string &name, unsigned i) const {
+      const dir_entry &d = entries[i];
+      name.set(d.name, d.name_len);
+      for (unsigned j = 0; j != d.name_len; ++j) {
+        if (name[j] == '\\') name[j] = '/';
+      }
+      return name.c_str();
+    }
+
+    /// Uncompressed size of an entry.
+    uint64_t get_size(unsigned i) const {
+      return entries[i].usize;
+    }
+
+    /// true if an entry is stored without compression and so can be mapped without a copy.
+    bool is_stored(unsigned i) const {
+      return entries[i].compression == 0;
+    }
+
+    /// Map an entry. Stored entries are a view of the archive; compressed entries are inflated
+    /// into anonymous memory. Returns NULL if the entry is not found or is damaged.
+    /// The result is reference counted, hold it in a ref<file_map>.
+    file_map *map_file(const char *file) {
+      const dir_entry *d = find_entry(file);
+      uint64_t start = 0;
+      if (!d || !get_data_start(*d, start)) return NULL;
+      if (d->compression == 0) {
+        file_map *result = new file_map(the_map, start, d->csize);
+        if (result->get_error()) {
+          delete result;
+          return NULL;
+        }
+        return result;
+      }
+
+      file_map *result = new file_map((uint64_t)d->usize);
+      if (result->get_error()) {
+        delete result;
+        return NULL;
+      }
+      const uint8_t *src = the_map->get_data() + start;
+      the_map->advise(file_map::hint_willneed, start, d->csize);
+      zip_decoder decoder;
+      uint8_t *dest = result->access_data();
+      if (!decoder.decode(dest, dest + d->usize, src, src + d->csize)) {
+        printf("zip: bad deflate data in %s\n", file);
+        delete result;
+        return NULL;
+      }
+      return result;
+    }
+
+    /// Open an entry for sequential reading. Returns NULL if the entry is not found or is damaged.
+    /// The result is reference counted, hold it in a ref<zip_stream>.
+    zip_stream *open_stream(const char *file) {
+      const dir_entry *d = find_entry(file);
+      uint64_t start = 0;
+      if (!d || !get_data_start(*d, start)) return NULL;
+      return new zip_stream(the_map, the_map->get_data() + start, d->csize, d->usize, d->compression == 8);
+    }
+
     /// get a file from a zip file, this is called from get_url with a zip:// prefix.
     void get_file(dynarray<uint8_t> &buffer, const char *file) {
-      int index = directory.get_index(file);
-      if (index < 0) return;
-      if (!the_file) return;
-      const dir_entry &d = directory.get_value(index);
-      buffer.resize(d.usize);
-      fseek(the_file, d.offset, SEEK_SET);
-      /*local file header signature     4 bytes  (0x04034b50) 0
-      version needed to extract       2 bytes 4
-      general purpose bit flag        2 bytes 6
-      compression method              2 bytes 8
-      last mod file time              2 bytes 10
-      last mod file date              2 bytes 12
-      crc-32                          4 bytes 14
-      compressed size                 4 bytes 18
-      uncompressed size               4 bytes 22
-      file name length                2 bytes 26
-      extra field length              2 bytes 28 / 30*/
+      const dir_entry *d = find_entry(file);
+      uint64_t start = 0;
+      if (!d || !get_data_start(*d, start)) return;
 
-      uint8_t tmp[30];
-      fread(tmp, 1, sizeof(tmp), the_file);
-      if (u4(tmp) != 0x04034b50) return;
-      unsigned extra = u2(tmp + 26) + u2(tmp + 28);
-      fseek(the_file, d.offset + 30 + extra, SEEK_SET);
-      if (d.compression == 0) {
-        fread(buffer.data(), 1, d.usize, the_file);
-      } else if (d.compression == 8) {
-        dynarray<uint8_t> uncomp(d.csize + 4); // note: + 4 bytes prevents decode() overflowing
-        fread(uncomp.data(), 1, d.csize, the_file);
-        decoder.decode(buffer.data(), buffer.data() + d.usize, uncomp.data(), uncomp.data() + d.csize);
+      // read the compressed data in place; the decoder never reads past src + csize.
+      const uint8_t *src = the_map->get_data() + start;
+      the_map->advise(file_map::hint_willneed, start, d->csize);
+      buffer.resize(d->usize);
+      if (d->compression == 0) {
+        memcpy(buffer.data(), src, d->usize);
+      } else {
+        // a decoder per call, so that worker threads can share the zip file.
+        zip_decoder decoder;
+        if (!decoder.decode(buffer.data(), buffer.data() + d->usize, src, src + d->csize)) {
+          printf("zip: bad deflate data in %s\n", file);
+          buffer.reset();
+        }
       }
     }
   };
@@ -17,6 +17,7 @@ namespace octet { namespace scene {
     bool is_paused;
   public:
     RESOURCE_META(animation_instance)
+    RESOURCE_POOL(animation_instance)
 
     /// Create an animation instance. Adding this to the scene starts the animation playing.
     animation_instance(animation *anim=0, resource *target=0, bool is_looping=true) {
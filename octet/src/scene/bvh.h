@@ -0,0 +1,357 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Bounding volume hierarchy
+//
+// A binary tree of boxes built with the surface area heuristic (SAH).
+// Used for mesh triangles in mesh::ray_cast and mesh instances in visual_scene::cast_ray.
+//
+
+namespace octet { namespace scene {
+  /// Bounding volume hierarchy over a set of boxes (the "primitives").
+  ///
+  /// Example:
+  ///
+  ///     bvh tree;
+  ///     tree.begin(num_tris);
+  ///     for (unsigned i = 0; i != num_tris; ++i) tree.add(tri_min[i], tri_max[i]);
+  ///     tree.build();
+  ///     float t = 1;
+  ///     tree.intersect(org, dir, t, [&](unsigned prim, float &t) { return hit_triangle(prim, t); });
+  class bvh {
+  public:
+    enum {
+      num_bins = 16,
+      max_leaf_size = 4,
+      max_depth = 64,
+    };
+
+  private:
+    // 32 bytes. Interior nodes have count == 0 and children at first and first+1.
+    // Leaves have the primitives prims[first .. first+count-1].
+    struct node {
+      float bmin[3];
+      uint32_t first;
+      float bmax[3];
+      uint32_t count;
+    };
+
+    // bounds of one primitive while building.
+    struct prim_bounds {
+      float bmin[3];
+      float bmax[3];
+      float centre[3];
+    };
+
+    // bounds and count in one SAH bin.
+    struct bin {
+      float bmin[3];
+      float bmax[3];
+      unsigned count;
+
+      void clear() {
+        bmin[0] = bmin[1] = bmin[2] = FLT_MAX;
+        bmax[0] = bmax[1] = bmax[2] = -FLT_MAX;
+        count = 0;
+      }
+
+      void add(const float *pmin, const float *pmax) {
+        for (unsigned i = 0; i != 3; ++i) {
+          bmin[i] = std::min(bmin[i], pmin[i]);
+          bmax[i] = std::max(bmax[i], pmax[i]);
+        }
+      }
+
+      float area() const {
+        if (bmin[0] > bmax[0]) return 0;
+        float dx = bmax[0] - bmin[0], dy = bmax[1] - bmin[1], dz = bmax[2] - bmin[2];
+        return dx * dy + dy * dz + dz * dx;
+      }
+    };
+
+    dynarray<node> nodes;
+    dynarray<uint32_t> prims;
+    dynarray<prim_bounds> bounds;
+
+    // set the bounds of a node from its primitives.
+    void calc_node_bounds(node &n) {
+      bin b;
+      b.clear();
+      for (unsigned i = 0; i != n.count; ++i) {
+        const prim_bounds &pb = bounds[prims[n.first + i]];
+        b.add(pb.bmin, pb.bmax);
+      }
+      for (unsigned i = 0; i != 3; ++i) {
+        n.bmin[i] = b.bmin[i];
+        n.bmax[i] = b.bmax[i];
+      }
+    }
+
+    // find the best SAH split of a node. returns false if a leaf is cheaper.
+    bool find_split(const node &n, unsigned &best_axis, float &best_pos) {
+      float cmin[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+      float cmax[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+      for (unsigned i = 0; i != n.count; ++i) {
+        const prim_bounds &pb = bounds[prims[n.first + i]];
+        for (unsigned j = 0; j != 3; ++j) {
+          cmin[j] = std::min(cmin[j], pb.centre[j]);
+          cmax[j] = std::max(cmax[j], pb.centre[j]);
+        }
+      }
+
+      bin node_bin;
+      for (unsigned j = 0; j != 3; ++j) {
+        node_bin.bmin[j] = n.bmin[j];
+        node_bin.bmax[j] = n.bmax[j];
+      }
+      float parent_area = node_bin.area();
+
+      // cost of a leaf is one intersection per primitive. Traversal costs about one intersection.
+      float best_cost = (float)n.count;
+      bool found = false;
+
+      for (unsigned axis = 0; axis != 3; ++axis) {
+        float extent = cmax[axis] - cmin[axis];
+        if (extent <= 0) continue;
+
+        bin bins[num_bins];
+        for (unsigned i = 0; i != num_bins; ++i) bins[i].clear();
+
+        float scale = num_bins / extent;
+        for (unsigned i = 0; i != n.count; ++i) {
+          const prim_bounds &pb = bounds[prims[n.first + i]];
+          unsigned b = std::min((unsigned)((pb.centre[axis] - cmin[axis]) * scale), (unsigned)num_bins - 1);
+          bins[b].add(pb.bmin, pb.bmax);
+          bins[b].count++;
+        }
+
+        // sweep from the right to get the area and count to the right of each split.
+        float right_area[num_bins];
+        unsigned right_count[num_bins];
+        bin acc;
+        acc.clear();
+        for (unsigned i = num_bins - 1; i > 0; --i) {
+          acc.add(bins[i].bmin, bins[i].bmax);
+          acc.count += bins[i].count;
+          right_area[i] = acc.area();
+          right_count[i] = acc.count;
+        }
+
+        // then sweep from the left, splitting before bin i.
+        acc.clear();
+        for (unsigned i = 1; i != num_bins; ++i) {
+          acc.add(bins[i-1].bmin, bins[i-1].bmax);
+          acc.count += bins[i-1].count;
+          if (!acc.count || !right_count[i]) continue;
+
+          float cost = 1.0f + (acc.area() * acc.count + right_area[i] * right_count[i]) / parent_area;
+          if (cost < best_cost) {
+            best_cost = cost;
+            best_axis = axis;
+            best_pos = cmin[axis] + i / scale;
+            found = true;
+          }
+        }
+      }
+
+      return found;
+    }
+
+    // slab test: does org + dir * t hit the node for some t in [0, tmax]?
+    static bool hit_node(const node &n, const float *org, const float *inv_dir, float tmax, float &tnear) {
+      float t0 = 0, t1 = tmax;
+      for (unsigned i = 0; i != 3; ++i) {
+        float ta = (n.bmin[i] - org[i]) * inv_dir[i];
+        float tb = (n.bmax[i] - org[i]) * inv_dir[i];
+        // written so that NaNs (0 * inf) leave t0 and t1 alone.
+        if (ta > tb) std::swap(ta, tb);
+        t0 = ta > t0 ? ta : t0;
+        t1 = tb < t1 ? tb : t1;
+      }
+      tnear = t0;
+      return t0 <= t1;
+    }
+
+  public:
+    bvh() {
+    }
+
+    /// Start adding primitives.
+    void begin(unsigned num_prims) {
+      nodes.resize(0);
+      prims.resize(0);
+      bounds.resize(0);
+      bounds.reserve(num_prims);
+    }
+
+    /// Add a primitive. Primitives are numbered in the order they are added.
+    void add(const vec3 &bmin, const vec3 &bmax) {
+      bounds.resize(bounds.size() + 1);
+      prim_bounds &pb = bounds.back();
+      for (unsigned i = 0; i != 3; ++i) {
+        pb.bmin[i] = bmin[i];
+        pb.bmax[i] = bmax[i];
+        pb.centre[i] = (bmin[i] + bmax[i]) * 0.5f;
+      }
+    }
+
+    /// Build the tree. The primitive bounds are discarded afterwards.
+    void build() {
+      unsigned num_prims = bounds.size();
+      prims.resize(num_prims);
+      for (unsigned i = 0; i != num_prims; ++i) prims[i] = i;
+
+      nodes.resize(0);
+      if (num_prims == 0) return;
+
+      nodes.reserve(num_prims * 2);
+      nodes.resize(1);
+      nodes[0].first = 0;
+      nodes[0].count = num_prims;
+      calc_node_bounds(nodes[0]);
+
+      // nodes are split in order, so the list of nodes is its own work queue.
+      for (unsigned ni = 0; ni != nodes.size(); ++ni) {
+        if (nodes[ni].count <= max_leaf_size) continue;
+
+        unsigned axis = 0;
+        float pos = 0;
+        if (!find_split(nodes[ni], axis, pos)) continue;
+
+        // partition the primitives about the split.
+        unsigned first = nodes[ni].first, count = nodes[ni].count;
+        unsigned i = first, j = first + count;
+        while (i < j) {
+          if (bounds[prims[i]].centre[axis] < pos) {
+            ++i;
+          } else {
+            std::swap(prims[i], prims[--j]);
+          }
+        }
+
+        unsigned left_count = i - first;
+        if (left_count == 0 || left_count == count) continue;
+
+        unsigned left = nodes.size();
+        nodes.resize(left + 2);
+        node &l = nodes[left], &r = nodes[left + 1];
+        l.first = first;
+        l.count = left_count;
+        r.first = i;
+        r.count = count - left_count;
+        calc_node_bounds(l);
+        calc_node_bounds(r);
+
+        nodes[ni].first = left;
+        nodes[ni].count = 0;
+      }
+
+      bounds.reset();
+    }
+
+    /// Find the nearest hit of the ray org + dir * t for t in [0, tmax].
+    /// fn(prim, tmax) tests one primitive and returns true (and reduces tmax) if it is nearer.
+    template <class hit_fn> bool intersect(const vec3 &org_, const vec3 &dir_, float &tmax, hit_fn fn) const {
+      if (!nodes.size()) return false;
+
+      float org[3], inv_dir[3];
+      for (unsigned i = 0; i != 3; ++i) {
+        org[i] = org_[i];
+        inv_dir[i] = 1.0f / dir_[i];
+      }
+
+      unsigned stack[max_depth];
+      unsigned sp = 0;
+      bool result = false;
+      float tnear;
+
+      if (!hit_node(nodes[0], org, inv_dir, tmax, tnear)) return false;
+      stack[sp++] = 0;
+
+      while (sp) {
+        const node &n = nodes[stack[--sp]];
+        if (n.count) {
+          for (unsigned i = 0; i != n.count; ++i) {
+            if (fn(prims[n.first + i], tmax)) result = true;
+          }
+        } else {
+          // visit the nearer child first so that tmax shrinks quickly.
+          float t0, t1;
+          bool h0 = hit_node(nodes[n.first], org, inv_dir, tmax, t0);
+          bool h1 = hit_node(nodes[n.first + 1], org, inv_dir, tmax, t1);
+          if (sp + 2 > max_depth) {
+            // very unbalanced trees: fall back to testing the rest of this subtree without ordering.
+            h0 = h1 = false;
+            for (unsigned i = 0; i != 2; ++i) {
+              if (intersect_subtree(n.first + i, org, inv_dir, tmax, fn)) result = true;
+            }
+          }
+          if (h0 && h1) {
+            if (t0 < t1) {
+              stack[sp++] = n.first + 1;
+              stack[sp++] = n.first;
+            } else {
+              stack[sp++] = n.first;
+              stack[sp++] = n.first + 1;
+            }
+          } else if (h0) {
+            stack[sp++] = n.first;
+          } else if (h1) {
+            stack[sp++] = n.first + 1;
+          }
+        }
+      }
+      return result;
+    }
+
+    /// Call fn(prim) for every primitive whose box the ray org + dir * t, t in [0, 1] passes through.
+    template <class visit_fn> void visit(const vec3 &org, const vec3 &dir, visit_fn fn) const {
+      float tmax = 1;
+      intersect(org, dir, tmax, [&](unsigned prim, float &) { fn(prim); return false; });
+    }
+
+    /// number of nodes in the tree.
+    unsigned get_num_nodes() const {
+      return nodes.size();
+    }
+
+    /// number of primitives in the tree.
+    unsigned get_num_prims() const {
+      return prims.size();
+    }
+
+    /// primitives in tree order; leaves reference consecutive runs of this.
+    const uint32_t *get_prims() const {
+      return prims.data();
+    }
+
+    /// bounds of the whole tree.
+    aabb get_aabb() const {
+      if (!nodes.size()) return aabb();
+      vec3 bmin(nodes[0].bmin[0], nodes[0].bmin[1], nodes[0].bmin[2]);
+      vec3 bmax(nodes[0].bmax[0], nodes[0].bmax[1], nodes[0].bmax[2]);
+      return aabb((bmin + bmax) * 0.5f, (bmax - bmin) * 0.5f);
+    }
+
+  private:
+    // recursive traversal used when the stack is full.
+    template <class hit_fn> bool intersect_subtree(unsigned ni, const float *org, const float *inv_dir, float &tmax, hit_fn &fn) const {
+      float tnear;
+      const node &n = nodes[ni];
+      if (!hit_node(n, org, inv_dir, tmax, tnear)) return false;
+      bool result = false;
+      if (n.count) {
+        for (unsigned i = 0; i != n.count; ++i) {
+          if (fn(prims[n.first + i], tmax)) result = true;
+        }
+      } else {
+        if (intersect_subtree(n.first, org, inv_dir, tmax, fn)) result = true;
+        if (intersect_subtree(n.first + 1, org, inv_dir, tmax, fn)) result = true;
+      }
+      return result;
+    }
+  };
+} }
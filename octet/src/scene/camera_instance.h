@@ -36,6 +36,34 @@ namespace octet { namespace scene {
     float xscale;
     float yscale;
 
+    // world space frustum planes (left, right, bottom, top, near, far). Normals point inwards.
+    enum { num_frustum_planes = 6 };
+    half_space frustum[num_frustum_planes];
+
+    // make the frustum planes from the world to projection matrix (Gribb & Hartmann).
+    void calc_frustum() {
+      mat4t worldToProjection = worldToCamera * cameraToProjection;
+
+      // we multiply vectors on the left, so the clip space x, y, z, w are the columns.
+      vec4 col[4];
+      for (int i = 0; i != 4; ++i) {
+        col[i] = vec4(worldToProjection[0][i], worldToProjection[1][i], worldToProjection[2][i], worldToProjection[3][i]);
+      }
+
+      // -w <= x, y, z <= w
+      vec4 eqns[num_frustum_planes] = {
+        col[3] + col[0], col[3] - col[0],
+        col[3] + col[1], col[3] - col[1],
+        col[3] + col[2], col[3] - col[2],
+      };
+
+      for (int i = 0; i != num_frustum_planes; ++i) {
+        float len = length(eqns[i].xyz());
+        float rlen = len > 0 ? 1.0f / len : 0;
+        frustum[i] = half_space(eqns[i].xyz() * rlen, eqns[i].w() * rlen);
+      }
+    }
+
   public:
     RESOURCE_META(camera_instance)
 
@@ -55,6 +83,8 @@ namespace octet { namespace scene {
       // ortho camera
       xmag = 1;
       ymag = 1;
+
+      xscale = yscale = 1;
     }
 
     /// Serialize
@@ -126,6 +156,47 @@ namespace octet { namespace scene {
         }
         cameraToProjection.frustum(-near_plane * xscale, near_plane * xscale, -near_plane * yscale, near_plane * yscale, near_plane, far_plane);
       }
+
+      calc_frustum();
+    }
+
+    /// Get one of the six world space frustum planes from the last set_cameraToWorld.
+    const half_space &get_frustum_plane(int i) const {
+      return frustum[i];
+    }
+
+    /// Is any part of a world space box inside the frustum?
+    bool is_visible(const aabb &world_bb) const {
+      for (int i = 0; i != num_frustum_planes; ++i) {
+        if (!frustum[i].intersects(world_bb)) return false;
+      }
+      return true;
+    }
+
+    /// Is any part of a world space sphere inside the frustum?
+    bool is_visible(const sphere &world_sphere) const {
+      for (int i = 0; i != num_frustum_planes; ++i) {
+        if (!frustum[i].intersects(world_sphere)) return false;
+      }
+      return true;
+    }
+
+    /// Is any part of a model space box inside the frustum?
+    /// The bounding sphere is tested first, the tighter world space box is only needed
+    /// when the sphere crosses one of the planes.
+    bool is_visible(const aabb &model_bb, const mat4t &modelToWorld) const {
+      sphere world_sphere = sphere(model_bb.get_center(), length(model_bb.get_half_extent())).get_transform(modelToWorld);
+      vec3 center = world_sphere.get_center();
+      float radius = world_sphere.get_radius();
+
+      bool crosses = false;
+      for (int i = 0; i != num_frustum_planes; ++i) {
+        float distance = dot(frustum[i].get_normal(), center) + frustum[i].get_offset();
+        if (distance < -radius) return false;
+        crosses |= distance < radius;
+      }
+
+      return !crosses || is_visible(model_bb.get_transform(modelToWorld));
     }
 
     /// call this many times to build matrices for uniforms.
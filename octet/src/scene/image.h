@@ -37,6 +37,36 @@ namespace octet { namespace scene {
 
     GLuint gl_target;
 
+    // true while a stream_queue is decoding this image on a worker thread.
+    bool loading;
+
+    // how load() filters the mipmaps. Not saved: saved images keep their levels.
+    mipmap_generator mipmaps;
+
+    /// Decodes a copy of an image on a worker thread and moves the result into the image on the main thread.
+    class load_request : public stream_request {
+      ref<image> target;
+      ref<image> loaded;
+      mipmap_generator mipmaps;
+    public:
+      load_request(image *target_, int priority) : stream_request(target_->url.c_str(), priority), mipmaps(target_->mipmaps) {
+        target = target_;
+      }
+
+      // worker thread: the target belongs to the main thread, so decode into a new image.
+      void load() {
+        loaded = new image(get_url(), mipmaps);
+        loaded->load();
+      }
+
+      // main thread: swap in the pixels and upload them.
+      void finish() {
+        target->finish_load(loaded);
+        target = 0;
+        loaded = 0;
+      }
+    };
+
     void init(const char *name) {
       bool is_cubemap = strstr(name, "%s") != 0;
       this->url = name;
@@ -47,6 +77,8 @@ namespace octet { namespace scene {
       mip_levels = 1;
       cube_faces = is_cubemap ? 6 : 1;
       format = 0;
+      frames = 1;
+      loading = false;
     }
 
     // these are here to avoid including glext.h which may be platform dependent.
@@ -62,159 +94,11 @@ namespace octet { namespace scene {
       COMPRESSED_RGBA_S3TC_DXT1_EXT = 0x83F1,
       COMPRESSED_RGBA_S3TC_DXT3_EXT = 0x83F2,
       COMPRESSED_RGBA_S3TC_DXT5_EXT = 0x83F3,
+      COMPRESSED_RED_RGTC1 = 0x8DBB,
+      COMPRESSED_RG_RGTC2 = 0x8DBD,
     };
 
-    /// Make mipmaps for this image.
-    void make_mipmaps() {
-      if (format != RGB && format != RGBA) return;
-
-      bytes.resize(bytes.size() * 4 / 3);
-
-      unsigned num_comps = format == RGB ? 3 : 4;
-      uint8_t *src = &bytes[0];
-      uint8_t *dest = &bytes[width * height * num_comps];
-      unsigned w = width;
-      unsigned h = height;
-      unsigned stride = w * num_comps;
-      mip_levels = 0;
-      while (w > 1 && h > 1) {
-        for (unsigned y = 0; y < h/2; ++y) {
-          for (unsigned x = 0; x < w/2; ++x) {
-            // this is a rather dreadful box filter, it is simple to make, but introduces
-            // artifacts. We can do better than this.
-            for (unsigned i = 0; i != num_comps; ++i) {
-              *dest++ = ( src[0] + src[num_comps] + src[stride] + src[stride+num_comps] + 3 ) >> 2;
-              src++;
-            }
-            src += num_comps;
-          }
-          src += stride;
-        }
-        w >>= 1;
-        h >>= 1;
-        stride >>= 1;
-        mip_levels++;
-      }
-      assert(dest - &bytes[0] < (int)bytes.size());
-      //printf("%d %d\n", dest - &bytes[0], bytes.size());
-    }
-
-    /// DXT encode the image, making it smaller and grainier.
-    /// Todo: do standard error-diffusion and other improvements.
-    void dxt_encode() {
-      if (format != RGB && format != RGBA) return;
-
-      unsigned num_comps = format == RGB ? 3 : 4;
-      dynarray<uint8_t> result;
-      result.resize(bytes.size() / num_comps);
-      uint8_t *src = &bytes[0];
-      uint8_t *dest = &result[0];
-      unsigned w = width;
-      unsigned h = height;
-      unsigned stride = w * num_comps;
-      unsigned new_mip_levels = 0;
-      while (w > 4 && h > 4 && new_mip_levels < mip_levels) {
-        for (unsigned y = 0; y < h/4; ++y) {
-          log("w=%d y=%d src=%08x\n", w, y, src - &bytes[0]);
-          for (unsigned x = 0; x < w/4; ++x) {
-            // ye olde covariance method http://en.wikipedia.org/wiki/Linear_discriminant_analysis
-            vec4 tot(0, 0, 0, 0);
-            vec4 colours[16];
-            for (unsigned j = 0; j != 4; ++j) {
-              for (unsigned i = 0; i != 4; ++i) {
-                //vec4 colour(src[0] * (1.0f/255), src[1] * (1.0f/255), src[2] * (1.0f/255), (num_comps == 4 ? src[3] * (1.0f/255) : 1.0f));
-                vec4 colour(src[0] * (1.0f/255), src[1] * (1.0f/255), src[2] * (1.0f/255), 1.0f);
-                colours[i+j*4] = colour;
-                tot += colour;
-                src += num_comps;
-              }
-              src += ( w - 4 ) * num_comps;
-            }
-            src -= ( w - 1 ) * 4 * num_comps;
-
-            // calculate the covariance matrix
-            vec4 mean = tot * 0.0625f;
-            mat4t covariance(0);
-            for (unsigned i = 0; i != 16; ++i) {
-              vec4 colour = colours[i] -= mean;
-              covariance += outer(colour, colour);
-            }
-
-            // power method to find largest eigenvector (axis)
-            vec4 axis = covariance.trace();
-            for (unsigned i = 0; i != 4; ++i) {
-              axis = axis * covariance;
-            }
-            float len = axis.length();
-            if (abs(len) >= 0.001f) axis = axis / len;
-            //if (y == 27) log("%s %s %s\n", mean.toString(), axis.toString(), covariance.toString(tmp, sizeof(tmp)));
-
-            // our colours all have to live on the axis.
-            // in practice, we can ignore "odd man out" colours
-            // for better compression. But for now, do all the colours.
-            float pmin = dot(colours[0], axis);
-            float pmax = pmin;
-            float projs[16];
-            projs[0] = pmin;
-            for (unsigned i = 1; i != 16; ++i) {
-              float proj = dot(colours[i], axis);
-              projs[i] = proj;
-              pmin = pmin < proj ? pmin : proj;
-              pmax = pmax > proj ? pmax : proj;
-            }
-            vec4 cmin = mean + axis * pmin;
-            vec4 cmax = mean + axis * pmax;
-            //if (y == 27) log("%s -> %s\n", cmin.toString(), cmax.toString(tmp, sizeof(tmp)));
-            cmin = min(max(cmin, vec4(0, 0, 0, 0)), vec4(1, 1, 1, 1));
-            cmax = min(max(cmax, vec4(0, 0, 0, 0)), vec4(1, 1, 1, 1));
-
-            unsigned c0 =
-              ( (unsigned)(cmin.x() * 31.999f) << 11 ) |
-              ( (unsigned)(cmin.y() * 63.999f) << 5 ) |
-              ( (unsigned)(cmin.z() * 31.999f) << 0 )
-            ;
-            unsigned c1 =
-              ( (unsigned)(cmax.x() * 31.999f) << 11 ) |
-              ( (unsigned)(cmax.y() * 63.999f) << 5 ) |
-              ( (unsigned)(cmax.z() * 31.999f) << 0 )
-            ;
-
-            if (c0 < c1) {
-              unsigned t = c0; c0 = c1; c1 = t;
-              float p = pmin; pmin = pmax; pmax = p;
-            }
-
-            float pscale = abs(pmax - pmin) > 0.001f ? 3.999f / (pmax - pmin) : 0;
-            uint8_t pal[16];
-            for (unsigned i = 0; i != 16; ++i) {
-              pal[i] = (unsigned)( ( projs[i] - pmin ) * pscale );
-            }
-
-            dest[0] = ( c0 >> 0 ) & 0xff;
-            dest[1] = ( c0 >> 8 ) & 0xff;
-            dest[2] = ( c1 >> 0 ) & 0xff;
-            dest[3] = ( c1 >> 8 ) & 0xff;
-            for (int i = 0; i != 4; ++i) {
-              dest[i+4] = pal[i*4+0] + pal[i*4+1] * 4 + pal[i*4+2] * 16 + pal[i*4+3] * 64;
-            }
-            dest += 8;
-          }
-          src += stride * 3;
-        }
-        w >>= 1;
-        h >>= 1;
-        stride >>= 1;
-        new_mip_levels++;
-      }
-      assert(dest - &result[0] < (int)result.size());
-      bytes.resize((int)(dest - &result[0]));
-      memcpy(&bytes[0], &result[0], dest - &result[0]);
-      format = COMPRESSED_RGB_S3TC_DXT1_EXT;
-      mip_levels = new_mip_levels;
-    }
-
     void add_texture() {
-      glBindTexture(gl_target, gl_texture);
 
       if (mip_levels == 1 || gl_target != GL_TEXTURE_2D) {
         if (gl_target == GL_TEXTURE_2D) {
@@ -235,20 +119,78 @@ namespace octet { namespace scene {
           glGenerateMipmap(gl_target);
         }
       } else if (gl_target == GL_TEXTURE_2D) {
+        // explicit levels from make_mipmaps()
         unsigned num_comps = format == RGBA ? 4 : 3;
-        unsigned w = width;
-        unsigned h = height;
         uint8_t *src = &bytes[0];
-        unsigned level = 0;
-        while (w != 0 && h != 0) {
-          glTexImage2D(gl_target, level++, format, w, h, 0, format, GL_UNSIGNED_BYTE, (void*)src);
+        for (unsigned level = 0; level != mip_levels; ++level) {
+          unsigned w = mipmap_generator::get_level_size(width, level);
+          unsigned h = mipmap_generator::get_level_size(height, level);
+          glTexImage2D(gl_target, level, format, w, h, 0, format, GL_UNSIGNED_BYTE, (void*)src);
           src += w * h * num_comps;
-          w >>= 1;
-          h >>= 1;
         }
       }
     }
 
+    // upload the pixels to gl_texture.
+    void upload() {
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(gl_target, gl_texture);
+
+      // RGB rows and small mip levels are not a multiple of four bytes.
+      glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+      if (format == GL_RGB || format == GL_RGBA) {
+        add_texture();
+      } else if (dds_decoder::get_block_bytes(format)) {
+        app_utils::upload_compressed(gl_target, format, bytes.data(), width, height, mip_levels);
+      }
+    }
+
+    // grey 1x1 texture to draw with until the real image arrives.
+    void upload_placeholder() {
+      static const uint8_t grey[4] = { 0x80, 0x80, 0x80, 0xff };
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(gl_target, gl_texture);
+      if (gl_target == GL_TEXTURE_CUBE_MAP) {
+        for (int i = 0; i != 6; ++i) {
+          glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, (void*)grey);
+        }
+      } else {
+        glTexImage2D(gl_target, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, (void*)grey);
+      }
+      glGenerateMipmap(gl_target);
+    }
+
+    // main thread: take the pixels from an image decoded on a worker thread.
+    void finish_load(image *src) {
+      loading = false;
+      bytes.swap(src->bytes);
+      frames = src->frames;
+      width = src->width;
+      height = src->height;
+      depth = src->depth;
+      format = src->format;
+      mip_levels = src->mip_levels;
+      cube_faces = src->cube_faces;
+
+      // if nobody has asked for the texture yet, get_gl_texture() will upload it.
+      if (gl_texture == 0 || bytes.size() == 0) return;
+
+      if (gl_target != src->gl_target) {
+        // a GL texture name can't change target, so samplers that have cached the old name will keep the placeholder.
+        printf("warning: %s changed texture target while loading\n", url.c_str());
+        glDeleteTextures(1, &gl_texture);
+        gl_target = src->gl_target;
+        glGenTextures(1, &gl_texture);
+        glBindTexture(gl_target, gl_texture);
+        glTexParameteri(gl_target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(gl_target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      }
+
+      // keep the same texture name, samplers and materials hold on to it.
+      upload();
+    }
+
   public:
     RESOURCE_META(image)
 
@@ -262,6 +204,13 @@ namespace octet { namespace scene {
       init(name);
     }
 
+    /// give url of file to load and how to make its mipmaps.
+    /// Use mipmap_generator::for_data() for normal maps and other textures that are not colours,
+    /// and turn off wrap for textures that are clamped, such as UI elements.
+    image(const char *name, const mipmap_generator &gen) : mipmaps(gen) {
+      init(name);
+    }
+
     /// generate an image from an opengl texture
     image(GLuint _target, GLuint _texture, unsigned _width, unsigned _height, unsigned _depth=1) {
       gl_target = _target;
@@ -269,6 +218,8 @@ namespace octet { namespace scene {
       width = _width;
       height = _height;
       depth = _depth; // for 3D textures
+      frames = 1;
+      loading = false;
     }
 
     /// release resources.
@@ -300,6 +251,76 @@ namespace octet { namespace scene {
       return frames;
     }
 
+    /// Set how load() makes mipmaps. Call this before the image is loaded.
+    void set_mipmap_generator(const mipmap_generator &gen) {
+      mipmaps = gen;
+    }
+
+    /// How load() makes mipmaps.
+    const mipmap_generator &get_mipmap_generator() const {
+      return mipmaps;
+    }
+
+    /// Replace any mipmaps of this image with a full chain down to 1x1 made by gen.
+    /// The levels are stored after level 0 in the image bytes, so they are saved with the image
+    /// and uploaded as they are.
+    void make_mipmaps(const mipmap_generator &gen = mipmap_generator()) {
+      if (format != RGB && format != RGBA) return;
+      if (gl_target != GL_TEXTURE_2D || !width || !height) return;
+
+      unsigned num_comps = format == RGB ? 3 : 4;
+      size_t top_size = (size_t)width * height * num_comps;
+      if (bytes.size() < top_size) return;
+
+      bytes.resize((unsigned)mipmap_generator::get_size(width, height, num_comps));
+      mip_levels = (uint8_t)gen.generate(bytes.data(), width, height, num_comps);
+    }
+
+    /// DXT encode the image and its mipmaps, making it smaller and grainier.
+    /// new_format 0 picks DXT1 for RGB and DXT5 for RGBA images.
+    /// Use dxt_encoder::COMPRESSED_RED_RGTC1 (BC4) for single channel images and
+    /// dxt_encoder::COMPRESSED_RG_RGTC2 (BC5) for normal maps.
+    void dxt_encode(unsigned new_format=0, dxt_encoder::quality_t quality=dxt_encoder::quality_normal) {
+      if (format != RGB && format != RGBA) return;
+      if (gl_target != GL_TEXTURE_2D) return;
+
+      if (new_format == 0) {
+        new_format = format == RGB ? COMPRESSED_RGB_S3TC_DXT1_EXT : COMPRESSED_RGBA_S3TC_DXT5_EXT;
+      }
+
+      // walk the mip chain to find the size of the result.
+      unsigned num_comps = format == RGB ? 3 : 4;
+      unsigned num_levels = 0;
+      size_t src_size = 0, dest_size = 0;
+      for (unsigned level = 0; level != mip_levels; ++level) {
+        unsigned w = mipmap_generator::get_level_size(width, level);
+        unsigned h = mipmap_generator::get_level_size(height, level);
+        if (src_size + w * h * num_comps > bytes.size()) break;
+        src_size += w * h * num_comps;
+        dest_size += dxt_encoder::get_size(new_format, w, h);
+        num_levels++;
+      }
+
+      dynarray<uint8_t> result(dest_size);
+      if (!dest_size) return;
+
+      dxt_encoder enc(quality);
+      const uint8_t *src = bytes.data();
+      uint8_t *dest = result.data();
+      for (unsigned level = 0; level != num_levels; ++level) {
+        unsigned w = mipmap_generator::get_level_size(width, level);
+        unsigned h = mipmap_generator::get_level_size(height, level);
+        size_t size = enc.encode(dest, new_format, src, w, h, num_comps);
+        if (!size) return;
+        dest += size;
+        src += w * h * num_comps;
+      }
+
+      bytes.swap(result);
+      format = (uint16_t)new_format;
+      mip_levels = num_levels;
+    }
+
     /// access attributes by name
     void visit(visitor &v) {
       v.visit(url, atom_url);
@@ -335,23 +356,26 @@ namespace octet { namespace scene {
     }
 
     void load_part(const char *_url) {
-      dynarray<uint8_t> buffer;
-      app_utils::get_url(buffer, _url);
-      const unsigned char *src = &buffer[0];
-      const unsigned char *src_max = src + buffer.size();
-      if (buffer.size() >= 6 && !memcmp(&buffer[0], "GIF89a", 6)) {
+      // decode straight from the mapped file.
+      ref<file_map> file = app_utils::map_url(_url);
+      if (!file) return;
+      file->advise(file_map::hint_sequential);
+      const unsigned char *src = file->get_data();
+      const unsigned char *src_max = src + file->get_size();
+      size_t size = (size_t)file->get_size();
+      if (size >= 6 && !memcmp(src, "GIF89a", 6)) {
         gif_decoder dec;
         dec.get_image(bytes, format, width, height, src, src_max);
-      } else if (buffer.size() >= 6 && buffer[0] == 0xff && buffer[1] == 0xd8) {
+      } else if (size >= 6 && src[0] == 0xff && src[1] == 0xd8) {
         jpeg_decoder dec;
         dec.get_image(bytes, format, width, height, src, src_max);
-      } else if (buffer.size() >= 6 && buffer[0] == 0 && buffer[1] == 0 && buffer[2] == 2) {
+      } else if (size >= 6 && src[0] == 0 && src[1] == 0 && src[2] == 2) {
         tga_decoder dec;
         dec.get_image(bytes, format, width, height, src, src_max);
-      } else if (buffer.size() >= 4 && buffer[0] == 'D' && buffer[1] == 'D' && buffer[2] == 'S' && buffer[3] == ' ') {
+      } else if (size >= 4 && !memcmp(src, "DDS ", 4)) {
         dds_decoder dec;
-        dec.get_image(bytes, format, width, height, src, src_max);
-      } else if (buffer.size() >= 348 && (!memcmp(&buffer[344], "ni1", 4) || !memcmp(&buffer[344], "n+1", 4))) {
+        dec.get_image(bytes, format, width, height, mip_levels, src, src_max);
+      } else if (size >= 348 && (!memcmp(src + 344, "ni1", 4) || !memcmp(src + 344, "n+1", 4))) {
         nifti_decoder dec;
         gl_target = GL_TEXTURE_3D;
         dec.get_image(bytes, format, width, height, depth, frames, src, src_max);
@@ -360,42 +384,36 @@ namespace octet { namespace scene {
         return;
       }
 
-      make_mipmaps();
+      make_mipmaps(mipmaps);
       //dxt_encode();
     }
 
+    /// Load the image on a worker thread. Until it arrives, get_gl_texture() returns a grey placeholder.
+    void load_async(stream_queue &queue, int priority=0) {
+      if (loading || bytes.size() != 0 || url.size() == 0) return;
+      loading = true;
+      queue.add(new load_request(this, priority));
+    }
+
+    /// true if the image is still being loaded by load_async()
+    bool is_loading() const {
+      return loading;
+    }
+
     /// get the OpenGL texture handle for this image.
     GLuint get_gl_texture() {
       if (!gl_texture) {
-        if (bytes.size() == 0 || width == 0 || height == 0) {
+        if (!loading && (bytes.size() == 0 || width == 0 || height == 0)) {
           load();
         }
 
         // make a new texture handle
         glGenTextures(1, &gl_texture);
-        glActiveTexture(GL_TEXTURE0);
-
-        // todo: handle compressed textures
-        if (format == GL_RGB || format == GL_RGBA) {
-          add_texture();
-        } else if (format == COMPRESSED_RGB_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT3_EXT || format == COMPRESSED_RGBA_S3TC_DXT5_EXT) {
-          glBindTexture(gl_target, gl_texture);
-          unsigned w = width;
-          unsigned h = height;
-          uint8_t *src = &bytes[0];
-          unsigned level = 0;
-          unsigned shift = ( format == COMPRESSED_RGB_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT1_EXT ) ? 1 : 0;
-          while (w != 0 && h != 0) {
-            unsigned wmin = w < 4 ? 4 : w;
-            unsigned hmin = h < 4 ? 4 : h;
-            unsigned size = ( wmin * hmin ) >> shift;
-            glCompressedTexImage2D(gl_target, level++, format, w, h, 0, size, (void*)src);
-            //printf("%d\n", glGetError());
-            src += size;
-            w >>= 1;
-            h >>= 1;
-          }
-          //printf("%d %d\n", src - image_, size);
+
+        if (loading) {
+          upload_placeholder();
+        } else {
+          upload();
         }
 
         glTexParameteri(gl_target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
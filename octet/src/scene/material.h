@@ -24,15 +24,130 @@ namespace octet { namespace scene {
     //dynarray<uint8_t> static_buffer;
     dynarray<uint8_t> buffer;
 
+    // the dynamic parameters, so that we don't have to search for them every draw.
+    param_uniform *modelToProjection_param;
+    param_uniform *modelToCamera_param;
+    param_uniform *cameraToProjection_param;
+    param_uniform *lighting_param;
+    param_uniform *num_lights_param;
+
+    // one uniform in a compiled table.
+    struct uniform_binding {
+      GLint location;
+      uint16_t type;
+      uint16_t repeat;
+      uint16_t offset;
+      uint16_t size;
+    };
+
+    // The uniforms of the params that exist in one program, compiled on first use.
+    // shadow holds the bytes we last sent so that unchanged uniforms can be skipped.
+    struct uniform_table {
+      dynarray<uniform_binding> bindings;
+      dynarray<param_sampler*> samplers;
+      dynarray<uint8_t> shadow;
+      shader *program;
+      int modelToProjection;  // index in bindings or -1
+      int modelToCamera;
+      bool compiled;
+
+      uniform_table() {
+        program = 0;
+        modelToProjection = modelToCamera = -1;
+        compiled = false;
+      }
+    };
+
+    enum { table_default, table_instanced, num_tables };
+    uniform_table tables[num_tables];
+
+    // blends with what is behind it, so it is drawn after opaque materials.
+    bool transparent;
+
+    void init_params() {
+      modelToProjection_param = modelToCamera_param = cameraToProjection_param = 0;
+      lighting_param = num_lights_param = 0;
+      transparent = false;
+    }
+
     // create the parameters that change frequently such as the matrices and lighting
     void create_dynamic_params() {
       buffer.reserve(0x200);
       param_buffer_info dynamic_pbi(buffer);
 
-      params.push_back(new param_uniform(dynamic_pbi, NULL, atom_modelToProjection, GL_FLOAT_MAT4, 1, param::stage_vertex));
-      params.push_back(new param_uniform(dynamic_pbi, NULL, atom_modelToCamera, GL_FLOAT_MAT4, 1, param::stage_vertex));
-      params.push_back(new param_uniform(dynamic_pbi, NULL, atom_lighting, GL_FLOAT_VEC4, ambient_size + max_lights * light_size, param::stage_fragment));
-      params.push_back(new param_uniform(dynamic_pbi, NULL, atom_num_lights, GL_INT, 1, param::stage_fragment));
+      params.push_back(modelToProjection_param = new param_uniform(dynamic_pbi, NULL, atom_modelToProjection, GL_FLOAT_MAT4, 1, param::stage_vertex));
+      params.push_back(modelToCamera_param = new param_uniform(dynamic_pbi, NULL, atom_modelToCamera, GL_FLOAT_MAT4, 1, param::stage_vertex));
+      params.push_back(cameraToProjection_param = new param_uniform(dynamic_pbi, NULL, atom_cameraToProjection, GL_FLOAT_MAT4, 1, param::stage_vertex));
+      params.push_back(lighting_param = new param_uniform(dynamic_pbi, NULL, atom_lighting, GL_FLOAT_VEC4, ambient_size + max_lights * light_size, param::stage_fragment));
+      params.push_back(num_lights_param = new param_uniform(dynamic_pbi, NULL, atom_num_lights, GL_INT, 1, param::stage_fragment));
+    }
+
+    // build a flat list of the uniforms that the program actually uses.
+    void compile_table(uniform_table &table, bool instanced) {
+      table.bindings.resize(0);
+      table.samplers.resize(0);
+      table.modelToProjection = table.modelToCamera = -1;
+      table.program = instanced ? custom_shader->get_instanced_shader() : (shader*)custom_shader;
+
+      for (unsigned i = 0; i != params.size(); ++i) {
+        param_uniform *pu = params[i]->get_param_uniform();
+        if (!pu) continue;
+
+        // textures are global state, bind them every time.
+        param_sampler *ps = params[i]->get_param_sampler();
+        if (ps) table.samplers.push_back(ps);
+
+        GLint location = instanced ? pu->get_instanced_uniform() : pu->get_uniform();
+        if (location == -1) continue;
+
+        if (pu == modelToProjection_param) table.modelToProjection = (int)table.bindings.size();
+        if (pu == modelToCamera_param) table.modelToCamera = (int)table.bindings.size();
+
+        uniform_binding b;
+        b.location = location;
+        b.type = pu->get_gl_type();
+        b.repeat = (uint16_t)pu->get_repeat();
+        b.offset = (uint16_t)pu->get_offset();
+        b.size = (uint16_t)pu->get_size();
+        table.bindings.push_back(b);
+      }
+
+      table.shadow.resize(buffer.size());
+      table.compiled = true;
+    }
+
+    // send the uniforms that have changed since we last sent them to this program.
+    // the per-draw matrices are skipped; render_matrices() sends those.
+    void bind_table(unsigned index) {
+      uniform_table &table = tables[index];
+      if (!table.compiled || table.shadow.size() != buffer.size()) {
+        compile_table(table, index == table_instanced);
+      }
+
+      // if another material has used the program, its uniforms are not ours.
+      bool all = !table.program || !table.program->claim_uniforms(this);
+
+      const uint8_t *src = buffer.data();
+      uint8_t *shadow = table.shadow.data();
+      const uniform_binding *b = table.bindings.data();
+      for (unsigned i = 0, n = table.bindings.size(); i != n; ++i, ++b) {
+        if ((int)i == table.modelToProjection || (int)i == table.modelToCamera) continue;
+        if (all || memcmp(shadow + b->offset, src + b->offset, b->size)) {
+          memcpy(shadow + b->offset, src + b->offset, b->size);
+          param_uniform::upload(b->location, b->type, b->repeat, src + b->offset);
+        }
+      }
+
+      for (unsigned i = 0; i != table.samplers.size(); ++i) {
+        table.samplers[i]->bind_texture();
+      }
+    }
+
+    // tables need rebuilding after adding params or compiling shaders.
+    void invalidate_tables() {
+      for (unsigned i = 0; i != num_tables; ++i) {
+        tables[i].compiled = false;
+      }
     }
 
     // create the attribute parameters
@@ -53,10 +168,12 @@ namespace octet { namespace scene {
 
     /// Default constructor makes a blank material.
     material() {
+      init_params();
     }
 
     /// Alternative constructor.
     material(const vec4 &color, param_shader *shader = NULL) {
+      init_params();
       // materials are constructed from parameters which build the final shader.
       // this allows us to use OpenGLES2 (uniforms) and 3 (buffers) as well as new shader features.
       params.reserve(16);
@@ -68,7 +185,7 @@ namespace octet { namespace scene {
       params.push_back(new param_color(static_pbi, color, atom_diffuse, param::stage_fragment));
 
       if (shader == NULL) {
-        shader = new param_shader("shaders/default.vs", "shaders/default_solid.fs");
+        shader = new param_shader("shaders/default.vs", "shaders/default_solid.fs", "shaders/default_instanced.vs");
       }
       shader->init(params);
       custom_shader = shader;
@@ -76,6 +193,7 @@ namespace octet { namespace scene {
 
     /// create a material from an existing image
     material(image *img, sampler *smpl = NULL, param_shader *shader = NULL) {
+      init_params();
       if (!smpl) smpl = new sampler();
 
       params.reserve(16);
@@ -87,13 +205,14 @@ namespace octet { namespace scene {
       params.push_back(new param_sampler(static_pbi, atom_diffuse_sampler, img, smpl, param::stage_fragment));
 
       if (shader == NULL) {
-        shader = new param_shader("shaders/default.vs", "shaders/default_textured.fs");
+        shader = new param_shader("shaders/default.vs", "shaders/default_textured.fs", "shaders/default_instanced.vs");
         shader->init(params);
       }
       custom_shader = shader;
     }
 
     material(param *diffuse, param *ambient, param *emission, param *specular, param *bump, param *shininess) {
+      init_params();
     }
 
     /// Serialize.
@@ -102,37 +221,75 @@ namespace octet { namespace scene {
 
     /// Set the uniforms for this material.
     void render(const mat4t &modelToProjection, const mat4t &modelToCamera, vec4 *light_uniforms, int num_light_uniforms, int num_lights) {
-      /*char tmp[256];
-      log("lu[0] = %s\n", light_uniforms[0].toString(tmp, sizeof(tmp)));
-      log("lu[1] = %s\n", light_uniforms[1].toString(tmp, sizeof(tmp)));
-      log("lu[2] = %s\n", light_uniforms[2].toString(tmp, sizeof(tmp)));
-      log("lu[3] = %s\n", light_uniforms[3].toString(tmp, sizeof(tmp)));*/
-      {
-        // matrices and lighting go in the dynamic uniform buffer
-        param_uniform *modelToProjection_param = get_param_uniform(atom_modelToProjection);
-        if (modelToProjection_param) modelToProjection_param->set_value(buffer.data(), modelToProjection.get(), sizeof(modelToProjection));
-
-        param_uniform *modelToCamera_param = get_param_uniform(atom_modelToCamera);
-        if (modelToCamera_param) modelToCamera_param->set_value(buffer.data(), modelToCamera.get(), sizeof(modelToCamera));
-
-        param_uniform *lighting_param = get_param_uniform(atom_lighting);
-        if (lighting_param) lighting_param->set_value(buffer.data(), light_uniforms, sizeof(vec4) * num_light_uniforms);
-
-        param_uniform *num_lights_param = get_param_uniform(atom_num_lights);
-        if (num_lights_param) num_lights_param->set_value(buffer.data(), &num_lights, sizeof(int32_t));
-      }
+      custom_shader->render();
+      render_static(light_uniforms, num_light_uniforms, num_lights);
+      render_matrices(modelToProjection, modelToCamera);
+    }
+
+    /// The shader program for this material. Materials with the same program can share a glUseProgram.
+    GLuint get_program() const {
+      return custom_shader ? custom_shader->get_program() : 0;
+    }
 
+    /// Select the shader program (render queue: first of three steps).
+    void use_program() {
       custom_shader->render();
+    }
 
-      {
-        // colours and textures go in the static uniform buffer
-        for (unsigned i = 0; i != params.size(); ++i) {
-          param_uniform *pu = params[i]->get_param_uniform();
-          if (pu) {
-            //printf("%s: %d off=%x\n", app_utils::get_atom_name(pu->get_name()), pu->get_uniform_buffer_index(), pu->get_offset());
-            pu->render(buffer.data());
-          }
-        }
+    /// Set the uniforms that are the same for every instance: colours, textures and lighting.
+    /// (render queue: once for a run of instances with this material).
+    /// Only uniforms that have changed since the last call are sent.
+    void render_static(vec4 *light_uniforms, int num_light_uniforms, int num_lights) {
+      if (lighting_param) lighting_param->set_value(buffer.data(), light_uniforms, sizeof(vec4) * num_light_uniforms);
+      if (num_lights_param) num_lights_param->set_value(buffer.data(), &num_lights, sizeof(int32_t));
+      bind_table(table_default);
+    }
+
+    /// Transparent materials are drawn after the opaque ones, furthest first, so that they
+    /// blend with what is behind them. Set this for materials with alpha, such as sprites.
+    void set_transparent(bool value) {
+      transparent = value;
+    }
+
+    /// true if this material is drawn in the transparent pass.
+    bool is_transparent() const {
+      return transparent;
+    }
+
+    /// true if the shader has a variant that takes the model matrix from an instance attribute.
+    bool can_instance() const {
+      return custom_shader && custom_shader->has_instanced();
+    }
+
+    /// The instanced shader program, compiled on first use (render queue: instanced runs).
+    GLuint get_instanced_program() {
+      custom_shader->init_instanced(params);
+      return custom_shader->get_instanced_program();
+    }
+
+    /// Select the instanced shader program.
+    void use_instanced_program() {
+      custom_shader->init_instanced(params);
+      custom_shader->render_instanced();
+    }
+
+    /// As render_static() but for the instanced program. The modelToCamera matrices come from attribute_instance.
+    void render_static_instanced(const mat4t &cameraToProjection, vec4 *light_uniforms, int num_light_uniforms, int num_lights) {
+      if (cameraToProjection_param) cameraToProjection_param->set_value(buffer.data(), cameraToProjection.get(), sizeof(cameraToProjection));
+      if (lighting_param) lighting_param->set_value(buffer.data(), light_uniforms, sizeof(vec4) * num_light_uniforms);
+      if (num_lights_param) num_lights_param->set_value(buffer.data(), &num_lights, sizeof(int32_t));
+      bind_table(table_instanced);
+    }
+
+    /// Set the matrices for one instance (render queue: once per draw).
+    /// Call after render_static().
+    void render_matrices(const mat4t &modelToProjection, const mat4t &modelToCamera) {
+      const uniform_table &table = tables[table_default];
+      if (table.modelToProjection != -1) {
+        glUniformMatrix4fv(table.bindings[table.modelToProjection].location, 1, GL_FALSE, modelToProjection.get());
+      }
+      if (table.modelToCamera != -1) {
+        glUniformMatrix4fv(table.bindings[table.modelToCamera].location, 1, GL_FALSE, modelToCamera.get());
       }
     }
 
@@ -181,6 +338,12 @@ namespace octet { namespace scene {
       param_bind_info pbind;
       pbind.program = custom_shader->get_program();
       result->bind(pbind);
+      if (shader *instanced = custom_shader->get_instanced_shader()) {
+        pbind.program = instanced->get_program();
+        pbind.instanced = true;
+        result->bind(pbind);
+      }
+      invalidate_tables();
       return result;
     }
 
@@ -193,6 +356,12 @@ namespace octet { namespace scene {
       param_bind_info pbind;
       pbind.program = custom_shader->get_program();
       result->bind(pbind);
+      if (shader *instanced = custom_shader->get_instanced_shader()) {
+        pbind.program = instanced->get_program();
+        pbind.instanced = true;
+        result->bind(pbind);
+      }
+      invalidate_tables();
       return result;
     }
   };
@@ -53,6 +53,21 @@ namespace octet { namespace scene {
 
     // optional skin
     ref<skin> mesh_skin;
+
+    // vertex array object caching the attribute setup (GL3/ES3 only).
+    // rebuilt if the layout changes or the buffers are replaced or reallocated.
+    // reallocated buffers often get the same name back, so vao_dirty must be set; names are not compared.
+    mutable GLuint vao;
+    mutable bool vao_dirty;
+
+    // triangles and bvh for ray_cast, built on first use.
+    // rebuilt if the mesh changes or the buffers are reallocated.
+    bvh ray_tree;
+    dynarray<vec3p> ray_positions;
+    dynarray<uint32_t> ray_indices;
+    GLuint ray_vertex_buffer;
+    GLuint ray_index_buffer;
+    bool ray_dirty;
     
     // bounding box
     aabb mesh_aabb;
@@ -177,6 +192,12 @@ namespace octet { namespace scene {
       mode = rhs.mode;
 
       mesh_skin = rhs.mesh_skin;
+
+      vao = 0;
+      vao_dirty = true;
+
+      ray_vertex_buffer = ray_index_buffer = 0;
+      ray_dirty = true;
     }
 
     /// Init function used for aggregated meshes.
@@ -200,6 +221,12 @@ namespace octet { namespace scene {
 
       mesh_skin = _skin;
 
+      vao = 0;
+      vao_dirty = true;
+
+      ray_vertex_buffer = ray_index_buffer = 0;
+      ray_dirty = true;
+
       if (max_vertices || max_indices) {
         set_default_attributes();
         allocate(max_vertices * sizeof(vertex), max_indices * sizeof(uint32_t));
@@ -221,10 +248,15 @@ namespace octet { namespace scene {
       v.visit(num_slots, atom_num_slots);
       v.visit(mesh_skin, atom_mesh_skin);
       v.visit(mesh_aabb, atom_aabb);
+      vao_dirty = true;
+      ray_dirty = true;
     }
 
     // Destructor
     ~mesh() {
+      #if OCTET_VAO
+        if (vao) glDeleteVertexArrays(1, &vao);
+      #endif
     }
 
     /// Set the defuault mesh parameters, used for boxes, spheres etc.
@@ -238,6 +270,8 @@ namespace octet { namespace scene {
     /// reset the mesh to empty.
     void clear_attributes() {
       num_slots = 0;
+      vao_dirty = true;
+      ray_dirty = true;
     }
 
     /// Add an extra attribute to the mesh. eg. add_attribute(attribute_pos, 3, GL_FLOAT, 0)
@@ -245,6 +279,8 @@ namespace octet { namespace scene {
       assert(num_slots < max_slots);
       format[num_slots] = (offset << 9) + (attr << 5) + ((size-1) << 3) + (kind - GL_BYTE);
       if (norm) normalized |= 1 << num_slots;
+      vao_dirty = true;
+      ray_dirty = true;
       return num_slots++;
     }
 
@@ -328,16 +364,19 @@ namespace octet { namespace scene {
     /// Set the number of vertices to draw. (may be smaller that the buffer size).
     void set_num_vertices(unsigned value) {
       num_vertices = value;
+      ray_dirty = true;
     }
 
     /// Set the number of indices to draw. (may be smaller that the buffer size).
     void set_num_indices(unsigned value) {
       num_indices = value;
+      ray_dirty = true;
     }
 
     /// Set the first index to draw.
     void set_first_index(unsigned value) {
       first_index = value;
+      ray_dirty = true;
     }
 
     /// Set the kind of primitive to draw. (ie. GL_TRIANGLES etc.)
@@ -431,12 +470,15 @@ namespace octet { namespace scene {
     void allocate(size_t vsize, size_t isize) {
       vertices->allocate(GL_ARRAY_BUFFER, vsize);
       indices->allocate(GL_ELEMENT_ARRAY_BUFFER, isize);
+      vao_dirty = true;
+      ray_dirty = true;
     }
 
     /// allocate and assign data to IBO and VBO
     void assign(size_t vsize, size_t isize, uint8_t *vsrc, uint8_t *isrc) {
       vertices->assign(vsrc, 0, vsize);
       indices->assign(isrc, 0, isize);
+      ray_dirty = true;
     }
 
     /// set standard parameters of the mesh together.
@@ -446,6 +488,8 @@ namespace octet { namespace scene {
       num_vertices = (uint32_t)num_vertices_;
       mode = mode_;
       index_type = index_type_;
+      vao_dirty = true;
+      ray_dirty = true;
     }
 
     /// dump the mesh to a file in ASCII. Used to debug mesh transforms.
@@ -474,7 +518,25 @@ namespace octet { namespace scene {
 
     /// When rendering a mesh, call this first to enable the attributes.
     /// assume the shader, uniforms and render params are already set up.
+    /// With GL3/ES3, the attribute setup is recorded in a VAO the first time and bound after that.
     void enable_attributes() const {
+      #if OCTET_VAO
+        if (can_use_vao()) {
+          if (vao && !vao_dirty) {
+            glBindVertexArray(vao);
+            return;
+          }
+
+          // start again with a clean VAO so that attributes from an old layout are not left enabled.
+          // attribute locations are the same in every program (see shader::link) so one VAO serves them all.
+          if (vao) glDeleteVertexArrays(1, &vao);
+          glGenVertexArrays(1, &vao);
+          glBindVertexArray(vao);
+          if (indices && indices->get_buffer()) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices->get_buffer());
+          vao_dirty = false;
+        }
+      #endif
+
       vertices->bind();
 
       unsigned n = normalized;
@@ -493,15 +555,85 @@ namespace octet { namespace scene {
     void draw() {
       //printf("de %04x %d %d\n", get_mode(), get_num_vertices(), get_index_type());
       if (get_index_type()) {
-        indices->bind();
+        // the VAO holds the index buffer binding.
+        if (!vao) indices->bind();
         glDrawElements(get_mode(), get_num_indices(), get_index_type(), (GLvoid*)(get_index_size() * first_index));
       } else {
         glDrawArrays(get_mode(), 0, get_num_vertices());
       }
     }
 
+    /// Draw count copies of the primitives. Per-instance attributes must be set up with a divisor.
+    /// Only call this if can_draw_instanced() is true.
+    void draw_instanced(unsigned count) {
+      #if OCTET_INSTANCING
+        if (get_index_type()) {
+          if (!vao) indices->bind();
+          glDrawElementsInstanced(get_mode(), get_num_indices(), get_index_type(), (GLvoid*)(get_index_size() * first_index), count);
+        } else {
+          glDrawArraysInstanced(get_mode(), 0, get_num_vertices(), count);
+        }
+      #endif
+    }
+
+    /// true if the GL context has vertex array objects (GL3 or ES3).
+    /// Needs a current context; the answer is cached after the first call.
+    static bool can_use_vao() {
+      #if OCTET_VAO
+        static int result = -1;
+        if (result == -1) {
+          const char *version = (const char*)glGetString(GL_VERSION);
+          if (!version) return false;
+
+          int major = 0;
+          bool es = !strncmp(version, "OpenGL ES ", 10);
+          sscanf(es ? version + 10 : version, "%d", &major);
+          result = major >= 3;
+
+          #ifdef WIN32
+            if (!glGenVertexArrays || !glBindVertexArray || !glDeleteVertexArrays) result = 0;
+          #endif
+        }
+        return result != 0;
+      #else
+        return false;
+      #endif
+    }
+
+    /// true if the GL context can draw instances with per-instance attributes (GL3.3 or ES3).
+    /// Needs a current context; the answer is cached after the first call.
+    static bool can_draw_instanced() {
+      #if OCTET_INSTANCING
+        static int result = -1;
+        if (result == -1) {
+          const char *version = (const char*)glGetString(GL_VERSION);
+          if (!version) return false;
+
+          int major = 0, minor = 0;
+          bool es = !strncmp(version, "OpenGL ES ", 10);
+          sscanf(es ? version + 10 : version, "%d.%d", &major, &minor);
+          result = es ? major >= 3 : major * 10 + minor >= 33;
+
+          #ifdef WIN32
+            // entry points come from wglGetProcAddress and may be missing.
+            if (!glDrawElementsInstanced || !glDrawArraysInstanced || !glVertexAttribDivisor) result = 0;
+          #endif
+        }
+        return result != 0;
+      #else
+        return false;
+      #endif
+    }
+
     /// When rendering a mesh, call this last to disable attributes.
     void disable_attributes() {
+      #if OCTET_VAO
+        if (vao) {
+          // leave attributes enabled in our VAO, but don't let anyone else modify it.
+          glBindVertexArray(0);
+          return;
+        }
+      #endif
       for (unsigned slot = 0; slot != get_num_slots(); ++slot) {
         unsigned attr = get_attr(slot);
         glDisableVertexAttribArray(attr);
@@ -531,16 +663,143 @@ namespace octet { namespace scene {
       for (unsigned i = 1; i < num_vertices; ++i) {
         vec3 pos = get_value(vtx_lock.u8(), slot, i).xyz();
         vmin = min(pos, vmin);
-        vmax = max(pos, vmin);
+        vmax = max(pos, vmax);
       }
       mesh_aabb = aabb((vmax + vmin) * 0.5f, (vmax - vmin) * 0.5f);
     }
 
-    /// *very* slow ray cast.
-    /// returns "barycentric" coordinates.
+    /// Call this if you change the vertices or indices through a lock, so that ray_cast sees the changes.
+    void invalidate_ray_cast() {
+      ray_dirty = true;
+    }
+
+    /// Ray cast against the triangles between the start and end of the ray.
+    /// returns "barycentric" coordinates of the nearest hit as bary_numer / bary_denom.
     /// eg. hit pos = bary[0] * pos0 + bary[1] * pos1 + bary[2] * pos2 (or ray.start + ray.distance * bary[3])
     /// eg. hit uv = bary[0] * uv0 + bary[1] * uv1 + bary[2] * uv2
-    bool ray_cast(const ray &the_ray, int indices[], vec4 &bary_numer, float &bary_denom) {
+    ///
+    /// Uses a bvh, built on the first call, and float arithmetic.
+    /// If exact is true, uses rational arithmetic on every triangle instead (*very* slow, GL_UNSIGNED_INT indices only).
+    bool ray_cast(const ray &the_ray, int indices[], vec4 &bary_numer, float &bary_denom, bool exact=false) {
+      if (exact) {
+        return ray_cast_exact(the_ray, indices, bary_numer, bary_denom);
+      }
+
+      bary_numer = vec4(0, 0, 0, 0);
+      bary_denom = 0;
+      if (!update_ray_cache()) return false;
+
+      vec3 org = the_ray.get_start();
+      vec3 dir = the_ray.get_distance();
+      const vec3p *pos = ray_positions.data();
+
+      float t = 1.0f;
+      int best = -1;
+      float best_u = 0, best_v = 0;
+      ray_tree.intersect(org, dir, t, [&](unsigned tri, float &tmax) {
+        // Moller-Trumbore, both sides.
+        vec3 a = pos[tri*3+0];
+        vec3 e1 = (vec3)pos[tri*3+1] - a;
+        vec3 e2 = (vec3)pos[tri*3+2] - a;
+        vec3 p = cross(dir, e2);
+        float det = dot(e1, p);
+        if (det == 0) return false;
+        float inv_det = 1.0f / det;
+
+        vec3 s = org - a;
+        float u = dot(s, p) * inv_det;
+        if (u < 0 || u > 1) return false;
+
+        vec3 q = cross(s, e1);
+        float v = dot(dir, q) * inv_det;
+        if (v < 0 || u + v > 1) return false;
+
+        float tt = dot(e2, q) * inv_det;
+        if (tt < 0 || tt >= tmax) return false;
+
+        tmax = tt;
+        best = (int)tri;
+        best_u = u;
+        best_v = v;
+        return true;
+      });
+
+      if (best == -1) return false;
+
+      indices[0] = ray_indices[best*3+0];
+      indices[1] = ray_indices[best*3+1];
+      indices[2] = ray_indices[best*3+2];
+      bary_numer = vec4(1 - best_u - best_v, best_u, best_v, t);
+      bary_denom = 1;
+      return true;
+    }
+
+    /// get the bvh used by ray_cast (empty until the first ray_cast).
+    const bvh &get_ray_bvh() const {
+      return ray_tree;
+    }
+
+  private:
+    // copy the triangles out of the GL buffers and build the bvh if anything has changed.
+    bool update_ray_cache() {
+      GLuint vb = vertices ? vertices->get_buffer() : 0;
+      GLuint ib = indices ? indices->get_buffer() : 0;
+      if (!ray_dirty && vb == ray_vertex_buffer && ib == ray_index_buffer) {
+        return ray_tree.get_num_prims() != 0;
+      }
+
+      ray_dirty = false;
+      ray_vertex_buffer = vb;
+      ray_index_buffer = ib;
+      ray_tree.begin(0);
+      ray_tree.build();
+      ray_positions.resize(0);
+      ray_indices.resize(0);
+
+      unsigned pos_slot = get_slot(attribute_pos);
+      if (pos_slot == ~0u || get_mode() != GL_TRIANGLES) return false;
+      if (get_size(pos_slot) < 3 || get_kind(pos_slot) != GL_FLOAT) return false;
+      if (!vertices || !vertices->get_size() || !num_vertices) return false;
+
+      bool indexed = index_type != 0;
+      if (indexed && (!indices || !indices->get_size())) return false;
+
+      unsigned num_tris = (indexed ? num_indices : num_vertices) / 3;
+      ray_positions.resize(num_tris * 3);
+      ray_indices.resize(num_tris * 3);
+
+      {
+        unsigned pos_offset = get_offset(pos_slot);
+        gl_resource::rolock vtx_lock(get_vertices());
+        const uint8_t *vtx = vtx_lock.u8();
+        if (indexed) {
+          gl_resource::rolock idx_lock(get_indices());
+          for (unsigned i = 0; i != num_tris * 3; ++i) {
+            ray_indices[i] = get_index(idx_lock.u8(), i);
+          }
+        } else {
+          for (unsigned i = 0; i != num_tris * 3; ++i) {
+            ray_indices[i] = i;
+          }
+        }
+
+        for (unsigned i = 0; i != num_tris * 3; ++i) {
+          unsigned idx = ray_indices[i];
+          ray_positions[i] = idx < num_vertices ? *(const vec3p*)(vtx + pos_offset + stride * idx) : vec3p(0, 0, 0);
+        }
+      }
+
+      ray_tree.begin(num_tris);
+      for (unsigned i = 0; i != num_tris; ++i) {
+        vec3 a = ray_positions[i*3+0], b = ray_positions[i*3+1], c = ray_positions[i*3+2];
+        ray_tree.add(min(a, min(b, c)), max(a, max(b, c)));
+      }
+      ray_tree.build();
+      return num_tris != 0;
+    }
+
+    // The original ray cast: every triangle, with rational arithmetic.
+    bool ray_cast_exact(const ray &the_ray, int indices[], vec4 &bary_numer, float &bary_denom) {
       unsigned pos_slot = get_slot(attribute_pos);
       if (get_index_type() != GL_UNSIGNED_INT) return false;
       if (get_size(pos_slot) < 3) return false;
@@ -621,6 +880,8 @@ namespace octet { namespace scene {
       }
     }
 
+  public:
+
     /// access the vertex buffer (VBO) or memory buffer
     gl_resource *get_vertices() const {
       return vertices;
@@ -634,6 +895,8 @@ namespace octet { namespace scene {
     /// set a new VBO object
     void set_vertices(gl_resource *value) {
       vertices = value;
+      vao_dirty = true;
+      ray_dirty = true;
     }
 
     /// assign a vector to the vertex buffer and set params
@@ -644,12 +907,15 @@ namespace octet { namespace scene {
       }
       vertices->assign(rhs.data(), 0, rhs.size() * sizeof(elem_t));
       stride = sizeof(elem_t);
+      vao_dirty = true;
       set_num_vertices(rhs.size());
     }
 
     /// set a new IBO object
     void set_indices(gl_resource *value) {
       indices = value;
+      vao_dirty = true;
+      ray_dirty = true;
     }
 
     /// assign a vector to the index buffer and set params
@@ -660,6 +926,8 @@ namespace octet { namespace scene {
       }
       indices->assign(rhs.data(), 0, rhs.size() * sizeof(elem_t));
       set_index_type(sizeof(elem_t) == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT);
+      vao_dirty = true;
+      ray_dirty = true;
       set_num_indices(rhs.size());
       set_first_index(0);
     }
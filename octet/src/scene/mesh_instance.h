@@ -11,7 +11,8 @@ namespace octet { namespace scene {
   /// Instance of a mesh in a game world; node, mesh, material and skin.
   class mesh_instance : public resource {
   public:
-    enum { flag_selected = 1 << 0, flag_enabled = 1 << 1, flag_lod = 1 << 2 };
+    // flag_no_cull: always draw, for meshes that move their vertices outside the aabb.
+    enum { flag_selected = 1 << 0, flag_enabled = 1 << 1, flag_lod = 1 << 2, flag_no_cull = 1 << 3 };
 
   private:
     // which scene_node (model to world matrix) to use in the scene
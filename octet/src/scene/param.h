@@ -37,6 +37,9 @@ namespace octet { namespace scene {
     virtual void render(const uint8_t *buffer) {
     }
 
+    virtual void render_instanced(const uint8_t *buffer) {
+    }
+
     const char *get_atom_name() const {
       return app_utils::get_atom_name(name);
     }
@@ -86,6 +89,12 @@ namespace octet { namespace scene {
 
   struct param_bind_info {
     GLint program;
+    bool instanced;   // binding the instanced variant of the shader?
+
+    param_bind_info() {
+      program = 0;
+      instanced = false;
+    }
   };
 
   struct param_buffer_info {
@@ -106,13 +115,17 @@ namespace octet { namespace scene {
   /// The parameter uniform records the location, name and type of the uniform as well as the repeat count for arrays.
   class param_uniform : public param {
     GLint uniform;           // uniform index
+    GLint instanced_uniform; // uniform index in the instanced shader
     uint16_t offset;         // offset in uniform buffer
+    uint16_t size;           // bytes used in uniform buffer
     uint16_t repeat;         // how many in array?
     uint8_t uniform_buffer;  // Which uniform buffer? 0 = dynamic, 1 = static.
   public:
     RESOURCE_META(param_uniform)
+    RESOURCE_POOL(param_uniform)
 
     param_uniform() {
+      uniform = instanced_uniform = -1;
     }
 
     /// create a new uniform parameter with a prototype in "buffer"
@@ -120,6 +133,7 @@ namespace octet { namespace scene {
     param_uniform(param_buffer_info &pbi, const void *data, atom_t name, uint16_t _type, uint16_t _repeat, stage_type _stage=stage_fragment) :
       param(name, _type, _stage)
     {
+      uniform = instanced_uniform = -1;
       repeat = _repeat;
 
       // in uniform buffers, everything is in units of 16 bytes
@@ -132,6 +146,7 @@ namespace octet { namespace scene {
       }
 
       //pbi.size += size;
+      this->size = size;
       offset = pbi.buffer.size();
       pbi.buffer.resize(offset + size);
 
@@ -169,7 +184,8 @@ namespace octet { namespace scene {
 
     /// connect the parameter to the shader
     void bind(param_bind_info &pbi) {
-      uniform = glGetUniformLocation(pbi.program, get_atom_name());
+      GLint &dest = pbi.instanced ? instanced_uniform : uniform;
+      dest = glGetUniformLocation(pbi.program, get_atom_name());
       //log("bind %d %s\n", uniform, get_atom_name());
     }
 
@@ -178,10 +194,25 @@ namespace octet { namespace scene {
       return uniform;
     }
 
+    /// get the uniform location in the instanced shader
+    GLint get_instanced_uniform() const {
+      return instanced_uniform;
+    }
+
     unsigned get_offset() const {
       return offset;
     }
 
+    /// bytes reserved in the uniform buffer.
+    unsigned get_size() const {
+      return size;
+    }
+
+    /// number of array elements.
+    unsigned get_repeat() const {
+      return repeat;
+    }
+
     /// if buffer is a pointer to a uniform buffer, set the value in the correct place.
     void set_value(uint8_t *buffer, const void *value, unsigned size) {
       memcpy(buffer + offset, value, size);
@@ -200,15 +231,27 @@ namespace octet { namespace scene {
     /// for OpenGL ES2, call glUniform* to copy the uniform to the GPU command buffer.
     /// for OpenGL ES3, we can use the uniform buffer directly and so don't need this.
     void render(const uint8_t *buffer) {
-      GLint uni = get_uniform();
+      render_location(uniform, buffer);
+    }
+
+    /// as render(), but for the instanced variant of the shader.
+    void render_instanced(const uint8_t *buffer) {
+      render_location(instanced_uniform, buffer);
+    }
 
+    /// copy the uniform to a specific location in the current program.
+    void render_location(GLint uni, const uint8_t *buffer) {
       if (uni == -1) return;
+      upload(uni, get_gl_type(), repeat, buffer + offset);
+    }
 
-      switch (get_gl_type()) {
-        case GL_FLOAT: glUniform1fv(uni, repeat, (float*)(buffer + offset)); break;
-        case GL_FLOAT_VEC2: glUniform2fv(uni, repeat, (float*)(buffer + offset)); break;
-        case GL_FLOAT_VEC3: glUniform3fv(uni, repeat, (float*)(buffer + offset)); break;
-        case GL_FLOAT_VEC4: glUniform4fv(uni, repeat, (float*)(buffer + offset)); break;
+    /// call glUniform* for a value of a GL type. (material uniform tables call this directly)
+    static void upload(GLint uni, unsigned type, unsigned repeat, const uint8_t *value) {
+      switch (type) {
+        case GL_FLOAT: glUniform1fv(uni, repeat, (float*)value); break;
+        case GL_FLOAT_VEC2: glUniform2fv(uni, repeat, (float*)value); break;
+        case GL_FLOAT_VEC3: glUniform3fv(uni, repeat, (float*)value); break;
+        case GL_FLOAT_VEC4: glUniform4fv(uni, repeat, (float*)value); break;
 
         case GL_SAMPLER_2D:
         case GL_SAMPLER_CUBE:
@@ -216,14 +259,14 @@ namespace octet { namespace scene {
         case GL_SAMPLER_2D_SHADOW:
         case GL_INT:
         case GL_BOOL: 
-        case GL_UNSIGNED_INT: glUniform1iv(uni, repeat, (GLint*)(buffer + offset)); break;
-        case GL_BOOL_VEC2: case GL_INT_VEC2: glUniform2iv(uni, repeat, (GLint*)(buffer + offset)); break;
-        case GL_BOOL_VEC3: case GL_INT_VEC3: glUniform3iv(uni, repeat, (GLint*)(buffer + offset)); break;
-        case GL_BOOL_VEC4: case GL_INT_VEC4: glUniform4iv(uni, repeat, (GLint*)(buffer + offset)); break;
+        case GL_UNSIGNED_INT: glUniform1iv(uni, repeat, (GLint*)value); break;
+        case GL_BOOL_VEC2: case GL_INT_VEC2: glUniform2iv(uni, repeat, (GLint*)value); break;
+        case GL_BOOL_VEC3: case GL_INT_VEC3: glUniform3iv(uni, repeat, (GLint*)value); break;
+        case GL_BOOL_VEC4: case GL_INT_VEC4: glUniform4iv(uni, repeat, (GLint*)value); break;
 
-        case GL_FLOAT_MAT2: glUniformMatrix2fv(uni, repeat, GL_FALSE, (float*)(buffer + offset)); break;
-        case GL_FLOAT_MAT3: glUniformMatrix3fv(uni, repeat, GL_FALSE, (float*)(buffer + offset)); break;
-        case GL_FLOAT_MAT4: glUniformMatrix4fv(uni, repeat, GL_FALSE, (float*)(buffer + offset)); break;
+        case GL_FLOAT_MAT2: glUniformMatrix2fv(uni, repeat, GL_FALSE, (float*)value); break;
+        case GL_FLOAT_MAT3: glUniformMatrix3fv(uni, repeat, GL_FALSE, (float*)value); break;
+        case GL_FLOAT_MAT4: glUniformMatrix4fv(uni, repeat, GL_FALSE, (float*)value); break;
 
         default: abort();
       }
@@ -290,6 +333,17 @@ namespace octet { namespace scene {
     /// Set the OpenGL state for this sampler.
     void render(const uint8_t *buffer) {
       param_uniform::render(buffer);
+      bind_texture();
+    }
+
+    /// Set the OpenGL state for this sampler in the instanced shader.
+    void render_instanced(const uint8_t *buffer) {
+      param_uniform::render_instanced(buffer);
+      bind_texture();
+    }
+
+    /// Bind the image to our texture slot.
+    void bind_texture() {
       glActiveTexture(GL_TEXTURE0 + texture_slot);
       glBindTexture(sampler_->get_gl_target(), sampler_->get_gl_texture(image_));
 
@@ -302,13 +356,19 @@ namespace octet { namespace scene {
     std::string vertex_shader;
     std::string fragment_shader;
 
+    // optional vertex shader that takes the model matrix from a per-instance attribute.
+    std::string instanced_vertex_shader;
+    ref<shader> instanced;
+
   public:
     RESOURCE_META(param_shader)
 
     param_shader() {
     }
 
-    param_shader(const char *vs_url, const char *fs_url) {
+    /// Load a vertex and fragment shader.
+    /// If instanced_vs_url is given, the same fragment shader can also be used with an instanced vertex shader.
+    param_shader(const char *vs_url, const char *fs_url, const char *instanced_vs_url = NULL) {
       dynarray<uint8_t> vs;
       dynarray<uint8_t> fs;
       app_utils::get_url(vs, vs_url);
@@ -316,6 +376,12 @@ namespace octet { namespace scene {
 
       vertex_shader.assign((const char*)vs.data(), (const char*)(vs.data() + vs.size()));
       fragment_shader.assign((const char*)fs.data(), (const char*)(fs.data() + fs.size()));
+
+      if (instanced_vs_url) {
+        dynarray<uint8_t> ivs;
+        app_utils::get_url(ivs, instanced_vs_url);
+        instanced_vertex_shader.assign((const char*)ivs.data(), (const char*)(ivs.data() + ivs.size()));
+      }
     }
 
     void init(dynarray<ref<param> > &params) {
@@ -328,6 +394,42 @@ namespace octet { namespace scene {
         params[i]->bind(pbi);
       }
     }
+
+    /// true if this shader has an instanced variant.
+    bool has_instanced() const {
+      return !instanced_vertex_shader.empty();
+    }
+
+    /// Compile the instanced variant on first use and bind the parameters to it.
+    void init_instanced(dynarray<ref<param> > &params) {
+      if (instanced || !has_instanced()) return;
+
+      instanced = new shader();
+      instanced->init(instanced_vertex_shader.data(), fragment_shader.data());
+
+      param_bind_info pbi;
+      pbi.program = instanced->get_program();
+      pbi.instanced = true;
+
+      for (unsigned i = 0; i != params.size(); ++i) {
+        params[i]->bind(pbi);
+      }
+    }
+
+    /// the instanced variant's OpenGL program (0 if not compiled).
+    GLuint get_instanced_program() const {
+      return instanced ? instanced->get_program() : 0;
+    }
+
+    /// the instanced variant (NULL if not compiled).
+    shader *get_instanced_shader() const {
+      return instanced;
+    }
+
+    /// use the instanced variant compiled in init_instanced()
+    void render_instanced() {
+      if (instanced) instanced->render();
+    }
   };
 }}
 
@@ -0,0 +1,413 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Render queue
+//
+// Draw calls are collected for a frame, sorted by a 64 bit key and then drawn
+// in order, only changing GL state when it differs from the previous draw.
+//
+// key bits:
+//
+//   63..60  pass (opaque, skinned, transparent)
+//   59..48  shader program
+//   47..32  material
+//   31..16  mesh
+//   15..0   depth (front to back)
+//
+// In the transparent pass, state is ignored so that blending works:
+//
+//   63..60  pass
+//   59..44  depth (back to front)
+//   43..0   order of add() calls
+//
+// After sorting, draws that share a mesh and material are next to each other.
+// Runs of these are drawn with one glDrawElementsInstanced call, taking the
+// modelToCamera matrices from a per-instance attribute buffer. Without GL3.3/ES3
+// the runs are drawn one instance at a time.
+//
+
+namespace octet { namespace scene {
+  /// Sorted list of mesh instances to draw this frame.
+  class render_queue {
+  public:
+    /// Passes draw in this order.
+    enum pass_t {
+      pass_opaque,
+      pass_skinned,
+      pass_transparent,  // blended materials, furthest first.
+      pass_max = 15,
+    };
+
+  private:
+    struct item {
+      mesh_instance *mi;
+      mat4t modelToProjection;
+      mat4t modelToCamera;
+    };
+
+    // a run of draws with the same mesh and material.
+    struct run {
+      unsigned begin;
+      unsigned end;
+      unsigned first_instance;  // offset in instance_matrices, or ~0 if drawn one at a time.
+    };
+
+    dynarray<item> items;
+    dynarray<uint64_t> keys;
+    dynarray<uint32_t> order;
+
+    // scratch space for the radix sort.
+    dynarray<uint64_t> tmp_keys;
+    dynarray<uint32_t> tmp_order;
+
+    // small numbers for materials and meshes so that they fit in the key.
+    // ids only affect the sort order, so a recycled pointer is harmless.
+    hash_map<void*, unsigned> ids;
+    unsigned num_ids;
+
+    // instancing
+    dynarray<run> runs;
+    dynarray<mat4t> instance_matrices;
+    GLuint instance_buffer;
+    unsigned instance_buffer_size;
+    unsigned min_instances;
+    bool instancing;
+
+    // stats for the last draw()
+    unsigned num_draws;
+    unsigned num_program_changes;
+    unsigned num_material_changes;
+    unsigned num_mesh_changes;
+    unsigned num_instanced_draws;
+
+    unsigned get_id(void *ptr) {
+      unsigned &id = ids[ptr];
+      if (!id) id = ++num_ids;
+      return id;
+    }
+
+    // top 16 bits of a positive float sort in the same order as the float.
+    static unsigned depth_bits(float depth) {
+      union { float f; uint32_t u; } u;
+      u.f = depth > 0 ? depth : 0;
+      return u.u >> 16;
+    }
+
+    // LSD radix sort of keys and order, eight bits at a time.
+    // Passes where every key has the same byte are skipped, which is common for the pass and program bits.
+    void radix_sort() {
+      unsigned n = keys.size();
+      tmp_keys.resize(n);
+      tmp_order.resize(n);
+
+      uint64_t *src_keys = keys.data(), *dest_keys = tmp_keys.data();
+      uint32_t *src_order = order.data(), *dest_order = tmp_order.data();
+
+      for (unsigned shift = 0; shift != 64; shift += 8) {
+        unsigned count[256];
+        memset(count, 0, sizeof(count));
+        for (unsigned i = 0; i != n; ++i) {
+          count[(src_keys[i] >> shift) & 0xff]++;
+        }
+
+        if (count[(src_keys[0] >> shift) & 0xff] == n) continue;
+
+        unsigned total = 0;
+        for (unsigned i = 0; i != 256; ++i) {
+          unsigned c = count[i];
+          count[i] = total;
+          total += c;
+        }
+
+        for (unsigned i = 0; i != n; ++i) {
+          unsigned d = count[(src_keys[i] >> shift) & 0xff]++;
+          dest_keys[d] = src_keys[i];
+          dest_order[d] = src_order[i];
+        }
+
+        uint64_t *tk = src_keys; src_keys = dest_keys; dest_keys = tk;
+        uint32_t *to = src_order; src_order = dest_order; dest_order = to;
+      }
+
+      // an odd number of passes leaves the result in the scratch arrays.
+      if (src_keys != keys.data()) {
+        keys.swap(tmp_keys);
+        order.swap(tmp_order);
+      }
+    }
+
+    // split the sorted draws into runs and gather the matrices of the runs we can instance.
+    void make_runs() {
+      runs.resize(0);
+      instance_matrices.resize(0);
+
+      bool can_instance = instancing && mesh::can_draw_instanced();
+
+      for (unsigned i = 0; i != order.size(); ) {
+        mesh_instance *mi = items[order[i]].mi;
+        mesh *msh = mi->get_mesh();
+        material *mat = mi->get_material();
+        bool skinned = mi->get_skeleton() && msh->get_skin();
+
+        unsigned j = i + 1;
+        if (!skinned) {
+          while (j != order.size()) {
+            mesh_instance *mj = items[order[j]].mi;
+            if (mj->get_mesh() != msh || mj->get_material() != mat || mj->get_skeleton()) break;
+            ++j;
+          }
+        }
+
+        run r;
+        r.begin = i;
+        r.end = j;
+        r.first_instance = ~0u;
+        if (can_instance && j - i >= min_instances && mat->can_instance()) {
+          r.first_instance = instance_matrices.size();
+          for (unsigned k = i; k != j; ++k) {
+            instance_matrices.push_back(items[order[k]].modelToCamera);
+          }
+        }
+        runs.push_back(r);
+        i = j;
+      }
+    }
+
+    // copy all the instance matrices for this frame to the GPU in one go.
+    void upload_instances() {
+      #if OCTET_INSTANCING
+        if (!instance_matrices.size()) return;
+
+        unsigned bytes = instance_matrices.size() * sizeof(mat4t);
+        if (!instance_buffer) glGenBuffers(1, &instance_buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+        if (bytes > instance_buffer_size) {
+          instance_buffer_size = bytes + bytes / 2;
+        }
+        // orphan the old storage so we don't wait for last frame's draws.
+        glBufferData(GL_ARRAY_BUFFER, instance_buffer_size, NULL, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, instance_matrices.data());
+      #endif
+    }
+
+    // point attribute_instance..attribute_instance+3 at the matrices for a run.
+    // matrix rows are GLSL columns, so the mat4 attribute is the same as the uniform.
+    void enable_instance_attributes(unsigned first_instance) {
+      #if OCTET_INSTANCING
+        glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+        for (unsigned i = 0; i != 4; ++i) {
+          unsigned attr = attribute_instance + i;
+          size_t offset = first_instance * sizeof(mat4t) + i * sizeof(vec4);
+          glVertexAttribPointer(attr, 4, GL_FLOAT, GL_FALSE, sizeof(mat4t), (void*)offset);
+          glVertexAttribDivisor(attr, 1);
+          glEnableVertexAttribArray(attr);
+        }
+      #endif
+    }
+
+    void disable_instance_attributes() {
+      #if OCTET_INSTANCING
+        for (unsigned i = 0; i != 4; ++i) {
+          unsigned attr = attribute_instance + i;
+          glVertexAttribDivisor(attr, 0);
+          glDisableVertexAttribArray(attr);
+        }
+      #endif
+    }
+
+  public:
+    render_queue() {
+      num_ids = 0;
+      num_draws = num_program_changes = num_material_changes = num_mesh_changes = num_instanced_draws = 0;
+      instance_buffer = 0;
+      instance_buffer_size = 0;
+      min_instances = 4;
+      instancing = true;
+    }
+
+    ~render_queue() {
+      if (instance_buffer) glDeleteBuffers(1, &instance_buffer);
+    }
+
+    /// Start a new frame.
+    void reset() {
+      items.resize(0);
+      keys.resize(0);
+      order.resize(0);
+
+      if (num_ids >= 0xffff) {
+        ids.clear();
+        num_ids = 0;
+      }
+    }
+
+    /// Add a mesh instance to draw with its matrices.
+    /// Draws in pass_transparent are sorted back to front, and in the order they were added if they are the same depth.
+    void add(mesh_instance *mi, pass_t pass, const mat4t &modelToProjection, const mat4t &modelToCamera) {
+      material *mat = mi->get_material();
+      uint64_t key;
+      if (pass == pass_transparent) {
+        key =
+          ((uint64_t)pass << 60) |
+          ((uint64_t)(depth_bits(-modelToCamera.w().z()) ^ 0xffff) << 44) |
+          ((uint64_t)items.size() & (((uint64_t)1 << 44) - 1))
+        ;
+      } else {
+        key =
+          ((uint64_t)pass << 60) |
+          ((uint64_t)(mat->get_program() & 0xfff) << 48) |
+          ((uint64_t)(get_id(mat) & 0xffff) << 32) |
+          ((uint64_t)(get_id(mi->get_mesh()) & 0xffff) << 16) |
+          depth_bits(-modelToCamera.w().z())
+        ;
+      }
+
+      order.push_back(items.size());
+      keys.push_back(key);
+      items.resize(items.size() + 1);
+      item &it = items.back();
+      it.mi = mi;
+      it.modelToProjection = modelToProjection;
+      it.modelToCamera = modelToCamera;
+    }
+
+    /// Sort the draws by key.
+    void sort() {
+      if (keys.size() > 1) {
+        radix_sort();
+      }
+    }
+
+    /// Draw everything in key order, changing the program, material and mesh only when needed.
+    /// Runs of at least get_min_instances() draws of the same mesh and material become one instanced draw.
+    void draw(const mat4t &cameraToProjection, vec4 *light_uniforms, int num_light_uniforms, int num_lights) {
+      GLuint cur_program = 0;
+      material *cur_material = 0;
+      bool cur_instanced = false;
+      mesh *cur_mesh = 0;
+
+      num_draws = num_program_changes = num_material_changes = num_mesh_changes = num_instanced_draws = 0;
+
+      make_runs();
+      upload_instances();
+
+      for (unsigned r = 0; r != runs.size(); ++r) {
+        const run &rn = runs[r];
+        bool instanced = rn.first_instance != ~0u;
+        mesh_instance *first = items[order[rn.begin]].mi;
+        mesh *msh = first->get_mesh();
+        material *mat = first->get_material();
+
+        if (mat != cur_material || instanced != cur_instanced) {
+          GLuint program = instanced ? mat->get_instanced_program() : mat->get_program();
+          if (program != cur_program) {
+            if (instanced) mat->use_instanced_program(); else mat->use_program();
+            cur_program = program;
+            num_program_changes++;
+          }
+          if (instanced) {
+            mat->render_static_instanced(cameraToProjection, light_uniforms, num_light_uniforms, num_lights);
+          } else {
+            mat->render_static(light_uniforms, num_light_uniforms, num_lights);
+          }
+          cur_material = mat;
+          cur_instanced = instanced;
+          num_material_changes++;
+        }
+
+        if (msh != cur_mesh) {
+          if (cur_mesh) cur_mesh->disable_attributes();
+          msh->enable_attributes();
+          cur_mesh = msh;
+          num_mesh_changes++;
+        }
+
+        if (instanced) {
+          enable_instance_attributes(rn.first_instance);
+          msh->draw_instanced(rn.end - rn.begin);
+          disable_instance_attributes();
+          num_draws++;
+          num_instanced_draws++;
+          continue;
+        }
+
+        for (unsigned i = rn.begin; i != rn.end; ++i) {
+          item &it = items[order[i]];
+          mesh_instance *mi = it.mi;
+          skin *skn = msh->get_skin();
+          skeleton *skel = mi->get_skeleton();
+
+          if (!skel || !skn) {
+            mat->render_matrices(it.modelToProjection, it.modelToCamera);
+          } else {
+            /// multi-matrix rendering
+            mat4t *transforms = skel->calc_transforms(it.modelToCamera, skn);
+            int num_bones = skel->get_num_bones();
+            if (num_bones > 192) {
+              printf("warning: too many bones (%d)\n", num_bones);
+            } else {
+              mat->render_skinned(cameraToProjection, transforms, num_bones, light_uniforms, num_light_uniforms, num_lights);
+            }
+          }
+
+          msh->draw();
+          num_draws++;
+        }
+      }
+
+      if (cur_mesh) cur_mesh->disable_attributes();
+    }
+
+    /// Turn hardware instancing on or off (it is only used if the GL context supports it).
+    void set_instancing(bool value) {
+      instancing = value;
+    }
+
+    /// Smallest run of identical draws that will be instanced.
+    void set_min_instances(unsigned value) {
+      min_instances = value < 1 ? 1 : value;
+    }
+
+    unsigned get_min_instances() const {
+      return min_instances;
+    }
+
+    /// number of draws in the queue.
+    unsigned size() const {
+      return order.size();
+    }
+
+    /// get the nth mesh instance in draw order (after sort()).
+    mesh_instance *get_mesh_instance(unsigned i) const {
+      return items[order[i]].mi;
+    }
+
+    /// number of draw calls in the last draw()
+    unsigned get_num_draws() const {
+      return num_draws;
+    }
+
+    /// number of glUseProgram calls in the last draw()
+    unsigned get_num_program_changes() const {
+      return num_program_changes;
+    }
+
+    /// number of times material uniforms were sent in the last draw()
+    unsigned get_num_material_changes() const {
+      return num_material_changes;
+    }
+
+    /// number of times mesh attributes were set up in the last draw()
+    unsigned get_num_mesh_changes() const {
+      return num_mesh_changes;
+    }
+
+    /// number of instanced draw calls in the last draw()
+    unsigned get_num_instanced_draws() const {
+      return num_instanced_draws;
+    }
+  };
+}}
@@ -14,6 +14,7 @@
 #include "../scene/skin.h"
 #include "../scene/skeleton.h"
 #include "../scene/animation.h"
+#include "../scene/bvh.h"
 #include "../scene/mesh.h"
 #include "../scene/image.h"
 #include "../scene/sampler.h"
@@ -24,6 +25,7 @@
 #include "../scene/light_instance.h"
 #include "../scene/mesh_instance.h"
 #include "../scene/animation_instance.h"
+#include "../scene/render_queue.h"
 #include "../scene/visual_scene.h"
 #include "../scene/displacement_map.h"
 #include "../scene/indexer.h"
@@ -27,14 +27,54 @@ namespace octet { namespace scene {
     // is this node and all its children renderable?
     bool enabled;
 
+    // derived attributes (not for saving)
+
+    // cached nodeToParent * parent's modelToWorld, valid when world_dirty is false.
+    mat4t modelToWorld;
+
+    // cached enabled state of this node and all its parents.
+    bool world_enabled;
+
+    // if a node is dirty, all its descendants are dirty too.
+    // so a clean node never has a dirty parent.
+    bool world_dirty;
+
+    void init() {
+      nodeToParent.loadIdentity();
+      modelToWorld.loadIdentity();
+      sid = atom_;
+      enabled = true;
+      world_enabled = true;
+      world_dirty = true;
+    }
+
+    // recompute the cached values from a clean (or no) parent.
+    void update_world() {
+      if (parent) {
+        modelToWorld = nodeToParent * parent->modelToWorld;
+        world_enabled = enabled && parent->world_enabled;
+      } else {
+        modelToWorld = nodeToParent;
+        world_enabled = enabled;
+      }
+      world_dirty = false;
+    }
+
+    // make sure the parents are clean, then clean this node.
+    void clean_world() {
+      if (world_dirty) {
+        if (parent) parent->clean_world();
+        update_world();
+      }
+    }
+
   public:
     RESOURCE_META(scene_node)
+    RESOURCE_POOL(scene_node)
 
     /// Construct a scene node with an identity transform and no parent.
     scene_node(scene_node *parent = 0) {
-      nodeToParent.loadIdentity();
-      sid = atom_;
-      enabled = true;
+      init();
       if (parent) {
         parent->add_child(this);
       }
@@ -42,9 +82,9 @@ namespace octet { namespace scene {
 
     /// Construct a scene node with a matrix and an identifying sid atom.
     scene_node(const mat4t &nodeToParent, atom_t sid) {
+      init();
       this->nodeToParent = nodeToParent;
       this->sid = sid;
-      enabled = true;
     }
 
     /// the virtual add_ref on animation_target gets passed to here and we pass iton (delegate it) to the resource
@@ -61,6 +101,7 @@ namespace octet { namespace scene {
     void set_value(atom_t sid, atom_t sub_target, atom_t component, float *value) {
       if (sub_target == atom_transform) {
         nodeToParent.init_transpose(value);
+        mark_dirty();
       }
     }
 
@@ -73,6 +114,7 @@ namespace octet { namespace scene {
       //log("visit scene_node nodeToParent\n");
       v.visit(nodeToParent, atom_nodeToParent);
       v.visit(sid, atom_sid);
+      mark_dirty();
     }
 
 
@@ -80,6 +122,7 @@ namespace octet { namespace scene {
     void add_child(scene_node *new_node) {
       new_node->parent = this;
       children.push_back(new_node);
+      new_node->mark_dirty();
     }
 
     /// Get the parent node of this node.
@@ -97,21 +140,63 @@ namespace octet { namespace scene {
       return children[index];
     }
 
+    /// Flag this node and its descendants for a new modelToWorld matrix and enabled state.
+    /// Stops at nodes that are already dirty, so repeated changes are cheap.
+    void mark_dirty() {
+      if (world_dirty) return;
+
+      dynarray<scene_node*> stack;
+      stack.push_back(this);
+      while (!stack.empty()) {
+        scene_node *node = stack.back();
+        stack.pop_back();
+        node->world_dirty = true;
+        for (int i = 0; i != node->children.size(); ++i) {
+          // dirty children already have dirty descendants.
+          if (!node->children[i]->world_dirty) {
+            stack.push_back(node->children[i]);
+          }
+        }
+      }
+    }
+
+    /// Update the cached transforms of this node and its descendants in one top-down pass.
+    /// Call this once per frame on the root (visual_scene does this before rendering).
+    void update_transforms() {
+      clean_world();
+
+      dynarray<scene_node*> stack;
+      stack.push_back(this);
+      while (!stack.empty()) {
+        scene_node *node = stack.back();
+        stack.pop_back();
+        for (int i = 0; i != node->children.size(); ++i) {
+          // a clean child can still have dirty children, so visit them all.
+          scene_node *child = node->children[i];
+          if (child->world_dirty) {
+            child->update_world();
+          }
+          stack.push_back(child);
+        }
+      }
+    }
+
     // compute the scene_node to world matrix for an individual scene_node;
     mat4t calcModelToWorld() {
-      mat4t result = nodeToParent;
-      for (scene_node *p = parent; p != NULL; p = p->parent) {
-        result = result * p->nodeToParent;
-      }
-      return result;
+      clean_world();
+      return modelToWorld;
     }
 
     // calculate whether this node is enabled (recursively)
     bool calcEnabled() {
-      for (scene_node *p = this; p != NULL; p = p->parent) {
-        if (!p->enabled) return false;
-      }
-      return true;
+      clean_world();
+      return world_enabled;
+    }
+
+    /// the cached model to world matrix, valid until the node or a parent changes.
+    const mat4t &get_modelToWorld() {
+      clean_world();
+      return modelToWorld;
     }
 
     /// transform a point from model space to world space
@@ -134,10 +219,18 @@ namespace octet { namespace scene {
     }
 
     /// access the node to parent transform matrix for writing.
+    /// Note: this marks the node as changed, so write the matrix before reading world transforms.
     mat4t &access_nodeToParent() {
+      mark_dirty();
       return nodeToParent;
     }
 
+    /// set the node to parent transform matrix
+    void set_nodeToParent(const mat4t &value) {
+      nodeToParent = value;
+      mark_dirty();
+    }
+
     /// get the x axis (left, right) of the node
     vec3 get_x() {
       return calcModelToWorld().x().xyz();
@@ -165,27 +258,34 @@ namespace octet { namespace scene {
 
     /// set enabled state
     void set_enabled(bool value) {
-      enabled = value;
+      if (enabled != value) {
+        enabled = value;
+        mark_dirty();
+      }
     }
 
     /// reset the matrix
     void loadIdentity() {
       nodeToParent.loadIdentity();
+      mark_dirty();
     }
 
     /// Translate the matrix
     void translate(vec3_in xyz) {
       nodeToParent.translate(xyz[0], xyz[1], xyz[2]);
+      mark_dirty();
     }
 
     /// Rotate the matrix
     void rotate(float angle, vec3_in axis) {
       nodeToParent.rotate(angle, axis[0], axis[1], axis[2]);
+      mark_dirty();
     }
 
     /// Scale the matrix
     void scale(vec3_in xyz) {
       nodeToParent.scale(xyz[0], xyz[1], xyz[2]);
+      mark_dirty();
     }
 
     /// Get the identifying sid
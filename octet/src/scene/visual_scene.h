@@ -31,6 +31,23 @@ namespace octet { namespace scene {
     bool render_aabbs;
     bool render_debug_lines;
     bool dump_vertices;
+
+    /// set this to skip mesh instances outside the camera frustum.
+    bool frustum_culling;
+
+    /// frustum culling stats for the last frame.
+    unsigned num_visible;
+    unsigned num_culled;
+
+    /// visible instances sorted by state to cut down GL calls.
+    render_queue queue;
+
+    /// top level bvh over the world boxes of the mesh instances for cast_ray.
+    /// rebuilt at most once per frame.
+    bvh instance_bvh;
+    dynarray<mesh_instance*> bvh_instances;
+    int bvh_frame;
+    int bvh_num_mesh_instances;
     ref<material> debug_material;
     dynarray<vec3p> debug_line_buffer;
     unsigned debug_in_ptr;
@@ -182,6 +199,9 @@ namespace octet { namespace scene {
     }
 
     void render_impl(bump_shader &object_shader, bump_shader &skin_shader, camera_instance &cam, float aspect_ratio) {
+      // one top-down pass over the nodes that changed since the last frame.
+      update_transforms();
+
       mat4t cameraToWorld = cam.get_node()->calcModelToWorld();
 
       mat4t worldToCamera;
@@ -194,6 +214,9 @@ namespace octet { namespace scene {
 
       draw_debug_data(cam);
 
+      num_visible = num_culled = 0;
+      queue.reset();
+
       for (unsigned mesh_index = 0; mesh_index != mesh_instances.size(); ++mesh_index) {
         mesh_instance *mi = mesh_instances[mesh_index];
 
@@ -208,9 +231,20 @@ namespace octet { namespace scene {
         mesh *msh = mi->get_mesh();
         skin *skn = msh->get_skin();
         skeleton *skel = mi->get_skeleton();
-        material *mat = mi->get_material();
 
-        mat4t modelToWorld = node->calcModelToWorld();
+        const mat4t &modelToWorld = node->get_modelToWorld();
+
+        // skip instances outside the frustum. Skinned meshes can move outside their aabb
+        // and an empty aabb means the mesh has not set one.
+        if (frustum_culling && !(flags & mesh_instance::flag_no_cull) && !(skel && skn)) {
+          const aabb &bb = msh->get_aabb();
+          vec3 half = bb.get_half_extent();
+          if ((half.x() != 0 || half.y() != 0 || half.z() != 0) && !cam.is_visible(bb, modelToWorld)) {
+            num_culled++;
+            continue;
+          }
+        }
+
         mat4t modelToCamera;
         mat4t modelToProjection;
         cam.get_matrices(modelToProjection, modelToCamera, modelToWorld);
@@ -228,32 +262,24 @@ namespace octet { namespace scene {
           }
         }
 
-        if (!skel || !skn) {
-          /// normal rendering for single matrix objects
-          /// build a projection matrix: model -> world -> camera_instance -> projection
-          /// the projection space is the cube -1 <= x/w, y/w, z/w <= 1
-          mat->render(modelToProjection, modelToCamera, light_uniforms, num_light_uniforms, num_lights);
-        } else {
-          /// multi-matrix rendering
-          mat4t *transforms = skel->calc_transforms(modelToCamera, skn);
-          int num_bones = skel->get_num_bones();
-          if(num_bones > 192) {
-            GLint mvuv = 0;
-            //glGetIntegerv(GL_MAX_VERTEX_UNIFORM_VECTORS, &mvuv);
-            printf("warning: too many bones (%d/%d)\n", num_bones, mvuv/4);
-          } else {
-            mat->render_skinned(cameraToProjection, transforms, num_bones, light_uniforms, num_light_uniforms, num_lights);
-          }
-        }
+        num_visible++;
+
+        /// build a projection matrix: model -> world -> camera_instance -> projection
+        /// the projection space is the cube -1 <= x/w, y/w, z/w <= 1
+        render_queue::pass_t pass =
+          mi->get_material()->is_transparent() ? render_queue::pass_transparent :
+          skel && skn ? render_queue::pass_skinned :
+          render_queue::pass_opaque
+        ;
+        queue.add(mi, pass, modelToProjection, modelToCamera);
+      }
 
-        /*if (true) {
-          static bool dumped;
-          if (!dumped) { msh->dump_transformed(modelToProjection); dumped = true; }
-        }*/
-        msh->enable_attributes();
-        msh->draw();
-        msh->disable_attributes();
+      /// draw in state order so that neighbours share programs, materials and meshes.
+      queue.sort();
+      queue.draw(cameraToProjection, light_uniforms, num_light_uniforms, num_lights);
 
+      for (unsigned i = 0; i != queue.size(); ++i) {
+        mesh_instance *mi = queue.get_mesh_instance(i);
         if (mi->get_flags() & mesh_instance::flag_selected) {
           aabb bb = mi->get_mesh()->get_aabb();
           bb = bb.get_transform(mi->get_node()->calcModelToWorld());
@@ -273,6 +299,10 @@ namespace octet { namespace scene {
       render_aabbs = false;
       dump_vertices = false;
       render_debug_lines = false;
+      frustum_culling = true;
+      num_visible = num_culled = 0;
+      bvh_frame = -1;
+      bvh_num_mesh_instances = 0;
       debug_material = new material(vec4(1, 0, 0, 1));
       debug_line_buffer.resize(256);
       assert(is_power_of_two(debug_line_buffer.size()));
@@ -501,6 +531,26 @@ namespace octet { namespace scene {
       render_aabbs = value;
     }
 
+    /// turn frustum culling on or off (on by default).
+    void set_frustum_culling(bool value) {
+      frustum_culling = value;
+    }
+
+    /// number of mesh instances drawn in the last frame.
+    unsigned get_num_visible() const {
+      return num_visible;
+    }
+
+    /// number of mesh instances skipped by frustum culling in the last frame.
+    unsigned get_num_culled() const {
+      return num_culled;
+    }
+
+    /// the sorted draw list from the last frame, with state change counts.
+    const render_queue &get_render_queue() const {
+      return queue;
+    }
+
     /// debugging aid to draw debug lines
     void set_render_debug_lines(bool value) {
       render_debug_lines = value;
@@ -614,41 +664,75 @@ namespace octet { namespace scene {
 
     struct cast_result {
       mesh_instance *mi;
-      rational depth;
+      rational depth;       // fraction of the ray's distance to the hit.
+      int indices[3];       // vertex indices of the triangle that was hit.
+      vec4 bary;            // barycentric coordinates of the hit (see mesh::ray_cast)
     };
 
-    /// brute force & ignorance ray cast.
-    /// return the mesh instance and location of hits.
-    /// todo: build a kd tree for mesh instance bbs & mesh triangles
-    void cast_ray(cast_result &result, const ray &the_ray) {
+    /// Rebuild the bvh that cast_ray uses. Call this if instances move between casts in the same frame.
+    void invalidate_ray_cast() {
+      bvh_frame = -1;
+    }
+
+    /// return the nearest mesh instance hit by the ray, and the location of the hit.
+    /// The instances are found with a top level bvh and the triangles with each mesh's bvh.
+    /// If exact is true, the triangles are tested with rational arithmetic (slow).
+    void cast_ray(cast_result &result, const ray &the_ray, bool exact=false) {
       result.mi = 0;
       result.depth = rational(0, 0);
+      result.indices[0] = result.indices[1] = result.indices[2] = 0;
+      result.bary = vec4(0, 0, 0, 0);
+
+      if (bvh_frame != frame_number || bvh_num_mesh_instances != mesh_instances.size()) {
+        build_instance_bvh();
+      }
 
+      float best_t = 1.0f;
+      instance_bvh.intersect(the_ray.get_start(), the_ray.get_distance(), best_t, [&](unsigned i, float &tmax) {
+        mesh_instance *mi = bvh_instances[i];
+        mat4t worldToNode = mi->get_node()->calcModelToWorld().inverse3x4();
+        ray model_ray = the_ray.get_transform(worldToNode);
+        int indices[3] = {0};
+        vec4 bary_numer(0, 0, 0, 0);
+        float bary_denom = 0;
+        if (!mi->get_mesh()->ray_cast(model_ray, indices, bary_numer, bary_denom, exact)) return false;
+
+        // the ray parameter is the same in model and world space.
+        rational depth(bary_numer.w(), bary_denom);
+        float t = (float)depth;
+        if (result.mi && !(depth < result.depth)) return false;
+        if (!exact && t >= tmax) return false;
+
+        result.mi = mi;
+        result.depth = depth;
+        result.indices[0] = indices[0];
+        result.indices[1] = indices[1];
+        result.indices[2] = indices[2];
+        result.bary = bary_numer / bary_denom;
+        if (t < tmax) tmax = t;
+        return true;
+      });
+    }
+
+  private:
+    void build_instance_bvh() {
+      update_transforms();
+      bvh_frame = frame_number;
+      bvh_num_mesh_instances = mesh_instances.size();
+      bvh_instances.resize(0);
+      instance_bvh.begin(mesh_instances.size());
       for (int i = 0; i != mesh_instances.size(); ++i) {
         mesh_instance *mi = mesh_instances[i];
-        if (mi && mi->get_node()) {
-          mat4t nodeToWorld = mi->get_node()->calcModelToWorld();
-          mesh *mesh = mi->get_mesh();
-          aabb bb = mesh->get_aabb();
-          bb = bb.get_transform(nodeToWorld);
-          if (the_ray.intersects(bb)) {
-            mat4t worldToNode = nodeToWorld.inverse3x4();
-            //ray model_ray = ray(vec3(0, 0, -1), vec3(0, 0, 2)); //the_ray.get_transform(worldToNode);
-            ray model_ray = the_ray.get_transform(worldToNode);
-            int indices[3] = {0};
-            vec4 bary_numer(0, 0, 0, 0);
-            float bary_denom;
-            bool hit = mesh->ray_cast(model_ray, indices, bary_numer, bary_denom);
-            if (hit) {
-              rational depth(bary_numer.w() / bary_denom);
-              result.depth = min(depth, result.depth);
-            }
-            //printf("hit=%d %s %f\n", hit, (bary_numer/bary_denom).toString(tmp, sizeof(tmp)), (float)result.depth);
-          }
+        if (mi && mi->get_node() && mi->get_mesh()) {
+          aabb bb = mi->get_mesh()->get_aabb().get_transform(mi->get_node()->calcModelToWorld());
+          instance_bvh.add(bb.get_min(), bb.get_max());
+          bvh_instances.push_back(mi);
         }
       }
+      instance_bvh.build();
     }
 
+  public:
     /// Debug rendering: add a new line in world space (old ones will be lost)
     void add_debug_line(const vec3 &start, const vec3 &end) {
       if (debug_line_buffer.size()) {
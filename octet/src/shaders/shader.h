@@ -14,6 +14,10 @@ namespace octet { namespace shaders {
   class shader : public resource {
     GLuint program_;
 
+    // the last object to send uniforms to this program. Uniform values belong to the program,
+    // so a material that shares a program with another must send all its uniforms again.
+    const void *uniform_owner;
+
     void link(GLuint vertex_shader, GLuint fragment_shader) {
           // assemble the program for use by glUseProgram
       GLuint program = glCreateProgram();
@@ -29,6 +33,7 @@ namespace octet { namespace shaders {
       glBindAttribLocation(program, attribute_blendindices, "blendindices");
       glBindAttribLocation(program, attribute_color, "color");
       glBindAttribLocation(program, attribute_uv, "uv");
+      glBindAttribLocation(program, attribute_instance, "instance_modelToCamera");
       glLinkProgram(program);
 
       program_ = program;
@@ -44,6 +49,8 @@ namespace octet { namespace shaders {
     }
   public:
     shader() {
+      program_ = 0;
+      uniform_owner = 0;
     }
 
     GLuint program() { return program_; }
@@ -98,6 +105,13 @@ namespace octet { namespace shaders {
     GLuint get_program() const {
       return program_;
     }
+
+    /// Claim the program's uniforms. Returns false if someone else set them last.
+    bool claim_uniforms(const void *owner) {
+      bool result = uniform_owner == owner;
+      uniform_owner = owner;
+      return result;
+    }
   };
 
 }}